@@ -129,6 +129,7 @@ HEADERS += \
 	$$PWD/../common_src/xisf.h \
 	$$PWD/../common_src/xml.h \
 	$$PWD/../common_src/pixelformat.h \
+	$$PWD/../common_src/pixel_layout.h \
 	$$PWD/../external/simpleplot/simpleplot.h \
 	$$PWD/../common_src/coordconv.h \
 	$$PWD/../common_src/stretcher.h \
@@ -149,10 +150,17 @@ INCLUDEPATH += \
 	"$$PWD/../ain_imager_src" \
 	"$$PWD/../ain_imager_src/sequencer"
 
-unix:!mac | win32 {
+# libraw_r keeps the decoder state per context so RAW files can be decoded on several threads,
+# the MinGW build of LibRaw provides only the single threaded libraw
+win32 {
 	LIBS += -L"$$PWD/../external/libraw/lib" -L"$$PWD/../external/lz4" -lraw -lz
 }
 
+unix:!mac {
+	LIBS += -L"$$PWD/../external/libraw/lib" -L"$$PWD/../external/lz4" -lraw_r -lz
+	DEFINES += DSLR_RAW_REENTRANT
+}
+
 unix {
 	INCLUDEPATH += "$$PWD/../external/libjpeg"
 }
@@ -161,7 +169,8 @@ INDIGO_LIB_DIR = $$PWD/../indigo/build/lib
 INDIGO_FLAVOR = $$(AIN_INDIGO_FLAVOR)
 
 unix:mac {
-	LIBS += -L"$$PWD/../external/libraw/lib" -L"$$PWD/../external/lz4" -lraw -lz
+	LIBS += -L"$$PWD/../external/libraw/lib" -L"$$PWD/../external/lz4" -lraw_r -lz
+	DEFINES += DSLR_RAW_REENTRANT
 	LIBS += -L"$$PWD/../external/libjpeg/.libs" -L"$$INDIGO_LIB_DIR"
 	exists($$INDIGO_LIB_DIR/libindigo_client.dylib) | exists($$INDIGO_LIB_DIR/libindigo_client.a) {
 		LIBS += -lindigo_client
@@ -63,44 +63,51 @@ bool blob_preview_cache::_remove(QString &key) {
 
 
 bool blob_preview_cache::obsolete(indigo_property *property, indigo_item *item) {
+	pthread_mutex_lock(&preview_mutex);
 	QString key = create_key(property, item);
 	if (contains(key)) {
 		auto preview = value(key);
 		indigo_debug("preview: %s(%s) == %p\n", __FUNCTION__, key.toUtf8().constData(), preview.get());
-		if (preview != nullptr) {
+		if (preview != nullptr && preview->pixels_writable()) {
 			QPainter painter(preview.get());
 			painter.setPen(QColor(241, 183, 1));
 			QFont ft = painter.font();
 			ft.setPixelSize(preview->height()/15);
 			painter.setFont(ft);
 			painter.drawText(preview->width()/20, preview->height()/20, preview->width(), preview->height(), Qt::AlignTop & Qt::AlignLeft, "\u231b Busy...");
+			pthread_mutex_unlock(&preview_mutex);
 			return true;
 		}
 	} else {
 		indigo_debug("preview: %s(%s) - no preview\n", __FUNCTION__, key.toUtf8().constData());
 	}
+	pthread_mutex_unlock(&preview_mutex);
 	return false;
 }
 
+void blob_preview_cache::_insert(QString &key, std::shared_ptr<preview_image> preview) {
+	_remove(key);
+	// Limit cache size to avoid unbounded growth when many distinct items arrive quickly
+	const int MAX_PREVIEWS = 32;
+	while ((int)size() >= MAX_PREVIEWS) {
+		blob_preview_cache::iterator it = begin();
+		it = erase(it);
+	}
+	insert(key, preview);
+}
 
-bool blob_preview_cache::create(indigo_property *property, indigo_item *item, const stretch_config_t sconfig) {
-	pthread_mutex_lock(&preview_mutex);
+// The previews are built without holding the lock, so a guider frame does not wait for an imager frame
+bool blob_preview_cache::create(indigo_property *property, indigo_item *item, std::shared_ptr<char> blob_owner, bool blob_writable, const stretch_config_t sconfig) {
 	QString key = create_key(property, item);
-	_remove(property, item);
-	std::shared_ptr<preview_image> preview(create_preview(property, item, sconfig));
+	remove(property, item);
+	std::shared_ptr<preview_image> preview(create_preview(property, item, blob_owner, blob_writable, sconfig));
 	//indigo_debug("preview: %s(%s) == %p", __FUNCTION__, key.toUtf8().constData(), preview);
 	if (preview != nullptr) {
-		// Limit cache size to avoid unbounded growth when many distinct items arrive quickly
-		const int MAX_PREVIEWS = 32;
-		while ((int)size() >= MAX_PREVIEWS) {
-			blob_preview_cache::iterator it = begin();
-			it = erase(it);
-		}
-		insert(key, preview);
+		pthread_mutex_lock(&preview_mutex);
+		_insert(key, preview);
 		pthread_mutex_unlock(&preview_mutex);
 		return true;
 	}
-	pthread_mutex_unlock(&preview_mutex);
 	return false;
 }
 
@@ -109,7 +116,7 @@ bool blob_preview_cache::add(QString &key, preview_image *preview) {
 	_remove(key);
 	//indigo_debug("preview: %s(%s) == %p, %.5f\n", __FUNCTION__, key.toUtf8().constData(), stretch->clip_white);
 	if (preview != nullptr) {
-		insert(key, std::shared_ptr<preview_image>(preview));
+		_insert(key, std::shared_ptr<preview_image>(preview));
 		pthread_mutex_unlock(&preview_mutex);
 		return true;
 	}
@@ -117,36 +124,40 @@ bool blob_preview_cache::add(QString &key, preview_image *preview) {
 	return false;
 }
 
-bool blob_preview_cache::recreate(QString &key, indigo_item *item, const stretch_config_t sconfig) {
+bool blob_preview_cache::recreate(QString &key, indigo_item *item, std::shared_ptr<char> blob_owner, const stretch_config_t sconfig) {
 	pthread_mutex_lock(&preview_mutex);
-	auto preview = _get(key);
-	if (preview != nullptr && item != nullptr) {
+	const bool cached = _get(key) != nullptr;
+	pthread_mutex_unlock(&preview_mutex);
+	if (cached && item != nullptr) {
 		//indigo_debug("recreate preview: %s(%s) == %p, %.5f\n", __FUNCTION__, key.toUtf8().constData(), stretch->clip_white);
-		std::shared_ptr<preview_image> new_preview(create_preview(item, sconfig));
+		std::shared_ptr<preview_image> new_preview(create_preview(item, blob_owner, false, sconfig));
+		pthread_mutex_lock(&preview_mutex);
 		_remove(key);
 		insert(key, new_preview);
 		pthread_mutex_unlock(&preview_mutex);
 		return true;
 	}
-	pthread_mutex_unlock(&preview_mutex);
 	return false;
 }
 
 bool blob_preview_cache::recreate(QString &key, const stretch_config_t sconfig) {
 	pthread_mutex_lock(&preview_mutex);
-	auto preview = _get(key);
+	// keeps the native pixels alive while the lock is not held
+	std::shared_ptr<preview_image> preview = contains(key) ? value(key) : nullptr;
+	pthread_mutex_unlock(&preview_mutex);
 	if (preview != nullptr) {
 		//indigo_debug("recreate preview: %s(%s) == %p, %.5f\n", __FUNCTION__, key.toUtf8().constData(), stretch->clip_white);
 		int width = preview->width();
 		int height = preview->height();
 		int pix_format = preview->m_pix_format;
-		std::shared_ptr<preview_image> new_preview(create_preview(width, height, pix_format, preview->m_raw_data, sconfig));
+		// the new preview shares the native pixels of the old one and is stretched as the viewers draw it
+		std::shared_ptr<preview_image> new_preview(create_tiled_preview(width, height, pix_format, preview->m_raw_owner, preview->m_raw_data, sconfig, preview->m_histogram));
+		pthread_mutex_lock(&preview_mutex);
 		_remove(key);
 		insert(key, new_preview);
 		pthread_mutex_unlock(&preview_mutex);
 		return true;
 	}
-	pthread_mutex_unlock(&preview_mutex);
 	return false;
 }
 
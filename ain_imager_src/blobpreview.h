@@ -45,12 +45,14 @@ private:
 	bool _remove(indigo_property *property, indigo_item *item);
 	bool _remove(QString &key);
 	preview_image* _get(QString &key);
+	void _insert(QString &key, std::shared_ptr<preview_image> preview);
 
 public:
 	QString create_key(indigo_property *property, indigo_item *item);
 	bool add(QString &key, preview_image *preview);
-	bool create(indigo_property *property, indigo_item *item, const stretch_config_t sconfig);
-	bool recreate(QString &key, indigo_item *item, const stretch_config_t sconfig);
+	/* blob_owner owns item->blob.value, the previews reference it instead of copying the pixels */
+	bool create(indigo_property *property, indigo_item *item, std::shared_ptr<char> blob_owner, bool blob_writable, const stretch_config_t sconfig);
+	bool recreate(QString &key, indigo_item *item, std::shared_ptr<char> blob_owner, const stretch_config_t sconfig);
 	bool recreate(QString &key, const stretch_config_t sconfig);
 	bool stretch(QString &key, const stretch_config_t sconfig);
 	bool obsolete(indigo_property *property, indigo_item *item);
@@ -34,6 +34,8 @@
 #include "version.h"
 #include <imageviewer.h>
 #include <image_stats.h>
+#include <fits.h>
+#include <raw_to_fits.h>
 #include <QSoundEffect>
 #include <QFileInfo>
 #include <QUrl>
@@ -42,9 +44,13 @@
 #include <QRegularExpression>
 #include <QGroupBox>
 #include <QGridLayout>
+#include <QFutureWatcher>
 #include "filenametemplatedlg.h"
 //#include <IndigoSequence.h>
 
+// downloaded INDIGO RAW frames and live stacks are saved locally as XISF with this codec
+#define XISF_SAVE_COMPRESSION "lz4+sh"
+
 void write_conf();
 
 //ImageViewer *m_imager_viewer;
@@ -140,6 +146,9 @@ ImagerWindow::ImagerWindow(QWidget *parent) : QMainWindow(parent) {
 	act = menu->addAction(tr("&Save Image As..."));
 	connect(act, &QAction::triggered, this, &ImagerWindow::on_image_save_act);
 
+	act = menu->addAction(tr("Save Live S&tack As..."));
+	connect(act, &QAction::triggered, this, &ImagerWindow::on_stack_save_act);
+
 	menu->addSeparator();
 
 	act = menu->addAction(tr("Image Output &Settings..."));
@@ -570,7 +579,7 @@ ImagerWindow::ImagerWindow(QWidget *parent) : QMainWindow(parent) {
 				m_imager_viewer->setImage(*image);
 				ImageStats stats;
 				if (conf.statistics_enabled)
-					stats = imageStats((const uint8_t*)image->m_raw_data, image->m_width, image->m_height, image->m_pix_format);
+					stats = preview_stats(image);
 				m_imager_viewer->setImageStats(stats);
 			}
 		}
@@ -739,12 +748,10 @@ ImagerWindow::~ImagerWindow () {
 	delete m_imager_viewer;
 	delete m_stacker;
 	if (m_indigo_item) {
-		if (m_indigo_item->blob.value) {
-			free(m_indigo_item->blob.value);
-		}
 		free(m_indigo_item);
 		m_indigo_item = nullptr;
 	}
+	m_indigo_blob.reset();
 	delete mLog;
 	delete mIndigoServers;
 	delete m_config_dialog;
@@ -817,10 +824,9 @@ void ImagerWindow::window_log(const char *message, int state) {
 	mLog->verticalScrollBar()->setValue(mLog->verticalScrollBar()->maximum());
 }
 
-bool ImagerWindow::show_preview_in_imager_viewer(QString &key, bool is_batch_image) {
+bool ImagerWindow::show_preview_in_imager_viewer(QString &key, bool should_stack) {
 	preview_image *image = preview_cache.get(key);
 	if (image) {
-		const bool should_stack = conf.live_stacking_enabled && (m_batch_running || is_batch_image);
 		// JPEG/TIFF images have no raw data and cannot be stacked; show them
 		// directly and reset any stale stack so it isn't displayed afterwards.
 		if (should_stack && image->m_raw_data == nullptr) {
@@ -851,7 +857,7 @@ bool ImagerWindow::show_preview_in_imager_viewer(QString &key, bool is_batch_ima
 		if (!m_imager_viewer->isShowingStack()) {
 			ImageStats stats;
 			if (conf.statistics_enabled) {
-				stats = imageStats((const uint8_t*)(image->m_raw_data), image->m_width, image->m_height, image->m_pix_format);
+				stats = preview_stats(image);
 			}
 			m_imager_viewer->setImageStats(stats);
 		}
@@ -1071,6 +1077,10 @@ void ImagerWindow::on_tab_changed(int index) {
 	togglePolarAlignmentOverlay(showPolarOverlay);
 }
 
+static bool is_raw_blob(indigo_item *item) {
+	return !strcasecmp(".raw", item->blob.format);
+}
+
 void ImagerWindow::on_create_preview(indigo_property *property, indigo_item *item, bool save_blob) {
 	char selected_agent[INDIGO_VALUE_SIZE];
 	if (item == nullptr || item->blob.value == nullptr) {
@@ -1082,24 +1092,29 @@ void ImagerWindow::on_create_preview(indigo_property *property, indigo_item *ite
 		client_match_device_property(property, selected_agent, CCD_IMAGE_PROPERTY_NAME)
 	) {
 		if (m_indigo_item) {
-			if (m_indigo_item->blob.value) {
-				free(m_indigo_item->blob.value);
-			}
 			free(m_indigo_item);
 			m_indigo_item = nullptr;
 		}
+		// the blob is kept for saving so the previews may share it but not convert it in place
 		m_indigo_item = item;
+		m_indigo_blob = std::shared_ptr<char>((char *)item->blob.value, [](char *p){ free(p); });
 		const stretch_config_t sconfig = {(uint8_t)conf.preview_stretch_level, (uint8_t)conf.preview_color_balance, conf.preview_bayer_pattern};
-		preview_cache.create(property, m_indigo_item, sconfig);
 		QString key = preview_cache.create_key(property, m_indigo_item);
-		//preview_image *image = preview_cache.get(m_image_key);
-		if (show_preview_in_imager_viewer(key, save_blob)) {
-			indigo_debug("m_imager_viewer = %p", m_imager_viewer);
-			m_imager_viewer->setText(QString("Unsaved") + QString(m_indigo_item->blob.format));
-			m_imager_viewer->setToolTip(QString("Unsaved") + QString(m_indigo_item->blob.format));
-			int size = (int)round(m_focus_star_radius->value() * 2 + 1);
-			move_resize_focuser_selection(m_star_x->value(), m_star_y->value(), size);
-		}
+		preview_request request = {
+			m_indigo_blob, (unsigned char *)m_indigo_item->blob.value, (size_t)m_indigo_item->blob.size, QByteArray(m_indigo_item->blob.format),
+			false, conf.live_stacking_enabled && (m_batch_running || save_blob), sconfig,
+			[this](QString &key, bool stack) {
+				if (show_preview_in_imager_viewer(key, stack)) {
+					indigo_debug("m_imager_viewer = %p", m_imager_viewer);
+					int size = (int)round(m_focus_star_radius->value() * 2 + 1);
+					move_resize_focuser_selection(m_star_x->value(), m_star_y->value(), size);
+				}
+			}
+		};
+		build_preview(key, request);
+		// the file name replaces this label when the frame is saved below
+		m_imager_viewer->setText(QString("Unsaved") + QString(m_indigo_item->blob.format));
+		m_imager_viewer->setToolTip(QString("Unsaved") + QString(m_indigo_item->blob.format));
 		indigo_debug("save_blob: %d", save_blob);
 		if (save_blob && strcasecmp(".raw", m_indigo_item->blob.format)) {
 			save_blob_item(m_indigo_item);
@@ -1110,32 +1125,36 @@ void ImagerWindow::on_create_preview(indigo_property *property, indigo_item *ite
 		client_match_device_property(property, selected_agent, CCD_PREVIEW_IMAGE_PROPERTY_NAME)
 	) {
 		if (m_indigo_item) {
-			if (m_indigo_item->blob.value) {
-				free(m_indigo_item->blob.value);
-			}
 			free(m_indigo_item);
 			m_indigo_item = nullptr;
 		}
+		// the blob is kept for saving so the previews may share it but not convert it in place
 		m_indigo_item = item;
+		m_indigo_blob = std::shared_ptr<char>((char *)item->blob.value, [](char *p){ free(p); });
 		const stretch_config_t sconfig = {(uint8_t)conf.preview_stretch_level, (uint8_t)conf.preview_color_balance, conf.preview_bayer_pattern};
-		preview_cache.create(property, m_indigo_item, sconfig);
 		QString key = preview_cache.create_key(property, m_indigo_item);
-		//preview_image *image = preview_cache.get(m_image_key);
-		if (show_preview_in_imager_viewer(key)) {
-			char message[PATH_LEN+100];
-			indigo_debug("m_imager_viewer = %p", m_imager_viewer);
-			m_imager_viewer->setText(QString("👁 Remote Image Preview"));
-			m_imager_viewer->setToolTip(QString("👁 Remote Image Preview - not the actual file"));
-			/*
-			if (!m_last_remote_image_file.isEmpty()) {
-				snprintf(message, sizeof(message), "%s Image saved remotely as '%s'", PREVIEW_REMOTE_INDICATOR, m_last_remote_image_file.toUtf8().constData());
-				m_last_remote_image_file = QString();
-				window_log(message);
+		preview_request request = {
+			m_indigo_blob, (unsigned char *)m_indigo_item->blob.value, (size_t)m_indigo_item->blob.size, QByteArray(m_indigo_item->blob.format),
+			false, conf.live_stacking_enabled && m_batch_running, sconfig,
+			[this](QString &key, bool stack) {
+				if (show_preview_in_imager_viewer(key, stack)) {
+					char message[PATH_LEN+100];
+					indigo_debug("m_imager_viewer = %p", m_imager_viewer);
+					m_imager_viewer->setText(QString("👁 Remote Image Preview"));
+					m_imager_viewer->setToolTip(QString("👁 Remote Image Preview - not the actual file"));
+					/*
+					if (!m_last_remote_image_file.isEmpty()) {
+						snprintf(message, sizeof(message), "%s Image saved remotely as '%s'", PREVIEW_REMOTE_INDICATOR, m_last_remote_image_file.toUtf8().constData());
+						m_last_remote_image_file = QString();
+						window_log(message);
+					}
+					*/
+					int size = (int)round(m_focus_star_radius->value() * 2 + 1);
+					move_resize_focuser_selection(m_star_x->value(), m_star_y->value(), size);
+				}
 			}
-			*/
-			int size = (int)round(m_focus_star_radius->value() * 2 + 1);
-			move_resize_focuser_selection(m_star_x->value(), m_star_y->value(), size);
-		}
+		};
+		build_preview(key, request);
 	} else if (
 		get_selected_imager_agent(selected_agent) &&
 		client_match_device_property(property, selected_agent, AGENT_IMAGER_DOWNLOAD_IMAGE_PROPERTY_NAME)
@@ -1146,7 +1165,6 @@ void ImagerWindow::on_create_preview(indigo_property *property, indigo_item *ite
 		} else {
 			char file_name[PATH_LEN] = {0};
 			static char file_name_static[PATH_LEN];
-			char message[PATH_LEN+100];
 			char location[PATH_LEN];
 			indigo_property *p = properties.get(selected_agent, AGENT_IMAGER_DOWNLOAD_FILE_PROPERTY_NAME);
 			if (p) {
@@ -1195,22 +1213,34 @@ void ImagerWindow::on_create_preview(indigo_property *property, indigo_item *ite
 					}
 
 					strcat(location, file_name);
-					if (save_blob_item_with_prefix(item, location, file_name, false)) {
-						if (!conf.keep_images_on_server) {
-							snprintf(message, sizeof(message), "%s Image saved as '%s' and removed remotely", DOWNLOAD_REMOVE_INDICATOR, file_name);
-							QtConcurrent::run([=]() {
-								QString next_file = file_name_static;
-								char agent[INDIGO_VALUE_SIZE];
-								get_selected_imager_agent(agent);
-								request_file_remove(agent, next_file.toUtf8().constData());
-							});
+					QString remote_file(file_name_static);
+					auto downloaded = [this, remote_file](bool saved, QByteArray saved_name) {
+						char message[PATH_LEN+100];
+						if (saved) {
+							if (!conf.keep_images_on_server) {
+								snprintf(message, sizeof(message), "%s Image saved as '%s' and removed remotely", DOWNLOAD_REMOVE_INDICATOR, saved_name.constData());
+								QtConcurrent::run([=]() {
+									char agent[INDIGO_VALUE_SIZE];
+									get_selected_imager_agent(agent);
+									request_file_remove(agent, remote_file.toUtf8().constData());
+								});
+							} else {
+								snprintf(message, sizeof(message), "%s Image saved as '%s' and kept remotely", DOWNLOAD_INDICATOR, saved_name.constData());
+							}
+							window_log(message);
 						} else {
-							snprintf(message, sizeof(message), "%s Image saved as '%s' and kept remotely", DOWNLOAD_INDICATOR, file_name);
+							snprintf(message, sizeof(message), "Error: can not save '%s'", saved_name.constData());
+							window_log(message, INDIGO_ALERT_STATE);
 						}
-						window_log(message);
+					};
+					bool saved = save_blob_item_with_prefix(item, location, file_name, false);
+					if (saved && is_raw_blob(item)) {
+						// the blob goes with the conversion, it is freed when the XISF file is written
+						std::shared_ptr<char> blob((char *)item->blob.value, [](char *p){ free(p); });
+						item->blob.value = nullptr;
+						save_raw_blob_as_xisf(blob, item->blob.size, file_name, downloaded);
 					} else {
-						snprintf(message, sizeof(message), "Error: can not save '%s'", file_name);
-						window_log(message, INDIGO_ALERT_STATE);
+						downloaded(saved, QByteArray(file_name));
 					}
 				}
 				if (!m_files_to_download.empty()) {
@@ -1237,22 +1267,30 @@ void ImagerWindow::on_create_preview(indigo_property *property, indigo_item *ite
 		item->blob.value = nullptr;
 		free(item);
 	} else if (get_selected_guider_agent(selected_agent)) {
+		// the guider does not keep the blob, the preview takes it over and may convert it in place
+		std::shared_ptr<char> blob_owner((char *)item->blob.value, [](char *p){ free(p); });
 		if ((client_match_device_property(property, selected_agent, CCD_IMAGE_PROPERTY_NAME) && conf.preview_mode == NO_PREVIEWS) ||
 			(client_match_device_property(property, selected_agent, CCD_PREVIEW_IMAGE_PROPERTY_NAME) && conf.preview_mode > NO_PREVIEWS)) {
 			const stretch_config_t sconfig = {(uint8_t)conf.guider_stretch_level, (uint8_t)conf.guider_color_balance, BAYER_PAT_AUTO};
-			preview_cache.create(property, item, sconfig);
 			QString key = preview_cache.create_key(property, item);
-			//preview_image *image = preview_cache.get(key);
-			if (show_preview_in_guider_viewer(key)) {
-				indigo_debug("m_guider_viewer = %p", m_guider_viewer);
-				//m_guider_viewer->setText(QString("Guider: image") + QString(item->blob.format));
-				int size = (int)round(m_guide_star_radius->value() * 2 + 1);
-				move_resize_guider_selection(m_guide_star_x->value(), m_guide_star_y->value(), size);
-			}
+			preview_request request = {
+				blob_owner, (unsigned char *)item->blob.value, (size_t)item->blob.size, QByteArray(item->blob.format),
+				true, false, sconfig,
+				[this](QString &key, bool) {
+					if (show_preview_in_guider_viewer(key)) {
+						indigo_debug("m_guider_viewer = %p", m_guider_viewer);
+						//m_guider_viewer->setText(QString("Guider: image") + QString(item->blob.format));
+						int size = (int)round(m_guide_star_radius->value() * 2 + 1);
+						move_resize_guider_selection(m_guide_star_x->value(), m_guide_star_y->value(), size);
+					}
+				}
+			};
+			build_preview(key, request);
 		} else {
-			preview_cache.remove(property, item);
+			QString key = preview_cache.create_key(property, item);
+			cancel_preview_build(key);
+			preview_cache.remove(key);
 		}
-		free(item->blob.value);
 		item->blob.value = nullptr;
 		free(item);
 	} else {
@@ -1268,7 +1306,70 @@ void ImagerWindow::on_obsolete_preview(indigo_property *property, indigo_item *i
 }
 
 void ImagerWindow::on_remove_preview(indigo_property *property, indigo_item *item){
-	preview_cache.remove(property, item);
+	QString key = preview_cache.create_key(property, item);
+	cancel_preview_build(key);
+	preview_cache.remove(key);
+}
+
+void ImagerWindow::build_preview(QString &key, const preview_request &request) {
+	preview_job &job = m_preview_jobs[key];
+	if (job.running) {
+		// only the newest frame is worth showing, drop the ones that are waiting unless the stacker needs them
+		int stacked = 0;
+		QList<preview_request>::iterator it = job.pending.begin();
+		while (it != job.pending.end()) {
+			if (it->stack) {
+				stacked++;
+				it++;
+			} else {
+				indigo_debug("PREVIEW: %s superseded\n", key.toUtf8().constData());
+				it = job.pending.erase(it);
+			}
+		}
+		// each waiting frame holds its blob, if the stacker falls behind the oldest frames are skipped
+		if (request.stack && stacked >= MAX_PENDING_STACK_FRAMES) {
+			indigo_error("PREVIEW: %s live stacking is not fast enough, skipping frame\n", key.toUtf8().constData());
+			job.pending.removeFirst();
+		}
+		job.pending.append(request);
+		return;
+	}
+	start_preview_build(key, request);
+}
+
+void ImagerWindow::start_preview_build(QString &key, const preview_request &request) {
+	preview_job &job = m_preview_jobs[key];
+	job.running = true;
+	const unsigned int generation = job.generation;
+	QFutureWatcher<preview_image *> *watcher = new QFutureWatcher<preview_image *>(this);
+	connect(watcher, &QFutureWatcher<preview_image *>::finished, this, [this, watcher, key, request, generation]() {
+		QString cache_key = key;
+		preview_image *preview = watcher->result();
+		watcher->deleteLater();
+		preview_job &job = m_preview_jobs[cache_key];
+		job.running = false;
+		if (job.generation != generation) {
+			// the preview was removed while it was being built
+			delete preview;
+		} else if (preview) {
+			preview_cache.add(cache_key, preview);
+			request.show(cache_key, request.stack);
+		}
+		if (!job.pending.isEmpty()) {
+			start_preview_build(cache_key, job.pending.takeFirst());
+		}
+	});
+	watcher->setFuture(QtConcurrent::run([request]() {
+		return create_preview(request.blob_owner, request.data, request.size, request.format.constData(), request.sconfig, nullptr, request.blob_writable);
+	}));
+}
+
+void ImagerWindow::cancel_preview_build(QString &key) {
+	if (m_preview_jobs.contains(key)) {
+		preview_job &job = m_preview_jobs[key];
+		job.generation++;
+		job.pending.clear();
+	}
 }
 
 void ImagerWindow::on_message_sent(indigo_property* property, char *message) {
@@ -1334,6 +1435,29 @@ void close_fd(int fd) {
 	close(fd);
 }
 
+/* INDIGO RAW frames are converted to XISF when saved */
+static const char *saved_blob_extension(indigo_item *item) {
+	return is_raw_blob(item) ? ".xisf" : item->blob.format;
+}
+
+/* Writes an INDIGO RAW blob to the file reserved by save_blob_item_with_prefix() on a worker,
+   the LZ4 compression takes too long for the GUI thread. done(saved, file_name) is called on this one. */
+void ImagerWindow::save_raw_blob_as_xisf(std::shared_ptr<char> blob, size_t size, const char *file_name, std::function<void(bool saved, QByteArray file_name)> done) {
+	QByteArray path(file_name);
+	QFutureWatcher<int> *watcher = new QFutureWatcher<int>(this);
+	connect(watcher, &QFutureWatcher<int>::finished, this, [watcher, path, done]() {
+		bool saved = (watcher->result() == 0);
+		if (!saved) {
+			unlink(path.constData());
+		}
+		watcher->deleteLater();
+		done(saved, path);
+	});
+	watcher->setFuture(QtConcurrent::run([blob, size, path]() {
+		return raw_to_xisf_file(blob.get(), (int)size, path.constData(), XISF_SAVE_COMPRESSION);
+	}));
+}
+
 bool ImagerWindow::save_blob_item_with_prefix(indigo_item *item, const char *prefix, char *file_name, bool auto_construct) {
 	int fd;
 	int file_no = 1;
@@ -1483,7 +1607,7 @@ bool ImagerWindow::save_blob_item_with_prefix(indigo_item *item, const char *pre
 				// The suffix *after* %nI is intentionally not used for matching,
 				// matching INDIGO behaviour: only prefix + digits + extension must agree.
 				QString file_prefix = result.left(m_nI.capturedStart());
-				QString ext = QString(item->blob.format);
+				QString ext = QString(saved_blob_extension(item));
 
 				// Build regex: <prefix><one-or-more-digits><anything><ext>
 				QRegularExpression scan_re(
@@ -1528,7 +1652,7 @@ bool ImagerWindow::save_blob_item_with_prefix(indigo_item *item, const char *pre
 	}
 
 	do {
-		sprintf(file_name, "%s%s_%c%03d%s", prefix, object_name.toUtf8().constData(), time_flag, file_no++, item->blob.format);
+		sprintf(file_name, "%s%s_%c%03d%s", prefix, object_name.toUtf8().constData(), time_flag, file_no++, saved_blob_extension(item));
 #if defined(INDIGO_WINDOWS)
 		fd = open(file_name, O_CREAT | O_WRONLY | O_EXCL | O_BINARY, S_IRUSR | S_IWUSR);
 #else
@@ -1538,6 +1662,10 @@ bool ImagerWindow::save_blob_item_with_prefix(indigo_item *item, const char *pre
 
 	if (fd < 0) {
 		return false;
+	}
+	if (is_raw_blob(item)) {
+		// only the name is reserved, the caller writes the XISF file with save_raw_blob_as_xisf()
+		close_fd(fd);
 	} else {
 		write(fd, item->blob.value, item->blob.size);
 		close_fd(fd);
@@ -1703,6 +1831,62 @@ void ImagerWindow::on_image_save_act() {
 	}
 }
 
+void ImagerWindow::on_stack_save_act() {
+	char message[PATH_LEN+100];
+	preview_image *stack = m_stacker->currentStack();
+	if (stack == nullptr || stack->m_raw_data == nullptr) {
+		delete stack;
+		window_log("Error: Live stack is empty", INDIGO_ALERT_STATE);
+		return;
+	}
+	QString qlocation = QDir::toNativeSeparators(QDir::homePath());
+	QString selected_filter;
+	QString file_name = QFileDialog::getSaveFileName(this,
+		tr("Save live stack"), qlocation,
+		QString("FITS Image (*.fits);;XISF Image (*.xisf)"), &selected_filter);
+
+	if (file_name == "") {
+		delete stack;
+		return;
+	}
+
+	const bool has_fits_suffix = file_name.endsWith(".fits", Qt::CaseInsensitive) || file_name.endsWith(".fit", Qt::CaseInsensitive);
+	const bool xisf = file_name.endsWith(".xisf", Qt::CaseInsensitive) || (!has_fits_suffix && selected_filter.startsWith("XISF"));
+	if (xisf && !file_name.endsWith(".xisf", Qt::CaseInsensitive)) file_name += ".xisf";
+	if (!xisf && !has_fits_suffix) file_name += ".fits";
+
+	snprintf(message, sizeof(message), "Saving live stack of %d frames as '%s'...", m_stacker->stackCount(), file_name.toUtf8().data());
+	window_log(message);
+
+	// A stack can be tens of megapixels, write it on a worker thread and report back here
+	QByteArray path = file_name.toUtf8();
+	QByteArray ncombine = QString("NCOMBINE= %1").arg(m_stacker->stackCount(), 20).toUtf8();
+	QFutureWatcher<int> *watcher = new QFutureWatcher<int>(this);
+	connect(watcher, &QFutureWatcher<int>::finished, this, [this, watcher, path]() {
+		char message[PATH_LEN+100];
+		// FITS_OK and XISF_OK are both 0
+		if (watcher->result() == FITS_OK) {
+			snprintf(message, sizeof(message), "%s Live stack saved as '%s'", DOWNLOAD_INDICATOR, path.constData());
+			window_log(message);
+		} else {
+			snprintf(message, sizeof(message), "Error: Can not save live stack as '%s'", path.constData());
+			window_log(message, INDIGO_ALERT_STATE);
+		}
+		watcher->deleteLater();
+	});
+	watcher->setFuture(QtConcurrent::run([stack, path, ncombine, xisf]() {
+		int res;
+		if (xisf) {
+			res = save_xisf_image(path.constData(), stack->m_width, stack->m_height, stack->m_pix_format, stack->m_raw_data, XISF_SAVE_COMPRESSION);
+		} else {
+			const char *cards[] = { ncombine.constData(), nullptr };
+			res = save_fits_image(path.constData(), stack->m_width, stack->m_height, stack->m_pix_format, stack->m_raw_data, cards);
+		}
+		delete stack;
+		return res;
+	}));
+}
+
 void ImagerWindow::on_output_settings_act() {
 	char message[PATH_LEN+100];
 	QString qlocation = QDir::toNativeSeparators(QDir::homePath());
@@ -1859,7 +2043,7 @@ void ImagerWindow::on_imager_stretch_changed(int level) {
 void ImagerWindow::on_imager_debayer_changed(uint32_t bayer_pat) {
 	conf.preview_bayer_pattern = bayer_pat;
 	const stretch_config_t sc = {(uint8_t)conf.preview_stretch_level, (uint8_t)conf.preview_color_balance, conf.preview_bayer_pattern};
-	preview_cache.recreate(m_image_key, m_indigo_item, sc);
+	preview_cache.recreate(m_image_key, m_indigo_item, m_indigo_blob, sc);
 	if (m_imager_viewer->isShowingStack()) {
 		on_stack_updated();
 	} else {
@@ -1945,7 +2129,7 @@ void ImagerWindow::on_live_stack_reset() {
 			m_imager_viewer->setImage(*image);
 			ImageStats stats;
 			if (conf.statistics_enabled) {
-				stats = imageStats((const uint8_t*)image->m_raw_data, image->m_width, image->m_height, image->m_pix_format);
+				stats = preview_stats(image);
 			}
 			m_imager_viewer->setImageStats(stats);
 		}
@@ -1976,7 +2160,7 @@ void ImagerWindow::on_stack_updated() {
 	m_imager_viewer->setImage(*stack);
 	ImageStats stats;
 	if (conf.statistics_enabled) {
-		stats = imageStats((const uint8_t*)stack->m_raw_data, stack->m_width, stack->m_height, stack->m_pix_format);
+		stats = preview_stats(stack);
 	}
 	stats.stack_count = m_stacker->stackCount();
 	m_imager_viewer->setImageStats(stats);
@@ -2003,7 +2187,7 @@ void ImagerWindow::on_statistics_show(bool enabled) {
 		if (image) {
 			ImageStats stats;
 			if (enabled)
-				stats = imageStats((const uint8_t*)(image->m_raw_data), image->m_width, image->m_height, image->m_pix_format);
+				stats = preview_stats(image);
 			m_imager_viewer->setImageStats(stats);
 		}
 	}
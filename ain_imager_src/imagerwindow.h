@@ -24,6 +24,9 @@
 #define GUIDER_MAX_DATA_POINTS 120
 #define GUIDER_GRAPH_BOTH_POINTS 54
 
+// Maximum number of received frames waiting for the live stacker
+#define MAX_PENDING_STACK_FRAMES 4
+
 #include <stdio.h>
 #include <QApplication>
 #include <QMainWindow>
@@ -71,6 +74,9 @@ class BalanceBar;
 #include <QStackedWidget>
 #include <QThread>
 #include <QtConcurrentRun>
+#include <QHash>
+#include <functional>
+#include <memory>
 #include <QProcess>
 #include <QMovie>
 #include "focusgraph.h"
@@ -80,6 +86,19 @@ class BalanceBar;
 #include "qconfigdialog.h"
 #include <IndigoSequence.h>
 
+// A received blob waiting for its preview, show() runs on the GUI thread once the preview is cached.
+// stack is decided when the frame arrives, the batch may be over by the time the preview is shown.
+struct preview_request {
+	std::shared_ptr<char> blob_owner;
+	unsigned char *data;
+	size_t size;
+	QByteArray format;
+	bool blob_writable;
+	bool stack;
+	stretch_config_t sconfig;
+	std::function<void(QString &key, bool stack)> show;
+};
+
 class ImagerWindow : public QMainWindow {
 	Q_OBJECT
 public:
@@ -288,6 +307,7 @@ public slots:
 	void on_log_debug();
 	void on_log_trace();
 	void on_image_save_act();
+	void on_stack_save_act();
 	void on_service_config_act();
 	void on_start_control_panel_act();
 	void on_output_settings_act();
@@ -1052,6 +1072,19 @@ private:
 	ImageViewer *m_seq_imager_viewer;
 
 	indigo_item *m_indigo_item;
+	// owns m_indigo_item->blob.value, the imager previews keep references to it
+	std::shared_ptr<char> m_indigo_blob;
+
+	// Previews are decoded and stretched on a worker, one at a time per preview key.
+	// A frame that arrives while one is being built waits in pending and a newer
+	// frame replaces it, unless it goes to the live stacker. At most
+	// MAX_PENDING_STACK_FRAMES of those wait, the oldest is dropped beyond that.
+	struct preview_job {
+		bool running = false;
+		unsigned int generation = 0;
+		QList<preview_request> pending;
+	};
+	QHash<QString, preview_job> m_preview_jobs;
 
 	IndigoSequence *m_sequence_editor2;
 
@@ -1220,12 +1253,17 @@ private:
 	void setup_preview(const char *agent);
 	bool open_image(QString file_name, int *image_size, unsigned char **image_data);
 
-	bool show_preview_in_imager_viewer(QString &key, bool is_batch_image = false);
+	bool show_preview_in_imager_viewer(QString &key, bool stack = false);
 	bool show_preview_in_guider_viewer(QString &key);
 	void show_selected_preview_in_solver_tab(QString &solver_source);
 	bool save_blob_item_with_prefix(indigo_item *item, const char *prefix, char *file_name, bool auto_construct = true);
 	bool save_blob_item(indigo_item *item, char *file_name);
 	void save_blob_item(indigo_item *item);
+	void save_raw_blob_as_xisf(std::shared_ptr<char> blob, size_t size, const char *file_name, std::function<void(bool saved, QByteArray file_name)> done);
+
+	void build_preview(QString &key, const preview_request &request);
+	void start_preview_build(QString &key, const preview_request &request);
+	void cancel_preview_build(QString &key);
 
 	void sync_remote_files();
 	void remove_synced_remote_files();
@@ -34,6 +34,7 @@ SOURCES += \
 	$$PWD/../common_src/live_stacker.cpp \
 	$$PWD/../common_src/antialiaseditems.cpp \
 	$$PWD/../common_src/image_stats.cpp \
+	$$PWD/../common_src/image_index.cpp \
 	$$PWD/../common_src/fits.c \
 	$$PWD/../common_src/raw_to_fits.c \
 	$$PWD/../common_src/xisf.c \
@@ -75,11 +76,13 @@ HEADERS += \
 	$$PWD/../common_src/live_stacker.h \
 	$$PWD/../common_src/antialiaseditems.h \
 	$$PWD/../common_src/image_stats.h \
+	$$PWD/../common_src/image_index.h \
 	$$PWD/../common_src/fits.h \
 	$$PWD/../common_src/raw_to_fits.h \
 	$$PWD/../common_src/xisf.h \
 	$$PWD/../common_src/xml.h \
 	$$PWD/../common_src/pixelformat.h \
+	$$PWD/../common_src/pixel_layout.h \
 	$$PWD/../common_src/coordconv.h \
 	$$PWD/../common_src/snr_calculator.h \
 	$$PWD/../common_src/snr_overlay.h \
@@ -102,7 +105,14 @@ INCLUDEPATH += \
 	"$$PWD/../common_src" \
 	"$$PWD/../ain_viewer_src"
 
-LIBS += -L"$$PWD/../external/libraw/lib" -L"$$PWD/../external/lz4" -lraw -lz
+# libraw_r keeps the decoder state per context so RAW files can be decoded on several threads,
+# the MinGW build of LibRaw provides only the single threaded libraw
+win32 {
+	LIBS += -L"$$PWD/../external/libraw/lib" -L"$$PWD/../external/lz4" -lraw -lz
+} else {
+	LIBS += -L"$$PWD/../external/libraw/lib" -L"$$PWD/../external/lz4" -lraw_r -lz
+	DEFINES += DSLR_RAW_REENTRANT
+}
 
 INDIGO_LIB_DIR = $$PWD/../indigo/build/lib
 INDIGO_FLAVOR = $$(AIN_INDIGO_FLAVOR)
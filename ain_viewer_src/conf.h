@@ -77,7 +77,11 @@ typedef struct {
 	bool statistics_enabled;
 	uint32_t preview_bayer_pattern;
 	bool show_reference;
-	char unused[100];
+	uint8_t image_sort_order;
+	bool browse_same_filter;
+	uint8_t raw_preview_mode;
+	uint8_t preview_debayer_mode;
+	char unused[96];
 } conf_t;
 
 extern conf_t conf;
@@ -23,6 +23,8 @@
 #include <QTextStream>
 #include <QVersionNumber>
 #include <viewerwindow.h>
+#include <image_index.h>
+#include <dslr_raw.h>
 #include <conf.h>
 
 conf_t conf;
@@ -68,6 +70,10 @@ int main(int argc, char *argv[]) {
 	conf.statistics_enabled = false;
 	conf.preview_bayer_pattern = 0;
 	conf.show_reference = false;
+	conf.image_sort_order = SORT_BY_NAME;
+	conf.browse_same_filter = false;
+	conf.raw_preview_mode = DSLR_RAW_FULL;
+	conf.preview_debayer_mode = DEBAYER_MODE_BILINEAR;
 	read_conf();
 
 	if (!conf.reopen_file_at_start) {
@@ -28,9 +28,11 @@
 #include "version.h"
 #include <imageviewer.h>
 #include <raw_to_fits.h>
+#include <fits.h>
 #include <dslr_raw.h>
 #include <image_stats.h>
 #include <xisf.h>
+#include <image_index.h>
 #include <QDateTime>
 #include <QGraphicsView>
 #include <QTimer>
@@ -38,7 +40,17 @@
 #include <QDropEvent>
 #include <QMimeData>
 #include <QUrl>
-
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFutureWatcher>
+#include <QActionGroup>
+
+// how often partially stretched frames are shown while a large image is loading
+#define PROGRESSIVE_UPDATE_MS 200
+// shuffled LZ4 shrinks 16-bit frames 2-3 times and is fast enough to keep up with captures
+#define XISF_CONVERSION_COMPRESSION "lz4+sh"
+// frames Quick Stack decodes ahead of the stacker
+#define QUICK_STACK_MAX_DECODERS 4
 
 void write_conf();
 
@@ -59,6 +71,9 @@ ViewerWindow::ViewerWindow(QWidget *parent) : QMainWindow(parent) {
 	m_preview_image = nullptr;
 	m_stack_last_image = nullptr;
 	m_stack_last_image_path[0] = '\0';
+	m_image_list_generation = 0;
+	m_opening_image = false;
+	m_quick_stacking = false;
 	m_stacker = new LiveStacker();
 
 	QIcon icon(":resource/ain_viewer.png");
@@ -120,6 +135,10 @@ ViewerWindow::ViewerWindow(QWidget *parent) : QMainWindow(parent) {
 	//act->setShortcutVisibleInContextMenu(true);
 	connect(act, &QAction::triggered, this, &ViewerWindow::on_image_close_act);
 
+	act = menu->addAction(tr("Load &Full Resolution RAW"));
+	act->setShortcut(QKeySequence(Qt::CTRL + Qt::Key_F));
+	connect(act, &QAction::triggered, this, &ViewerWindow::on_image_full_resolution_act);
+
 	menu->addSeparator();
 
 	act = menu->addAction(tr("Convert &RAW to FITS"));
@@ -127,10 +146,16 @@ ViewerWindow::ViewerWindow(QWidget *parent) : QMainWindow(parent) {
 	//act->setShortcutVisibleInContextMenu(true);
 	connect(act, &QAction::triggered, this, &ViewerWindow::on_image_raw_to_fits);
 
+	act = menu->addAction(tr("Convert RAW to &XISF"));
+	connect(act, &QAction::triggered, this, &ViewerWindow::on_image_raw_to_xisf);
+
 	act = menu->addAction(tr("&Quick Stack"));
 	act->setShortcut(QKeySequence(Qt::CTRL + Qt::Key_T));
 	connect(act, &QAction::triggered, this, &ViewerWindow::on_quick_stack_act);
 
+	act = menu->addAction(tr("Save Quick Stack as FITS..."));
+	connect(act, &QAction::triggered, this, &ViewerWindow::on_save_stack_act);
+
 	menu->addSeparator();
 
 	act = menu->addAction(tr("&Delete File"));
@@ -163,6 +188,55 @@ ViewerWindow::ViewerWindow(QWidget *parent) : QMainWindow(parent) {
 	act->setChecked(conf.antialiasing_enabled);
 	connect(act, &QAction::toggled, this, &ViewerWindow::on_antialias_view);
 
+	menu->addSeparator();
+
+	QMenu *sort_menu = menu->addMenu(tr("&Browse images by"));
+	QActionGroup *sort_group = new QActionGroup(this);
+	sort_group->setExclusive(true);
+	const struct { const char *title; image_sort_key key; } sort_orders[] = {
+		{ QT_TR_NOOP("File &name"), SORT_BY_NAME },
+		{ QT_TR_NOOP("Observation &time"), SORT_BY_TIME },
+		{ QT_TR_NOOP("&Exposure time"), SORT_BY_EXPOSURE },
+		{ QT_TR_NOOP("&Filter"), SORT_BY_FILTER },
+		{ QT_TR_NOOP("&Object"), SORT_BY_OBJECT }
+	};
+	for (const auto &order: sort_orders) {
+		act = sort_menu->addAction(tr(order.title));
+		act->setCheckable(true);
+		act->setChecked(conf.image_sort_order == order.key);
+		sort_group->addAction(act);
+		const int key = order.key;
+		connect(act, &QAction::triggered, this, [this, key]() {
+			on_image_sort_changed(key);
+		});
+	}
+
+	act = menu->addAction(tr("Browse images with the same filter &only"));
+	act->setCheckable(true);
+	act->setChecked(conf.browse_same_filter);
+	connect(act, &QAction::toggled, this, &ViewerWindow::on_browse_same_filter_changed);
+
+	menu->addSeparator();
+
+	QMenu *raw_menu = menu->addMenu(tr("DSLR RAW &preview"));
+	QActionGroup *raw_group = new QActionGroup(this);
+	raw_group->setExclusive(true);
+	const struct { const char *title; dslr_raw_mode mode; } raw_modes[] = {
+		{ QT_TR_NOOP("&Full resolution"), DSLR_RAW_FULL },
+		{ QT_TR_NOOP("&Half size (faster)"), DSLR_RAW_HALF_SIZE },
+		{ QT_TR_NOOP("Embedded &thumbnail (fastest)"), DSLR_RAW_THUMBNAIL }
+	};
+	for (const auto &raw_mode: raw_modes) {
+		act = raw_menu->addAction(tr(raw_mode.title));
+		act->setCheckable(true);
+		act->setChecked(conf.raw_preview_mode == raw_mode.mode);
+		raw_group->addAction(act);
+		const int mode = raw_mode.mode;
+		connect(act, &QAction::triggered, this, [this, mode]() {
+			on_raw_preview_mode_changed(mode);
+		});
+	}
+
 	menu_bar->addMenu(menu);
 
 	QMenu *tools_menu = new QMenu("&Tools", this);
@@ -217,12 +291,13 @@ ViewerWindow::ViewerWindow(QWidget *parent) : QMainWindow(parent) {
 	rootLayout->addWidget(form_panel);
 
 	m_imager_viewer->setStretch(conf.preview_stretch_level);
-	m_imager_viewer->setDebayer(conf.preview_bayer_pattern);
+	m_imager_viewer->setDebayer(conf.preview_bayer_pattern, conf.preview_debayer_mode);
 	m_imager_viewer->setBalance(conf.preview_color_balance);
 	m_imager_viewer->enableSNRMode(true);  // Enable SNR mode for ain_viewer
 
 	connect(m_imager_viewer, &ImageViewer::stretchChanged, this, &ViewerWindow::on_stretch_changed);
 	connect(m_imager_viewer, &ImageViewer::debayerChanged, this, &ViewerWindow::on_debayer_changed);
+	connect(m_imager_viewer, &ImageViewer::debayerModeChanged, this, &ViewerWindow::on_debayer_mode_changed);
 	connect(m_imager_viewer, &ImageViewer::BalanceChanged, this, &ViewerWindow::on_cb_changed);
 	connect(m_imager_viewer, &ImageViewer::showStackChanged, this, &ViewerWindow::on_stack_updated);
 	connect(m_imager_viewer, &ImageViewer::previousRequested, this, &ViewerWindow::on_image_prev_act);
@@ -239,7 +314,6 @@ ViewerWindow::~ViewerWindow () {
 	conf.window_width = wsize.width();
 	conf.window_height = wsize.height();
 	write_conf();
-	if (m_image_data) free(m_image_data);
 	delete m_stack_last_image;
 	delete m_preview_image;
 	delete m_stacker;
@@ -253,26 +327,35 @@ void close_fd(int fd) {
 }
 
 void ViewerWindow::open_image(QString file_name) {
-	char msg[PATH_LEN];
 	if (file_name == "") return;
-	FILE *file;
+	if (m_opening_image) {
+		// asked for from the events processed while a large image is shown band by band, it is opened next
+		m_next_image = file_name;
+		return;
+	}
+	m_opening_image = true;
+	load_image(file_name);
+	while (!m_next_image.isEmpty()) {
+		file_name = m_next_image;
+		m_next_image.clear();
+		load_image(file_name);
+	}
+	m_opening_image = false;
+}
+
+void ViewerWindow::load_image(QString file_name) {
+	char msg[PATH_LEN];
 	block_scrolling(true);
 	strncpy(m_image_path, file_name.toUtf8().data(), PATH_LEN);
 	m_image_path[PATH_LEN - 1] = '\0';
 	strncpy(conf.file_open, file_name.toUtf8().data(), PATH_LEN);
 	conf.file_open[PATH_LEN - 1] = '\0';
-	file = fopen(m_image_path, "rb");
-	if (file) {
-		fseek(file, 0, SEEK_END);
-		m_image_size = (size_t)ftell(file);
-		fseek(file, 0, SEEK_SET);
-		if (m_image_data == nullptr) {
-			m_image_data = (unsigned char *)malloc(m_image_size + 1);
-		} else {
-			m_image_data = (unsigned char *)realloc(m_image_data, m_image_size + 1);
-		}
-		fread(m_image_data, m_image_size, 1, file);
-		fclose(file);
+	size_t image_size;
+	std::shared_ptr<char> image_owner = map_file(m_image_path, &image_size);
+	if (image_owner) {
+		m_image_owner = image_owner;
+		m_image_data = (unsigned char *)m_image_owner.get();
+		m_image_size = image_size;
 	} else {
 		block_scrolling(false);
 		snprintf(msg, PATH_LEN, "File '%s'\nCan not be open for reading.", QDir::toNativeSeparators(m_image_path).toUtf8().data());
@@ -293,15 +376,25 @@ void ViewerWindow::open_image(QString file_name) {
 	}
 
 	m_image_formrat = strrchr(m_image_path, '.');
-	const stretch_config_t sc = {(uint8_t)conf.preview_stretch_level, (uint8_t)conf.preview_color_balance, conf.preview_bayer_pattern};
-	m_preview_image = create_preview(m_image_data, m_image_size, (const char*)m_image_formrat, sc);
+	const stretch_config_t sc = {(uint8_t)conf.preview_stretch_level, (uint8_t)conf.preview_color_balance, conf.preview_bayer_pattern, conf.raw_preview_mode, conf.preview_debayer_mode};
+	QElapsedTimer update_timer;
+	update_timer.start();
+	preview_band_cb show_band = [&](preview_image *partial, int rows_done) {
+		// the complete frame is shown below
+		if (rows_done >= partial->m_height || update_timer.elapsed() < PROGRESSIVE_UPDATE_MS) return;
+		m_imager_viewer->setImage(*partial);
+		// repaint only, the user input waits until the image is complete
+		QCoreApplication::processEvents(QEventLoop::ExcludeUserInputEvents);
+		update_timer.restart();
+	};
+	m_preview_image = create_preview(m_image_owner, m_image_data, m_image_size, (const char*)m_image_formrat, sc, show_band);
 
 	if (m_preview_image) {
 		m_imager_viewer->setImage(*m_preview_image);
 
 		ImageStats stats;
 		if (conf.statistics_enabled) {
-			stats = imageStats((const uint8_t*)(m_preview_image->m_raw_data), m_preview_image->m_width, m_preview_image->m_height, m_preview_image->m_pix_format);
+			stats = preview_stats(m_preview_image);
 		}
 		m_imager_viewer->setImageStats(stats);
 		m_imager_viewer->centerReference();
@@ -333,9 +426,77 @@ void ViewerWindow::open_image(QString file_name) {
 		show_message("Error!", msg);
 	}
 	block_scrolling(false);
-	QDir directory(dirname(file_name.toUtf8().data()));
-	QString pattern = "*" + QString(m_image_formrat);
-	m_image_list = directory.entryList(QStringList() << pattern, QDir::Files);
+	update_image_list();
+}
+
+static QStringList sorted_image_list(const ImageIndex &index, const QString &file_name, image_sort_key sort_key, bool same_filter) {
+	image_index_filter filter = nullptr;
+	const ImageIndexEntry *current = index.entry(file_name);
+	if (same_filter && current && current->has_info) {
+		const std::string filter_name = current->info.filter_name;
+		filter = [filter_name](const ImageIndexEntry &entry) {
+			return entry.has_info && filter_name == entry.info.filter_name;
+		};
+	}
+	return index.fileNames(sort_key, filter);
+}
+
+// Lists the images next/previous walk through. The headers are only read when the order or the
+// filter needs them, the folder index is cached so only new or modified files are scanned again.
+// Until a worker has read the headers of the new files the images are listed by name.
+void ViewerWindow::update_image_list() {
+	char path[PATH_LEN];
+	const unsigned int generation = ++m_image_list_generation;
+	if (m_image_path[0] == '\0' || m_image_formrat == nullptr) {
+		m_image_list.clear();
+		return;
+	}
+	strncpy(path, m_image_path, PATH_LEN);
+	path[PATH_LEN - 1] = '\0';
+	const QString folder = QString(dirname(path));
+	strncpy(path, m_image_path, PATH_LEN);
+	path[PATH_LEN - 1] = '\0';
+	const QString file_name = QString(basename(path));
+	const QStringList name_filters = QStringList() << "*" + QString(m_image_formrat);
+	const image_sort_key sort_key = (image_sort_key)conf.image_sort_order;
+	const bool same_filter = conf.browse_same_filter;
+
+	std::shared_ptr<const ImageIndex> index = ImageIndex::get(folder, name_filters, false);
+	const bool read_info = sort_key != SORT_BY_NAME || same_filter;
+	if (!read_info || index->infoRead()) {
+		m_image_list = sorted_image_list(*index, file_name, sort_key, same_filter);
+		return;
+	}
+	m_image_list = index->fileNames();
+
+	QFutureWatcher<std::shared_ptr<const ImageIndex>> *watcher = new QFutureWatcher<std::shared_ptr<const ImageIndex>>(this);
+	connect(watcher, &QFutureWatcher<std::shared_ptr<const ImageIndex>>::finished, this, [this, watcher, generation, file_name, sort_key, same_filter]() {
+		std::shared_ptr<const ImageIndex> index = watcher->result();
+		watcher->deleteLater();
+		// another image was opened or the order changed while the headers were read
+		if (generation == m_image_list_generation) {
+			m_image_list = sorted_image_list(*index, file_name, sort_key, same_filter);
+		}
+	});
+	watcher->setFuture(QtConcurrent::run([folder, name_filters]() {
+		return ImageIndex::get(folder, name_filters, true);
+	}));
+}
+
+void ViewerWindow::on_image_sort_changed(int sort_order) {
+	conf.image_sort_order = sort_order;
+	write_conf();
+	block_scrolling(true);
+	update_image_list();
+	block_scrolling(false);
+}
+
+void ViewerWindow::on_browse_same_filter_changed(bool status) {
+	conf.browse_same_filter = status;
+	write_conf();
+	block_scrolling(true);
+	update_image_list();
+	block_scrolling(false);
 }
 
 void ViewerWindow::on_image_info_act() {
@@ -347,13 +508,22 @@ void ViewerWindow::on_image_info_act() {
 		m_image_info_dlg->setWindowTitle(QString("FITS Header: ") + QString(basename(m_image_path)));
 		auto text = m_image_info_dlg->textWidget();
 		text->clear();
+		bool extension_shown = false;
  		while (card <= end) {
 			char card_line[81];
 			strncpy(card_line, card, 80);
 			card_line[80] ='\0';
 			//printf("%s\n", card_line);
 			text->append(card_line);
-			if (!strncmp(card, "END", 3)) break;
+			if (!strncmp(card, "END", 3)) {
+				// tile compressed images (fpack) keep the image header in the first extension
+				char *next = (char*)m_image_data + ((card - (char*)m_image_data) / 2880 + 1) * 2880;
+				if (extension_shown || next + 80 > end || strncmp(next, "XTENSION= 'BINTABLE'", 20)) break;
+				extension_shown = true;
+				text->append("");
+				card = next;
+				continue;
+			}
 			card+=80;
 		}
 		m_image_info_dlg->show();
@@ -369,6 +539,7 @@ void ViewerWindow::on_image_info_act() {
 		*/
 		xisf_metadata metadata;
 		xisf_read_metadata((uint8_t *)m_image_data, m_image_size, &metadata);
+		xisf_metadata_free(&metadata);
 
 		m_image_info_dlg->setWindowTitle(QString("Image Info: ") + QString(basename(m_image_path)));
 		auto text = m_image_info_dlg->textWidget();
@@ -536,10 +707,10 @@ void ViewerWindow::on_image_open_act() {
 		tr("Open Image"),
 		qlocation,
 		QString(
-			"FITS (*.fit *.FIT *.fits *.FITS *.fts *.FTS );;"
+			"FITS (*.fit *.FIT *.fits *.FITS *.fts *.FTS *.fz *.FZ);;"
 			"Indigo RAW (*.raw *.RAW);;"
 			"XISF (*.xisf *.XISF);;"
-			"FITS / Indigo RAW / XISF (*.fit *FIT *.fits *.FITS *.fts *.FTS *.raw *.RAW *.raw *.RAW);;"
+			"FITS / Indigo RAW / XISF (*.fit *FIT *.fits *.FITS *.fts *.FTS *.fz *.FZ *.raw *.RAW *.raw *.RAW);;"
 			"Nikon NEF / NRW (*.nef *.NEF *.nrw *.NRW);;"
 			"Canon CRW / CR2 (*.crw *.CRW *.cr2 *.CR2);;"
 			"Sony ARW / SR2 (*.arw *.ARW *.sr2 *.SR2);;"
@@ -580,9 +751,7 @@ void ViewerWindow::on_delete_current_image_act() {
 
 		QFile::remove(path);
 
-		QDir directory(dirname(path));
-		QString pattern = "*" + QString(m_image_formrat);
-		m_image_list = directory.entryList(QStringList() << pattern, QDir::Files);
+		update_image_list();
 
 		if (0 == m_image_list.size()) {
 			on_image_close_act();
@@ -652,7 +821,33 @@ void ViewerWindow::on_image_prev_act() {
 	open_image(next_file.toUtf8().data());
 }
 
+// One Quick Stack run. The frames are decoded ahead on worker threads and added to the stack in order
+// from QFutureWatcher continuations, so no nested event loop lets other signals in while a frame is decoded.
+struct QuickStackRun {
+	QStringList file_names;
+	stretch_config_t sc;
+	int decoders;
+	QList<QFuture<preview_image*>> pending;
+	int queued;
+	int next;
+	int stacked;
+	int failed;
+	int unsupported;
+	QString last_file;
+	QProgressDialog *progress;
+};
+
+static preview_image *quick_stack_decode(QByteArray in_file, stretch_config_t sc) {
+	size_t size;
+	std::shared_ptr<char> data = map_file(in_file.constData(), &size);
+	if (!data) return nullptr;
+	const char *ext = strrchr(in_file.constData(), '.');
+	return create_preview(data, (unsigned char *)data.get(), size, ext, sc);
+}
+
 void ViewerWindow::on_quick_stack_act() {
+	if (m_quick_stacking) return;
+
 	char path[PATH_LEN];
 	strncpy(path, m_image_path, PATH_LEN);
 	QString qlocation(dirname(path));
@@ -663,10 +858,10 @@ void ViewerWindow::on_quick_stack_act() {
 		tr("Select Images to Quick Stack..."),
 		qlocation,
 		QString(
-			"FITS (*.fit *.FIT *.fits *.FITS *.fts *.FTS );;"
+			"FITS (*.fit *.FIT *.fits *.FITS *.fts *.FTS *.fz *.FZ);;"
 			"Indigo RAW (*.raw *.RAW);;"
 			"XISF (*.xisf *.XISF);;"
-			"FITS / Indigo RAW / XISF (*.fit *FIT *.fits *.FITS *.fts *.FTS *.raw *.RAW *.raw *.RAW);;"
+			"FITS / Indigo RAW / XISF (*.fit *FIT *.fits *.FITS *.fts *.FTS *.fz *.FZ *.raw *.RAW *.raw *.RAW);;"
 			"Nikon NEF / NRW (*.nef *.NEF *.nrw *.NRW);;"
 			"Canon CRW / CR2 (*.crw *.CRW *.cr2 *.CR2);;"
 			"Sony ARW / SR2 (*.arw *.ARW *.sr2 *.SR2);;"
@@ -690,80 +885,90 @@ void ViewerWindow::on_quick_stack_act() {
 	delete m_stack_last_image;
 	m_stack_last_image = nullptr;
 
-	QProgressDialog progress("", "Abort", 0, file_num, this);
-	progress.setMinimumWidth(350);
-	progress.setMinimumDuration(0);
-	progress.setWindowModality(Qt::WindowModal);
-
-	const stretch_config_t sc = {(uint8_t)conf.preview_stretch_level, (uint8_t)conf.preview_color_balance, conf.preview_bayer_pattern};
-	char file_name[PATH_MAX];
-	int stacked = 0;
-	int failed = 0;
-	int unsupported = 0;
-
-	for (int i = 0; i < file_num; i++) {
-		progress.setValue(i);
-		if (progress.wasCanceled()) break;
+	std::shared_ptr<QuickStackRun> run = std::make_shared<QuickStackRun>();
+	run->file_names = file_names;
+	run->sc = {(uint8_t)conf.preview_stretch_level, (uint8_t)conf.preview_color_balance, conf.preview_bayer_pattern};
+	// Each decoded DSLR frame can take a few hundred MB so only a few are kept in flight.
+	run->decoders = std::max(1, std::min(get_number_of_cores(), QUICK_STACK_MAX_DECODERS));
+	run->queued = run->next = 0;
+	run->stacked = run->failed = run->unsupported = 0;
+	run->progress = new QProgressDialog("", "Abort", 0, file_num, this);
+	run->progress->setMinimumWidth(350);
+	run->progress->setMinimumDuration(0);
+	run->progress->setWindowModality(Qt::WindowModal);
+	m_quick_stacking = true;
+	quick_stack_next(run);
+}
 
-		strncpy(file_name, file_names.at(i).toUtf8().data(), PATH_MAX);
-		char message[PATH_MAX + 64];
-		snprintf(message, sizeof(message), "Stacking '%s'... (%d of %d)", basename(file_name), i + 1, file_num);
-		progress.setLabelText(message);
-		QCoreApplication::processEvents();
+void ViewerWindow::quick_stack_next(std::shared_ptr<QuickStackRun> run) {
+	const int file_num = run->file_names.size();
+	if (run->next >= file_num || run->progress->wasCanceled()) {
+		quick_stack_done(run);
+		return;
+	}
 
-		FILE *f = fopen(file_name, "rb");
-		if (!f) {
-			failed++;
-			continue;
-		}
-		fseek(f, 0, SEEK_END);
-		size_t size = (size_t)ftell(f);
-		fseek(f, 0, SEEK_SET);
-		unsigned char *data = (unsigned char *)malloc(size + 1);
-		if (!data) {
-			fclose(f);
-			failed++;
-			continue;
-		}
-		fread(data, size, 1, f);
-		fclose(f);
+	for (; run->queued < file_num && run->queued < run->next + run->decoders; run->queued++) {
+		QByteArray in_file = run->file_names.at(run->queued).toUtf8();
+		stretch_config_t sc = run->sc;
+		run->pending.append(QtConcurrent::run([in_file, sc]() {
+			return quick_stack_decode(in_file, sc);
+		}));
+	}
 
-		char *ext = strrchr(file_name, '.');
-		preview_image *img = create_preview(data, size, (const char *)ext, sc);
-		free(data);
+	run->last_file = run->file_names.at(run->next);
+	run->progress->setValue(run->next);
+	run->progress->setLabelText(QString("Stacking '%1'... (%2 of %3)").arg(QFileInfo(run->last_file).fileName()).arg(run->next + 1).arg(file_num));
 
+	QFutureWatcher<preview_image*> *watcher = new QFutureWatcher<preview_image*>(this);
+	connect(watcher, &QFutureWatcher<preview_image*>::finished, this, [this, watcher, run]() {
+		watcher->deleteLater();
+		preview_image *img = run->pending.takeFirst().result();
 		if (img && img->m_raw_data) {
 			m_stacker->addImage(img);
 			delete m_stack_last_image;
 			m_stack_last_image = img;
-			stacked++;
+			run->stacked++;
 		} else if (img && img->m_raw_data == nullptr) {
-			unsupported++;
+			run->unsupported++;
 			delete img;
-			img = nullptr;
 		} else {
-			failed++;
+			run->failed++;
 		}
+		run->next++;
+		quick_stack_next(run);
+	});
+	watcher->setFuture(run->pending.first());
+}
+
+void ViewerWindow::quick_stack_done(std::shared_ptr<QuickStackRun> run) {
+	// frames decoded ahead when the stacking was aborted
+	for (QFuture<preview_image*> &future: run->pending) {
+		delete future.result();
 	}
-	progress.setValue(file_num);
+	run->pending.clear();
+	run->progress->setValue(run->file_names.size());
+	run->progress->deleteLater();
+	m_quick_stacking = false;
 
-	if (stacked > 0) {
+	if (run->stacked > 0) {
+		QByteArray file_name = run->last_file.toUtf8();
 		m_imager_viewer->showStackButton(true);
 		m_imager_viewer->setShowStack(true);
-		strncpy(m_image_path, file_name, PATH_MAX);
+		strncpy(m_image_path, file_name.constData(), PATH_MAX);
 		m_image_path[PATH_MAX - 1] = '\0';
-		strncpy(m_stack_last_image_path, file_name, PATH_LEN);
+		strncpy(m_stack_last_image_path, file_name.constData(), PATH_LEN);
 		m_stack_last_image_path[PATH_LEN - 1] = '\0';
 		m_image_formrat = strrchr(m_image_path, '.');
 		// Rebuild full directory listing so normal navigation works after exiting stack view.
-		QDir stack_dir(QFileInfo(QString(file_name)).absolutePath());
+		QDir stack_dir(QFileInfo(run->last_file).absolutePath());
+		m_image_list_generation++;
 		m_image_list = stack_dir.entryList(QStringList() << "*" + QString(m_image_formrat), QDir::Files);
 	}
 
-	if (failed > 0 || unsupported > 0) {
+	if (run->failed > 0 || run->unsupported > 0) {
 		char message[128];
 		snprintf(message, sizeof(message),
-			"%d file(s) stacked successfully.\n%d file(s) failed.\n%d file(s) unsupported.", stacked, failed, unsupported);
+			"%d file(s) stacked successfully.\n%d file(s) failed.\n%d file(s) unsupported.", run->stacked, run->failed, run->unsupported);
 		show_message("Quick Stack", message);
 	}
 }
@@ -784,10 +989,9 @@ void ViewerWindow::on_image_close_act() {
 	preview_image *pi = new preview_image();
 	m_imager_viewer->setImage(*pi);
 	delete pi;
-	if (m_image_data) {
-		free(m_image_data);
-		m_image_data = nullptr;
-	}
+	m_image_owner.reset();
+	m_image_data = nullptr;
+	m_image_list_generation++;
 	m_image_list.clear();
 	m_image_size = 0;
 	m_image_path[0] = '\0';
@@ -796,13 +1000,22 @@ void ViewerWindow::on_image_close_act() {
 }
 
 void ViewerWindow::on_image_raw_to_fits() {
+	convert_raw_images(false);
+}
+
+void ViewerWindow::on_image_raw_to_xisf() {
+	convert_raw_images(true);
+}
+
+void ViewerWindow::convert_raw_images(bool to_xisf) {
+	const char *format_name = to_xisf ? "XISF" : "FITS";
 	char path[PATH_LEN];
 	strncpy(path, m_image_path, PATH_LEN);
 	QString qlocation(dirname(path));
 	if (m_image_path[0] == '\0') qlocation = QDir::toNativeSeparators(QDir::homePath());
 	QStringList file_names = QFileDialog::getOpenFileNames(
 		this,
-		tr("Select RAW Images to convert to FITS..."),
+		tr("Select RAW Images to convert to %1...").arg(format_name),
 		qlocation,
 		QString("Indigo RAW (*.raw *.RAW);;All Files (*)")
 	);
@@ -827,7 +1040,18 @@ void ViewerWindow::on_image_raw_to_fits() {
 		char message[500];
 		snprintf(message, 500, "Converting '%s'... (%d of %d)", basename(file_name), i, file_num);
 		progress.setLabelText(message);
-		int res = convert_raw_to_fits(file_name);
+		// convert in the background so the conversion does not freeze the GUI
+		QByteArray in_file(file_name);
+		QFuture<int> future = QtConcurrent::run([in_file, to_xisf]() {
+			char *name = (char *)in_file.constData();
+			return to_xisf ? convert_raw_to_xisf(name, XISF_CONVERSION_COMPRESSION) : convert_raw_to_fits(name);
+		});
+		QFutureWatcher<int> watcher;
+		QEventLoop loop;
+		connect(&watcher, &QFutureWatcher<int>::finished, &loop, &QEventLoop::quit);
+		watcher.setFuture(future);
+		if (!future.isFinished()) loop.exec();
+		int res = future.result();
 		printf("file '%s' -> %d\n", file_name ,res);
 		if (res < 0) {
 			failed ++;
@@ -835,6 +1059,7 @@ void ViewerWindow::on_image_raw_to_fits() {
 	}
 	progress.setValue(file_num);
 
+	char title[100];
 	if (failed) {
 		char message[100];
 		snprintf(
@@ -844,7 +1069,8 @@ void ViewerWindow::on_image_raw_to_fits() {
 			file_num - failed,
 			failed
 		);
-		show_message("RAW to FITS conversion results", message);
+		snprintf(title, sizeof(title), "RAW to %s conversion results", format_name);
+		show_message(title, message);
 	} else {
 		char message[100];
 		snprintf(
@@ -853,7 +1079,8 @@ void ViewerWindow::on_image_raw_to_fits() {
 			"%d file(s) succeessfully converted.",
 			file_num
 		);
-		show_message("RAW to FITS conversion results", message, QMessageBox::Information);
+		snprintf(title, sizeof(title), "RAW to %s conversion results", format_name);
+		show_message(title, message, QMessageBox::Information);
 	}
 }
 
@@ -890,7 +1117,7 @@ void ViewerWindow::on_statistics_show(bool enabled) {
 	if (m_preview_image) {
 		ImageStats stats;
 		if (enabled) {
-			stats = imageStats((const uint8_t*)(m_preview_image->m_raw_data), m_preview_image->m_width, m_preview_image->m_height, m_preview_image->m_pix_format);
+			stats = preview_stats(m_preview_image);
 		}
 		if (m_imager_viewer->isShowingStack()) {
 			stats.stack_count = m_stacker->stackCount();
@@ -910,6 +1137,51 @@ void ViewerWindow::enable_image_inspector(bool enable) {
 	}
 }
 
+void ViewerWindow::on_save_stack_act() {
+	preview_image *stack = m_stacker->currentStack();
+	if (stack == nullptr || stack->m_raw_data == nullptr) {
+		delete stack;
+		show_message("Save Quick Stack", "Nothing is stacked yet.", QMessageBox::Warning);
+		return;
+	}
+
+	QString suggested_name = QFileInfo(QString(m_stack_last_image_path)).absolutePath() + "/quick_stack.fits";
+	QString selected_filter;
+	QString file_name = QFileDialog::getSaveFileName(this, tr("Save Quick Stack"), suggested_name, tr("FITS Images (*.fits *.fit *.fts);;XISF Images (*.xisf)"), &selected_filter);
+	if (file_name.isEmpty()) {
+		delete stack;
+		return;
+	}
+	const bool xisf = file_name.endsWith(".xisf", Qt::CaseInsensitive) || selected_filter.startsWith("XISF");
+	if (xisf && !file_name.endsWith(".xisf", Qt::CaseInsensitive)) {
+		file_name = QFileInfo(file_name).absolutePath() + "/" + QFileInfo(file_name).completeBaseName() + ".xisf";
+	}
+
+	// The stack is written on a worker thread, the window stays responsive while a large stack goes to disk
+	QByteArray path = file_name.toUtf8();
+	QByteArray ncombine = QString("NCOMBINE= %1").arg(m_stacker->stackCount(), 20).toUtf8();
+	QFutureWatcher<int> *watcher = new QFutureWatcher<int>(this);
+	connect(watcher, &QFutureWatcher<int>::finished, this, [this, watcher, file_name]() {
+		int res = watcher->result();
+		watcher->deleteLater();
+		// FITS_OK and XISF_OK are both 0
+		if (res != FITS_OK) {
+			show_message("Save Quick Stack", QString("Failed to save '%1'").arg(file_name).toUtf8().constData(), QMessageBox::Critical);
+		}
+	});
+	watcher->setFuture(QtConcurrent::run([stack, path, ncombine, xisf]() {
+		int res;
+		if (xisf) {
+			res = save_xisf_image(path.constData(), stack->m_width, stack->m_height, stack->m_pix_format, stack->m_raw_data, XISF_CONVERSION_COMPRESSION);
+		} else {
+			const char *cards[] = { ncombine.constData(), nullptr };
+			res = save_fits_image(path.constData(), stack->m_width, stack->m_height, stack->m_pix_format, stack->m_raw_data, cards);
+		}
+		delete stack;
+		return res;
+	}));
+}
+
 void ViewerWindow::on_save_preview_act() {
 	if (!m_imager_viewer || m_image_path[0] == '\0') {
 		show_message("Save View", "No image is currently loaded.", QMessageBox::Warning);
@@ -993,7 +1265,7 @@ void ViewerWindow::on_stretch_changed(int level) {
 		int height = m_preview_image->height();
 		int pix_format = m_preview_image->m_pix_format;
 		const stretch_config_t sc = {(uint8_t)conf.preview_stretch_level, (uint8_t)conf.preview_color_balance, conf.preview_bayer_pattern};
-		preview_image *new_preview = create_preview(width, height, pix_format, m_preview_image->m_raw_data, sc);
+		preview_image *new_preview = create_tiled_preview(width, height, pix_format, m_preview_image->m_raw_owner, m_preview_image->m_raw_data, sc, m_preview_image->m_histogram);
 		if (new_preview) {
 			delete m_preview_image;
 			m_preview_image = new_preview;
@@ -1006,10 +1278,32 @@ void ViewerWindow::on_stretch_changed(int level) {
 
 void ViewerWindow::on_debayer_changed(uint32_t bayer_pat) {
 	conf.preview_bayer_pattern = bayer_pat;
+	reload_image(conf.raw_preview_mode);
+	write_conf();
+}
+
+void ViewerWindow::on_debayer_mode_changed(int mode) {
+	conf.preview_debayer_mode = mode;
+	reload_image(conf.raw_preview_mode);
+	write_conf();
+}
+
+void ViewerWindow::on_raw_preview_mode_changed(int mode) {
+	conf.raw_preview_mode = mode;
+	reload_image(conf.raw_preview_mode);
+	write_conf();
+}
+
+// DSLR RAW files are browsed with conf.raw_preview_mode, this decodes the current one in full on demand
+void ViewerWindow::on_image_full_resolution_act() {
+	reload_image(DSLR_RAW_FULL);
+}
+
+void ViewerWindow::reload_image(uint8_t raw_mode) {
 	if (m_preview_image) {
 		block_scrolling(true);
-		const stretch_config_t sc = {(uint8_t)conf.preview_stretch_level, (uint8_t)conf.preview_color_balance, conf.preview_bayer_pattern};
-		preview_image *new_preview = create_preview(m_image_data, m_image_size, (const char*)m_image_formrat, sc);
+		const stretch_config_t sc = {(uint8_t)conf.preview_stretch_level, (uint8_t)conf.preview_color_balance, conf.preview_bayer_pattern, raw_mode, conf.preview_debayer_mode};
+		preview_image *new_preview = create_preview(m_image_owner, m_image_data, m_image_size, (const char*)m_image_formrat, sc);
 		if (new_preview) {
 			delete m_preview_image;
 			m_preview_image = new_preview;
@@ -1017,13 +1311,17 @@ void ViewerWindow::on_debayer_changed(uint32_t bayer_pat) {
 
 			ImageStats stats;
 			if (conf.statistics_enabled) {
-				stats = imageStats((const uint8_t*)(m_preview_image->m_raw_data), m_preview_image->m_width, m_preview_image->m_height, m_preview_image->m_pix_format);
+				stats = preview_stats(m_preview_image);
 			}
 			m_imager_viewer->setImageStats(stats);
+
+			// the size changes when switching between the full and the reduced RAW decode
+			char info[256] = {};
+			snprintf(info, sizeof(info), "%s [%d x %d]", basename(m_image_path), m_preview_image->width(), m_preview_image->height());
+			m_imager_viewer->setText(info);
 		}
 		block_scrolling(false);
 	}
-	write_conf();
 }
 
 void ViewerWindow::on_cb_changed(int balance) {
@@ -1034,7 +1332,7 @@ void ViewerWindow::on_cb_changed(int balance) {
 		int height = m_preview_image->height();
 		int pix_format = m_preview_image->m_pix_format;
 		const stretch_config_t sc = {(uint8_t)conf.preview_stretch_level, (uint8_t)conf.preview_color_balance, conf.preview_bayer_pattern};
-		preview_image *new_preview = create_preview(width, height, pix_format, m_preview_image->m_raw_data, sc);
+		preview_image *new_preview = create_tiled_preview(width, height, pix_format, m_preview_image->m_raw_owner, m_preview_image->m_raw_data, sc, m_preview_image->m_histogram);
 		if (new_preview) {
 			delete m_preview_image;
 			m_preview_image = new_preview;
@@ -1069,7 +1367,7 @@ void ViewerWindow::on_stack_updated(bool showing_stack) {
 	m_imager_viewer->setImage(*m_preview_image);
 	ImageStats stats;
 	if (conf.statistics_enabled) {
-		stats = imageStats((const uint8_t*)m_preview_image->m_raw_data, m_preview_image->m_width, m_preview_image->m_height, m_preview_image->m_pix_format);
+		stats = preview_stats(m_preview_image);
 	}
 	if (showing_stack) {
 		stats.stack_count = m_stacker->stackCount();
@@ -43,6 +43,8 @@
 #include <QProgressBar>
 
 
+struct QuickStackRun;
+
 class ViewerWindow : public QMainWindow {
 	Q_OBJECT
 public:
@@ -73,8 +75,11 @@ public slots:
 	void on_image_prev_act();
 	void on_delete_current_image_act();
 	void on_image_close_act();
+	void on_image_full_resolution_act();
 	void on_image_raw_to_fits();
+	void on_image_raw_to_xisf();
 	void on_quick_stack_act();
+	void on_save_stack_act();
 	void on_stack_updated(bool showing_stack);
 	void on_image_info_act();
 	void on_save_preview_act();
@@ -84,11 +89,21 @@ public slots:
 	void on_stretch_changed(int level);
 	void on_cb_changed(int balance);
 	void on_debayer_changed(uint32_t bayer_pat);
+	void on_debayer_mode_changed(int mode);
 	void on_antialias_view(bool status);
 	void on_viewer_show_reference(bool status);
 	void on_statistics_show(bool enabled);
+	void on_image_sort_changed(int sort_order);
+	void on_browse_same_filter_changed(bool status);
+	void on_raw_preview_mode_changed(int mode);
 
 private:
+	void convert_raw_images(bool to_xisf);
+	void update_image_list();
+	void load_image(QString file_name);
+	void reload_image(uint8_t raw_mode);
+	void quick_stack_next(std::shared_ptr<QuickStackRun> run);
+	void quick_stack_done(std::shared_ptr<QuickStackRun> run);
 	bool save_view(const QString &file_name, bool show_errors_as_dialogs);
 	QString save_view_default_filename() const;
 
@@ -98,6 +113,7 @@ private:
 	LiveStacker *m_stacker;
 	preview_image *m_preview_image;
 	preview_image *m_stack_last_image;
+	std::shared_ptr<char> m_image_owner;
 	unsigned char *m_image_data;
 	size_t m_image_size;
 	char m_image_path[PATH_LEN];
@@ -105,6 +121,12 @@ private:
 	char *m_image_formrat;
 	QString m_selected_filter;
 	QStringList m_image_list;
+	// bumped whenever m_image_list is replaced, a header scan still running for an older list is ignored
+	unsigned int m_image_list_generation;
+	// open_image() is not entered again while an image is loaded, the last image asked for meanwhile is opened next
+	bool m_opening_image;
+	QString m_next_image;
+	bool m_quick_stacking;
 };
 
 #endif // VIEWERWINDOW_H
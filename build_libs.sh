@@ -7,7 +7,8 @@ cd ../..
 
 cd external/libraw
 mkdir lib/
-make -f Makefile.mingw library
+# builds the thread safe libraw_r next to libraw
+make -f Makefile.dist library
 cd ../..
 
 cd external/lz4
@@ -24,8 +24,91 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <string.h>
+#include <pthread.h>
 #include <indigo/indigo_bus.h>
 #include <dslr_raw.h>
+#include <utils.h>
+
+/* Decoder contexts are kept between files, libraw_init() allocates and clears several MB each time.
+   Batch callers decode from several threads so the pool holds one context per core, they are freed at exit. */
+#define MAX_IDLE_CONTEXTS 64
+#define DEFAULT_IDLE_CONTEXTS 4
+
+static pthread_mutex_t context_mutex = PTHREAD_MUTEX_INITIALIZER;
+static libraw_data_t *idle_contexts[MAX_IDLE_CONTEXTS];
+static int idle_context_count = 0;
+static int idle_context_limit = 0;
+static libraw_output_params_t default_params;
+static bool default_params_set = false;
+
+#if defined(DSLR_RAW_REENTRANT)
+#define DECODER_LOCK()
+#define DECODER_UNLOCK()
+#else
+/* libraw built with LIBRAW_NOTHREADS keeps the decoder state in statics, so one file at a time */
+static pthread_mutex_t decoder_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define DECODER_LOCK() pthread_mutex_lock(&decoder_mutex)
+#define DECODER_UNLOCK() pthread_mutex_unlock(&decoder_mutex)
+#endif
+
+static void free_idle_contexts(void) {
+	pthread_mutex_lock(&context_mutex);
+	while (idle_context_count > 0) {
+		libraw_close(idle_contexts[--idle_context_count]);
+	}
+	/* contexts still decoding are closed when released */
+	idle_context_limit = -1;
+	pthread_mutex_unlock(&context_mutex);
+}
+
+static libraw_data_t *acquire_context(void) {
+	libraw_data_t *raw_data = NULL;
+	pthread_mutex_lock(&context_mutex);
+	if (idle_context_count > 0) {
+		raw_data = idle_contexts[--idle_context_count];
+	}
+	pthread_mutex_unlock(&context_mutex);
+
+	if (raw_data) {
+		/* libraw_recycle() keeps the parameters, start each file from the defaults */
+		raw_data->params = default_params;
+		return raw_data;
+	}
+
+	raw_data = libraw_init(0);
+	if (raw_data == NULL) {
+		indigo_error("libraw_init failed");
+		return NULL;
+	}
+	pthread_mutex_lock(&context_mutex);
+	if (!default_params_set) {
+		default_params = raw_data->params;
+		default_params_set = true;
+		int cores = get_number_of_cores();
+		if (cores <= 0) cores = DEFAULT_IDLE_CONTEXTS;
+		idle_context_limit = (cores < MAX_IDLE_CONTEXTS) ? cores : MAX_IDLE_CONTEXTS;
+		atexit(free_idle_contexts);
+	}
+	pthread_mutex_unlock(&context_mutex);
+	return raw_data;
+}
+
+static void release_context(libraw_data_t *raw_data) {
+	libraw_free_image(raw_data);
+	libraw_recycle(raw_data);
+
+	pthread_mutex_lock(&context_mutex);
+	if (idle_context_count < idle_context_limit) {
+		idle_contexts[idle_context_count++] = raw_data;
+		raw_data = NULL;
+	}
+	pthread_mutex_unlock(&context_mutex);
+
+	if (raw_data) {
+		libraw_close(raw_data);
+	}
+}
 
 static int image_debayered_data(libraw_data_t *raw_data, dslr_raw_image_s *output_image) {
 	int rc;
@@ -150,7 +233,67 @@ static int image_bayered_data(libraw_data_t *raw_data, dslr_raw_image_s *output_
 	return 0;
 }
 
+/* the thumbnail is used only if it is at least this fraction of the image width, tiny ones are not worth showing */
+#define MIN_THUMBNAIL_SCALE 4
+
+static int image_thumbnail_data(libraw_data_t *raw_data, dslr_raw_image_s *output_image) {
+	int rc;
+	libraw_processed_image_t *processed_image = NULL;
+
+	rc = libraw_unpack_thumb(raw_data);
+	if (rc != LIBRAW_SUCCESS) {
+		indigo_debug("[rc:%d] libraw_unpack_thumb failed: '%s'", rc, libraw_strerror(rc));
+		return rc;
+	}
+
+	processed_image = libraw_dcraw_make_mem_thumb(raw_data, &rc);
+	if (!processed_image) {
+		indigo_debug("[rc:%d] libraw_dcraw_make_mem_thumb failed: '%s'", rc, libraw_strerror(rc));
+		return rc;
+	}
+
+	if (processed_image->type == LIBRAW_IMAGE_JPEG) {
+		output_image->jpeg = true;
+		output_image->bits = 8;
+		output_image->colors = 3;
+		/* the fallback is a half size decode, a larger thumbnail is scaled down to match it while decoding */
+		while (output_image->jpeg_scale_denom < 8 && raw_data->thumbnail.twidth / (output_image->jpeg_scale_denom * 2) >= raw_data->sizes.width / 2) {
+			output_image->jpeg_scale_denom *= 2;
+		}
+	} else if (processed_image->type == LIBRAW_IMAGE_BITMAP && processed_image->colors == 3 && processed_image->bits == 8) {
+		output_image->bits = 8;
+		output_image->colors = 3;
+	} else {
+		indigo_debug("unsupported thumbnail (type: %d, colors: %d, bits: %d)", processed_image->type, processed_image->colors, processed_image->bits);
+		rc = LIBRAW_UNSPECIFIED_ERROR;
+		goto cleanup;
+	}
+
+	output_image->width = raw_data->thumbnail.twidth;
+	output_image->height = raw_data->thumbnail.theight;
+	if (processed_image->type == LIBRAW_IMAGE_BITMAP) {
+		output_image->width = processed_image->width;
+		output_image->height = processed_image->height;
+	}
+	output_image->size = processed_image->data_size;
+	output_image->data = malloc(output_image->size);
+	if (!output_image->data) {
+		indigo_error("%s", strerror(errno));
+		rc = errno;
+		goto cleanup;
+	}
+	memcpy(output_image->data, processed_image->data, output_image->size);
+
+cleanup:
+	libraw_dcraw_clear_mem(processed_image);
+	return rc;
+}
+
 int dslr_raw_process_image(void *buffer, size_t buffer_size, dslr_raw_image_s *output_image) {
+	return dslr_raw_process_image_mode(buffer, buffer_size, output_image, DSLR_RAW_FULL);
+}
+
+int dslr_raw_process_image_mode(void *buffer, size_t buffer_size, dslr_raw_image_s *output_image, dslr_raw_mode mode) {
 	int rc;
 	libraw_data_t *raw_data;
 
@@ -158,7 +301,9 @@ int dslr_raw_process_image(void *buffer, size_t buffer_size, dslr_raw_image_s *o
 	output_image->height = 0;
 	output_image->bits = 16;
 	output_image->colors = 0;
-	output_image->colors = false;
+	output_image->debayered = false;
+	output_image->jpeg = false;
+	output_image->jpeg_scale_denom = 1;
 	memset(output_image->bayer_pattern, 0, sizeof(output_image->bayer_pattern));
 	output_image->size = 0;
 	output_image->data = NULL;
@@ -167,7 +312,11 @@ int dslr_raw_process_image(void *buffer, size_t buffer_size, dslr_raw_image_s *o
 	clock_t start = clock();
 #endif
 
-	raw_data = libraw_init(0);
+	raw_data = acquire_context();
+	if (raw_data == NULL) {
+		return LIBRAW_UNSPECIFIED_ERROR;
+	}
+	DECODER_LOCK();
 
 	/* These work fine for astro - change with caution */
 	/* Linear 16-bit output. */
@@ -188,6 +337,8 @@ int dslr_raw_process_image(void *buffer, size_t buffer_size, dslr_raw_image_s *o
 	raw_data->params.use_camera_wb = 1;
 	/* Output colorspace raw*/
 	raw_data->params.output_color = 0;
+	/* Half size skips the interpolation, it has to be set before the file is opened */
+	raw_data->params.half_size = (mode != DSLR_RAW_FULL);
 
 	rc = libraw_open_buffer(raw_data, buffer, buffer_size);
 	if (rc != LIBRAW_SUCCESS) {
@@ -195,6 +346,18 @@ int dslr_raw_process_image(void *buffer, size_t buffer_size, dslr_raw_image_s *o
 		goto cleanup;
 	}
 
+	if (mode == DSLR_RAW_THUMBNAIL) {
+		if (raw_data->thumbnail.twidth * MIN_THUMBNAIL_SCALE >= raw_data->sizes.width && image_thumbnail_data(raw_data, output_image) == LIBRAW_SUCCESS) {
+			output_image->debayered = true;
+			indigo_debug("using %d x %d embedded thumbnail", output_image->width, output_image->height);
+			goto cleanup;
+		}
+		indigo_debug("no usable thumbnail (%d x %d), decoding at half size", raw_data->thumbnail.twidth, raw_data->thumbnail.theight);
+		output_image->bits = 16;
+		output_image->colors = 0;
+		output_image->jpeg = false;
+	}
+
 	rc = libraw_unpack(raw_data);
 	if (rc != LIBRAW_SUCCESS) {
 		indigo_error( "[rc:%d] libraw_unpack failed: '%s'", rc, libraw_strerror(rc));
@@ -241,9 +404,8 @@ int dslr_raw_process_image(void *buffer, size_t buffer_size, dslr_raw_image_s *o
 #endif
 
 cleanup:
-	libraw_free_image(raw_data);
-	libraw_recycle(raw_data);
-	libraw_close(raw_data);
+	release_context(raw_data);
+	DECODER_UNLOCK();
 
 	return rc;
 }
@@ -260,7 +422,11 @@ int dslr_raw_image_info(void *buffer, size_t buffer_size, dslr_raw_image_info_s
 #if !defined(INDIGO_WINDOWS)
 	clock_t start = clock();
 #endif
-	raw_data = libraw_init(0);
+	raw_data = acquire_context();
+	if (raw_data == NULL) {
+		return LIBRAW_UNSPECIFIED_ERROR;
+	}
+	DECODER_LOCK();
 
 	rc = libraw_open_buffer(raw_data, buffer, buffer_size);
 	if (rc != LIBRAW_SUCCESS) {
@@ -302,9 +468,8 @@ int dslr_raw_image_info(void *buffer, size_t buffer_size, dslr_raw_image_info_s
 #endif
 
 cleanup:
-	libraw_free_image(raw_data);
-	libraw_recycle(raw_data);
-	libraw_close(raw_data);
+	release_context(raw_data);
+	DECODER_UNLOCK();
 
 	return rc;
 }
@@ -33,9 +33,17 @@ typedef struct {
 	uint8_t bits;
 	uint8_t colors;
 	bool debayered;
+	bool jpeg; /* data holds the JPEG thumbnail embedded by the camera */
+	uint8_t jpeg_scale_denom; /* the JPEG thumbnail may be decoded at 1/jpeg_scale_denom and still be at least half size */
 	char bayer_pattern[5];
 } dslr_raw_image_s;
 
+typedef enum {
+	DSLR_RAW_FULL = 0,      /* unpack and debayer at full resolution */
+	DSLR_RAW_HALF_SIZE,     /* each 2x2 CFA block becomes one RGB pixel, no interpolation */
+	DSLR_RAW_THUMBNAIL      /* embedded camera thumbnail, falls back to DSLR_RAW_HALF_SIZE if there is no usable one */
+} dslr_raw_mode;
+
 typedef struct {
 	char camera_make[64];
 	char camera_model[64];
@@ -66,6 +74,7 @@ extern "C" {
 #define FIT_FORMAT_AMATEUR_CCD
 
 int dslr_raw_process_image(void *buffer, size_t buffer_size, dslr_raw_image_s *output_image);
+int dslr_raw_process_image_mode(void *buffer, size_t buffer_size, dslr_raw_image_s *output_image, dslr_raw_mode mode);
 int dslr_raw_image_info(void *buffer, size_t buffer_size, dslr_raw_image_info_s *image_info);
 
 #ifdef __cplusplus
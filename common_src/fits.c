@@ -22,7 +22,11 @@
 #include <string.h>
 #include <stdio.h>
 #include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
 #include <indigo/indigo_bus.h>
+#include <utils.h>
 
 static int fits_header_init(fits_header *header, fits_header_state state) {
 	header->state = state;
@@ -43,6 +47,11 @@ static int fits_header_init(fits_header *header, fits_header_state state) {
 	header->data_max = 0;
 	header->data_max_found = 0;
 	header->data_offset = 0;
+	header->exposure_time = -1;
+	header->filter_name[0] = '\0';
+	header->object_name[0] = '\0';
+	header->observation_time[0] = '\0';
+	header->tile_compressed = 0;
 	return 0;
 }
 
@@ -86,6 +95,17 @@ static int read_keyword_value(const uint8_t *ptr8, char *keyword, char *value) {
 }
 
 
+void fits_copy_string_value(char *dest, const char *value, size_t size) {
+	size_t len = 0;
+	while (*value == '\'' || *value == ' ') value++;
+	while (value[len] != '\0' && value[len] != '\'' && len < size - 1) {
+		dest[len] = value[len];
+		len++;
+	}
+	while (len > 0 && dest[len - 1] == ' ') len--;
+	dest[len] = '\0';
+}
+
 #define CHECK_KEYWORD(key) \
 	if (strcmp(keyword, key)) { \
 		indigo_error("Expected %s keyword, found %s = %s\n", key, keyword, value); \
@@ -190,6 +210,14 @@ static int fits_header_parse_line(fits_header *header, const uint8_t line[80]) {
 			header->xbayeroff = d;
 		} else if (!strcmp(keyword, "YBAYROFF") && sscanf(value, "%lf", &d) == 1) {
 			header->ybayeroff = d;
+		} else if ((!strcmp(keyword, "EXPTIME") || (!strcmp(keyword, "EXPOSURE") && header->exposure_time < 0)) && sscanf(value, "%lf", &d) == 1) {
+			header->exposure_time = d;
+		} else if (!strcmp(keyword, "FILTER")) {
+			fits_copy_string_value(header->filter_name, value, sizeof(header->filter_name));
+		} else if (!strcmp(keyword, "OBJECT")) {
+			fits_copy_string_value(header->object_name, value, sizeof(header->object_name));
+		} else if (!strcmp(keyword, "DATE-OBS")) {
+			fits_copy_string_value(header->observation_time, value, sizeof(header->observation_time));
 		} else if (!strcmp(keyword, "DATAMIN") && sscanf(value, "%lf", &d) == 1) {
 			header->data_min_found = 1;
 			header->data_min = d;
@@ -208,6 +236,263 @@ static int fits_header_parse_line(fits_header *header, const uint8_t line[80]) {
 }
 
 
+#define FITS_MAX_ZNAMES 16
+#define FITS_MAX_TFIELDS 999
+
+/* compares a quoted string value ignoring the trailing spaces */
+static int fits_string_value_is(const char *value, const char *str) {
+	size_t len = strlen(str);
+	if (value[0] != '\'' || strncmp(value + 1, str, len)) return 0;
+	for (value += len + 1; *value == ' '; value++);
+	return *value == '\'' || *value == '\0';
+}
+
+static int fits_tform_size(const char *value, char *code) {
+	int repeat = 1;
+	if (*value == '\'') value++;
+	if (*value >= '0' && *value <= '9') {
+		repeat = atoi(value);
+		while (*value >= '0' && *value <= '9') value++;
+		/* no field is that wide, keeps the sizes below from overflowing */
+		if (repeat < 0 || repeat > INT32_MAX / 16) return -1;
+	}
+	*code = *value;
+	switch (*value) {
+		case 'L':
+		case 'B':
+		case 'A': return repeat;
+		case 'X': return (repeat + 7) / 8;
+		case 'I': return repeat * 2;
+		case 'J':
+		case 'E': return repeat * 4;
+		case 'K':
+		case 'D':
+		case 'C':
+		case 'P': return repeat * 8;
+		case 'M':
+		case 'Q': return repeat * 16;
+	}
+	return -1;
+}
+
+/* Parses the BINTABLE extension at offset and, if it holds a tile compressed image (ZIMAGE = T),
+ * sets up header as if the image was stored uncompressed and fills header->tiles.
+ * Returns FITS_OK if there is no tile compressed image, the header is left untouched then.
+ */
+static int fits_read_tile_compressed_header(const uint8_t *fits_data, int fits_size, int offset, fits_header *header) {
+	char keyword[10], value[72];
+	char tform_code[FITS_MAX_TFIELDS];
+	int tform_size[FITS_MAX_TFIELDS];
+	int zname[FITS_MAX_ZNAMES], zval[FITS_MAX_ZNAMES], zval_found[FITS_MAX_ZNAMES];
+	int column_index[5] = { -1, -1, -1, -1, -1 };
+	int zimage = 0, zbitpix = 0, znaxis = 0, znaxisn[3] = { 0, 0, 0 }, tfields = 0, n;
+	int naxis1 = 0, naxis2 = 0, theap = -1, lines_read = 0;
+	int zscale_found = 0, zquantiz_found = 0;
+	const char *column_names[5] = { "COMPRESSED_DATA", "GZIP_COMPRESSED_DATA", "ZSCALE", "ZZERO", "ZBLANK" };
+	fits_header ext;
+	fits_tile_info *tiles = &ext.tiles;
+
+	if (offset < 0 || (int64_t)offset + FITS_HEADER_BLOCK_SIZE > fits_size) return FITS_OK;
+	if (strncmp((const char *)fits_data + offset, "XTENSION= 'BINTABLE'", 20)) return FITS_OK;
+
+	ext = *header;
+	ext.state = STATE_REST;
+	memset(tiles, 0, sizeof(fits_tile_info));
+	memset(zname, 0, sizeof(zname));
+	memset(zval, 0, sizeof(zval));
+	memset(zval_found, 0, sizeof(zval_found));
+	memset(tform_size, 0, sizeof(tform_size));
+	memset(tform_code, 0, sizeof(tform_code));
+	tiles->quantize = FITS_QUANTIZE_NO_DITHER;
+	tiles->rice_blocksize = 32;
+	tiles->zscale = 1.0;
+
+	const uint8_t *ptr8 = fits_data + offset;
+	for (;;) {
+		if (ptr8 + 80 > fits_data + fits_size) {
+			indigo_error("BINTABLE header is truncated\n");
+			return FITS_INVALIDDATA;
+		}
+		read_keyword_value(ptr8, keyword, value);
+		ptr8 += 80;
+		lines_read++;
+		if (!strcmp(keyword, "ZIMAGE")) {
+			zimage = (value[0] == 'T');
+		} else if (!strcmp(keyword, "ZBITPIX")) {
+			zbitpix = atoi(value);
+		} else if (!strcmp(keyword, "ZNAXIS")) {
+			znaxis = atoi(value);
+		} else if (sscanf(keyword, "ZNAXIS%d", &n) == 1) {
+			if (n >= 1 && n <= 3) znaxisn[n - 1] = atoi(value);
+		} else if (sscanf(keyword, "ZTILE%d", &n) == 1) {
+			if (n >= 1 && n <= 3) tiles->ztile[n - 1] = atoi(value);
+		} else if (!strcmp(keyword, "ZCMPTYPE")) {
+			if (fits_string_value_is(value, "RICE_1") || fits_string_value_is(value, "RICE_ONE")) {
+				tiles->compression = FITS_COMPRESSION_RICE_1;
+			} else if (fits_string_value_is(value, "GZIP_1")) {
+				tiles->compression = FITS_COMPRESSION_GZIP_1;
+			} else if (fits_string_value_is(value, "GZIP_2")) {
+				tiles->compression = FITS_COMPRESSION_GZIP_2;
+			} else {
+				indigo_error("unsupported tile compression ZCMPTYPE = %s\n", value);
+				return FITS_INVALIDDATA;
+			}
+		} else if (sscanf(keyword, "ZNAME%d", &n) == 1) {
+			if (n >= 1 && n <= FITS_MAX_ZNAMES) {
+				if (fits_string_value_is(value, "BLOCKSIZE")) zname[n - 1] = 1;
+				else if (fits_string_value_is(value, "BYTEPIX")) zname[n - 1] = 2;
+			}
+		} else if (sscanf(keyword, "ZVAL%d", &n) == 1) {
+			if (n >= 1 && n <= FITS_MAX_ZNAMES) {
+				zval[n - 1] = atoi(value);
+				zval_found[n - 1] = 1;
+			}
+		} else if (!strcmp(keyword, "ZQUANTIZ")) {
+			zquantiz_found = 1;
+			if (fits_string_value_is(value, "SUBTRACTIVE_DITHER_1")) tiles->quantize = FITS_QUANTIZE_SUBTRACTIVE_DITHER_1;
+			else if (fits_string_value_is(value, "SUBTRACTIVE_DITHER_2")) tiles->quantize = FITS_QUANTIZE_SUBTRACTIVE_DITHER_2;
+			else if (fits_string_value_is(value, "NONE")) tiles->quantize = FITS_QUANTIZE_NONE;
+			else tiles->quantize = FITS_QUANTIZE_NO_DITHER;
+		} else if (!strcmp(keyword, "ZDITHER0")) {
+			tiles->dither_seed = atoi(value);
+		} else if (!strcmp(keyword, "ZSCALE")) {
+			zscale_found = 1;
+			tiles->zscale = atof(value);
+		} else if (!strcmp(keyword, "ZZERO")) {
+			tiles->zzero = atof(value);
+		} else if (!strcmp(keyword, "ZBLANK")) {
+			tiles->zblank_found = 1;
+			tiles->zblank = atoi(value);
+		} else if (!strcmp(keyword, "NAXIS1")) {
+			naxis1 = atoi(value);
+		} else if (!strcmp(keyword, "NAXIS2")) {
+			naxis2 = atoi(value);
+		} else if (!strcmp(keyword, "THEAP")) {
+			theap = atoi(value);
+		} else if (!strcmp(keyword, "TFIELDS")) {
+			tfields = atoi(value);
+		} else if (sscanf(keyword, "TTYPE%d", &n) == 1) {
+			for (int i = 0; i < 5; i++) {
+				if (n >= 1 && n <= FITS_MAX_TFIELDS && fits_string_value_is(value, column_names[i])) {
+					column_index[i] = n - 1;
+				}
+			}
+		} else if (sscanf(keyword, "TFORM%d", &n) == 1) {
+			if (n >= 1 && n <= FITS_MAX_TFIELDS) tform_size[n - 1] = fits_tform_size(value, &tform_code[n - 1]);
+		} else if (
+			!strcmp(keyword, "XTENSION") || !strcmp(keyword, "BITPIX") || !strcmp(keyword, "NAXIS") ||
+			!strcmp(keyword, "GCOUNT")
+		) {
+			/* describe the table, not the image */
+		} else if (fits_header_parse_line(&ext, ptr8 - 80) == 1) {
+			break;
+		}
+	}
+
+	if (!zimage) return FITS_OK;
+
+	if (zbitpix != 8 && zbitpix != 16 && zbitpix != 32 && zbitpix != -32) {
+		indigo_error("unsupported tile compressed image ZBITPIX = %d\n", zbitpix);
+		return FITS_INVALIDDATA;
+	}
+	if (znaxis < 1 || znaxis > 3 || tfields > FITS_MAX_TFIELDS || column_index[0] < 0 || column_index[0] >= tfields || tiles->compression == FITS_COMPRESSION_NONE) {
+		indigo_error("unsupported tile compressed image ZNAXIS = %d, TFIELDS = %d\n", znaxis, tfields);
+		return FITS_INVALIDDATA;
+	}
+
+	int64_t tile_count = 1;
+	for (int i = 0; i < 3; i++) {
+		if (i >= znaxis) {
+			znaxisn[i] = 1;
+			tiles->ztile[i] = 1;
+		} else if (tiles->ztile[i] <= 0) {
+			tiles->ztile[i] = (i == 0) ? znaxisn[0] : 1;
+		}
+		if (znaxisn[i] <= 0) {
+			indigo_error("invalid value of ZNAXIS%d = %d\n", i + 1, znaxisn[i]);
+			return FITS_INVALIDDATA;
+		}
+		tile_count *= (znaxisn[i] + tiles->ztile[i] - 1) / tiles->ztile[i];
+	}
+
+	int column_offset[5] = { -1, -1, -1, -1, -1 };
+	for (int i = 0; i < 5; i++) {
+		if (column_index[i] < 0 || column_index[i] >= tfields) continue;
+		/* the columns before this one and the column itself must fit in a row of NAXIS1 bytes */
+		int64_t end = 0;
+		for (int j = 0; j <= column_index[i]; j++) {
+			if (tform_size[j] < 0) {
+				indigo_error("unsupported TFORM%d\n", j + 1);
+				return FITS_INVALIDDATA;
+			}
+			end += tform_size[j];
+		}
+		if (end > naxis1) {
+			indigo_error("TFORM%d column ends at byte %"PRId64" of a %d byte row\n", column_index[i] + 1, end, naxis1);
+			return FITS_INVALIDDATA;
+		}
+		column_offset[i] = (int)(end - tform_size[column_index[i]]);
+	}
+	tiles->compressed_column = column_offset[0];
+	tiles->compressed_64bit = (tform_code[column_index[0]] == 'Q');
+	tiles->gzip_column = column_offset[1];
+	tiles->gzip_64bit = (column_index[1] >= 0 && tform_code[column_index[1]] == 'Q');
+	tiles->zscale_column = column_offset[2];
+	tiles->zzero_column = column_offset[3];
+	tiles->zblank_column = column_offset[4];
+	if (tform_code[column_index[0]] != 'P' && tform_code[column_index[0]] != 'Q') {
+		indigo_error("COMPRESSED_DATA column is not a variable length array\n");
+		return FITS_INVALIDDATA;
+	}
+	if ((tiles->zscale_column >= 0 && tform_code[column_index[2]] != 'D') || (tiles->zzero_column >= 0 && tform_code[column_index[3]] != 'D') || (tiles->zblank_column >= 0 && tform_code[column_index[4]] != 'J')) {
+		indigo_error("unsupported ZSCALE, ZZERO or ZBLANK column format\n");
+		return FITS_INVALIDDATA;
+	}
+
+	if (zbitpix == -32) {
+		if (!zscale_found && tiles->zscale_column < 0) {
+			tiles->quantize = FITS_QUANTIZE_NONE;
+		} else if (!zquantiz_found) {
+			tiles->quantize = FITS_QUANTIZE_NO_DITHER;
+		}
+	} else {
+		tiles->quantize = FITS_QUANTIZE_NONE;
+	}
+
+	tiles->rice_bytepix = (zbitpix == -32) ? 4 : abs(zbitpix) / 8;
+	for (int i = 0; i < FITS_MAX_ZNAMES; i++) {
+		if (zname[i] && !zval_found[i]) {
+			indigo_error("ZNAME%d without ZVAL%d\n", i + 1, i + 1);
+			return FITS_INVALIDDATA;
+		}
+		if (zname[i] == 1) tiles->rice_blocksize = zval[i];
+		else if (zname[i] == 2) tiles->rice_bytepix = zval[i];
+	}
+	if (tiles->compression == FITS_COMPRESSION_RICE_1 && (tiles->rice_blocksize <= 0 || tiles->rice_bytepix != ((zbitpix == -32) ? 4 : zbitpix / 8))) {
+		indigo_error("unsupported RICE_1 parameters BLOCKSIZE = %d, BYTEPIX = %d\n", tiles->rice_blocksize, tiles->rice_bytepix);
+		return FITS_INVALIDDATA;
+	}
+
+	tiles->row_size = naxis1;
+	tiles->rows = naxis2;
+	tiles->heap_offset = (theap < 0) ? naxis1 * naxis2 : theap;
+	if (naxis1 <= 0 || (int64_t)naxis2 < tile_count || (int64_t)naxis1 * naxis2 > INT32_MAX) {
+		indigo_error("BINTABLE has %d rows of %d bytes, %"PRId64" tiles expected\n", naxis2, naxis1, tile_count);
+		return FITS_INVALIDDATA;
+	}
+
+	ext.data_offset = offset + (int)ceil(lines_read / 36.0) * FITS_HEADER_BLOCK_SIZE;
+	ext.bitpix = zbitpix;
+	ext.naxis = znaxis;
+	for (int i = 0; i < znaxis; i++) {
+		ext.naxisn[i] = znaxisn[i];
+	}
+	ext.tile_compressed = 1;
+	*header = ext;
+	indigo_debug("tile compressed image: compression = %d, tiles = %d x %d x %d, table = %d x %d\n", tiles->compression, tiles->ztile[0], tiles->ztile[1], tiles->ztile[2], naxis1, naxis2);
+	return FITS_OK;
+}
+
 int fits_read_header(const uint8_t *fits_data, int fits_size, fits_header *header) {
 	const uint8_t *ptr8 = fits_data;
 	int lines_read, ret = 0;
@@ -218,6 +503,10 @@ int fits_read_header(const uint8_t *fits_data, int fits_size, fits_header *heade
 	lines_read = 0;
 	fits_header_init(header, STATE_SIMPLE);
 	do {
+		if (ptr8 + 80 > fits_data + fits_size) {
+			indigo_error("FITS header is truncated\n");
+			return FITS_INVALIDDATA;
+		}
 		ret = fits_header_parse_line(header, ptr8);
 		ptr8 += 80;
 		lines_read++;
@@ -228,6 +517,12 @@ int fits_read_header(const uint8_t *fits_data, int fits_size, fits_header *heade
 	header->data_offset = (int)ceil(lines_read / 36.0) * FITS_HEADER_BLOCK_SIZE;
 	indigo_debug("lines_read = %d, header blocks = %d", lines_read, (int)ceil(lines_read / 36.0));
 
+	/* no primary image - look for a tile compressed image (fpack) in the first extension */
+	if (header->naxis == 0) {
+		ret = fits_read_tile_compressed_header(fits_data, fits_size, header->data_offset, header);
+		if (ret < 0) return ret;
+	}
+
 	if (header->rgb && (header->naxis != 3 || (header->naxisn[2] != 3 && header->naxisn[2] != 4))) {
 		indigo_error("File contains RGB image but NAXIS = %d and NAXIS3 = %d\n", header->naxis, header->naxisn[2]);
 		return FITS_INVALIDDATA;
@@ -257,87 +552,1140 @@ int fits_get_buffer_size(fits_header *header) {
 	return size;
 }
 
-int fits_process_data(const uint8_t *fits_data, int fits_size, fits_header *header, char *native_data) {
-	int little_endian = 1;
-	int size = 1;
-	for (int i = 0; i < header->naxis; i++){
-		size *= header->naxisn[i];
+/* Sample conversion kernels.
+ * FITS data is big endian, the fast paths below byte swap with SIMD and, when BSCALE = 1 and
+ * BZERO is an integer, apply BZERO as a wrapping integer add. This is what the floating point
+ * expression evaluates to for every in-range result, so the output is identical.
+ */
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FITS_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FITS_USE_AVX2
+#include <immintrin.h>
+#endif
+
+#define FITS_MIN_SIZE_TO_PARALLELIZE 0x3FFFF
+
+typedef struct {
+	const uint8_t *raw;
+	char *native;
+	size_t count;
+	const fits_header *header;
+} fits_convert_job;
+
+typedef struct {
+	void *(*worker)(void *);
+	uint8_t *jobs;
+	size_t job_size;
+} fits_jobs;
+
+static void fits_run_job_range(void *context, size_t first, size_t last) {
+	fits_jobs *jobs = (fits_jobs *)context;
+	for (size_t i = first; i < last; i++) {
+		jobs->worker(jobs->jobs + i * jobs->job_size);
 	}
+}
 
-	indigo_debug("size = %d min_size = %d fits_size = %d\n", size, size * abs(header->bitpix)/8 + header->data_offset, fits_size);
-	if ((size * abs(header->bitpix)/8 + header->data_offset) > fits_size) {
-		return FITS_INVALIDDATA;
+/* Runs worker on each of the count jobs on the shared pool */
+static void fits_run_jobs(void *(*worker)(void *), void *jobs, size_t job_size, int count) {
+	fits_jobs context = { worker, (uint8_t *)jobs, job_size };
+	parallel_for(0, count, 1, fits_run_job_range, &context);
+}
+
+static inline int fits_integer_bzero(const fits_header *header, double max_bzero) {
+	return header->bscale == 1.0 && header->bzero == floor(header->bzero) && fabs(header->bzero) <= max_bzero;
+}
+
+/* 32-bit samples are shifted and scaled to uint32 (PIX_FMT_Y32). An integer BZERO with BSCALE = 1 is added
+ * modulo 2^32, so unsigned frames (BZERO = 2^31) decode exactly. Otherwise the samples go through double and
+ * are saturated to 0..2^32-1 here, the plain float to integer conversion is undefined out of that range. */
+static inline uint32_t fits_saturate32(double value) {
+	if (!(value > 0)) return 0;
+	if (value >= 4294967295.0) return UINT32_MAX;
+	return (uint32_t)value;
+}
+
+#if defined(FITS_USE_AVX2)
+static int fits_has_avx2() {
+	static int has_avx2 = -1;
+	if (has_avx2 < 0) {
+		__builtin_cpu_init();
+		has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
 	}
+	return has_avx2;
+}
 
-	if (header->bitpix == -32 && header->naxis > 0) {
-		float *raw = (float *)(fits_data + header->data_offset);
-		float *native = (float *)native_data;
-		if (little_endian) {
-			for (int i = 0; i < size; i++) {
-				char *rawc = ( char* ) raw;
-				char *nativec = ( char* ) native;
-				// swap bytes
-				nativec[0] = rawc[3];
-				nativec[1] = rawc[2];
-				nativec[2] = rawc[1];
-				nativec[3] = rawc[0];
-				*native = (*native + header->bzero) * header->bscale;
-				native++;
-				raw++;
-			}
+__attribute__((target("avx2")))
+static size_t fits_swap16_avx2(const uint8_t *raw, uint16_t *native, size_t count, uint16_t bzero) {
+	const __m256i mask = _mm256_setr_epi8(
+		1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+		1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14
+	);
+	const __m256i offset = _mm256_set1_epi16((short)bzero);
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(raw + 2 * i));
+		v = _mm256_add_epi16(_mm256_shuffle_epi8(v, mask), offset);
+		_mm256_storeu_si256((__m256i *)(native + i), v);
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t fits_swap32_avx2(const uint8_t *raw, uint32_t *native, size_t count, uint32_t bzero) {
+	const __m256i mask = _mm256_setr_epi8(
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+	);
+	const __m256i offset = _mm256_set1_epi32((int)bzero);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(raw + 4 * i));
+		v = _mm256_add_epi32(_mm256_shuffle_epi8(v, mask), offset);
+		_mm256_storeu_si256((__m256i *)(native + i), v);
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t fits_scale_float_avx2(const uint8_t *raw, float *native, size_t count, double bzero, double bscale) {
+	const __m256i mask = _mm256_setr_epi8(
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+	);
+	const __m256d zero = _mm256_set1_pd(bzero);
+	const __m256d scale = _mm256_set1_pd(bscale);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256 v = _mm256_castsi256_ps(_mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(raw + 4 * i)), mask));
+		__m256d lo = _mm256_cvtps_pd(_mm256_castps256_ps128(v));
+		__m256d hi = _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1));
+		lo = _mm256_mul_pd(_mm256_add_pd(lo, zero), scale);
+		hi = _mm256_mul_pd(_mm256_add_pd(hi, zero), scale);
+		v = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm256_cvtpd_ps(lo)), _mm256_cvtpd_ps(hi), 1);
+		_mm256_storeu_ps(native + i, v);
+	}
+	return i;
+}
+#endif
+
+#if defined(FITS_USE_SSE2)
+static inline __m128i fits_bswap16_sse2(__m128i v) {
+	return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+static inline __m128i fits_bswap32_sse2(__m128i v) {
+	v = fits_bswap16_sse2(v);
+	return _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1);
+}
+
+static size_t fits_swap16_sse2(const uint8_t *raw, uint16_t *native, size_t count, uint16_t bzero) {
+	const __m128i offset = _mm_set1_epi16((short)bzero);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(raw + 2 * i));
+		_mm_storeu_si128((__m128i *)(native + i), _mm_add_epi16(fits_bswap16_sse2(v), offset));
+	}
+	return i;
+}
+
+static size_t fits_swap32_sse2(const uint8_t *raw, uint32_t *native, size_t count, uint32_t bzero) {
+	const __m128i offset = _mm_set1_epi32((int)bzero);
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(raw + 4 * i));
+		_mm_storeu_si128((__m128i *)(native + i), _mm_add_epi32(fits_bswap32_sse2(v), offset));
+	}
+	return i;
+}
+
+static size_t fits_scale_float_sse2(const uint8_t *raw, float *native, size_t count, double bzero, double bscale) {
+	const __m128d zero = _mm_set1_pd(bzero);
+	const __m128d scale = _mm_set1_pd(bscale);
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 v = _mm_castsi128_ps(fits_bswap32_sse2(_mm_loadu_si128((const __m128i *)(raw + 4 * i))));
+		__m128d lo = _mm_cvtps_pd(v);
+		__m128d hi = _mm_cvtps_pd(_mm_movehl_ps(v, v));
+		lo = _mm_mul_pd(_mm_add_pd(lo, zero), scale);
+		hi = _mm_mul_pd(_mm_add_pd(hi, zero), scale);
+		_mm_storeu_ps(native + i, _mm_movelh_ps(_mm_cvtpd_ps(lo), _mm_cvtpd_ps(hi)));
+	}
+	return i;
+}
+
+static size_t fits_add8_sse2(const uint8_t *raw, uint8_t *native, size_t count, uint8_t bzero) {
+	const __m128i offset = _mm_set1_epi8((char)bzero);
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(raw + i));
+		_mm_storeu_si128((__m128i *)(native + i), _mm_add_epi8(v, offset));
+	}
+	return i;
+}
+#endif
+
+static size_t fits_swap16(const uint8_t *raw, uint16_t *native, size_t count, uint16_t bzero) {
+	size_t i = 0;
+#if defined(FITS_USE_AVX2)
+	if (fits_has_avx2()) i = fits_swap16_avx2(raw, native, count, bzero);
+#endif
+#if defined(FITS_USE_SSE2)
+	i += fits_swap16_sse2(raw + 2 * i, native + i, count - i, bzero);
+#endif
+	for (; i < count; i++) {
+		native[i] = (uint16_t)((raw[2 * i] << 8 | raw[2 * i + 1]) + bzero);
+	}
+	return count;
+}
+
+static size_t fits_swap32(const uint8_t *raw, uint32_t *native, size_t count, uint32_t bzero) {
+	size_t i = 0;
+#if defined(FITS_USE_AVX2)
+	if (fits_has_avx2()) i = fits_swap32_avx2(raw, native, count, bzero);
+#endif
+#if defined(FITS_USE_SSE2)
+	i += fits_swap32_sse2(raw + 4 * i, native + i, count - i, bzero);
+#endif
+	for (; i < count; i++) {
+		const uint8_t *p = raw + 4 * i;
+		native[i] = ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3]) + bzero;
+	}
+	return count;
+}
+
+static size_t fits_scale_float(const uint8_t *raw, float *native, size_t count, double bzero, double bscale) {
+	size_t i = 0;
+#if defined(FITS_USE_AVX2)
+	if (fits_has_avx2()) i = fits_scale_float_avx2(raw, native, count, bzero, bscale);
+#endif
+#if defined(FITS_USE_SSE2)
+	i += fits_scale_float_sse2(raw + 4 * i, native + i, count - i, bzero, bscale);
+#endif
+	for (; i < count; i++) {
+		const uint8_t *p = raw + 4 * i;
+		uint32_t bits = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+		memcpy(native + i, &bits, sizeof(bits));
+		native[i] = (native[i] + bzero) * bscale;
+	}
+	return count;
+}
+
+static size_t fits_add8(const uint8_t *raw, uint8_t *native, size_t count, uint8_t bzero) {
+	size_t i = 0;
+	if (bzero == 0) {
+		if (native != raw) memcpy(native, raw, count);
+		return count;
+	}
+#if defined(FITS_USE_SSE2)
+	i = fits_add8_sse2(raw, native, count, bzero);
+#endif
+	for (; i < count; i++) {
+		native[i] = (uint8_t)(raw[i] + bzero);
+	}
+	return count;
+}
+
+static void fits_convert(const fits_convert_job *job) {
+	const fits_header *header = job->header;
+	const uint8_t *raw = job->raw;
+	const size_t count = job->count;
+
+	if (header->bitpix == -32) {
+		if (header->bzero == 0 && header->bscale == 1.0) {
+			fits_swap32(raw, (uint32_t *)job->native, count, 0);
 		} else {
-			for (int i = 0; i < size; i++) {
-				*native++ = (*raw++ + header->bzero) * header->bscale;
+			fits_scale_float(raw, (float *)job->native, count, header->bzero, header->bscale);
+		}
+	} else if (header->bitpix == 32) {
+		int32_t *native = (int32_t *)job->native;
+		if (fits_integer_bzero(header, 4294967296.0)) {
+			fits_swap32(raw, (uint32_t *)native, count, (uint32_t)(int64_t)header->bzero);
+		} else {
+			fits_swap32(raw, (uint32_t *)native, count, 0);
+			for (size_t i = 0; i < count; i++) {
+				native[i] = fits_saturate32(fits_saturate32(native[i] + header->bzero) * header->bscale);
 			}
 		}
-		return FITS_OK;
-	} else if (header->bitpix == 32 && header->naxis > 0) {
-		int32_t *raw = (int32_t *)(fits_data + header->data_offset);
-		int32_t *native = (int32_t *)native_data;
-		if (little_endian) {
-			for (int i = 0; i < size; i++) {
-				char *rawc = ( char* ) raw;
-				char *nativec = ( char* ) native;
-				// swap bytes
-				nativec[0] = rawc[3];
-				nativec[1] = rawc[2];
-				nativec[2] = rawc[1];
-				nativec[3] = rawc[0];
-				*native = (uint32_t)(*native + header->bzero) * header->bscale;
-				native++;
-				raw++;
+	} else if (header->bitpix == 16) {
+		short *native = (short *)job->native;
+		if (fits_integer_bzero(header, 1073741824.0)) {
+			fits_swap16(raw, (uint16_t *)native, count, (uint16_t)(int64_t)header->bzero);
+		} else {
+			fits_swap16(raw, (uint16_t *)native, count, 0);
+			for (size_t i = 0; i < count; i++) {
+				native[i] = (native[i] + header->bzero) * header->bscale;
 			}
+		}
+	} else if (header->bitpix == 8) {
+		uint8_t *native = (uint8_t *)job->native;
+		if (fits_integer_bzero(header, 1073741824.0)) {
+			fits_add8(raw, native, count, (uint8_t)(int64_t)header->bzero);
 		} else {
-			for (int i = 0; i < size; i++) {
-				*native++ = (*raw++ + header->bzero) * header->bscale;
+			for (size_t i = 0; i < count; i++) {
+				native[i] = (raw[i] + header->bzero) * header->bscale;
 			}
 		}
+	}
+}
+
+static void *fits_convert_worker(void *arg) {
+	fits_convert((const fits_convert_job *)arg);
+	return NULL;
+}
+
+/* Tile compressed images (fpack).
+ * Every tile is one row of the BINTABLE, its compressed bytes live in the heap. Tiles are independent
+ * so they are spread over threads and, when the tile maps to a contiguous run of the requested range,
+ * decompressed straight into the native buffer, other tiles go through a per thread scratch buffer.
+ */
+
+#define FITS_RANDOM_COUNT 10000
+#define FITS_NULL_VALUE -2147483647
+#define FITS_ZERO_VALUE -2147483646
+
+static float fits_random_values[FITS_RANDOM_COUNT];
+static pthread_once_t fits_random_once = PTHREAD_ONCE_INIT;
+
+/* the dither sequence of the tiled image compression convention (Park & Miller) */
+static void fits_init_random_values(void) {
+	double a = 16807.0, m = 2147483647.0, seed = 1, temp;
+	for (int i = 0; i < FITS_RANDOM_COUNT; i++) {
+		temp = a * seed;
+		seed = temp - m * ((int)(temp / m));
+		fits_random_values[i] = (float)(seed / m);
+	}
+}
+
+static inline int fits_bit_length(uint32_t value) {
+#if defined(__GNUC__)
+	return 32 - __builtin_clz(value);
+#else
+	int bits = 0;
+	for (; value; value >>= 1) bits++;
+	return bits;
+#endif
+}
+
+/* reads past the end of the tile return zeroes, the decoders check for overrun once per block */
+#define FITS_RICE_NEXT_BYTE() ((c < end) ? *c++ : (c++, 0))
+
+#define FITS_RICE_DECODER(name, type, fsbits, fsmax, bbits) \
+static int name(const uint8_t *c, size_t size, type *out, size_t count, int blocksize) { \
+	const uint8_t *end = c + size; \
+	uint32_t b, diff, lastpix = 0; \
+	int nbits, nzero, fs, k; \
+	if (size < sizeof(type) + 1) return FITS_INVALIDDATA; \
+	for (k = 0; k < (int)sizeof(type); k++) lastpix = lastpix << 8 | *c++; \
+	b = *c++; \
+	nbits = 8; \
+	for (size_t i = 0; i < count; ) { \
+		nbits -= fsbits; \
+		while (nbits < 0) { \
+			b = b << 8 | FITS_RICE_NEXT_BYTE(); \
+			nbits += 8; \
+		} \
+		fs = (int)(b >> nbits) - 1; \
+		b &= (1u << nbits) - 1; \
+		size_t imax = i + blocksize; \
+		if (imax > count) imax = count; \
+		if (fs < 0) { \
+			for (; i < imax; i++) out[i] = (type)lastpix; \
+		} else if (fs == fsmax) { \
+			for (; i < imax; i++) { \
+				k = bbits - nbits; \
+				diff = (k < 32) ? b << k : 0; \
+				for (k -= 8; k >= 0; k -= 8) { \
+					b = FITS_RICE_NEXT_BYTE(); \
+					diff |= b << k; \
+				} \
+				if (nbits > 0) { \
+					b = FITS_RICE_NEXT_BYTE(); \
+					diff |= b >> (-k); \
+					b &= (1u << nbits) - 1; \
+				} else { \
+					b = 0; \
+				} \
+				diff = (diff & 1) ? ~(diff >> 1) : (diff >> 1); \
+				out[i] = (type)(diff + lastpix); \
+				lastpix = out[i]; \
+			} \
+		} else { \
+			for (; i < imax; i++) { \
+				while (b == 0) { \
+					if (c >= end) return FITS_INVALIDDATA; \
+					nbits += 8; \
+					b = *c++; \
+				} \
+				nzero = nbits - fits_bit_length(b); \
+				nbits -= nzero + 1; \
+				b ^= 1u << nbits; \
+				nbits -= fs; \
+				while (nbits < 0) { \
+					b = b << 8 | FITS_RICE_NEXT_BYTE(); \
+					nbits += 8; \
+				} \
+				diff = ((uint32_t)nzero << fs) | (b >> nbits); \
+				b &= (1u << nbits) - 1; \
+				diff = (diff & 1) ? ~(diff >> 1) : (diff >> 1); \
+				out[i] = (type)(diff + lastpix); \
+				lastpix = out[i]; \
+			} \
+		} \
+		if (c > end) return FITS_INVALIDDATA; \
+	} \
+	return FITS_OK; \
+}
+
+FITS_RICE_DECODER(fits_rice_decode8, uint8_t, 3, 6, 8)
+FITS_RICE_DECODER(fits_rice_decode16, uint16_t, 4, 14, 16)
+FITS_RICE_DECODER(fits_rice_decode32, uint32_t, 5, 25, 32)
+
+static int fits_inflate(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size) {
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	/* 15 + 32 accepts both gzip and zlib streams */
+	if (inflateInit2(&stream, 15 + 32) != Z_OK) return FITS_INVALIDDATA;
+	stream.next_in = (Bytef *)in;
+	stream.avail_in = (uInt)in_size;
+	stream.next_out = out;
+	stream.avail_out = (uInt)out_size;
+	int res = inflate(&stream, Z_FINISH);
+	inflateEnd(&stream);
+	return (res == Z_STREAM_END && stream.avail_out == 0) ? FITS_OK : FITS_INVALIDDATA;
+}
+
+/* applies BZERO / BSCALE to already native integer samples, same arithmetic as fits_convert() */
+static void fits_scale_native(const fits_header *header, char *data, size_t count) {
+	if (header->bscale == 1.0 && header->bzero == 0) return;
+	if (header->bitpix == 32) {
+		int32_t *native = (int32_t *)data;
+		if (fits_integer_bzero(header, 4294967296.0)) {
+			uint32_t bzero = (uint32_t)(int64_t)header->bzero;
+			for (size_t i = 0; i < count; i++) native[i] = (uint32_t)native[i] + bzero;
+		} else {
+			for (size_t i = 0; i < count; i++) native[i] = fits_saturate32(fits_saturate32(native[i] + header->bzero) * header->bscale);
+		}
+	} else if (header->bitpix == 16) {
+		short *native = (short *)data;
+		if (fits_integer_bzero(header, 1073741824.0)) {
+			uint16_t bzero = (uint16_t)(int64_t)header->bzero;
+			for (size_t i = 0; i < count; i++) native[i] = (uint16_t)(native[i] + bzero);
+		} else {
+			for (size_t i = 0; i < count; i++) native[i] = (native[i] + header->bzero) * header->bscale;
+		}
+	} else if (header->bitpix == 8) {
+		uint8_t *native = (uint8_t *)data;
+		if (fits_integer_bzero(header, 1073741824.0)) {
+			uint8_t bzero = (uint8_t)(int64_t)header->bzero;
+			for (size_t i = 0; i < count; i++) native[i] = (uint8_t)(native[i] + bzero);
+		} else {
+			for (size_t i = 0; i < count; i++) native[i] = (native[i] + header->bzero) * header->bscale;
+		}
+	}
+}
+
+static inline uint64_t fits_read_be(const uint8_t *p, int size) {
+	uint64_t value = 0;
+	for (int i = 0; i < size; i++) value = value << 8 | p[i];
+	return value;
+}
+
+static void fits_unquantize(const fits_header *header, int tile, const uint8_t *row, char *data, size_t count) {
+	const fits_tile_info *tiles = &header->tiles;
+	double zscale = tiles->zscale, zzero = tiles->zzero;
+	int32_t zblank = tiles->zblank;
+	int check_null = tiles->zblank_found;
+	uint64_t bits;
+	if (tiles->zscale_column >= 0) {
+		bits = fits_read_be(row + tiles->zscale_column, 8);
+		memcpy(&zscale, &bits, sizeof(zscale));
+	}
+	if (tiles->zzero_column >= 0) {
+		bits = fits_read_be(row + tiles->zzero_column, 8);
+		memcpy(&zzero, &bits, sizeof(zzero));
+	}
+	if (tiles->zblank_column >= 0) {
+		zblank = (int32_t)fits_read_be(row + tiles->zblank_column, 4);
+		check_null = 1;
+	}
+
+	const int32_t *in = (const int32_t *)data;
+	float *out = (float *)data;
+	if (tiles->quantize == FITS_QUANTIZE_NO_DITHER) {
+		for (size_t i = 0; i < count; i++) {
+			out[i] = (check_null && in[i] == zblank) ? NAN : (float)(in[i] * zscale + zzero);
+		}
+		return;
+	}
+	pthread_once(&fits_random_once, fits_init_random_values);
+	int iseed = (int)(((int64_t)tile + tiles->dither_seed - 1) % FITS_RANDOM_COUNT);
+	if (iseed < 0) iseed += FITS_RANDOM_COUNT;
+	int nextrand = (int)(fits_random_values[iseed] * 500);
+	const int dither_2 = (tiles->quantize == FITS_QUANTIZE_SUBTRACTIVE_DITHER_2);
+	for (size_t i = 0; i < count; i++) {
+		int32_t value = in[i];
+		if (check_null && value == zblank) {
+			out[i] = NAN;
+		} else if (dither_2 && value == FITS_ZERO_VALUE) {
+			out[i] = 0.0f;
+		} else {
+			out[i] = (float)(((double)value - fits_random_values[nextrand] + 0.5) * zscale + zzero);
+		}
+		if (++nextrand == FITS_RANDOM_COUNT) {
+			if (++iseed == FITS_RANDOM_COUNT) iseed = 0;
+			nextrand = (int)(fits_random_values[iseed] * 500);
+		}
+	}
+}
+
+/* reads a P or Q heap descriptor, returns the address of the array or NULL if it is empty or out of the file */
+static const uint8_t *fits_tile_array(const uint8_t *fits_data, int fits_size, const fits_header *header, const uint8_t *row, int column, int is_64bit, size_t *size) {
+	uint64_t count, offset;
+	if (column < 0) return NULL;
+	if (is_64bit) {
+		count = fits_read_be(row + column, 8);
+		offset = fits_read_be(row + column + 8, 8);
+	} else {
+		count = fits_read_be(row + column, 4);
+		offset = fits_read_be(row + column + 4, 4);
+	}
+	uint64_t start = (uint64_t)header->data_offset + header->tiles.heap_offset + offset;
+	if (count == 0 || start > (uint64_t)fits_size || count > (uint64_t)fits_size - start) return NULL;
+	*size = count;
+	return fits_data + start;
+}
+
+/* decompresses one tile of count samples into native */
+static int fits_decompress_tile(const uint8_t *fits_data, int fits_size, const fits_header *header, int tile, char *native, size_t count, char *scratch) {
+	const fits_tile_info *tiles = &header->tiles;
+	const int sample_size = abs(header->bitpix) / 8;
+	const int quantized = (header->bitpix == -32 && tiles->quantize != FITS_QUANTIZE_NONE);
+	const uint8_t *row = fits_data + header->data_offset + (size_t)tile * tiles->row_size;
+	size_t size = 0;
+	fits_convert_job job = { (const uint8_t *)native, native, count, header };
+
+	const uint8_t *data = fits_tile_array(fits_data, fits_size, header, row, tiles->compressed_column, tiles->compressed_64bit, &size);
+	if (data == NULL) {
+		/* tiles which could not be quantized are stored losslessly */
+		if ((data = fits_tile_array(fits_data, fits_size, header, row, tiles->gzip_column, tiles->gzip_64bit, &size))) {
+			if (fits_inflate(data, size, (uint8_t *)native, count * sample_size) != FITS_OK) return FITS_INVALIDDATA;
+		} else {
+			return FITS_INVALIDDATA;
+		}
+		fits_convert(&job);
 		return FITS_OK;
-	} else if (header->bitpix == 16 && header->naxis > 0) {
-		short *raw = (short *)(fits_data + header->data_offset);
-		short *native = (short *)native_data;
-		if (little_endian) {
-			for (int i = 0; i < size; i++) {
-				*native = (*raw & 0xff) << 8 | (*raw & 0xff00) >> 8;
-				*native = (*native + header->bzero) * header->bscale;
-				native++;
-				raw++;
+	}
+
+	switch (tiles->compression) {
+		case FITS_COMPRESSION_RICE_1: {
+			int res;
+			if (tiles->rice_bytepix == 1) {
+				res = fits_rice_decode8(data, size, (uint8_t *)native, count, tiles->rice_blocksize);
+			} else if (tiles->rice_bytepix == 2) {
+				res = fits_rice_decode16(data, size, (uint16_t *)native, count, tiles->rice_blocksize);
+			} else {
+				res = fits_rice_decode32(data, size, (uint32_t *)native, count, tiles->rice_blocksize);
+			}
+			if (res != FITS_OK) return res;
+			if (quantized) {
+				fits_unquantize(header, tile, row, native, count);
+			} else {
+				fits_scale_native(header, native, count);
+			}
+			return FITS_OK;
+		}
+		case FITS_COMPRESSION_GZIP_1:
+			if (fits_inflate(data, size, (uint8_t *)native, count * sample_size) != FITS_OK) return FITS_INVALIDDATA;
+			break;
+		case FITS_COMPRESSION_GZIP_2:
+			/* bytes are shuffled, most significant bytes of all samples first */
+			if (fits_inflate(data, size, (uint8_t *)scratch, count * sample_size) != FITS_OK) return FITS_INVALIDDATA;
+			for (int byte = 0; byte < sample_size; byte++) {
+				const uint8_t *plane = (const uint8_t *)scratch + byte * count;
+				uint8_t *dst = (uint8_t *)native + byte;
+				for (size_t i = 0; i < count; i++) dst[i * sample_size] = plane[i];
+			}
+			break;
+		default:
+			return FITS_INVALIDDATA;
+	}
+	if (quantized) {
+		fits_swap32((const uint8_t *)native, (uint32_t *)native, count, 0);
+		fits_unquantize(header, tile, row, native, count);
+	} else {
+		fits_convert(&job);
+	}
+	return FITS_OK;
+}
+
+typedef struct {
+	const uint8_t *fits_data;
+	int fits_size;
+	const fits_header *header;
+	size_t first_sample;
+	size_t count;
+	char *native;
+	int first_tile;
+	int last_tile;
+	int result;
+} fits_tile_job;
+
+static void fits_decompress_tiles(fits_tile_job *job) {
+	const fits_header *header = job->header;
+	const int *ztile = header->tiles.ztile;
+	const size_t nx = header->naxisn[0];
+	const size_t ny = (header->naxis > 1) ? header->naxisn[1] : 1;
+	const size_t nz = (header->naxis > 2) ? header->naxisn[2] : 1;
+	const int tiles_x = (int)((nx + ztile[0] - 1) / ztile[0]);
+	const int tiles_y = (int)((ny + ztile[1] - 1) / ztile[1]);
+	const int sample_size = abs(header->bitpix) / 8;
+	const size_t range_end = job->first_sample + job->count;
+	const size_t tile_samples = (size_t)ztile[0] * ztile[1] * ztile[2];
+	char *scratch = NULL;
+
+	job->result = FITS_OK;
+	for (int tile = job->first_tile; tile < job->last_tile; tile++) {
+		const size_t x0 = (size_t)(tile % tiles_x) * ztile[0];
+		const size_t y0 = (size_t)((tile / tiles_x) % tiles_y) * ztile[1];
+		const size_t z0 = (size_t)(tile / tiles_x / tiles_y) * ztile[2];
+		const size_t w = (x0 + ztile[0] > nx) ? nx - x0 : (size_t)ztile[0];
+		const size_t h = (y0 + ztile[1] > ny) ? ny - y0 : (size_t)ztile[1];
+		const size_t d = (z0 + ztile[2] > nz) ? nz - z0 : (size_t)ztile[2];
+		const size_t tile_first = x0 + nx * (y0 + ny * z0);
+		const size_t tile_last = (x0 + w) + nx * ((y0 + h - 1) + ny * (z0 + d - 1));
+		if (tile_last <= job->first_sample || tile_first >= range_end) continue;
+
+		const int contiguous = (w == nx || (h == 1 && d == 1)) && (h == ny || d == 1);
+		if (contiguous && tile_first >= job->first_sample && tile_last <= range_end) {
+			char *native = job->native + (tile_first - job->first_sample) * sample_size;
+			if (header->tiles.compression == FITS_COMPRESSION_GZIP_2 && scratch == NULL) {
+				scratch = (char *)malloc(2 * tile_samples * sample_size);
+				if (scratch == NULL) {
+					job->result = FITS_INVALIDDATA;
+					return;
+				}
 			}
+			job->result = fits_decompress_tile(job->fits_data, job->fits_size, header, tile, native, w * h * d, scratch ? scratch + tile_samples * sample_size : NULL);
 		} else {
-			for (int i = 0; i < size; i++) {
-				*native++ = (*raw++ + header->bzero) * header->bscale;
+			if (scratch == NULL) {
+				scratch = (char *)malloc(2 * tile_samples * sample_size);
+				if (scratch == NULL) {
+					job->result = FITS_INVALIDDATA;
+					return;
+				}
+			}
+			job->result = fits_decompress_tile(job->fits_data, job->fits_size, header, tile, scratch, w * h * d, scratch + tile_samples * sample_size);
+			if (job->result == FITS_OK) {
+				/* copy the rows of the tile which fall into the requested range */
+				for (size_t z = 0; z < d; z++) {
+					for (size_t y = 0; y < h; y++) {
+						size_t start = x0 + nx * ((y0 + y) + ny * (z0 + z));
+						size_t end = start + w;
+						size_t src = (z * h + y) * w;
+						if (end <= job->first_sample || start >= range_end) continue;
+						if (start < job->first_sample) {
+							src += job->first_sample - start;
+							start = job->first_sample;
+						}
+						if (end > range_end) end = range_end;
+						memcpy(job->native + (start - job->first_sample) * sample_size, scratch + src * sample_size, (end - start) * sample_size);
+					}
+				}
 			}
 		}
-		return FITS_OK;
-	} else if (header->bitpix == 8 && header->naxis > 0) {
-		uint8_t *raw = (uint8_t *)(fits_data + header->data_offset);
-		uint8_t *native = (uint8_t *)native_data;
-		for (int i = 0; i < size; i++) {
-			*native++ = (*raw++ + header->bzero) * header->bscale;
+		if (job->result != FITS_OK) {
+			indigo_error("error decompressing tile %d\n", tile + 1);
+			break;
 		}
+	}
+	free(scratch);
+}
+
+static void *fits_decompress_worker(void *arg) {
+	fits_decompress_tiles((fits_tile_job *)arg);
+	return NULL;
+}
+
+static int fits_process_tiles(const uint8_t *fits_data, int fits_size, fits_header *header, int first_sample, int count, char *native_data) {
+	const int *ztile = header->tiles.ztile;
+	int tile_count = 1;
+	for (int i = 0; i < 3; i++) {
+		int n = (i < header->naxis) ? header->naxisn[i] : 1;
+		tile_count *= (n + ztile[i] - 1) / ztile[i];
+	}
+	if ((int64_t)header->data_offset + (int64_t)header->tiles.row_size * header->tiles.rows > fits_size) {
+		indigo_error("BINTABLE data is truncated\n");
+		return FITS_INVALIDDATA;
+	}
+
+	int threads = (count < FITS_MIN_SIZE_TO_PARALLELIZE) ? 1 : parallel_threads();
+	if (threads > tile_count) threads = tile_count;
+
+	if (threads <= 1) {
+		fits_tile_job job = { fits_data, fits_size, header, (size_t)first_sample, (size_t)count, native_data, 0, tile_count, FITS_OK };
+		fits_decompress_tiles(&job);
+		return job.result;
+	}
+
+	/* tiles outside of the requested range are skipped, split only the ones which overlap it */
+	const size_t nx = header->naxisn[0];
+	const size_t ny = (header->naxis > 1) ? header->naxisn[1] : 1;
+	int first_tile = 0, last_tile = tile_count;
+	if (ztile[0] == (int)nx && header->naxis <= 2) {
+		first_tile = (int)(first_sample / nx / ztile[1]);
+		last_tile = (int)(((first_sample + count + nx - 1) / nx + ztile[1] - 1) / ztile[1]);
+		if (last_tile > tile_count) last_tile = tile_count;
+	} else if (ztile[0] == (int)nx && ztile[1] == (int)ny) {
+		first_tile = (int)(first_sample / (nx * ny) / ztile[2]);
+		last_tile = (int)(((first_sample + count + nx * ny - 1) / (nx * ny) + ztile[2] - 1) / ztile[2]);
+		if (last_tile > tile_count) last_tile = tile_count;
+	}
+	const int span = last_tile - first_tile;
+	if (threads > span) threads = (span > 0) ? span : 1;
+
+	fits_tile_job jobs[threads];
+	for (int rank = 0; rank < threads; rank++) {
+		jobs[rank] = (fits_tile_job){ fits_data, fits_size, header, (size_t)first_sample, (size_t)count, native_data,
+			first_tile + (int)((int64_t)span * rank / threads), first_tile + (int)((int64_t)span * (rank + 1) / threads), FITS_OK };
+	}
+	fits_run_jobs(fits_decompress_worker, jobs, sizeof(fits_tile_job), threads);
+	int result = FITS_OK;
+	for (int rank = 0; rank < threads; rank++) {
+		if (jobs[rank].result != FITS_OK) result = jobs[rank].result;
+	}
+	return result;
+}
+
+int fits_process_data(const uint8_t *fits_data, int fits_size, fits_header *header, char *native_data) {
+	int size = 1;
+	for (int i = 0; i < header->naxis; i++){
+		size *= header->naxisn[i];
+	}
+	return fits_process_data_range(fits_data, fits_size, header, 0, size, native_data);
+}
+
+int fits_process_data_range(const uint8_t *fits_data, int fits_size, fits_header *header, int first_sample, int count, char *native_data) {
+	int size = 1;
+	for (int i = 0; i < header->naxis; i++){
+		size *= header->naxisn[i];
+	}
+
+	if (header->naxis <= 0 || first_sample < 0 || count < 0 || first_sample + count > size) {
+		return FITS_INVALIDDATA;
+	}
+
+	if (header->tile_compressed) {
+		return fits_process_tiles(fits_data, fits_size, header, first_sample, count, native_data);
+	}
+
+	indigo_debug("size = %d min_size = %d fits_size = %d\n", size, size * abs(header->bitpix)/8 + header->data_offset, fits_size);
+	if ((size * abs(header->bitpix)/8 + header->data_offset) > fits_size) {
+		return FITS_INVALIDDATA;
+	}
+
+	switch (header->bitpix) {
+		case -32:
+		case 32:
+		case 16:
+		case 8:
+			break;
+		default:
+			return FITS_INVALIDDATA;
+	}
+
+	const int sample_size = abs(header->bitpix) / 8;
+	const uint8_t *raw = fits_data + header->data_offset + (size_t)first_sample * sample_size;
+	int threads = (count < FITS_MIN_SIZE_TO_PARALLELIZE) ? 1 : parallel_threads();
+
+	if (threads == 1) {
+		fits_convert_job job = { raw, native_data, (size_t)count, header };
+		fits_convert(&job);
 		return FITS_OK;
 	}
-	return FITS_INVALIDDATA;
+
+	/* keep chunks a multiple of 64 samples so every thread but the last stays on the SIMD path */
+	size_t chunk = ((size_t)count / threads + 63) & ~(size_t)63;
+	fits_convert_job jobs[threads];
+	for (int rank = 0; rank < threads; rank++) {
+		size_t start = chunk * rank;
+		size_t end = start + chunk;
+		if (start > (size_t)count) start = count;
+		if (end > (size_t)count) end = count;
+		jobs[rank].raw = raw + start * sample_size;
+		jobs[rank].native = native_data + start * sample_size;
+		jobs[rank].count = end - start;
+		jobs[rank].header = header;
+	}
+	fits_run_jobs(fits_convert_worker, jobs, sizeof(fits_convert_job), threads);
+	return FITS_OK;
+}
+
+/* FITS writer.
+ * Native little endian samples are stored big endian, unsigned 16 and 32 bit samples as signed with
+ * BZERO = 2^15 and 2^31, which is a flip of the sign bit done before the SIMD byte swap. The data is
+ * converted a block at a time on all cores into one of two buffers, while a writer thread stores the
+ * previous block to the file.
+ */
+
+#define FITS_WRITE_BLOCK_SIZE 0x1000000
+
+#if defined(FITS_USE_AVX2)
+__attribute__((target("avx2")))
+static size_t fits_store16_avx2(const uint16_t *native, uint8_t *raw, size_t count, uint16_t flip) {
+	const __m256i mask = _mm256_setr_epi8(
+		1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+		1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14
+	);
+	const __m256i bits = _mm256_set1_epi16((short)flip);
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(native + i)), bits);
+		_mm256_storeu_si256((__m256i *)(raw + 2 * i), _mm256_shuffle_epi8(v, mask));
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t fits_store32_avx2(const uint32_t *native, uint8_t *raw, size_t count, uint32_t flip) {
+	const __m256i mask = _mm256_setr_epi8(
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+	);
+	const __m256i bits = _mm256_set1_epi32((int)flip);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(native + i)), bits);
+		_mm256_storeu_si256((__m256i *)(raw + 4 * i), _mm256_shuffle_epi8(v, mask));
+	}
+	return i;
+}
+#endif
+
+#if defined(FITS_USE_SSE2)
+static size_t fits_store16_sse2(const uint16_t *native, uint8_t *raw, size_t count, uint16_t flip) {
+	const __m128i bits = _mm_set1_epi16((short)flip);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(native + i)), bits);
+		_mm_storeu_si128((__m128i *)(raw + 2 * i), fits_bswap16_sse2(v));
+	}
+	return i;
+}
+
+static size_t fits_store32_sse2(const uint32_t *native, uint8_t *raw, size_t count, uint32_t flip) {
+	const __m128i bits = _mm_set1_epi32((int)flip);
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(native + i)), bits);
+		_mm_storeu_si128((__m128i *)(raw + 4 * i), fits_bswap32_sse2(v));
+	}
+	return i;
+}
+#endif
+
+/* stride is the distance of two consecutive samples in native, 1 for planar data and the number of channels for interleaved */
+static void fits_store16(const uint16_t *native, size_t stride, uint8_t *raw, size_t count, uint16_t flip) {
+	size_t i = 0;
+	if (stride == 1) {
+#if defined(FITS_USE_AVX2)
+		if (fits_has_avx2()) i = fits_store16_avx2(native, raw, count, flip);
+#endif
+#if defined(FITS_USE_SSE2)
+		i += fits_store16_sse2(native + i, raw + 2 * i, count - i, flip);
+#endif
+	}
+	for (; i < count; i++) {
+		const uint16_t value = native[i * stride] ^ flip;
+		raw[2 * i] = (uint8_t)(value >> 8);
+		raw[2 * i + 1] = (uint8_t)value;
+	}
+}
+
+static void fits_store32(const uint32_t *native, size_t stride, uint8_t *raw, size_t count, uint32_t flip) {
+	size_t i = 0;
+	if (stride == 1) {
+#if defined(FITS_USE_AVX2)
+		if (fits_has_avx2()) i = fits_store32_avx2(native, raw, count, flip);
+#endif
+#if defined(FITS_USE_SSE2)
+		i += fits_store32_sse2(native + i, raw + 4 * i, count - i, flip);
+#endif
+	}
+	for (; i < count; i++) {
+		const uint32_t value = native[i * stride] ^ flip;
+		uint8_t *p = raw + 4 * i;
+		p[0] = (uint8_t)(value >> 24);
+		p[1] = (uint8_t)(value >> 16);
+		p[2] = (uint8_t)(value >> 8);
+		p[3] = (uint8_t)value;
+	}
+}
+
+static void fits_store8(const uint8_t *native, size_t stride, uint8_t *raw, size_t count) {
+	if (stride == 1) {
+		memcpy(raw, native, count);
+		return;
+	}
+	for (size_t i = 0; i < count; i++) {
+		raw[i] = native[i * stride];
+	}
+}
+
+typedef struct {
+	const char *native;
+	size_t first;       /* first sample in the file order, channels are stored as planes */
+	size_t count;
+	size_t plane;       /* samples in one channel */
+	int channels;       /* samples of one pixel next to each other in native, 1 for mono and planar data */
+	int bitpix;
+	uint8_t *raw;
+} fits_store_job;
+
+static void fits_store(const fits_store_job *job) {
+	const int sample_size = abs(job->bitpix) / 8;
+	size_t sample = job->first;
+	size_t done = 0;
+	/* an interleaved range is stored one plane at a time */
+	while (done < job->count) {
+		const size_t channel = sample / job->plane;
+		const size_t pixel = sample % job->plane;
+		size_t count = job->plane - pixel;
+		if (count > job->count - done) count = job->count - done;
+		const char *native = (job->channels == 1) ?
+			job->native + sample * sample_size :
+			job->native + (pixel * job->channels + channel) * sample_size;
+		uint8_t *raw = job->raw + done * sample_size;
+		switch (job->bitpix) {
+			case -32:
+				fits_store32((const uint32_t *)native, job->channels, raw, count, 0);
+				break;
+			case 32:
+				fits_store32((const uint32_t *)native, job->channels, raw, count, 0x80000000);
+				break;
+			case 16:
+				fits_store16((const uint16_t *)native, job->channels, raw, count, 0x8000);
+				break;
+			default:
+				fits_store8((const uint8_t *)native, job->channels, raw, count);
+				break;
+		}
+		sample += count;
+		done += count;
+	}
+}
+
+static void *fits_store_worker(void *arg) {
+	fits_store((const fits_store_job *)arg);
+	return NULL;
+}
+
+static void fits_store_parallel(const fits_store_job *block) {
+	int threads = (block->count < FITS_MIN_SIZE_TO_PARALLELIZE) ? 1 : parallel_threads();
+	if (threads == 1) {
+		fits_store(block);
+		return;
+	}
+	const int sample_size = abs(block->bitpix) / 8;
+	/* keep chunks a multiple of 64 samples so every thread but the last stays on the SIMD path */
+	size_t chunk = (block->count / threads + 63) & ~(size_t)63;
+	fits_store_job jobs[threads];
+	for (int rank = 0; rank < threads; rank++) {
+		size_t start = chunk * rank;
+		size_t end = start + chunk;
+		if (start > block->count) start = block->count;
+		if (end > block->count) end = block->count;
+		jobs[rank] = *block;
+		jobs[rank].first = block->first + start;
+		jobs[rank].count = end - start;
+		jobs[rank].raw = block->raw + start * sample_size;
+	}
+	fits_run_jobs(fits_store_worker, jobs, sizeof(fits_store_job), threads);
+}
+
+typedef struct {
+	FILE *file;
+	uint8_t *buffers[2];
+	size_t sizes[2];
+	int blocks;
+	int converted;
+	int written;
+	int failed;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} fits_block_writer;
+
+static void *fits_block_writer_worker(void *arg) {
+	fits_block_writer *writer = (fits_block_writer *)arg;
+	pthread_mutex_lock(&writer->mutex);
+	while (writer->written < writer->blocks) {
+		if (writer->converted == writer->written) {
+			pthread_cond_wait(&writer->cond, &writer->mutex);
+			continue;
+		}
+		const int slot = writer->written % 2;
+		pthread_mutex_unlock(&writer->mutex);
+		const int ok = fwrite(writer->buffers[slot], 1, writer->sizes[slot], writer->file) == writer->sizes[slot];
+		pthread_mutex_lock(&writer->mutex);
+		if (!ok) {
+			writer->failed = 1;
+			writer->blocks = writer->converted;
+		}
+		writer->written++;
+		pthread_cond_broadcast(&writer->cond);
+	}
+	pthread_mutex_unlock(&writer->mutex);
+	return NULL;
+}
+
+static void fits_add_card(char *header, int *cards, const char *text) {
+	char *card = header + *cards * 80;
+	size_t length = strlen(text);
+	if (length > 80) length = 80;
+	memset(card, ' ', 80);
+	memcpy(card, text, length);
+	(*cards)++;
+}
+
+int fits_write(const char *file_name, int width, int height, int bitpix, int channels, int planar, const void *data, const char *const *cards) {
+	if (!file_name || !data || width <= 0 || height <= 0 || (channels != 1 && channels != 3)) {
+		return FITS_INVALIDPARAM;
+	}
+	if (bitpix != 8 && bitpix != 16 && bitpix != 32 && bitpix != -32) {
+		return FITS_INVALIDPARAM;
+	}
+
+	int extra_cards = 0;
+	while (cards && cards[extra_cards]) extra_cards++;
+	/* SIMPLE, BITPIX, NAXIS, 3 x NAXISn, BZERO, BSCALE, ROWORDER and END */
+	const int header_size = ((10 + extra_cards) * 80 + FITS_HEADER_BLOCK_SIZE - 1) / FITS_HEADER_BLOCK_SIZE * FITS_HEADER_BLOCK_SIZE;
+	char *header = (char *)malloc(header_size);
+	if (header == NULL) {
+		return FITS_INVALIDDATA;
+	}
+	memset(header, ' ', header_size);
+	char text[81];
+	int count = 0;
+	snprintf(text, sizeof(text), "SIMPLE  = %20s / file conforms to FITS standard", "T");
+	fits_add_card(header, &count, text);
+	snprintf(text, sizeof(text), "BITPIX  = %20d / number of bits per data pixel", bitpix);
+	fits_add_card(header, &count, text);
+	snprintf(text, sizeof(text), "NAXIS   = %20d / number of data axes", (channels == 1) ? 2 : 3);
+	fits_add_card(header, &count, text);
+	snprintf(text, sizeof(text), "NAXIS1  = %20d / length of data axis 1", width);
+	fits_add_card(header, &count, text);
+	snprintf(text, sizeof(text), "NAXIS2  = %20d / length of data axis 2", height);
+	fits_add_card(header, &count, text);
+	if (channels == 3) {
+		snprintf(text, sizeof(text), "NAXIS3  = %20d / length of data axis 3", channels);
+		fits_add_card(header, &count, text);
+	}
+	if (bitpix == 16 || bitpix == 32) {
+		snprintf(text, sizeof(text), "BZERO   = %20s / offset data range to that of unsigned", (bitpix == 16) ? "32768" : "2147483648");
+		fits_add_card(header, &count, text);
+		snprintf(text, sizeof(text), "BSCALE  = %20d / default scaling factor", 1);
+		fits_add_card(header, &count, text);
+	}
+	snprintf(text, sizeof(text), "ROWORDER= %-20s / order of the rows in the image", "'TOP-DOWN'");
+	fits_add_card(header, &count, text);
+	for (int i = 0; i < extra_cards; i++) {
+		fits_add_card(header, &count, cards[i]);
+	}
+	fits_add_card(header, &count, "END");
+
+	FILE *file = fopen(file_name, "wb");
+	if (file == NULL) {
+		free(header);
+		return FITS_IOERROR;
+	}
+	int failed = fwrite(header, 1, header_size, file) != (size_t)header_size;
+	free(header);
+
+	const int sample_size = abs(bitpix) / 8;
+	const size_t plane = (size_t)width * height;
+	const size_t samples = plane * channels;
+	const size_t block_samples = FITS_WRITE_BLOCK_SIZE / sample_size;
+
+	fits_block_writer writer;
+	memset(&writer, 0, sizeof(writer));
+	writer.file = file;
+	writer.blocks = (int)((samples + block_samples - 1) / block_samples);
+	writer.buffers[0] = (uint8_t *)malloc(FITS_WRITE_BLOCK_SIZE);
+	writer.buffers[1] = (writer.blocks > 1) ? (uint8_t *)malloc(FITS_WRITE_BLOCK_SIZE) : NULL;
+	if (writer.buffers[0] == NULL || (writer.blocks > 1 && writer.buffers[1] == NULL)) {
+		free(writer.buffers[0]);
+		free(writer.buffers[1]);
+		fclose(file);
+		return FITS_INVALIDDATA;
+	}
+	pthread_mutex_init(&writer.mutex, NULL);
+	pthread_cond_init(&writer.cond, NULL);
+	pthread_t writer_id;
+	const int threaded = !failed && writer.blocks > 1 && pthread_create(&writer_id, NULL, fits_block_writer_worker, &writer) == 0;
+
+	for (int block = 0; block < writer.blocks && !failed; block++) {
+		const int slot = block % 2;
+		if (threaded) {
+			/* wait for the writer to release the buffer converted two blocks ago */
+			pthread_mutex_lock(&writer.mutex);
+			while (block - writer.written >= 2 && !writer.failed) {
+				pthread_cond_wait(&writer.cond, &writer.mutex);
+			}
+			failed = writer.failed;
+			pthread_mutex_unlock(&writer.mutex);
+			if (failed) break;
+		}
+		fits_store_job job;
+		job.native = (const char *)data;
+		job.first = block * block_samples;
+		job.count = (job.first + block_samples > samples) ? samples - job.first : block_samples;
+		job.plane = plane;
+		job.channels = planar ? 1 : channels;
+		job.bitpix = bitpix;
+		job.raw = writer.buffers[slot];
+		fits_store_parallel(&job);
+		writer.sizes[slot] = job.count * sample_size;
+		if (threaded) {
+			pthread_mutex_lock(&writer.mutex);
+			writer.converted++;
+			pthread_cond_broadcast(&writer.cond);
+			pthread_mutex_unlock(&writer.mutex);
+		} else {
+			failed = fwrite(writer.buffers[slot], 1, writer.sizes[slot], file) != writer.sizes[slot];
+		}
+	}
+	if (threaded) {
+		pthread_mutex_lock(&writer.mutex);
+		/* let the writer finish what is converted if the conversion stopped early */
+		writer.blocks = writer.converted;
+		pthread_cond_broadcast(&writer.cond);
+		pthread_mutex_unlock(&writer.mutex);
+		pthread_join(writer_id, NULL);
+		failed = failed || writer.failed;
+	}
+	pthread_cond_destroy(&writer.cond);
+	pthread_mutex_destroy(&writer.mutex);
+	free(writer.buffers[0]);
+	free(writer.buffers[1]);
+
+	/* the data is padded with zeros to the block size */
+	const size_t padding = (FITS_HEADER_BLOCK_SIZE - samples * sample_size % FITS_HEADER_BLOCK_SIZE) % FITS_HEADER_BLOCK_SIZE;
+	if (!failed && padding > 0) {
+		char zeros[FITS_HEADER_BLOCK_SIZE] = {0};
+		failed = fwrite(zeros, 1, padding, file) != padding;
+	}
+	if (fclose(file) != 0) {
+		failed = 1;
+	}
+	if (failed) {
+		remove(file_name);
+		return FITS_IOERROR;
+	}
+	return FITS_OK;
 }
 
 /*
@@ -33,7 +33,8 @@ extern "C" {
 typedef enum fits_error {
 	FITS_OK = 0,
 	FITS_INVALIDDATA = -1,
-	FITS_INVALIDPARAM = -2
+	FITS_INVALIDPARAM = -2,
+	FITS_IOERROR = -3
 } fits_error;
 
 
@@ -48,6 +49,46 @@ typedef enum fits_headerState {
 	STATE_REST,
 } fits_header_state;
 
+typedef enum fits_compression {
+	FITS_COMPRESSION_NONE = 0,
+	FITS_COMPRESSION_RICE_1,
+	FITS_COMPRESSION_GZIP_1,
+	FITS_COMPRESSION_GZIP_2
+} fits_compression;
+
+typedef enum fits_quantization {
+	FITS_QUANTIZE_NONE = -1,
+	FITS_QUANTIZE_NO_DITHER = 0,
+	FITS_QUANTIZE_SUBTRACTIVE_DITHER_1 = 1,
+	FITS_QUANTIZE_SUBTRACTIVE_DITHER_2 = 2
+} fits_quantization;
+
+/**
+ * Layout of the tile compressed image BINTABLE (fpack), column offsets are -1 if the column is not present
+ */
+typedef struct fits_tile_info {
+	fits_compression compression;
+	int ztile[3];
+	int rice_blocksize;
+	int rice_bytepix;
+	fits_quantization quantize;
+	int dither_seed;
+	double zscale;
+	double zzero;
+	int zblank_found;
+	int32_t zblank;
+	int row_size;
+	int rows;
+	int heap_offset;           /**< offset of the heap from data_offset */
+	int compressed_column;
+	int compressed_64bit;      /**< 1 for Q descriptors, 0 for P descriptors */
+	int gzip_column;
+	int gzip_64bit;
+	int zscale_column;
+	int zzero_column;
+	int zblank_column;
+} fits_tile_info;
+
 /**
  * Structure to store the header keywords in FITS file
  */
@@ -74,11 +115,28 @@ typedef struct fits_header {
 	int data_max_found;
 	double data_max;
 	int data_offset;
+	double exposure_time;      /**< EXPTIME or EXPOSURE, -1 if not present */
+	char filter_name[72];      /**< FILTER */
+	char object_name[72];      /**< OBJECT */
+	char observation_time[72]; /**< DATE-OBS */
+	int tile_compressed; /**< 1 if the image is stored as a tile compressed BINTABLE extension, bitpix and naxisn describe the image */
+	fits_tile_info tiles;
 } fits_header;
 
 int fits_read_header(const uint8_t *fits_data, int fits_size, fits_header *header);
 int fits_get_buffer_size(fits_header *header);
+/* native_data may also be fits_data + data_offset of an uncompressed image to convert it in place */
 int fits_process_data(const uint8_t *fits_data, int fits_size, fits_header *header, char *native_data);
+/* converts count samples starting at first_sample, native_data must hold count samples */
+int fits_process_data_range(const uint8_t *fits_data, int fits_size, fits_header *header, int first_sample, int count, char *native_data);
+/**
+ * Writes a native (little endian) image to file_name. bitpix is 8, 16, 32 or -32, 16 and 32 bit samples are unsigned.
+ * channels is 1 or 3, RGB data is interleaved (RGBRGB...) or planar (RR..GG..BB..) and stored as a cube.
+ * cards is an optional NULL terminated list of additional header cards, such as "EXPTIME = 10.0".
+ */
+int fits_write(const char *file_name, int width, int height, int bitpix, int channels, int planar, const void *data, const char *const *cards);
+/* copies a FITS string keyword value like "'Ha      '" to dest without the quotes and the padding, dest is always terminated */
+void fits_copy_string_value(char *dest, const char *value, size_t size);
 //int fits_process_data_with_hist(const uint8_t *fits_data, int fits_size, fits_header *header, char *native_data, int *hist);
 
 #ifdef __cplusplus
@@ -0,0 +1,269 @@
+// Copyright (c) 2025 Rumen G.Bogdanovski
+// All rights reserved.
+//
+// You can use this software under the terms of 'INDIGO Astronomy
+// open-source license' (see LICENSE.md).
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHORS 'AS IS' AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include <QDir>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QHash>
+
+#include <fits.h>
+#include <xisf.h>
+#include <utils.h>
+#include <image_index.h>
+
+// enough for the header of almost every FITS and XISF file, longer headers are mapped as a whole
+#define IMAGE_INFO_PREFIX_SIZE 0x10000
+#define IMAGE_INDEX_CACHED_FOLDERS 8
+
+static bool read_fits_info(const char *file_name, std::shared_ptr<char> data, size_t size, image_info *info) {
+	fits_header header;
+	int res = fits_read_header((const uint8_t *)data.get(), (int)size, &header);
+	if ((res != FITS_OK || header.naxis == 0) && size >= IMAGE_INFO_PREFIX_SIZE) {
+		// the header (or the tile compressed image header) does not fit the prefix
+		data = map_file(file_name, &size);
+		if (data == nullptr) return false;
+		res = fits_read_header((const uint8_t *)data.get(), (int)size, &header);
+	}
+	if (res != FITS_OK || header.naxis < 1) return false;
+
+	info->width = header.naxisn[0];
+	info->height = (header.naxis > 1) ? header.naxisn[1] : 1;
+	info->channels = (header.naxis > 2) ? header.naxisn[2] : 1;
+	info->bitpix = header.bitpix;
+	info->exposure_time = header.exposure_time;
+	strncpy(info->filter_name, header.filter_name, IMAGE_INFO_STRING_LEN - 1);
+	strncpy(info->object_name, header.object_name, IMAGE_INFO_STRING_LEN - 1);
+	strncpy(info->observation_time, header.observation_time, IMAGE_INFO_STRING_LEN - 1);
+	return true;
+}
+
+static bool read_xisf_info(const char *file_name, std::shared_ptr<char> data, size_t size, image_info *info) {
+	const xisf_header *header = (const xisf_header *)data.get();
+	size_t header_size = sizeof(xisf_header) + header->xml_length;
+	if (header_size > size) {
+		data = map_file(file_name, &size, header_size);
+		if (data == nullptr || size < header_size) return false;
+	}
+	xisf_metadata metadata;
+	if (xisf_read_metadata((uint8_t *)data.get(), (int)size, &metadata) != XISF_OK) return false;
+	xisf_metadata_free(&metadata);
+
+	info->width = metadata.width;
+	info->height = metadata.height;
+	info->channels = metadata.channels;
+	info->bitpix = metadata.bitpix;
+	info->exposure_time = metadata.exposure_time;
+	strncpy(info->filter_name, metadata.filter_name, IMAGE_INFO_STRING_LEN - 1);
+	strncpy(info->object_name, metadata.object_name, IMAGE_INFO_STRING_LEN - 1);
+	strncpy(info->observation_time, metadata.observation_time, IMAGE_INFO_STRING_LEN - 1);
+	return true;
+}
+
+bool read_image_info(const char *file_name, image_info *info) {
+	memset(info, 0, sizeof(image_info));
+	info->exposure_time = -1;
+
+	size_t size = 0;
+	std::shared_ptr<char> data = map_file(file_name, &size, IMAGE_INFO_PREFIX_SIZE);
+	if (data == nullptr || size < sizeof(xisf_header)) return false;
+
+	if (!strncmp(data.get(), "SIMPLE", 6)) {
+		return read_fits_info(file_name, data, size, info);
+	} else if (!strncmp(data.get(), "XISF0100", 8)) {
+		return read_xisf_info(file_name, data, size, info);
+	}
+	return false;
+}
+
+void ImageIndex::update(const QStringList &name_filters, bool read_info) {
+	QHash<QString, int> previous;
+	for (int i = 0; i < m_entries.size(); i++) {
+		previous.insert(m_entries[i].file_name, i);
+	}
+
+	QVector<ImageIndexEntry> entries;
+	QFileInfoList files = QDir(m_folder).entryInfoList(name_filters, QDir::Files, QDir::Name | QDir::IgnoreCase);
+	entries.reserve(files.size());
+	for (const QFileInfo &file: files) {
+		ImageIndexEntry entry;
+		entry.file_name = file.fileName();
+		entry.size = file.size();
+		entry.modified = file.lastModified().toMSecsSinceEpoch();
+		auto found = previous.constFind(entry.file_name);
+		if (found != previous.constEnd() && m_entries[*found].size == entry.size && m_entries[*found].modified == entry.modified) {
+			entry = m_entries[*found];
+		} else {
+			entry.info_read = false;
+			entry.has_info = false;
+			memset(&entry.info, 0, sizeof(image_info));
+			entry.info.exposure_time = -1;
+		}
+		entries.append(entry);
+	}
+	m_entries.swap(entries);
+	m_name_filters = name_filters;
+
+	if (!read_info) return;
+
+	std::vector<int> pending;
+	for (int i = 0; i < m_entries.size(); i++) {
+		if (!m_entries[i].info_read) pending.push_back(i);
+	}
+	if (pending.empty()) return;
+
+	// the headers are tiny, the scan is bound by file open and page fault latency, one reader per core
+	int max_threads = (get_number_of_cores() > 0) ? get_number_of_cores() : AIN_DEFAULT_THREADS;
+	int threads = std::min((int)pending.size(), max_threads);
+	std::atomic<size_t> next(0);
+	ImageIndexEntry *data = m_entries.data();  // detach once before the workers write to it
+	auto worker = [&]() {
+		for (size_t i = next++; i < pending.size(); i = next++) {
+			ImageIndexEntry &entry = data[pending[i]];
+			QByteArray path = QDir(m_folder).filePath(entry.file_name).toUtf8();
+			entry.has_info = read_image_info(path.constData(), &entry.info);
+			entry.info_read = true;
+		}
+	};
+	std::vector<std::thread> workers;
+	for (int rank = 1; rank < threads; rank++) {
+		workers.emplace_back(worker);
+	}
+	worker();
+	for (auto &thread: workers) {
+		thread.join();
+	}
+}
+
+std::shared_ptr<const ImageIndex> ImageIndex::get(const QString &folder, const QStringList &name_filters, bool read_info) {
+	static std::mutex cache_mutex;
+	static QHash<QString, std::shared_ptr<const ImageIndex>> cache;
+	static QStringList cache_order;
+
+	const QString key = QDir(folder).absolutePath();
+
+	// indices handed out are never modified, the updated index replaces the cached one
+	std::shared_ptr<ImageIndex> index(new ImageIndex(key));
+	{
+		std::lock_guard<std::mutex> lock(cache_mutex);
+		auto cached = cache.constFind(key);
+		if (cached != cache.constEnd() && (*cached)->m_name_filters == name_filters) {
+			index->m_entries = (*cached)->m_entries;
+		}
+	}
+	// the folder is listed and the headers are read without the lock, folders are indexed concurrently
+	index->update(name_filters, read_info);
+
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	auto cached = cache.constFind(key);
+	if (cached != cache.constEnd() && (*cached)->m_name_filters == name_filters) {
+		// keep the headers another update of the folder read meanwhile
+		index->merge(**cached);
+	}
+	cache_order.removeAll(key);
+	cache_order.append(key);
+	cache.insert(key, index);
+	while (cache_order.size() > IMAGE_INDEX_CACHED_FOLDERS) {
+		cache.remove(cache_order.takeFirst());
+	}
+	return index;
+}
+
+void ImageIndex::merge(const ImageIndex &other) {
+	QHash<QString, int> read;
+	for (int i = 0; i < other.m_entries.size(); i++) {
+		if (other.m_entries[i].info_read) read.insert(other.m_entries[i].file_name, i);
+	}
+	for (ImageIndexEntry &entry: m_entries) {
+		auto found = read.constFind(entry.file_name);
+		if (!entry.info_read && found != read.constEnd()) {
+			const ImageIndexEntry &other_entry = other.m_entries[*found];
+			if (other_entry.size == entry.size && other_entry.modified == entry.modified) {
+				entry = other_entry;
+			}
+		}
+	}
+}
+
+bool ImageIndex::infoRead() const {
+	for (const ImageIndexEntry &entry: m_entries) {
+		if (!entry.info_read) return false;
+	}
+	return true;
+}
+
+const ImageIndexEntry *ImageIndex::entry(const QString &file_name) const {
+	for (const ImageIndexEntry &entry: m_entries) {
+		if (entry.file_name == file_name) return &entry;
+	}
+	return nullptr;
+}
+
+static int compare_entries(const ImageIndexEntry *a, const ImageIndexEntry *b, image_sort_key key) {
+	if (key != SORT_BY_NAME && a->has_info != b->has_info) {
+		return a->has_info ? 1 : -1;
+	}
+	if (key != SORT_BY_NAME && a->has_info) {
+		int res = 0;
+		switch (key) {
+			case SORT_BY_TIME:
+				res = strcmp(a->info.observation_time, b->info.observation_time);
+				break;
+			case SORT_BY_EXPOSURE:
+				res = (a->info.exposure_time > b->info.exposure_time) - (a->info.exposure_time < b->info.exposure_time);
+				break;
+			case SORT_BY_FILTER:
+				res = strcmp(a->info.filter_name, b->info.filter_name);
+				break;
+			case SORT_BY_OBJECT:
+				res = strcmp(a->info.object_name, b->info.object_name);
+				break;
+			default:
+				break;
+		}
+		if (res) return res;
+	}
+	// the same order as the folder listing
+	int res = a->file_name.compare(b->file_name, Qt::CaseInsensitive);
+	return res ? res : a->file_name.compare(b->file_name);
+}
+
+QStringList ImageIndex::fileNames(image_sort_key key, const image_index_filter &filter) const {
+	std::vector<const ImageIndexEntry *> selected;
+	selected.reserve(m_entries.size());
+	for (const ImageIndexEntry &entry: m_entries) {
+		if (!filter || filter(entry)) selected.push_back(&entry);
+	}
+	if (key != SORT_BY_NAME) {
+		std::sort(selected.begin(), selected.end(), [key](const ImageIndexEntry *a, const ImageIndexEntry *b) {
+			return compare_entries(a, b, key) < 0;
+		});
+	}
+	QStringList names;
+	names.reserve((int)selected.size());
+	for (const ImageIndexEntry *entry: selected) {
+		names.append(entry->file_name);
+	}
+	return names;
+}
@@ -0,0 +1,94 @@
+// Copyright (c) 2025 Rumen G.Bogdanovski
+// All rights reserved.
+//
+// You can use this software under the terms of 'INDIGO Astronomy
+// open-source license' (see LICENSE.md).
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHORS 'AS IS' AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _IMAGE_INDEX_H
+#define _IMAGE_INDEX_H
+
+#include <memory>
+#include <functional>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+#define IMAGE_INFO_STRING_LEN 72
+
+typedef struct image_info {
+	int width;
+	int height;
+	int channels;
+	int bitpix;
+	double exposure_time;  // -1 if not known
+	char filter_name[IMAGE_INFO_STRING_LEN];
+	char object_name[IMAGE_INFO_STRING_LEN];
+	char observation_time[IMAGE_INFO_STRING_LEN];  // DATE-OBS, ISO 8601 sorts as a string
+} image_info;
+
+/* Reads the image geometry and the acquisition metadata of a FITS or XISF file from the header only,
+   just the mapped header pages are read, the pixel data is never touched.
+   Returns false for other formats or broken headers. */
+bool read_image_info(const char *file_name, image_info *info);
+
+typedef enum {
+	SORT_BY_NAME = 0,
+	SORT_BY_TIME = 1,
+	SORT_BY_EXPOSURE = 2,
+	SORT_BY_FILTER = 3,
+	SORT_BY_OBJECT = 4
+} image_sort_key;
+
+struct ImageIndexEntry {
+	QString file_name;   // relative to the folder
+	qint64 size;
+	qint64 modified;     // ms since epoch
+	bool info_read;      // read_image_info() was called for this version of the file
+	bool has_info;       // info is valid
+	image_info info;
+};
+
+typedef std::function<bool(const ImageIndexEntry &entry)> image_index_filter;
+
+class ImageIndex {
+public:
+	/* Returns the index of folder listing the files matching name_filters. Indices are cached per folder
+	   and only new or modified files are looked at again. If read_info is set the headers of the files
+	   not scanned yet are read in parallel, otherwise only the file list is refreshed. Reading the headers
+	   of a large folder takes a while, call it from a worker thread then. Safe to call from several
+	   threads at once. */
+	static std::shared_ptr<const ImageIndex> get(const QString &folder, const QStringList &name_filters, bool read_info);
+
+	/* Returns the file names sorted by key (ties and files with no info are sorted by name),
+	   only the entries for which filter returns true are listed if filter is set */
+	QStringList fileNames(image_sort_key key = SORT_BY_NAME, const image_index_filter &filter = nullptr) const;
+
+	const ImageIndexEntry *entry(const QString &file_name) const;
+	// true if the headers of all the files are read
+	bool infoRead() const;
+	const QVector<ImageIndexEntry> &entries() const { return m_entries; }
+	const QString &folder() const { return m_folder; }
+
+private:
+	ImageIndex(const QString &folder): m_folder(folder) {}
+	void update(const QStringList &name_filters, bool read_info);
+	void merge(const ImageIndex &other);
+
+	QString m_folder;
+	QStringList m_name_filters;
+	QVector<ImageIndexEntry> m_entries;  // sorted by name, ignoring case
+};
+
+#endif /* _IMAGE_INDEX_H */
@@ -3,7 +3,7 @@
 #include "snr_calculator.h"
 #include <cmath>
 #include <algorithm>
-#include <future>
+#include <utils.h>
 #include <cstdlib>
 #include <cstdint>
 
@@ -66,7 +66,11 @@ bool ImagePreprocessor::isColorFormat(int pix_format) {
 	return pix_format == PIX_FMT_RGB24 ||
 	       pix_format == PIX_FMT_RGB48 ||
 	       pix_format == PIX_FMT_RGB96 ||
-	       pix_format == PIX_FMT_RGBF;
+	       pix_format == PIX_FMT_RGBF ||
+	       pix_format == PIX_FMT_3RGB24 ||
+	       pix_format == PIX_FMT_3RGB48 ||
+	       pix_format == PIX_FMT_3RGB96 ||
+	       pix_format == PIX_FMT_3RGBF;
 }
 
 std::unique_ptr<preview_image> ImagePreprocessor::convertToFloat32Grayscale(const preview_image& img) {
@@ -560,28 +564,13 @@ std::vector<CellStatistics> GridAnalyzer::analyzeTargetCells(const preview_image
 
 	auto targets = getTargetCells();
 
-	// Launch parallel analysis
-	std::vector<std::future<CellStatistics>> futures;
-	futures.reserve(targets.size());
-
-	for (size_t i = 0; i < targets.size(); ++i) {
-		int cx = targets[i].first;
-		int cy = targets[i].second;
-		futures.push_back(std::async(
-			std::launch::async,
-			[this, &img, cx, cy, cell_w, cell_h, gx, gy]() {
-				return m_cell_analyzer.analyze(img, cx, cy, cell_w, cell_h, gx, gy);
-			}
-		));
-	}
-
-	// Collect results
-	std::vector<CellStatistics> results;
-	results.reserve(futures.size());
-
-	for (auto& f : futures) {
-		results.push_back(f.get());
-	}
+	// Analyze the cells in parallel, one cell per chunk
+	std::vector<CellStatistics> results(targets.size());
+	parallel_for(0, targets.size(), [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			results[i] = m_cell_analyzer.analyze(img, targets[i].first, targets[i].second, cell_w, cell_h, gx, gy);
+		}
+	}, 1);
 
 	return results;
 }
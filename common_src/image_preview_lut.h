@@ -44,6 +44,13 @@ typedef enum {
 	DEBAYER_COUNT
 } debayer_t;
 
+typedef enum {
+	DEBAYER_MODE_BILINEAR = 0, /* full resolution RGB */
+	DEBAYER_MODE_SUPERPIXEL,   /* each 2x2 CFA quad becomes one RGB pixel, half size */
+	DEBAYER_MODE_BINNED_LUMA,  /* each 2x2 CFA quad is averaged to one mono pixel, half size */
+	DEBAYER_MODE_COUNT
+} debayer_mode_t;
+
 typedef struct {
 	double clip_black;
 	double clip_white;
@@ -53,6 +60,8 @@ typedef struct {
 	uint8_t stretch_level;
 	uint8_t balance; /* 0 = AWB, 1 = red, 2 = green, 3 = blue; */
 	uint32_t bayer_pattern; /* BAYER_PAT_XXXX from image_preview_lut.h */
+	uint8_t raw_mode; /* DSLR_RAW_XXX from dslr_raw.h, 0 = full decode */
+	uint8_t debayer_mode; /* DEBAYER_MODE_XXX, 0 = full resolution bilinear */
 } stretch_config_t;
 
 typedef struct {
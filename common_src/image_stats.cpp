@@ -17,193 +17,541 @@
 // SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "image_stats.h"
+#include "pixel_layout.h"
 #include "indigo/indigo_bus.h"
 
 #include <math.h>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <type_traits>
 #include <QCoreApplication>
-#include <QtConcurrent>
+#include <utils.h>
 
-#define MAX_THREADS 4
+// One channel of an interleaved, planar or mono frame
+template <typename T>
+struct ChannelSamples {
+	T const *data;
+	size_t stride;
+	T operator[](size_t i) const { return data[i * stride]; }
+};
+
+// One chunk per thread, each chunk has its own bins merged afterwards
+static size_t histogramGrain(size_t count) {
+	const size_t threads = parallel_threads();
+	// the extra bins are not worth it for small frames
+	return std::max<size_t>(65536, (count + threads - 1) / threads);
+}
+
+// Sums the per chunk bins into the first ones
+static void mergeBins(std::vector<std::vector<uint32_t>> &partial) {
+	std::vector<uint32_t> &bins = partial[0];
+	for (size_t chunk = 1; chunk < partial.size(); chunk++) {
+		for (size_t i = 0; i < bins.size(); i++) bins[i] += partial[chunk][i];
+	}
+}
+
+// Median, MAD and min/max of one channel from its merged bins, the bins are moved to the histogram
+static void binnedChannelStatistics(std::vector<uint32_t> &merged, size_t count, ImageHistogram1Channel *histogram) {
+	histogram->bins.swap(merged);
+	const std::vector<uint32_t> &bins = histogram->bins;
+	const size_t size = bins.size();
+
+	size_t first = 0, last = size - 1;
+	while (bins[first] == 0) first++;
+	while (bins[last] == 0) last--;
+
+	// the sample at count / 2 of the sorted channel, the one nth_element() picks
+	const size_t rank = count / 2;
+	size_t median = first;
+	size_t seen = bins[median];
+	while (seen <= rank) seen += bins[++median];
 
+	// grow the window around the median until it holds more than half of the samples
+	size_t deviation = 0;
+	seen = bins[median];
+	while (seen <= rank) {
+		deviation++;
+		if (median >= deviation) seen += bins[median - deviation];
+		if (median + deviation < size) seen += bins[median + deviation];
+	}
+
+	histogram->min = first;
+	histogram->max = last;
+	histogram->median = median;
+	histogram->mad = deviation;
+}
+
+// Exact statistics of 8 and 16 bit channels from one bin per value
 template <typename T>
-ImageStats imageStatsOneChannel(T const *buffer, int count) {
-	ImageStats stats;
-	if (count < 1) return stats;
-
-	double sum = 0, min = INFINITY, max = -INFINITY;
-	for (int i = 0; i < count; i++) {
-		sum += buffer[i];
-		if (buffer[i] > max) max = buffer[i];
-		if (buffer[i] < min) min = buffer[i];
-	}
-	double mean = sum / count;
-
-	double hist_max;
-	if (typeid(T) == typeid(uint8_t)) {
-		hist_max = UCHAR_MAX;
-		stats.bitdepth = 8;
-	} else if (typeid(T) == typeid(uint16_t)) {
-		hist_max = USHRT_MAX;
-		stats.bitdepth = 16;
-	} else if (typeid(T) == typeid(uint32_t)) {
-		hist_max = UINT_MAX;
-		stats.bitdepth = 32;
-	} else {
-		hist_max = max;
-		stats.bitdepth = -32;
-	}
-
-	double d;
-	double stddev_sum = 0, mad_sum = 0;
-	for (int i = 0; i < count; i++) {
-		if (hist_max > 0) {
-			int idx = (int)(buffer[i] / hist_max * 255);
-			if (idx < 0) idx = 0;
-			if (idx > 255) idx = 255;
-			stats.grey_red.histogram[idx]++;
+static void binnedOrderStatistics(const ChannelSamples<T> *samples, int channels, size_t count, ImageHistogram1Channel **out) {
+	const size_t size = (size_t)std::numeric_limits<T>::max() + 1;
+	const size_t grain = histogramGrain(count);
+	const size_t chunks = parallel_chunk_count(count, grain);
+	std::vector<std::vector<uint32_t>> partial[3];
+	for (int c = 0; c < channels; c++) {
+		partial[c].assign(chunks, std::vector<uint32_t>(size));
+	}
+	parallel_chunks(0, count, grain, [&](size_t chunk, size_t begin, size_t end) {
+		for (int c = 0; c < channels; c++) {
+			uint32_t *bins = partial[c][chunk].data();
+			const ChannelSamples<T> channel = samples[c];
+			for (size_t i = begin; i < end; i++) bins[channel[i]]++;
+		}
+	});
+
+	for (int c = 0; c < channels; c++) {
+		mergeBins(partial[c]);
+		binnedChannelStatistics(partial[c][0], count, out[c]);
+	}
+}
+
+// Keys that sort as the samples do
+static inline uint32_t sampleKey(uint32_t value) {
+	return value;
+}
+
+static inline uint32_t sampleKey(float value) {
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	// negative floats sort in reverse
+	return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+}
+
+// Branchless, the deviations of noise go either way at random
+static inline uint32_t absoluteDeviation(uint32_t value, uint32_t median) {
+	return std::max(value, median) - std::min(value, median);
+}
+
+static inline float absoluteDeviation(float value, float median) {
+	return fabsf(value - median);
+}
+
+// NaN keys sort past the infinities, they are left out of the order statistics
+template <typename T>
+static bool orderedKey(uint32_t key);
+
+template <>
+bool orderedKey<uint32_t>(uint32_t) {
+	return true;
+}
+
+template <>
+bool orderedKey<float>(uint32_t key) {
+	return key >= sampleKey(-INFINITY) && key <= sampleKey(INFINITY);
+}
+
+template <typename T>
+static T keySample(uint32_t key);
+
+template <>
+uint32_t keySample<uint32_t>(uint32_t key) {
+	return key;
+}
+
+template <>
+float keySample<float>(uint32_t key) {
+	const uint32_t bits = (key & 0x80000000u) ? (key & 0x7FFFFFFFu) : ~key;
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+// Finds the bin holding the sample at *rank and makes *rank relative to that bin
+static uint32_t rankBin(const std::vector<uint32_t> &bins, size_t *rank) {
+	uint32_t bin = 0;
+	while (*rank >= bins[bin]) *rank -= bins[bin++];
+	return bin;
+}
+
+// Returns the key of the median of the ordered keys without sorting: the top 16 bits of the keys
+// are binned first, then the bottom 16 bits of those in the bin holding the median. Sets *ordered
+// to the number of ordered keys, the returned key and *min_key / *max_key are only valid if it is not 0.
+// The passes are bound by the scattered bin increments, the min/max rides along in scalar code for free.
+template <typename T, typename KeyOf>
+static uint32_t selectKey(size_t count, KeyOf keyOf, size_t *ordered, uint32_t *min_key = nullptr, uint32_t *max_key = nullptr) {
+	const size_t grain = histogramGrain(count);
+	const size_t chunks = parallel_chunk_count(count, grain);
+	std::vector<std::vector<uint32_t>> partial(chunks, std::vector<uint32_t>(65536));
+	std::vector<uint32_t> mins(chunks, UINT32_MAX), maxs(chunks, 0);
+	std::vector<size_t> counts(chunks, 0);
+	parallel_chunks(0, count, grain, [&](size_t chunk, size_t begin, size_t end) {
+		uint32_t *bins = partial[chunk].data();
+		uint32_t lo = UINT32_MAX, hi = 0;
+		size_t n = 0;
+		for (size_t i = begin; i < end; i++) {
+			const uint32_t key = keyOf(i);
+			if (!orderedKey<T>(key)) continue;
+			bins[key >> 16]++;
+			lo = std::min(lo, key);
+			hi = std::max(hi, key);
+			n++;
 		}
-		d = buffer[i] - mean;
-		stddev_sum += d * d;
-		mad_sum += fabs(d);
-	}
-	double stddev = sqrt(stddev_sum / count);
-	double mad = mad_sum / count;
-
-	stats.channels = 1;
-	stats.grey_red.min = min;
-	stats.grey_red.max = max;
-	stats.grey_red.mean = mean;
-	stats.grey_red.stddev = stddev;
-	stats.grey_red.mad = mad;
-	//for (int i = 0; i < 256; i++) {
-	//	indigo_error("%d -> %d", i, stats.grey_red.histogram[i]);
-	//}
+		mins[chunk] = lo;
+		maxs[chunk] = hi;
+		counts[chunk] = n;
+	});
+	*ordered = 0;
+	for (size_t n : counts) *ordered += n;
+	if (*ordered == 0) return 0;
+	mergeBins(partial);
+	// the key at ordered / 2 of the sorted keys, the one nth_element() picks
+	size_t rank = *ordered / 2;
+	const uint32_t high = rankBin(partial[0], &rank);
+	if (min_key) *min_key = *std::min_element(mins.begin(), mins.end());
+	if (max_key) *max_key = *std::max_element(maxs.begin(), maxs.end());
+
+	for (auto &bins : partial) std::fill(bins.begin(), bins.end(), 0);
+	parallel_chunks(0, count, grain, [&](size_t chunk, size_t begin, size_t end) {
+		uint32_t *bins = partial[chunk].data();
+		for (size_t i = begin; i < end; i++) {
+			const uint32_t key = keyOf(i);
+			if ((key >> 16) == high && orderedKey<T>(key)) bins[key & 0xFFFF]++;
+		}
+	});
+	mergeBins(partial);
+	const uint32_t low = rankBin(partial[0], &rank);
+	return (high << 16) | low;
+}
+
+// Exact statistics of 32 bit and float channels, four passes each. NaN samples are skipped,
+// a channel of NaN only keeps the zero statistics.
+template <typename T>
+static void rankedOrderStatistics(const ChannelSamples<T> *samples, int channels, size_t count, ImageHistogram1Channel **out) {
+	for (int c = 0; c < channels; c++) {
+		const ChannelSamples<T> channel = samples[c];
+		uint32_t min_key, max_key;
+		size_t ordered;
+		const T median = keySample<T>(selectKey<T>(count, [=](size_t i) {
+			return sampleKey(channel[i]);
+		}, &ordered, &min_key, &max_key));
+		if (ordered == 0) continue;
+		const T deviation = keySample<T>(selectKey<T>(count, [=](size_t i) {
+			return sampleKey(absoluteDeviation(channel[i], median));
+		}, &ordered));
+		out[c]->min = keySample<T>(min_key);
+		out[c]->max = keySample<T>(max_key);
+		out[c]->median = median;
+		out[c]->mad = ordered ? deviation : 0;
+	}
+}
+
+template <typename T>
+static void orderStatistics(const ChannelSamples<T> *samples, int channels, size_t count, ImageHistogram1Channel **out, std::true_type) {
+	binnedOrderStatistics(samples, channels, count, out);
+}
+
+template <typename T>
+static void orderStatistics(const ChannelSamples<T> *samples, int channels, size_t count, ImageHistogram1Channel **out, std::false_type) {
+	rankedOrderStatistics(samples, channels, count, out);
+}
+
+template <typename T>
+static ImageHistogram histogramChannels(const ChannelSamples<T> *samples, int channels, size_t count, int pix_fmt) {
+	ImageHistogram histogram;
+	histogram.channels = channels;
+	histogram.pix_fmt = pix_fmt;
+	histogram.count = count;
+	ImageHistogram1Channel *out[3] = { &histogram.grey_red, &histogram.green, &histogram.blue };
+	orderStatistics(samples, channels, count, out, std::integral_constant<bool, sizeof(T) <= 2>());
+	return histogram;
+}
+
+template <typename T>
+static ImageHistogram histogramOneChannel(T const *buffer, size_t count, int pix_fmt) {
+	const ChannelSamples<T> samples[1] = { { buffer, 1 } };
+	return histogramChannels(samples, 1, count, pix_fmt);
+}
+
+template <typename T, bool PLANAR>
+static ImageHistogram histogramThreeChannels(T const *buffer, size_t count, int pix_fmt) {
+	const RGBPixels<T, PLANAR> pixels(buffer, count);
+	const ChannelSamples<T> samples[3] = {
+		{ pixels.channel(0), pixels.pixelStride() },
+		{ pixels.channel(1), pixels.pixelStride() },
+		{ pixels.channel(2), pixels.pixelStride() }
+	};
+	return histogramChannels(samples, 3, count, pix_fmt);
+}
+
+// Bins the bands of an interleaved frame as read_band() hands them over, the same bins as binnedOrderStatistics()
+template <typename T>
+static ImageHistogram bandedHistogram(int width, int height, int channels, int pix_fmt, int band_rows, const std::function<void(int start_row, int end_row, uint8_t *band)> &read_band) {
+	const size_t size = (size_t)std::numeric_limits<T>::max() + 1;
+	const size_t band_count = (size_t)width * band_rows;
+	const size_t grain = histogramGrain(band_count);
+	const size_t chunks = parallel_chunk_count(band_count, grain);
+	std::vector<T> band(band_count * channels);
+	std::vector<std::vector<uint32_t>> partial[3];
+	for (int c = 0; c < channels; c++) {
+		partial[c].assign(chunks, std::vector<uint32_t>(size));
+	}
+	for (int start_row = 0; start_row < height; start_row += band_rows) {
+		const int end_row = std::min(start_row + band_rows, height);
+		read_band(start_row, end_row, reinterpret_cast<uint8_t*>(band.data()));
+		const T *samples = band.data();
+		parallel_chunks(0, (size_t)width * (end_row - start_row), grain, [&](size_t chunk, size_t begin, size_t end) {
+			for (int c = 0; c < channels; c++) {
+				uint32_t *bins = partial[c][chunk].data();
+				for (size_t i = begin; i < end; i++) bins[samples[i * channels + c]]++;
+			}
+		});
+	}
+
+	ImageHistogram histogram;
+	histogram.channels = channels;
+	histogram.pix_fmt = pix_fmt;
+	histogram.count = (size_t)width * height;
+	ImageHistogram1Channel *out[3] = { &histogram.grey_red, &histogram.green, &histogram.blue };
+	for (int c = 0; c < channels; c++) {
+		mergeBins(partial[c]);
+		binnedChannelStatistics(partial[c][0], histogram.count, out[c]);
+	}
+	return histogram;
+}
+
+ImageHistogram imageHistogram(int width, int height, int pix_fmt, int band_rows, const std::function<void(int start_row, int end_row, uint8_t *band)> &read_band) {
+	if (width < 1 || height < 1 || band_rows < 1) return ImageHistogram();
+	switch (pix_fmt) {
+		case PIX_FMT_Y8:
+			return bandedHistogram<uint8_t>(width, height, 1, pix_fmt, band_rows, read_band);
+		case PIX_FMT_Y16:
+			return bandedHistogram<uint16_t>(width, height, 1, pix_fmt, band_rows, read_band);
+		case PIX_FMT_RGB24:
+			return bandedHistogram<uint8_t>(width, height, 3, pix_fmt, band_rows, read_band);
+		case PIX_FMT_RGB48:
+			return bandedHistogram<uint16_t>(width, height, 3, pix_fmt, band_rows, read_band);
+		default:
+			return ImageHistogram();
+	}
+}
+
+ImageHistogram imageHistogram(uint8_t const *input, int width, int height, int pix_fmt) {
+	if (input == nullptr || width < 1 || height < 1) return ImageHistogram();
+	const size_t count = (size_t)width * height;
+	switch (pix_fmt) {
+		case PIX_FMT_Y8:
+			return histogramOneChannel(reinterpret_cast<uint8_t const*>(input), count, pix_fmt);
+		case PIX_FMT_Y16:
+			return histogramOneChannel(reinterpret_cast<uint16_t const*>(input), count, pix_fmt);
+		case PIX_FMT_Y32:
+			return histogramOneChannel(reinterpret_cast<uint32_t const*>(input), count, pix_fmt);
+		case PIX_FMT_F32:
+			return histogramOneChannel(reinterpret_cast<float const*>(input), count, pix_fmt);
+		case PIX_FMT_RGB24:
+			return histogramThreeChannels<uint8_t, false>(reinterpret_cast<uint8_t const*>(input), count, pix_fmt);
+		case PIX_FMT_RGB48:
+			return histogramThreeChannels<uint16_t, false>(reinterpret_cast<uint16_t const*>(input), count, pix_fmt);
+		case PIX_FMT_RGB96:
+			return histogramThreeChannels<uint32_t, false>(reinterpret_cast<uint32_t const*>(input), count, pix_fmt);
+		case PIX_FMT_RGBF:
+			return histogramThreeChannels<float, false>(reinterpret_cast<float const*>(input), count, pix_fmt);
+		case PIX_FMT_3RGB24:
+			return histogramThreeChannels<uint8_t, true>(reinterpret_cast<uint8_t const*>(input), count, pix_fmt);
+		case PIX_FMT_3RGB48:
+			return histogramThreeChannels<uint16_t, true>(reinterpret_cast<uint16_t const*>(input), count, pix_fmt);
+		case PIX_FMT_3RGB96:
+			return histogramThreeChannels<uint32_t, true>(reinterpret_cast<uint32_t const*>(input), count, pix_fmt);
+		case PIX_FMT_3RGBF:
+			return histogramThreeChannels<float, true>(reinterpret_cast<float const*>(input), count, pix_fmt);
+		default:
+			return ImageHistogram();
+	}
+}
+
+static void binnedStats(const ImageHistogram1Channel &histogram, size_t count, double hist_max, ImageStats1Channel *stats) {
+	const std::vector<uint32_t> &bins = histogram.bins;
+	const size_t first = histogram.min;
+	const size_t last = histogram.max;
+
+	double sum = 0;
+	for (size_t value = first; value <= last; value++) {
+		sum += (double)value * bins[value];
+	}
+	const double mean = sum / count;
+
+	double stddev_sum = 0;
+	for (size_t value = first; value <= last; value++) {
+		if (bins[value] == 0) continue;
+		const double d = value - mean;
+		stddev_sum += d * d * bins[value];
+		int idx = (int)(value / hist_max * 255);
+		if (idx > 255) idx = 255;
+		stats->histogram[idx] += bins[value];
+	}
+
+	stats->min = histogram.min;
+	stats->max = histogram.max;
+	stats->mean = mean;
+	stats->stddev = sqrt(stddev_sum / count);
+	stats->median = histogram.median;
+	stats->mad = histogram.mad;
+}
+
+// 8 and 16 bit statistics without another pass over the pixels
+static ImageStats binnedImageStats(const ImageHistogram &histogram) {
+	ImageStats stats;
+	if (histogram.channels == 0 || histogram.count == 0) return stats;
+	const double hist_max = histogram.grey_red.bins.size() - 1;
+	stats.bitdepth = hist_max == UCHAR_MAX ? 8 : 16;
+	stats.channels = histogram.channels;
+	binnedStats(histogram.grey_red, histogram.count, hist_max, &stats.grey_red);
+	if (histogram.channels == 3) {
+		binnedStats(histogram.green, histogram.count, hist_max, &stats.green);
+		binnedStats(histogram.blue, histogram.count, hist_max, &stats.blue);
+	}
 	return stats;
 }
 
+// Mean and sum of squared deviations of the samples seen so far (Welford), chunks are merged with Chan's formula
+struct SampleMoments {
+	double count;
+	double mean;
+	double m2;
+
+	SampleMoments(): count(0), mean(0), m2(0) {}
+
+	void add(double value) {
+		count++;
+		const double d = value - mean;
+		mean += d / count;
+		m2 += d * (value - mean);
+	}
+
+	void merge(const SampleMoments &other) {
+		if (other.count == 0) return;
+		const double total = count + other.count;
+		const double d = other.mean - mean;
+		mean += d * other.count / total;
+		m2 += other.m2 + d * d * count * other.count / total;
+		count = total;
+	}
+};
+
+// 32 bit and float statistics: the min/max, median and MAD come from the order statistics,
+// the moments and the display histogram from one parallel pass with per chunk accumulators, NaN samples are left out of all of them
 template <typename T>
-ImageStats imageStatsThreeChannels(T const *buffer, int count) {
+static ImageStats rankedImageStats(const ChannelSamples<T> *samples, int channels, size_t count, const ImageHistogram &order) {
 	ImageStats stats;
-	if (count < 3) return stats;
-
-	double sum_r = 0, sum_g = 0, sum_b = 0;
-	double min_r = INFINITY, min_g = INFINITY, min_b = INFINITY;
-	double max_r = -INFINITY, max_g = -INFINITY, max_b = -INFINITY;
-
-	for (int i = 0; i < count * 3; i += 3) {
-		sum_r += buffer[i];
-		if (buffer[i] > max_r) max_r = buffer[i];
-		if (buffer[i] < min_r) min_r = buffer[i];
-
-		sum_g += buffer[i+1];
-		if (buffer[i + 1] > max_g) max_g = buffer[i + 1];
-		if (buffer[i + 1] < min_g) min_g = buffer[i + 1];
-
-		sum_b += buffer[i + 2];
-		if (buffer[i + 2] > max_b) max_b = buffer[i + 2];
-		if (buffer[i + 2] < min_b) min_b = buffer[i + 2];
-	}
-	double mean_r = sum_r / count;
-	double mean_g = sum_g / count;
-	double mean_b = sum_b / count;
-
-	double hist_max;
-	if (typeid(T) == typeid(uint8_t)) {
-		hist_max = UCHAR_MAX;
-		stats.bitdepth = 8;
-	} else if (typeid(T) == typeid(uint16_t)) {
-		hist_max = USHRT_MAX;
-		stats.bitdepth = 16;
-	} else if (typeid(T) == typeid(uint32_t)) {
-		hist_max = UINT_MAX;
-		stats.bitdepth = 32;
-	} else {
-		double max = (max_r > max_g) ? max_r : max_g;
-		hist_max = (max > max_b) ? max : max_b;
-		stats.bitdepth = -32;
-	}
-
-	double d;
-	double stddev_sum_r = 0, stddev_sum_g = 0, stddev_sum_b = 0;
-	double mad_sum_r = 0, mad_sum_g = 0, mad_sum_b = 0;
-	for (int i = 0; i < count * 3; i += 3) {
-		if (hist_max > 0) {
-			int idx_r = (int)(buffer[i] / hist_max * 255);
-			if (idx_r < 0) idx_r = 0;
-			if (idx_r > 255) idx_r = 255;
-			stats.grey_red.histogram[idx_r]++;
-
-			int idx_g = (int)(buffer[i + 1] / hist_max * 255);
-			if (idx_g < 0) idx_g = 0;
-			if (idx_g > 255) idx_g = 255;
-			stats.green.histogram[idx_g]++;
-
-			int idx_b = (int)(buffer[i + 2] / hist_max * 255);
-			if (idx_b < 0) idx_b = 0;
-			if (idx_b > 255) idx_b = 255;
-			stats.blue.histogram[idx_b]++;
+	if (count == 0) return stats;
+	const ImageHistogram1Channel *order_channels[3] = { &order.grey_red, &order.green, &order.blue };
+	ImageStats1Channel *out[3] = { &stats.grey_red, &stats.green, &stats.blue };
+
+	double hist_max = UINT_MAX;
+	if (std::is_floating_point<T>::value) {
+		hist_max = order_channels[0]->max;
+		for (int c = 1; c < channels; c++) hist_max = std::max(hist_max, order_channels[c]->max);
+	}
+
+	const size_t grain = histogramGrain(count);
+	const size_t chunks = parallel_chunk_count(count, grain);
+	std::vector<SampleMoments> moments(chunks * channels);
+	std::vector<uint32_t> bins(chunks * channels * hist_width);
+	parallel_chunks(0, count, grain, [&](size_t chunk, size_t begin, size_t end) {
+		for (int c = 0; c < channels; c++) {
+			const ChannelSamples<T> channel = samples[c];
+			SampleMoments m;
+			uint32_t *histogram = &bins[(chunk * channels + c) * hist_width];
+			for (size_t i = begin; i < end; i++) {
+				const double value = channel[i];
+				if (std::isnan(value)) continue;
+				m.add(value);
+				if (hist_max > 0) {
+					int idx = (int)(value / hist_max * 255);
+					if (idx < 0) idx = 0;
+					if (idx > 255) idx = 255;
+					histogram[idx]++;
+				}
+			}
+			moments[chunk * channels + c] = m;
 		}
-		d = buffer[i] - mean_r;
-		stddev_sum_r += d * d;
-		mad_sum_r += fabs(d);
-
-		d = buffer[i + 1] - mean_g;
-		stddev_sum_g += d * d;
-		mad_sum_g += fabs(d);
-
-		d = buffer[i + 2] - mean_b;
-		stddev_sum_b += d * d;
-		mad_sum_b += fabs(d);
-	}
-	double stddev_r = sqrt(stddev_sum_r / count);
-	double stddev_g = sqrt(stddev_sum_g / count);
-	double stddev_b = sqrt(stddev_sum_b / count);
-	double mad_r = mad_sum_r / count;
-	double mad_g = mad_sum_g / count;
-	double mad_b = mad_sum_b / count;
-
-	stats.channels = 3;
-
-	stats.grey_red.min = min_r;
-	stats.grey_red.max = max_r;
-	stats.grey_red.mean = mean_r;
-	stats.grey_red.stddev = stddev_r;
-	stats.grey_red.mad = mad_r;
-
-	stats.green.min = min_g;
-	stats.green.max = max_g;
-	stats.green.mean = mean_g;
-	stats.green.stddev = stddev_g;
-	stats.green.mad = mad_g;
-
-	stats.blue.min = min_b;
-	stats.blue.max = max_b;
-	stats.blue.mean = mean_b;
-	stats.blue.stddev = stddev_b;
-	stats.blue.mad = mad_b;
+	});
 
+	stats.channels = channels;
+	stats.bitdepth = std::is_floating_point<T>::value ? -32 : 32;
+	for (int c = 0; c < channels; c++) {
+		SampleMoments total;
+		for (size_t chunk = 0; chunk < chunks; chunk++) {
+			total.merge(moments[chunk * channels + c]);
+			const uint32_t *histogram = &bins[(chunk * channels + c) * hist_width];
+			for (int i = 0; i < hist_width; i++) out[c]->histogram[i] += histogram[i];
+		}
+		out[c]->min = order_channels[c]->min;
+		out[c]->max = order_channels[c]->max;
+		out[c]->mean = total.mean;
+		out[c]->stddev = total.count > 0 ? sqrt(total.m2 / total.count) : 0;
+		out[c]->median = order_channels[c]->median;
+		out[c]->mad = order_channels[c]->mad;
+	}
 	return stats;
 }
 
-ImageStats imageStats(uint8_t const *input, int width, int height, int pix_fmt) {
+template <typename T>
+static ImageStats rankedImageStatsOneChannel(T const *buffer, size_t count, const ImageHistogram &order) {
+	const ChannelSamples<T> samples[1] = { { buffer, 1 } };
+	return rankedImageStats(samples, 1, count, order);
+}
+
+template <typename T, bool PLANAR>
+static ImageStats rankedImageStatsThreeChannels(T const *buffer, size_t count, const ImageHistogram &order) {
+	const RGBPixels<T, PLANAR> pixels(buffer, count);
+	const ChannelSamples<T> samples[3] = {
+		{ pixels.channel(0), pixels.pixelStride() },
+		{ pixels.channel(1), pixels.pixelStride() },
+		{ pixels.channel(2), pixels.pixelStride() }
+	};
+	return rankedImageStats(samples, 3, count, order);
+}
+
+static ImageStats rankedImageStats(uint8_t const *input, size_t count, int pix_fmt, const ImageHistogram &order) {
+	switch (pix_fmt) {
+		case PIX_FMT_Y32:
+			return rankedImageStatsOneChannel(reinterpret_cast<uint32_t const*>(input), count, order);
+		case PIX_FMT_F32:
+			return rankedImageStatsOneChannel(reinterpret_cast<float const*>(input), count, order);
+		case PIX_FMT_RGB96:
+			return rankedImageStatsThreeChannels<uint32_t, false>(reinterpret_cast<uint32_t const*>(input), count, order);
+		case PIX_FMT_RGBF:
+			return rankedImageStatsThreeChannels<float, false>(reinterpret_cast<float const*>(input), count, order);
+		case PIX_FMT_3RGB96:
+			return rankedImageStatsThreeChannels<uint32_t, true>(reinterpret_cast<uint32_t const*>(input), count, order);
+		case PIX_FMT_3RGBF:
+			return rankedImageStatsThreeChannels<float, true>(reinterpret_cast<float const*>(input), count, order);
+		default:
+			return ImageStats();
+	}
+}
+
+ImageStats imageStats(const ImageHistogram &histogram) {
+	if (histogram.grey_red.bins.empty()) return ImageStats();
+	return binnedImageStats(histogram);
+}
+
+ImageStats imageStats(uint8_t const *input, int width, int height, int pix_fmt, const ImageHistogram *histogram) {
 	if (input == nullptr) return ImageStats();
 	switch (pix_fmt) {
 		case PIX_FMT_Y8:
-			return imageStatsOneChannel(reinterpret_cast<uint8_t const*>(input), width * height);
 		case PIX_FMT_Y16:
-			return imageStatsOneChannel(reinterpret_cast<uint16_t const*>(input), height * width);
-		case PIX_FMT_Y32:
-			return imageStatsOneChannel(reinterpret_cast<uint32_t const*>(input), height * width);
-		case PIX_FMT_F32:
-			return imageStatsOneChannel(reinterpret_cast<float const*>(input), height * width);
 		case PIX_FMT_RGB24:
-			return imageStatsThreeChannels(reinterpret_cast<uint8_t const*>(input), width * height);
 		case PIX_FMT_RGB48:
-			return imageStatsThreeChannels(reinterpret_cast<uint16_t const*>(input), width * height);
+		case PIX_FMT_3RGB24:
+		case PIX_FMT_3RGB48:
+			if (histogram && histogram->pix_fmt == pix_fmt && histogram->count == (size_t)width * height) {
+				return binnedImageStats(*histogram);
+			}
+			return binnedImageStats(imageHistogram(input, width, height, pix_fmt));
+		case PIX_FMT_Y32:
+		case PIX_FMT_F32:
 		case PIX_FMT_RGB96:
-			return imageStatsThreeChannels(reinterpret_cast<uint32_t const*>(input), width * height);
 		case PIX_FMT_RGBF:
-			return imageStatsThreeChannels(reinterpret_cast<float const*>(input), width * height);
+		case PIX_FMT_3RGB96:
+		case PIX_FMT_3RGBF:
+			if (histogram && histogram->pix_fmt == pix_fmt && histogram->count == (size_t)width * height) {
+				return rankedImageStats(input, (size_t)width * height, pix_fmt, *histogram);
+			}
+			return rankedImageStats(input, (size_t)width * height, pix_fmt, imageHistogram(input, width, height, pix_fmt));
 		default:
 			return ImageStats();
 	}
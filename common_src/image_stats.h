@@ -18,7 +18,9 @@
 
 #pragma once
 
+#include <functional>
 #include <memory>
+#include <vector>
 #include <pixelformat.h>
 #include <QImage>
 
@@ -30,7 +32,8 @@ struct ImageStats1Channel {
 	double max;
 	double mean;
 	double stddev;
-	double mad;
+	double median;
+	double mad; ///< median absolute deviation from the median (not scaled to sigma)
 	uint32_t histogram[hist_width];
 
 	ImageStats1Channel() {
@@ -38,6 +41,7 @@ struct ImageStats1Channel {
 		max =
 		mean =
 		stddev =
+		median =
 		mad = 0;
 		for (int i = 0; i < hist_width; i++) histogram[i] = 0;
 	}
@@ -61,6 +65,48 @@ struct ImageStats {
 	}
 };
 
-//ImageStats imageStats(uint8_t const *input, int width, int height, int pix_fmt);
-ImageStats imageStats(uint8_t const *input, int width, int height, int pix_fmt);
+// Exact order statistics of one channel over the whole frame
+struct ImageHistogram1Channel {
+	std::vector<uint32_t> bins; ///< one bin per value for 8 and 16 bit samples, empty otherwise
+	double min;
+	double max;
+	double median;
+	double mad; ///< median absolute deviation from the median (not scaled to sigma)
+
+	ImageHistogram1Channel() {
+		min =
+		max =
+		median =
+		mad = 0;
+	}
+};
+
+// 8 and 16 bit frames are binned by value in one parallel pass. 32 bit and float frames are
+// ranked in two levels: by the top and then by the bottom 16 bits of the order preserving sample key.
+struct ImageHistogram {
+	int channels;
+	int pix_fmt;
+	size_t count; ///< samples per channel
+	ImageHistogram1Channel grey_red;
+	ImageHistogram1Channel green;
+	ImageHistogram1Channel blue;
+
+	// 0 - uninitialized, 1 - monochrome, 3 - RGB image
+	ImageHistogram() {
+		channels =
+		pix_fmt = 0;
+		count = 0;
+	}
+};
+
+ImageHistogram imageHistogram(uint8_t const *input, int width, int height, int pix_fmt);
+// The histogram of an 8 or 16 bit frame that is never held whole (Y8, Y16, RGB24 and RGB48):
+// read_band() fills band with the rows [start_row, end_row), at most band_rows at a time.
+ImageHistogram imageHistogram(int width, int height, int pix_fmt, int band_rows, const std::function<void(int start_row, int end_row, uint8_t *band)> &read_band);
+
+// 8 and 16 bit statistics are taken from the histogram, 32 bit and float statistics take their order
+// statistics from it and the rest from one more pass. It is built if not given.
+ImageStats imageStats(uint8_t const *input, int width, int height, int pix_fmt, const ImageHistogram *histogram = nullptr);
+// The statistics of an 8 or 16 bit frame from its histogram alone, empty for the other frames
+ImageStats imageStats(const ImageHistogram &histogram);
 QImage makeHistogram(ImageStats stats);
\ No newline at end of file
@@ -24,20 +24,25 @@
 #include <imagepreview.h>
 #include <QPainter>
 #include <QCoreApplication>
+#include <QBuffer>
+#include <QImageReader>
 #include <image_preview_lut.h>
 #include <dslr_raw.h>
 #include <utils.h>
 
 #include <unistd.h>
-#include <thread>
-#include <mutex>
+#include <algorithm>
 
 #define MIN_SIZE_TO_PARALLELIZE 0x3FFFF
+// rows decoded, debayered and stretched at a time by the band streamed paths
+#define PREVIEW_BAND_ROWS 256
+// longest side of the coarse level shown zoomed out while a large frame is being stretched
+#define PREVIEW_SAMPLED_SIZE 1024
+// no preview is larger than 2^16 pixels on a side
+#define PREVIEW_MAX_LEVEL 16
 
 // Related Functions
 
-static std::recursive_mutex g_preview_mutex;
-
 static void qimage_cleanup(void *info) {
 	if (info) free(info);
 }
@@ -74,7 +79,7 @@ int get_bayer_offsets(uint32_t pix_format) {
 	}
 }
 
-template <typename T> static inline void debayer(T *raw, int index, int row, int column, int width, int height, int offsets, float &red, float &green, float &blue) {
+template <typename T> static inline void debayer(const T *raw, int index, int row, int column, int width, int height, int offsets, float &red, float &green, float &blue) {
 	switch (offsets ^ ((column & 1) << 4 | (row & 1))) {
 		case 0x00:
 			red = raw[index];
@@ -187,51 +192,246 @@ template <typename T> static inline void debayer(T *raw, int index, int row, int
 	}
 }
 
-template <typename T> void parallel_debayer(T *input_buffer, int width, int height, int offsets, T *output_buffer) {
-	const size_t size = width * height;
-	if (size < MIN_SIZE_TO_PARALLELIZE) {
-		int input_index = 0;
-		for (int row_index = 0; row_index < height; row_index++) {
+// Arithmetic of the bilinear interpolation, it must give the same results as debayer() above,
+// which goes through float and divides by 2.0, 3.0 or 4.0. For 8 and 16 bit samples that is
+// exactly an integer division of the sum, the other sample types keep the float round trip.
+template <typename T> struct bayer_math {
+	typedef decltype(T() + T()) sum_t;
+	static inline T value(T v) { return (T)(float)v; }
+	static inline T mean2(sum_t sum) { return (T)(float)(sum / 2.0); }
+	static inline T mean4(sum_t sum) { return (T)(float)(sum / 4.0); }
+};
+
+template <typename T> struct bayer_math_int {
+	typedef unsigned int sum_t;
+	static inline T value(T v) { return v; }
+	static inline T mean2(sum_t sum) { return (T)(sum >> 1); }
+	static inline T mean4(sum_t sum) { return (T)(sum >> 2); }
+};
+
+template <> struct bayer_math<uint8_t> : bayer_math_int<uint8_t> {};
+template <> struct bayer_math<uint16_t> : bayer_math_int<uint16_t> {};
+
+// Interpolates one pixel away from the frame border, PHASE is the switch case of debayer().
+// The additions are done in the same order as in debayer() so float frames round the same way.
+template <typename T, int PHASE> static inline void debayer_interior(const T *raw, const int width, T *output) {
+	typedef bayer_math<T> M;
+	typedef typename M::sum_t S;
+	if (PHASE == 0x00) {
+		output[0] = M::value(raw[0]);
+		output[1] = M::mean4((S)raw[1] + raw[-1] + raw[width] + raw[-width]);
+		output[2] = M::mean4((S)raw[-width - 1] + raw[-width + 1] + raw[width - 1] + raw[width + 1]);
+	} else if (PHASE == 0x10) {
+		output[0] = M::mean2((S)raw[-1] + raw[1]);
+		output[1] = M::value(raw[0]);
+		output[2] = M::mean2((S)raw[-width] + raw[width]);
+	} else if (PHASE == 0x01) {
+		output[0] = M::mean2((S)raw[-width] + raw[width]);
+		output[1] = M::value(raw[0]);
+		output[2] = M::mean2((S)raw[-1] + raw[1]);
+	} else {
+		output[0] = M::mean4((S)raw[-width - 1] + raw[-width + 1] + raw[width - 1] + raw[width + 1]);
+		output[1] = M::mean4((S)raw[1] + raw[-1] + raw[width] + raw[-width]);
+		output[2] = M::value(raw[0]);
+	}
+}
+
+// Columns 1 to width - 2 of a row that is not the first or the last one. EVEN_PHASE is the
+// phase of the even columns, odd columns have the other column parity, so the loop body
+// handles a pair of columns with no branches and the compiler can vectorize it.
+template <typename T, int EVEN_PHASE> static void debayer_interior_row(const T * __restrict raw, int width, T * __restrict output) {
+	const int pairs = (width - 2) / 2;
+	for (int pair = 0; pair < pairs; pair++) {
+		const int column = 2 * pair + 1;
+		debayer_interior<T, EVEN_PHASE ^ 0x10>(raw + column, width, output + 3 * column);
+		debayer_interior<T, EVEN_PHASE>(raw + column + 1, width, output + 3 * column + 3);
+	}
+	if (width % 2 == 1) {
+		debayer_interior<T, EVEN_PHASE ^ 0x10>(raw + width - 2, width, output + 3 * (width - 2));
+	}
+}
+
+template <typename T> static inline void debayer_border(const T *input_buffer, int input_index, int row, int column, int width, int height, int offsets, T *output) {
+	float red = 0, green = 0, blue = 0;
+	debayer(input_buffer, input_index, row, column, width, height, offsets, red, green, blue);
+	output[0] = red;
+	output[1] = green;
+	output[2] = blue;
+}
+
+// Debayers rows [start_row, end_row) of a width x height frame into the interleaved RGB output_buffer,
+// which holds the rows from output_first_row on. input_buffer holds the CFA rows starting at input_first_row,
+// including one row above and below the range where the frame has them, so a band of the frame can be
+// debayered on its own. The interior is interpolated by the kernels specialized on the Bayer phase,
+// only the one pixel border goes through the checks in debayer().
+template <typename T> static void debayer_rows(const T *input_buffer, int input_first_row, int width, int height, int offsets, int start_row, int end_row, T *output_buffer, int output_first_row = 0) {
+	for (int row_index = start_row; row_index < end_row; row_index++) {
+		const int input_index = (row_index - input_first_row) * width;
+		T *output = output_buffer + (size_t)(row_index - output_first_row) * width * 3;
+		if (row_index == 0 || row_index == height - 1 || width < 3) {
 			for (int column_index = 0; column_index < width; column_index++) {
-				float red = 0, green = 0, blue = 0;
-				int output_index = input_index * 3;
-				debayer(input_buffer, input_index, row_index, column_index, width, height, offsets, red, green, blue);
-				output_buffer[output_index] = red;
-				output_buffer[output_index + 1] = green;
-				output_buffer[output_index + 2] = blue;
-				input_index++;
+				debayer_border(input_buffer, input_index + column_index, row_index, column_index, width, height, offsets, output + 3 * column_index);
 			}
+			continue;
 		}
-	} else {
-		int max_threads = get_number_of_cores();
-		max_threads = (max_threads > 0) ? max_threads : AIN_DEFAULT_THREADS;
-		std::thread threads[max_threads];
-		for (int rank = 0; rank < max_threads; rank++) {
-			const int chunk = ceil(height / (double)max_threads);
-			threads[rank] = std::thread([=]() {
-				const int start = chunk * rank;
-				int end = start + chunk;
-				end = (end > height) ? height : end;
-				int input_index = start * width;
-				for (int row_index = start; row_index < end; row_index++) {
-					for (int column_index = 0; column_index < width; column_index++) {
-						float red = 0, green = 0, blue = 0;
-						int output_index = input_index * 3;
-						debayer(input_buffer, input_index, row_index, column_index, width, height, offsets, red, green, blue);
-						output_buffer[output_index] = red;
-						output_buffer[output_index + 1] = green;
-						output_buffer[output_index + 2] = blue;
-						input_index++;
-					}
-				}
-			});
+		debayer_border(input_buffer, input_index, row_index, 0, width, height, offsets, output);
+		const T *raw = input_buffer + input_index;
+		switch (offsets ^ (row_index & 1)) {
+			case 0x00:
+				debayer_interior_row<T, 0x00>(raw, width, output);
+				break;
+			case 0x01:
+				debayer_interior_row<T, 0x01>(raw, width, output);
+				break;
+			case 0x10:
+				debayer_interior_row<T, 0x10>(raw, width, output);
+				break;
+			case 0x11:
+				debayer_interior_row<T, 0x11>(raw, width, output);
+				break;
 		}
-		for (int rank = 0; rank < max_threads; rank++) {
-			threads[rank].join();
+		debayer_border(input_buffer, input_index + width - 1, row_index, width - 1, width, height, offsets, output + 3 * (width - 1));
+	}
+}
+
+template <typename T> static void parallel_debayer(const T *input_buffer, int input_first_row, int width, int height, int offsets, int start_row, int end_row, T *output_buffer, int output_first_row = 0) {
+	const size_t size = (size_t)width * (end_row - start_row);
+	if (size < MIN_SIZE_TO_PARALLELIZE) {
+		debayer_rows(input_buffer, input_first_row, width, height, offsets, start_row, end_row, output_buffer, output_first_row);
+	} else {
+		parallel_for(start_row, end_row, [=](size_t start, size_t end) {
+			debayer_rows(input_buffer, input_first_row, width, height, offsets, (int)start, (int)end, output_buffer, output_first_row);
+		});
+	}
+}
+
+template <typename T> void parallel_debayer(T *input_buffer, int width, int height, int offsets, T *output_buffer) {
+	parallel_debayer((const T*)input_buffer, 0, width, height, offsets, 0, height, output_buffer);
+}
+
+// Reduces rows [start_row, end_row) of the half size output, each 2x2 CFA quad becomes one
+// pixel: R, mean of the two Gs and B for the superpixel mode or the mean of all four for luma.
+// An odd last row or column of the frame has no complete quad and is dropped.
+template <typename T> static void bin_bayer_rows(const T *input_buffer, int width, int offsets, bool luma, int start_row, int end_row, T *output_buffer) {
+	typedef bayer_math<T> M;
+	typedef typename M::sum_t S;
+	const int out_width = width / 2;
+	// position of the red and the blue sample in the quad, the greens are on the other diagonal
+	const int red = ((offsets & 0x01) ? width : 0) + ((offsets & 0x10) ? 1 : 0);
+	const int blue = (width + 1) - red;
+	const int green1 = ((offsets & 0x01) ? width : 0) + ((offsets & 0x10) ? 0 : 1);
+	const int green2 = (width + 1) - green1;
+	for (int row = start_row; row < end_row; row++) {
+		const T *quad = input_buffer + (size_t)2 * row * width;
+		if (luma) {
+			T *output = output_buffer + (size_t)row * out_width;
+			for (int column = 0; column < out_width; column++, quad += 2) {
+				output[column] = M::mean4((S)quad[0] + quad[1] + quad[width] + quad[width + 1]);
+			}
+		} else {
+			T *output = output_buffer + (size_t)row * out_width * 3;
+			for (int column = 0; column < out_width; column++, quad += 2, output += 3) {
+				output[0] = M::value(quad[red]);
+				output[1] = M::mean2((S)quad[green1] + quad[green2]);
+				output[2] = M::value(quad[blue]);
+			}
 		}
 	}
 }
 
+template <typename T> static void parallel_bin_bayer(const T *input_buffer, int width, int height, int offsets, bool luma, T *output_buffer) {
+	const int out_height = height / 2;
+	const size_t size = (size_t)width * height;
+	if (size < MIN_SIZE_TO_PARALLELIZE) {
+		bin_bayer_rows(input_buffer, width, offsets, luma, 0, out_height, output_buffer);
+	} else {
+		parallel_for(0, out_height, [=](size_t start, size_t end) {
+			bin_bayer_rows(input_buffer, width, offsets, luma, (int)start, (int)end, output_buffer);
+		});
+	}
+}
+
+template <typename T> static preview_image* create_binned_bayer_preview(int width, int height, int pix_format, int out_format, const char *cfa_data, const stretch_config_t sconfig, const preview_band_cb &band_cb) {
+	const bool luma = sconfig.debayer_mode == DEBAYER_MODE_BINNED_LUMA;
+	const int out_width = width / 2;
+	const int out_height = height / 2;
+	T *out_data = (T*)malloc(sizeof(T) * out_width * out_height * (luma ? 1 : 3));
+	if (out_data == nullptr) {
+		indigo_error("%s(): Can not allocate %dx%d preview", __FUNCTION__, out_width, out_height);
+		return nullptr;
+	}
+	parallel_bin_bayer((const T*)cfa_data, width, height, get_bayer_offsets(pix_format), luma, out_data);
+
+	preview_image* img = new preview_image(out_width, out_height, QImage::Format_RGB32);
+	img->m_raw_owner = std::shared_ptr<char>((char*)out_data, [](char *p){ free(p); });
+	img->m_raw_data = img->m_raw_owner.get();
+	img->m_pix_format = out_format;
+	img->m_height = out_height;
+	img->m_width = out_width;
+
+	stretch_preview(img, sconfig, band_cb);
+	return img;
+}
+
+// Superpixel and binned luma previews of a CFA frame, the binned pixels are a copy, cfa_data is not kept.
+// Returns nullptr for formats that are not Bayer and for frames too small to bin.
+static preview_image* create_binned_bayer_preview(int width, int height, int pix_format, const char *cfa_data, const stretch_config_t sconfig, const preview_band_cb &band_cb = nullptr) {
+	if (width < 2 || height < 2) {
+		return nullptr;
+	}
+	const bool luma = sconfig.debayer_mode == DEBAYER_MODE_BINNED_LUMA;
+	switch (pix_format) {
+		case PIX_FMT_SBGGR8:
+		case PIX_FMT_SGBRG8:
+		case PIX_FMT_SGRBG8:
+		case PIX_FMT_SRGGB8:
+			return create_binned_bayer_preview<uint8_t>(width, height, pix_format, luma ? PIX_FMT_Y8 : PIX_FMT_RGB24, cfa_data, sconfig, band_cb);
+		case PIX_FMT_SBGGR16:
+		case PIX_FMT_SGBRG16:
+		case PIX_FMT_SGRBG16:
+		case PIX_FMT_SRGGB16:
+			return create_binned_bayer_preview<uint16_t>(width, height, pix_format, luma ? PIX_FMT_Y16 : PIX_FMT_RGB48, cfa_data, sconfig, band_cb);
+		case PIX_FMT_SBGGR32:
+		case PIX_FMT_SGBRG32:
+		case PIX_FMT_SGRBG32:
+		case PIX_FMT_SRGGB32:
+			return create_binned_bayer_preview<uint32_t>(width, height, pix_format, luma ? PIX_FMT_Y32 : PIX_FMT_RGB96, cfa_data, sconfig, band_cb);
+		case PIX_FMT_SBGGRF:
+		case PIX_FMT_SGBRGF:
+		case PIX_FMT_SGRBGF:
+		case PIX_FMT_SRGGBF:
+			return create_binned_bayer_preview<float>(width, height, pix_format, luma ? PIX_FMT_F32 : PIX_FMT_RGBF, cfa_data, sconfig, band_cb);
+	}
+	return nullptr;
+}
+
+static int bayer_sample_size(int pix_format) {
+	switch (pix_format) {
+		case PIX_FMT_SBGGR8:
+		case PIX_FMT_SGBRG8:
+		case PIX_FMT_SGRBG8:
+		case PIX_FMT_SRGGB8:
+			return 1;
+		case PIX_FMT_SBGGR16:
+		case PIX_FMT_SGBRG16:
+		case PIX_FMT_SGRBG16:
+		case PIX_FMT_SRGGB16:
+			return 2;
+		case PIX_FMT_SBGGR32:
+		case PIX_FMT_SGBRG32:
+		case PIX_FMT_SGRBG32:
+		case PIX_FMT_SRGGB32:
+		case PIX_FMT_SBGGRF:
+		case PIX_FMT_SGBRGF:
+		case PIX_FMT_SGRBGF:
+		case PIX_FMT_SRGGBF:
+			return 4;
+	}
+	return 0;
+}
+
+static preview_image* create_cfa_preview(int width, int height, int pix_format, std::shared_ptr<char> cfa_owner, char *cfa_data, const stretch_config_t sconfig, const preview_band_cb &band_cb = nullptr, std::shared_ptr<const ImageHistogram> histogram = nullptr);
+
 static unsigned int bayer_to_pix_format(const char *image_bayer_pat, const char bitpix, uint32_t prefered_bayer_pat) {
 	char bayerpat[5] = {0};
 
@@ -299,35 +499,63 @@ preview_image* create_qtsupported_preview(unsigned char *image_buffer, unsigned
 
 
 #if defined(USE_LIBJPEG)
-static jmp_buf jpeg_error;
+// error manager per decode, libjpeg calls error_exit() on fatal errors and it must not return
+struct jpeg_preview_error_mgr {
+	struct jpeg_error_mgr pub;
+	jmp_buf setjmp_buffer;
+};
+
 static void jpeg_error_cb(j_common_ptr cinfo) {
-	Q_UNUSED(cinfo);
-	longjmp(jpeg_error, 1);
+	jpeg_preview_error_mgr *err = (jpeg_preview_error_mgr *)cinfo->err;
+	longjmp(err->setjmp_buffer, 1);
+}
+
+static void jpeg_message_cb(j_common_ptr cinfo) {
+	char message[JMSG_LENGTH_MAX];
+	(*cinfo->err->format_message)(cinfo, message);
+	indigo_debug("JPEG: %s", message);
 }
 #endif
 
-preview_image* create_jpeg_preview(unsigned char *jpg_buffer, unsigned long jpg_size) {
+preview_image* create_jpeg_preview(unsigned char *jpg_buffer, unsigned long jpg_size, int scale_denom) {
+	if (scale_denom != 2 && scale_denom != 4 && scale_denom != 8) {
+		scale_denom = 1;
+	}
 #if !defined(USE_LIBJPEG)
 
+	QByteArray jpg_data = QByteArray::fromRawData((const char*)jpg_buffer, jpg_size);
+	QBuffer jpg_device(&jpg_data);
+	QImageReader reader(&jpg_device, "JPG");
+	if (scale_denom > 1) {
+		// the Qt JPEG plugin maps this to DCT scaling for the 1/2, 1/4 and 1/8 ratios
+		QSize size = reader.size();
+		reader.setScaledSize(QSize((size.width() + scale_denom - 1) / scale_denom, (size.height() + scale_denom - 1) / scale_denom));
+	}
 	preview_image* img = new preview_image();
-	img->loadFromData((const uchar*)jpg_buffer, jpg_size, "JPG");
+	if (!reader.read(img)) {
+		indigo_error("JPEG: %s", reader.errorString().toUtf8().constData());
+		delete img;
+		return nullptr;
+	}
 	return img;
 
 #else // INDIGO Mac and Linux
 
-	unsigned char *bmp_buffer = nullptr;
+	// written after setjmp() so it must be volatile to be valid after longjmp()
+	unsigned char * volatile bmp_buffer = nullptr;
 	size_t bmp_size;
 
 	struct jpeg_decompress_struct cinfo;
-	struct jpeg_error_mgr jerr;
+	jpeg_preview_error_mgr jerr;
 
 	int row_stride, width, height, pixel_size, color_space;
 
-	cinfo.err = jpeg_std_error(&jerr);
+	cinfo.err = jpeg_std_error(&jerr.pub);
 	/* override default exit() and return 2 lines below */
-	jerr.error_exit = jpeg_error_cb;
+	jerr.pub.error_exit = jpeg_error_cb;
+	jerr.pub.output_message = jpeg_message_cb;
 	/* Jump here in case of a decmpression error */
-	if (setjmp(jpeg_error)) {
+	if (setjmp(jerr.setjmp_buffer)) {
 		if (bmp_buffer) free(bmp_buffer);
 		jpeg_destroy_decompress(&cinfo);
 		return nullptr;
@@ -340,15 +568,27 @@ preview_image* create_jpeg_preview(unsigned char *jpg_buffer, unsigned long jpg_
 	int rc = jpeg_read_header(&cinfo, TRUE);
 	if (rc != 1) {
 		indigo_error("JPEG: Data does not seem to be JPEG");
+		jpeg_destroy_decompress(&cinfo);
 		return nullptr;
 	}
+	if (scale_denom > 1) {
+		// libjpeg scales in the DCT domain, the skipped coefficients are never dequantized or transformed
+		cinfo.scale_num = 1;
+		cinfo.scale_denom = scale_denom;
+	}
 	jpeg_start_decompress(&cinfo);
 
 	width = cinfo.output_width;
 	height = cinfo.output_height;
 	pixel_size = cinfo.output_components;
 	color_space = cinfo.out_color_space;
-	indigo_debug("JPEG: Image is %d x %d (BPP: %d CS: %d)", width, height, pixel_size*8, color_space);
+	indigo_debug("JPEG: Image is %d x %d (BPP: %d CS: %d, scale 1/%d)", width, height, pixel_size*8, color_space, scale_denom);
+
+	if (color_space != JCS_GRAYSCALE && color_space != JCS_RGB) {
+		indigo_error("JPEG: Unsupported colour space (CS: %d)", color_space);
+		jpeg_destroy_decompress(&cinfo);
+		return nullptr;
+	}
 
 	bmp_size = width * height * pixel_size;
 	bmp_buffer = (unsigned char*)malloc(bmp_size);
@@ -362,16 +602,8 @@ preview_image* create_jpeg_preview(unsigned char *jpg_buffer, unsigned long jpg_
 	jpeg_finish_decompress(&cinfo);
 	jpeg_destroy_decompress(&cinfo);
 
-	preview_image* img;
-	if (color_space == JCS_GRAYSCALE) {
-		img = new preview_image(width, height, QImage::Format_Indexed8);
-	} else if (color_space == JCS_RGB) {
-		img = new preview_image(width, height, QImage::Format_RGB888);
-	} else {
-		indigo_error("JPEG: Unsupported colour space (CS: %d)", color_space);
-		return nullptr;
-	}
-
+	// allocated once decoding can no longer longjmp() past it
+	preview_image* img = new preview_image(width, height, color_space == JCS_GRAYSCALE ? QImage::Format_Indexed8 : QImage::Format_RGB888);
 	for (int y = 0; y < img->height(); y++) {
 		memcpy(img->scanLine(y), bmp_buffer + y * row_stride, row_stride);
 	}
@@ -386,12 +618,18 @@ preview_image* create_dslr_raw_preview(unsigned char *raw_buffer, unsigned long
 	dslr_raw_image_s outout_image;
 	unsigned int pix_format = 0;
 
-	int rc = dslr_raw_process_image((void *)raw_buffer, raw_size, &outout_image);
+	int rc = dslr_raw_process_image_mode((void *)raw_buffer, raw_size, &outout_image, (dslr_raw_mode)sconfig.raw_mode);
 	if (rc != LIBRAW_SUCCESS) {
 		if (outout_image.data != nullptr) free(outout_image.data);
 		return nullptr;
 	}
 
+	if (outout_image.jpeg) {
+		preview_image *img = create_jpeg_preview((unsigned char *)outout_image.data, outout_image.size, outout_image.jpeg_scale_denom);
+		free(outout_image.data);
+		return img;
+	}
+
 	if (outout_image.debayered) {
 		if (outout_image.bits == 8) {
 			pix_format = PIX_FMT_RGB24;
@@ -411,7 +649,41 @@ preview_image* create_dslr_raw_preview(unsigned char *raw_buffer, unsigned long
 }
 
 
+// Decodes and debayers a CFA frame band by band so the full native CFA frame is never allocated,
+// only the debayered frame, which is kept for the analysis, stays resident.
+template <typename T> static T* fits_debayer_streamed(unsigned char *raw_fits_buffer, unsigned long fits_size, fits_header *header, int offsets) {
+	const int width = header->naxisn[0];
+	const int height = header->naxisn[1];
+	T *rgb_data = (T*)malloc(sizeof(T) * width * height * 3);
+	T *band_data = (T*)malloc(sizeof(T) * width * (PREVIEW_BAND_ROWS + 2));
+	if (rgb_data == nullptr || band_data == nullptr) {
+		indigo_error("FITS: Can not allocate debayer buffers");
+		free(rgb_data);
+		free(band_data);
+		return nullptr;
+	}
+	for (int start_row = 0; start_row < height; start_row += PREVIEW_BAND_ROWS) {
+		const int end_row = std::min(start_row + PREVIEW_BAND_ROWS, height);
+		const int first_row = std::max(start_row - 1, 0);
+		const int last_row = std::min(end_row + 1, height);
+		int res = fits_process_data_range(raw_fits_buffer, fits_size, header, first_row * width, (last_row - first_row) * width, (char*)band_data);
+		if (res != FITS_OK) {
+			indigo_error("FITS: Error processing data");
+			free(rgb_data);
+			free(band_data);
+			return nullptr;
+		}
+		parallel_debayer((const T*)band_data, first_row, width, height, offsets, start_row, end_row, rgb_data);
+	}
+	free(band_data);
+	return rgb_data;
+}
+
 preview_image* create_fits_preview(unsigned char *raw_fits_buffer, unsigned long fits_size, const stretch_config_t sconfig) {
+	return create_fits_preview(nullptr, raw_fits_buffer, fits_size, sconfig);
+}
+
+preview_image* create_fits_preview(std::shared_ptr<char> fits_owner, unsigned char *raw_fits_buffer, unsigned long fits_size, const stretch_config_t sconfig, const preview_band_cb &band_cb, bool fits_writable) {
 	fits_header header;
 	unsigned int pix_format = 0;
 
@@ -443,7 +715,89 @@ preview_image* create_fits_preview(unsigned char *raw_fits_buffer, unsigned long
 		return nullptr;
 	}
 
-	char *fits_data = (char*)malloc(fits_get_buffer_size(&header));
+	int bayer_pix_fmt = 0;
+	if (header.naxis == 2) {
+		bayer_pix_fmt = bayer_to_pix_format(header.bayerpat, header.bitpix, sconfig.bayer_pattern);
+	}
+
+	// superpixel, binned luma and 8 and 16 bit bilinear previews need the whole CFA frame, the bilinear ones keep it
+	if (bayer_pix_fmt != 0 && (sconfig.debayer_mode != DEBAYER_MODE_BILINEAR || header.bitpix == 8 || header.bitpix == 16)) {
+		const int data_size = fits_get_buffer_size(&header);
+		char *cfa_data = nullptr;
+		std::shared_ptr<char> cfa_owner;
+		if (fits_owner && fits_writable && !header.tile_compressed && (unsigned long)header.data_offset + data_size <= fits_size) {
+			cfa_data = (char*)raw_fits_buffer + header.data_offset;
+			cfa_owner = fits_owner;
+		} else {
+			cfa_data = (char*)malloc(data_size);
+			if (cfa_data == nullptr) {
+				indigo_error("FITS: Can not allocate CFA buffer");
+				return nullptr;
+			}
+			cfa_owner = std::shared_ptr<char>(cfa_data, [](char *p){ free(p); });
+		}
+		res = fits_process_data(raw_fits_buffer, fits_size, &header, cfa_data);
+		if (res != FITS_OK) {
+			indigo_error("FITS: Error processing data");
+			return nullptr;
+		}
+		preview_image *img = create_preview(header.naxisn[0], header.naxisn[1], bayer_pix_fmt, cfa_owner, cfa_data, sconfig, band_cb);
+		indigo_debug("FITS_END: cfa_data = %p (CFA)", cfa_data);
+		return img;
+	}
+
+	if (bayer_pix_fmt != 0) {
+		const int offsets = get_bayer_offsets(bayer_pix_fmt);
+		char *rgb_data = nullptr;
+		int rgb_format = 0;
+		if (header.bitpix == 8) {
+			rgb_data = (char*)fits_debayer_streamed<uint8_t>(raw_fits_buffer, fits_size, &header, offsets);
+			rgb_format = PIX_FMT_RGB24;
+		} else if (header.bitpix == 16) {
+			rgb_data = (char*)fits_debayer_streamed<uint16_t>(raw_fits_buffer, fits_size, &header, offsets);
+			rgb_format = PIX_FMT_RGB48;
+		} else if (header.bitpix == 32) {
+			rgb_data = (char*)fits_debayer_streamed<uint32_t>(raw_fits_buffer, fits_size, &header, offsets);
+			rgb_format = PIX_FMT_RGB96;
+		} else {
+			rgb_data = (char*)fits_debayer_streamed<float>(raw_fits_buffer, fits_size, &header, offsets);
+			rgb_format = PIX_FMT_RGBF;
+		}
+		if (rgb_data == nullptr) {
+			return nullptr;
+		}
+		std::shared_ptr<char> owner(rgb_data, [](char *p){ free(p); });
+		preview_image *img = create_preview(header.naxisn[0], header.naxisn[1], rgb_format, owner, rgb_data, sconfig, band_cb);
+		indigo_debug("FITS_END: rgb_data = %p (debayered)", rgb_data);
+		return img;
+	}
+
+	// 8-bit data with no scaling is stored as is, use it in place if the caller keeps the buffer alive
+	const int data_size = fits_get_buffer_size(&header);
+	if (
+		fits_owner && !header.tile_compressed && header.bitpix == 8 && header.bzero == 0 && header.bscale == 1.0 &&
+		(unsigned long)header.data_offset + data_size <= fits_size
+	) {
+		char *fits_data = (char*)raw_fits_buffer + header.data_offset;
+		preview_image *img = create_preview(header.naxisn[0], header.naxisn[1], pix_format, fits_owner, fits_data, sconfig, band_cb);
+		indigo_debug("FITS_END: fits_data = %p (in place)", fits_data);
+		return img;
+	}
+
+	// nobody else reads the buffer, every sample keeps its size so it is converted where it is
+	if (fits_owner && fits_writable && !header.tile_compressed && (unsigned long)header.data_offset + data_size <= fits_size) {
+		char *fits_data = (char*)raw_fits_buffer + header.data_offset;
+		res = fits_process_data(raw_fits_buffer, fits_size, &header, fits_data);
+		if (res != FITS_OK) {
+			indigo_error("FITS: Error processing data");
+			return nullptr;
+		}
+		preview_image *img = create_preview(header.naxisn[0], header.naxisn[1], pix_format, fits_owner, fits_data, sconfig, band_cb);
+		indigo_debug("FITS_END: fits_data = %p (converted in place)", fits_data);
+		return img;
+	}
+
+	char *fits_data = (char*)malloc(data_size);
 
 	res = fits_process_data(raw_fits_buffer, fits_size, &header, fits_data);
 	if (res != FITS_OK) {
@@ -452,20 +806,19 @@ preview_image* create_fits_preview(unsigned char *raw_fits_buffer, unsigned long
 		return nullptr;
 	}
 
-	if (header.naxis == 2) {
-		int bayer_pix_fmt = bayer_to_pix_format(header.bayerpat, header.bitpix, sconfig.bayer_pattern);
-		if (bayer_pix_fmt != 0) pix_format = bayer_pix_fmt;
-	}
-
 	// pass ownership of fits_data to preview to avoid an extra memcpy/free
 	std::shared_ptr<char> owner(fits_data, [](char *p){ free(p); });
-	preview_image *img = create_preview(header.naxisn[0], header.naxisn[1], pix_format, owner, fits_data, sconfig);
+	preview_image *img = create_preview(header.naxisn[0], header.naxisn[1], pix_format, owner, fits_data, sconfig, band_cb);
 
 	indigo_debug("FITS_END: fits_data = %p (owned)", fits_data);
 	return img;
 }
 
 preview_image* create_xisf_preview(unsigned char *xisf_buffer, unsigned long xisf_size, const stretch_config_t sconfig) {
+	return create_xisf_preview(nullptr, xisf_buffer, xisf_size, sconfig);
+}
+
+preview_image* create_xisf_preview(std::shared_ptr<char> xisf_owner, unsigned char *xisf_buffer, unsigned long xisf_size, const stretch_config_t sconfig, const preview_band_cb &band_cb) {
 	xisf_metadata header;
 	unsigned int pix_format = 0;
 	preview_image *img = nullptr;
@@ -495,10 +848,12 @@ preview_image* create_xisf_preview(unsigned char *xisf_buffer, unsigned long xis
 		pix_format = (header.normal_pixel_storage) ? PIX_FMT_RGB24 : PIX_FMT_3RGB24;
 	} else {
 		indigo_error("XISF: Unsupported bitpix (BITPIX= %d)", header.bitpix);
+		xisf_metadata_free(&header);
 		return nullptr;
 	}
 
 	if (header.compression[0] == '\0') {
+		xisf_metadata_free(&header);
 		indigo_debug("XISF: file_size = %d, required_size = %d", xisf_size, header.data_offset + header.data_size);
 		if (header.data_offset + header.data_size > xisf_size) {
 			indigo_error("XISF: Wrong size (file_size = %d, required_size = %d)", xisf_size, header.data_offset + header.data_size);
@@ -510,10 +865,16 @@ preview_image* create_xisf_preview(unsigned char *xisf_buffer, unsigned long xis
 			if (bayer_pix_fmt != 0) pix_format = bayer_pix_fmt;
 		}
 
-		img = create_preview(header.width, header.height, pix_format, (char*)xisf_buffer + header.data_offset, sconfig);
+		if (xisf_owner && !header.big_endian) {
+			// uncompressed little endian data matches the native layout - use it in place
+			img = create_preview(header.width, header.height, pix_format, xisf_owner, (char*)xisf_buffer + header.data_offset, sconfig, band_cb);
+		} else {
+			img = create_preview(header.width, header.height, pix_format, (char*)xisf_buffer + header.data_offset, sconfig);
+		}
 	} else {
 		char *xisf_data = (char*)malloc(header.uncompressed_data_size);
 		int res = xisf_decompress(xisf_buffer, &header, (uint8_t*)xisf_data);
+		xisf_metadata_free(&header);
 		if (res != XISF_OK) {
 			indigo_error("XISF: Decompression failed res = %d", res);
 			free(xisf_data);
@@ -527,7 +888,7 @@ preview_image* create_xisf_preview(unsigned char *xisf_buffer, unsigned long xis
 
 		// transfer ownership of the decompressed buffer to the preview
 		std::shared_ptr<char> owner(xisf_data, [](char *p){ free(p); });
-		img = create_preview(header.width, header.height, pix_format, owner, (char*)xisf_data, sconfig);
+		img = create_preview(header.width, header.height, pix_format, owner, (char*)xisf_data, sconfig, band_cb);
 	}
 
 	indigo_debug("XISF_END");
@@ -574,6 +935,10 @@ static int raw_read_keyword_value(const char *ptr8, char *keyword, char *value)
 }
 
 preview_image* create_raw_preview(unsigned char *raw_image_buffer, unsigned long raw_size, const stretch_config_t sconfig) {
+	return create_raw_preview(nullptr, raw_image_buffer, raw_size, sconfig);
+}
+
+preview_image* create_raw_preview(std::shared_ptr<char> raw_owner, unsigned char *raw_image_buffer, unsigned long raw_size, const stretch_config_t sconfig, const preview_band_cb &band_cb) {
 	unsigned int pix_format = 0;
 
 	if (sizeof(indigo_raw_header) > raw_size) {
@@ -644,21 +1009,26 @@ preview_image* create_raw_preview(unsigned char *raw_image_buffer, unsigned long
 		if (bayer_pix_fmt != 0) pix_format = bayer_pix_fmt;
 	}
 
-	preview_image *img = create_preview(header->width, header->height,
-	        pix_format, raw_data, sconfig);
+	preview_image *img;
+	if (raw_owner) {
+		// INDIGO RAW is little endian with no padding - the data can be used in place
+		img = create_preview(header->width, header->height, pix_format, raw_owner, raw_data, sconfig, band_cb);
+	} else {
+		img = create_preview(header->width, header->height, pix_format, raw_data, sconfig);
+	}
 
 	indigo_debug("RAW_END: raw_data = %p", raw_data);
 	return img;
 }
 
 // Overload: accept ownership of already-allocated input buffer to avoid extra memcpy.
-preview_image* create_preview(int width, int height, int pix_format, std::shared_ptr<char> image_owner, char *image_data, const stretch_config_t sconfig) {
-	std::lock_guard<std::recursive_mutex> _preview_lock(g_preview_mutex);
-	// formats that can be used directly without rearrangement
-	if (
+preview_image* create_preview(int width, int height, int pix_format, std::shared_ptr<char> image_owner, char *image_data, const stretch_config_t sconfig, const preview_band_cb &band_cb) {
+	// formats that can be used directly without rearrangement, nothing to share without an owner
+	if (image_owner && (
 		pix_format == PIX_FMT_Y8 || pix_format == PIX_FMT_Y16 || pix_format == PIX_FMT_Y32 || pix_format == PIX_FMT_F32 ||
-		pix_format == PIX_FMT_RGB24 || pix_format == PIX_FMT_RGB48 || pix_format == PIX_FMT_RGB96 || pix_format == PIX_FMT_RGBF
-	) {
+		pix_format == PIX_FMT_RGB24 || pix_format == PIX_FMT_RGB48 || pix_format == PIX_FMT_RGB96 || pix_format == PIX_FMT_RGBF ||
+		pix_format == PIX_FMT_3RGB24 || pix_format == PIX_FMT_3RGB48 || pix_format == PIX_FMT_3RGB96 || pix_format == PIX_FMT_3RGBF
+	)) {
 		// create QImage from external buffer so Qt doesn't call QImageData::create
 		// Use QImage-internal buffer to avoid external buffer cleanup races
 		preview_image* img = new preview_image(width, height, QImage::Format_RGB32);
@@ -668,16 +1038,50 @@ preview_image* create_preview(int width, int height, int pix_format, std::shared
 		img->m_height = height;
 		img->m_width = width;
 
-		stretch_preview(img, sconfig);
+		stretch_preview(img, sconfig, band_cb);
 		return img;
 	}
 
-	// For other formats (planar, bayer etc) fall back to the existing path which will perform conversion/copy.
+	if (sconfig.debayer_mode != DEBAYER_MODE_BILINEAR && bayer_sample_size(pix_format)) {
+		preview_image* img = create_binned_bayer_preview(width, height, pix_format, image_data, sconfig, band_cb);
+		if (img) {
+			return img;
+		}
+	}
+
+	// full resolution previews of 8 and 16 bit CFA frames keep a reference to the CFA frame instead of a copy
+	if (image_owner && sconfig.debayer_mode == DEBAYER_MODE_BILINEAR) {
+		preview_image* img = create_cfa_preview(width, height, pix_format, image_owner, image_data, sconfig, band_cb);
+		if (img) {
+			return img;
+		}
+	}
+
+	// For other formats (bayer etc) or unowned data fall back to the existing path which will perform conversion/copy.
 	return create_preview(width, height, pix_format, image_data, sconfig);
 }
 
 preview_image* create_preview(int width, int height, int pix_format, char *image_data, const stretch_config_t sconfig) {
-	std::lock_guard<std::recursive_mutex> _preview_lock(g_preview_mutex);
+	const int cfa_sample_size = bayer_sample_size(pix_format);
+	if (cfa_sample_size && sconfig.debayer_mode != DEBAYER_MODE_BILINEAR) {
+		preview_image* img = create_binned_bayer_preview(width, height, pix_format, image_data, sconfig);
+		if (img) {
+			return img;
+		}
+	}
+	// a copy of the CFA frame is smaller than the debayered frame, keep that if the preview can
+	if (cfa_sample_size && cfa_sample_size <= 2 && sconfig.debayer_mode == DEBAYER_MODE_BILINEAR) {
+		const size_t cfa_size = (size_t)cfa_sample_size * width * height;
+		char *cfa_data = (char*)malloc(cfa_size);
+		if (cfa_data) {
+			memcpy(cfa_data, image_data, cfa_size);
+			std::shared_ptr<char> cfa_owner(cfa_data, [](char *p){ free(p); });
+			preview_image* img = create_cfa_preview(width, height, pix_format, cfa_owner, cfa_data, sconfig);
+			if (img) {
+				return img;
+			}
+		}
+	}
 	// Use QImage-internal buffer to avoid external buffer cleanup races
 	preview_image* img = new preview_image(width, height, QImage::Format_RGB32);
 	if (pix_format == PIX_FMT_Y8) {
@@ -725,93 +1129,45 @@ preview_image* create_preview(int width, int height, int pix_format, char *image
 
 		stretch_preview(img, sconfig);
 	} else if (pix_format == PIX_FMT_3RGB24) {
-		int channel_offest = width * height;
 		uint8_t* buf = (uint8_t*)image_data;
 		uint8_t* pixmap_data = (uint8_t*)malloc(sizeof(uint8_t) * height * width * 3);
-		int index = 0;
-		int index2 = 0;
-		for (int y = 0; y < height; ++y) {
-			QCoreApplication::processEvents();
-			for (int x = 0; x < width; ++x) {
-				pixmap_data[index2 + 0] = buf[index];
-				pixmap_data[index2 + 1] = buf[index + channel_offest];
-				pixmap_data[index2 + 2] = buf[index + 2 * channel_offest];
-				index++;
-				index2 += 3;
-			}
-		}
+		memcpy(pixmap_data, buf, sizeof(uint8_t) * height * width * 3);
 		img->m_raw_owner = std::shared_ptr<char>((char*)pixmap_data, [](char *p){ free(p); });
 		img->m_raw_data = img->m_raw_owner.get();
-		img->m_pix_format = PIX_FMT_RGB24;
+		img->m_pix_format = PIX_FMT_3RGB24;
 		img->m_height = height;
 		img->m_width = width;
 
 		stretch_preview(img, sconfig);
 	} else if (pix_format == PIX_FMT_3RGB48) {
-		int channel_offest = width * height;
 		uint16_t* buf = (uint16_t*)image_data;
 		uint16_t* pixmap_data = (uint16_t*)malloc(sizeof(uint16_t) * height * width * 3);
-		int index = 0;
-		int index2 = 0;
-		for (int y = 0; y < height; ++y) {
-			QCoreApplication::processEvents();
-			for (int x = 0; x < width; ++x) {
-				pixmap_data[index2 + 0] = buf[index];
-				pixmap_data[index2 + 1] = buf[index + channel_offest];
-				pixmap_data[index2 + 2] = buf[index + 2 * channel_offest];
-				index++;
-				index2 += 3;
-			}
-		}
+		memcpy(pixmap_data, buf, sizeof(uint16_t) * height * width * 3);
 		img->m_raw_owner = std::shared_ptr<char>((char*)pixmap_data, [](char *p){ free(p); });
 		img->m_raw_data = img->m_raw_owner.get();
-		img->m_pix_format = PIX_FMT_RGB48;
+		img->m_pix_format = PIX_FMT_3RGB48;
 		img->m_height = height;
 		img->m_width = width;
 
 		stretch_preview(img, sconfig);
 	} else if (pix_format == PIX_FMT_3RGB96) {
-		int channel_offest = width * height;
 		uint32_t* buf = (uint32_t*)image_data;
 		uint32_t* pixmap_data = (uint32_t*)malloc(sizeof(uint32_t) * height * width * 3);
-		int index = 0;
-		int index2 = 0;
-		for (int y = 0; y < height; ++y) {
-			QCoreApplication::processEvents();
-			for (int x = 0; x < width; ++x) {
-				pixmap_data[index2 + 0] = buf[index];
-				pixmap_data[index2 + 1] = buf[index + channel_offest];
-				pixmap_data[index2 + 2] = buf[index + 2 * channel_offest];
-				index++;
-				index2 += 3;
-			}
-		}
+		memcpy(pixmap_data, buf, sizeof(uint32_t) * height * width * 3);
 		img->m_raw_owner = std::shared_ptr<char>((char*)pixmap_data, [](char *p){ free(p); });
 		img->m_raw_data = img->m_raw_owner.get();
-		img->m_pix_format = PIX_FMT_RGB96;
+		img->m_pix_format = PIX_FMT_3RGB96;
 		img->m_height = height;
 		img->m_width = width;
 
 		stretch_preview(img, sconfig);
 	} else if (pix_format == PIX_FMT_3RGBF) {
-		int channel_offest = width * height;
 		float* buf = (float*)image_data;
 		float* pixmap_data = (float*)malloc(sizeof(float) * height * width * 3);
-		int index = 0;
-		int index2 = 0;
-		for (int y = 0; y < height; ++y) {
-			QCoreApplication::processEvents();
-			for (int x = 0; x < width; ++x) {
-				pixmap_data[index2 + 0] = buf[index];
-				pixmap_data[index2 + 1] = buf[index + channel_offest];
-				pixmap_data[index2 + 2] = buf[index + 2 * channel_offest];
-				index++;
-				index2 += 3;
-			}
-		}
+		memcpy(pixmap_data, buf, sizeof(float) * height * width * 3);
 		img->m_raw_owner = std::shared_ptr<char>((char*)pixmap_data, [](char *p){ free(p); });
 		img->m_raw_data = img->m_raw_owner.get();
-		img->m_pix_format = PIX_FMT_RGBF;
+		img->m_pix_format = PIX_FMT_3RGBF;
 		img->m_height = height;
 		img->m_width = width;
 
@@ -917,37 +1273,463 @@ preview_image* create_preview(int width, int height, int pix_format, char *image
 	return img;
 }
 
-void stretch_preview(preview_image *img, const stretch_config_t sconfig) {
-	std::lock_guard<std::recursive_mutex> _preview_lock(g_preview_mutex);
-	if (
-		img->m_pix_format == PIX_FMT_Y8 ||
-		img->m_pix_format == PIX_FMT_Y16 ||
-		img->m_pix_format == PIX_FMT_Y32 ||
-		img->m_pix_format == PIX_FMT_F32 ||
-		img->m_pix_format == PIX_FMT_RGB24 ||
-		img->m_pix_format == PIX_FMT_RGB48 ||
-		img->m_pix_format == PIX_FMT_RGB96 ||
-		img->m_pix_format == PIX_FMT_RGBF
+// 2x2 box filter, the odd last row or column is averaged with itself
+static QImage half_size_image(const QImage &image) {
+	const int width = image.width();
+	const int height = image.height();
+	const int out_width = (width + 1) / 2;
+	const int out_height = (height + 1) / 2;
+	int bytes;
+	switch (image.format()) {
+		case QImage::Format_RGB32:
+		case QImage::Format_ARGB32:
+			bytes = 4;
+			break;
+		case QImage::Format_RGB888:
+			bytes = 3;
+			break;
+		case QImage::Format_Grayscale8:
+			bytes = 1;
+			break;
+		default:
+			return image.scaled(out_width, out_height, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+	}
+	QImage half(out_width, out_height, image.format());
+	const uchar *in_bits = image.constBits();
+	const int in_bpl = image.bytesPerLine();
+	uchar *out_bits = half.bits();
+	const int out_bpl = half.bytesPerLine();
+	parallel_for(0, out_height, [=](size_t start, size_t end) {
+		for (int y = start; y < (int)end; y++) {
+			const uchar *row0 = in_bits + (size_t)(2 * y) * in_bpl;
+			const uchar *row1 = in_bits + (size_t)std::min(2 * y + 1, height - 1) * in_bpl;
+			uchar *out = out_bits + (size_t)y * out_bpl;
+			for (int x = 0; x < out_width; x++) {
+				const int x0 = 2 * x * bytes;
+				const int x1 = std::min(2 * x + 1, width - 1) * bytes;
+				for (int c = 0; c < bytes; c++) {
+					*out++ = (row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) >> 2;
+				}
+			}
+		}
+	});
+	return half;
+}
+
+QImage preview_pyramid::level_for_scale(const QImage &base, double scale, bool sampled_only) {
+	int level = 0;
+	while (
+		level < PREVIEW_MAX_LEVEL &&
+		scale * (1 << (level + 1)) <= 1.0 &&
+		(base.width() >> (level + 1)) > 0 &&
+		(base.height() >> (level + 1)) > 0
 	) {
-		Stretcher s(img->m_width, img->m_height, img->m_pix_format);
-		StretchParams sp;
-		sp.grey_red.highlights = sp.green.highlights = sp.blue.highlights = 0.9;
-		if (sconfig.stretch_level > 0) {
-			sp = s.computeParams((const uint8_t*)img->m_raw_data, stretch_params_lut[sconfig.stretch_level].brightness, stretch_params_lut[sconfig.stretch_level].contrast);
+		level++;
+	}
+	if (level == 0) {
+		return QImage();
+	}
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_sampled_level) {
+		return m_levels[m_sampled_level];
+	}
+	if (sampled_only) {
+		return QImage();
+	}
+	if ((int)m_levels.size() <= level) {
+		m_levels.resize(level + 1);
+	}
+	for (int n = 1; n <= level; n++) {
+		if (m_levels[n].isNull()) {
+			m_levels[n] = half_size_image(n == 1 ? base : m_levels[n - 1]);
 		}
-		indigo_debug("Stretch level: %d, params %f %f %f\n", sconfig.stretch_level, sp.grey_red.shadows, sp.grey_red.midtones, sp.grey_red.highlights);
+	}
+	return m_levels[level];
+}
+
+void preview_pyramid::clear() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_levels.clear();
+	m_sampled_level = 0;
+}
 
-		if (sconfig.balance) {
-			sp.refChannel = &sp.green;
+preview_tiles::preview_tiles(int width, int height, QImage::Format format, const Stretcher &stretcher, const char *raw_data, std::shared_ptr<char> raw_owner, std::shared_ptr<preview_pyramid> pyramid):
+	m_image(width, height, format),
+	m_bits(nullptr),
+	m_stretcher(stretcher),
+	m_raw_data((const uint8_t *)raw_data),
+	m_raw_owner(raw_owner),
+	m_pyramid(pyramid),
+	m_columns((width + PREVIEW_TILE_SIZE - 1) / PREVIEW_TILE_SIZE),
+	m_rows((height + PREVIEW_TILE_SIZE - 1) / PREVIEW_TILE_SIZE),
+	m_state(m_columns * m_rows, TILE_PENDING),
+	m_pending(m_columns * m_rows)
+{
+	// nothing shares the pixels yet, the tiles keep writing through this pointer once the previews do
+	m_bits = m_image.bits();
+	m_stretcher.prepareLut();
+}
+
+void preview_tiles::stretch_tile(int index) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (m_state[index] == TILE_BUSY) {
+		m_cond.wait(lock);
+	}
+	if (m_state[index] == TILE_DONE) {
+		return;
+	}
+	m_state[index] = TILE_BUSY;
+	lock.unlock();
+
+	const int x = (index % m_columns) * PREVIEW_TILE_SIZE;
+	const int y = (index / m_columns) * PREVIEW_TILE_SIZE;
+	const int width = std::min(PREVIEW_TILE_SIZE, m_image.width() - x);
+	const int height = std::min(PREVIEW_TILE_SIZE, m_image.height() - y);
+	m_stretcher.stretchRect(m_raw_data, m_bits, m_image.bytesPerLine(), x, y, width, height);
+
+	lock.lock();
+	m_state[index] = TILE_DONE;
+	m_cond.notify_all();
+	if (--m_pending == 0 && m_pyramid) {
+		// the levels can be built from the pixels now
+		m_pyramid->clear();
+	}
+}
+
+void preview_tiles::stretch(const QRect &rect) {
+	const QRect area = rect.intersected(m_image.rect());
+	if (area.isEmpty() || complete()) {
+		return;
+	}
+	for (int row = area.top() / PREVIEW_TILE_SIZE; row <= area.bottom() / PREVIEW_TILE_SIZE; row++) {
+		for (int column = area.left() / PREVIEW_TILE_SIZE; column <= area.right() / PREVIEW_TILE_SIZE; column++) {
+			stretch_tile(row * m_columns + column);
 		}
-		s.setParams(sp);
-		s.stretch((const uint8_t*)img->m_raw_data, img, 1);
+	}
+}
+
+void preview_tiles::stretch_all(const std::atomic<bool> &cancelled) {
+	for (int index = 0; index < m_columns * m_rows && !cancelled.load(); index++) {
+		stretch_tile(index);
+	}
+}
+
+void preview_pyramid::set_sampled_level(int level, const QImage &image) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_levels.clear();
+	m_levels.resize(level + 1);
+	m_levels[level] = image;
+	m_sampled_level = level;
+}
+
+static bool stretchable_pix_format(int pix_format) {
+	return
+		pix_format == PIX_FMT_Y8 ||
+		pix_format == PIX_FMT_Y16 ||
+		pix_format == PIX_FMT_Y32 ||
+		pix_format == PIX_FMT_F32 ||
+		pix_format == PIX_FMT_RGB24 ||
+		pix_format == PIX_FMT_RGB48 ||
+		pix_format == PIX_FMT_RGB96 ||
+		pix_format == PIX_FMT_RGBF ||
+		pix_format == PIX_FMT_3RGB24 ||
+		pix_format == PIX_FMT_3RGB48 ||
+		pix_format == PIX_FMT_3RGB96 ||
+		pix_format == PIX_FMT_3RGBF;
+}
+
+// The histogram of the native pixels, taken once and kept in img. For the previews that keep a CFA frame
+// it is the histogram of the debayered frame, debayered a band at a time.
+static const ImageHistogram &preview_histogram(preview_image *img) {
+	if (img->m_histogram) {
+		return *img->m_histogram;
+	}
+	if (img->m_debayered) {
+		const char *cfa_data = img->m_raw_data;
+		const int width = img->m_width;
+		const int height = img->m_height;
+		const int offsets = get_bayer_offsets(img->m_pix_format);
+		const int rgb_format = img->m_debayered->pix_format;
+		img->m_histogram = std::make_shared<const ImageHistogram>(imageHistogram(width, height, rgb_format, PREVIEW_BAND_ROWS, [=](int start_row, int end_row, uint8_t *band) {
+			if (rgb_format == PIX_FMT_RGB24) {
+				parallel_debayer((const uint8_t*)cfa_data, 0, width, height, offsets, start_row, end_row, band, start_row);
+			} else {
+				parallel_debayer((const uint16_t*)cfa_data, 0, width, height, offsets, start_row, end_row, (uint16_t*)band, start_row);
+			}
+		}));
+	} else {
+		img->m_histogram = std::make_shared<const ImageHistogram>(imageHistogram((const uint8_t*)img->m_raw_data, img->m_width, img->m_height, img->m_pix_format));
+	}
+	return *img->m_histogram;
+}
+
+// The tables are built here, as the params point into sp which goes out of scope
+static void set_preview_params(preview_image *img, const stretch_config_t sconfig, Stretcher &s) {
+	StretchParams sp;
+	sp.grey_red.highlights = sp.green.highlights = sp.blue.highlights = 0.9;
+	if (sconfig.stretch_level > 0) {
+		sp = s.computeParams(preview_histogram(img), stretch_params_lut[sconfig.stretch_level].brightness, stretch_params_lut[sconfig.stretch_level].contrast);
+	}
+	indigo_debug("Stretch level: %d, params %f %f %f\n", sconfig.stretch_level, sp.grey_red.shadows, sp.grey_red.midtones, sp.grey_red.highlights);
+
+	if (sconfig.balance) {
+		sp.refChannel = &sp.green;
+	}
+	s.setParams(sp);
+	s.prepareLut();
+}
+
+// Until all the pixels are stretched the zoomed out view shows every 2^level-th pixel of the whole frame
+static void set_sampled_level(preview_image *img, Stretcher &s) {
+	int level = 0;
+	while ((std::max(img->m_width, img->m_height) >> level) > PREVIEW_SAMPLED_SIZE) {
+		level++;
+	}
+	if (level > 0) {
+		const int sampling = 1 << level;
+		QImage sampled((img->m_width + sampling - 1) / sampling, (img->m_height + sampling - 1) / sampling, img->format());
+		s.stretch((const uint8_t*)img->m_raw_data, &sampled, sampling);
+		img->m_pyramid->set_sampled_level(level, sampled);
+	}
+}
+
+// Debayers and stretches rows [start_row, end_row) of a CFA frame one row at a time, so the debayered
+// row is still in the cache when it is stretched. s stretches one debayered row.
+template <typename T> static void stretch_cfa_rows(const T *cfa_data, int width, int height, int offsets, Stretcher &s, uchar *bits, size_t bytes_per_line, int start_row, int end_row) {
+	std::vector<T> row((size_t)width * 3);
+	for (int row_index = start_row; row_index < end_row; row_index++) {
+		debayer_rows(cfa_data, 0, width, height, offsets, row_index, row_index + 1, row.data(), row_index);
+		s.stretchRect((const uint8_t*)row.data(), bits + (size_t)row_index * bytes_per_line, bytes_per_line, 0, 0, width, 1);
+	}
+}
+
+template <typename T> static void parallel_stretch_cfa(const T *cfa_data, int width, int height, int offsets, Stretcher &s, uchar *bits, size_t bytes_per_line, int start_row, int end_row) {
+	const size_t size = (size_t)width * (end_row - start_row);
+	if (size < MIN_SIZE_TO_PARALLELIZE) {
+		stretch_cfa_rows(cfa_data, width, height, offsets, s, bits, bytes_per_line, start_row, end_row);
+	} else {
+		parallel_for(start_row, end_row, [&](size_t start, size_t end) {
+			stretch_cfa_rows(cfa_data, width, height, offsets, s, bits, bytes_per_line, (int)start, (int)end);
+		});
+	}
+}
+
+static void stretch_cfa_preview(preview_image *img, const stretch_config_t sconfig, const preview_band_cb &band_cb) {
+	Q_ASSERT(img->m_tiles == nullptr);
+	const int rgb_format = img->m_debayered->pix_format;
+	const int offsets = get_bayer_offsets(img->m_pix_format);
+	Stretcher s(img->m_width, 1, rgb_format);
+	set_preview_params(img, sconfig, s);
+	const int band_rows = band_cb ? PREVIEW_BAND_ROWS : img->m_height;
+	if (band_cb) {
+		// the partial previews show the rows not stretched yet black
+		img->fill(0);
+	}
+	for (int start_row = 0; start_row < img->m_height; start_row += band_rows) {
+		const int end_row = std::min(start_row + band_rows, img->m_height);
+		uchar *bits = img->bits();
+		if (rgb_format == PIX_FMT_RGB24) {
+			parallel_stretch_cfa((const uint8_t*)img->m_raw_data, img->m_width, img->m_height, offsets, s, bits, img->bytesPerLine(), start_row, end_row);
+		} else {
+			parallel_stretch_cfa((const uint16_t*)img->m_raw_data, img->m_width, img->m_height, offsets, s, bits, img->bytesPerLine(), start_row, end_row);
+		}
+		if (band_cb) {
+			band_cb(img, end_row);
+		}
+	}
+	img->m_pyramid = std::make_shared<preview_pyramid>();
+}
+
+static preview_image* create_cfa_preview(int width, int height, int pix_format, std::shared_ptr<char> cfa_owner, char *cfa_data, const stretch_config_t sconfig, const preview_band_cb &band_cb, std::shared_ptr<const ImageHistogram> histogram) {
+	int rgb_format = 0;
+	switch (bayer_sample_size(pix_format)) {
+		case 1:
+			rgb_format = PIX_FMT_RGB24;
+			break;
+		case 2:
+			rgb_format = PIX_FMT_RGB48;
+			break;
+		default:
+			return nullptr;
+	}
+	preview_image* img = new preview_image(width, height, QImage::Format_RGB32);
+	img->m_raw_owner = cfa_owner;
+	img->m_raw_data = cfa_data;
+	img->m_pix_format = pix_format;
+	img->m_height = height;
+	img->m_width = width;
+	img->m_debayered = std::make_shared<preview_debayered>();
+	img->m_debayered->pix_format = rgb_format;
+	if (histogram && histogram->pix_fmt == rgb_format && histogram->count == (size_t)width * height) {
+		img->m_histogram = histogram;
+	}
+
+	stretch_cfa_preview(img, sconfig, band_cb);
+	return img;
+}
+
+const char *preview_image::debayered_data(int &pix_format) const {
+	if (!m_debayered) {
+		pix_format = m_pix_format;
+		return m_raw_data;
+	}
+	std::lock_guard<std::mutex> lock(m_debayered->mutex);
+	if (!m_debayered->owner) {
+		const int offsets = get_bayer_offsets(m_pix_format);
+		const size_t sample_size = m_debayered->pix_format == PIX_FMT_RGB24 ? 1 : 2;
+		char *rgb_data = (char*)malloc(sample_size * 3 * m_width * m_height);
+		if (rgb_data == nullptr) {
+			indigo_error("%s(): Can not allocate %dx%d debayered frame", __FUNCTION__, m_width, m_height);
+			pix_format = 0;
+			return nullptr;
+		}
+		if (sample_size == 1) {
+			parallel_debayer((const uint8_t*)m_raw_data, 0, m_width, m_height, offsets, 0, m_height, (uint8_t*)rgb_data);
+		} else {
+			parallel_debayer((const uint16_t*)m_raw_data, 0, m_width, m_height, offsets, 0, m_height, (uint16_t*)rgb_data);
+		}
+		m_debayered->owner = std::shared_ptr<char>(rgb_data, [](char *p){ free(p); });
+	}
+	pix_format = m_debayered->pix_format;
+	return m_debayered->owner.get();
+}
+
+// One pixel interpolated as parallel_debayer() does it, the frame is not debayered for it
+int preview_image::debayered_pixel_value(int x, int y, double &r, double &g, double &b) const {
+	const int offsets = get_bayer_offsets(m_pix_format);
+	if (m_debayered->pix_format == PIX_FMT_RGB24) {
+		uint8_t rgb[3];
+		debayer_border((const uint8_t*)m_raw_data, y * m_width + x, y, x, m_width, m_height, offsets, rgb);
+		r = rgb[0];
+		g = rgb[1];
+		b = rgb[2];
+	} else {
+		uint16_t rgb[3];
+		debayer_border((const uint16_t*)m_raw_data, y * m_width + x, y, x, m_width, m_height, offsets, rgb);
+		r = rgb[0];
+		g = rgb[1];
+		b = rgb[2];
+	}
+	return m_debayered->pix_format;
+}
+
+ImageStats preview_stats(preview_image *img) {
+	if (img->m_debayered) {
+		return imageStats(preview_histogram(img));
+	}
+	return imageStats((const uint8_t*)img->m_raw_data, img->m_width, img->m_height, img->m_pix_format, img->m_histogram.get());
+}
+
+void stretch_preview(preview_image *img, const stretch_config_t sconfig, const preview_band_cb &band_cb) {
+	// the pending tiles would keep writing into the pixels, bits() detaches from the ones they fill in
+	img->m_tiles.reset();
+	if (img->m_debayered) {
+		stretch_cfa_preview(img, sconfig, band_cb);
+	} else if (stretchable_pix_format(img->m_pix_format)) {
+		Stretcher s(img->m_width, img->m_height, img->m_pix_format);
+		set_preview_params(img, sconfig, s);
+		if (band_cb) {
+			img->m_pyramid = std::make_shared<preview_pyramid>();
+			set_sampled_level(img, s);
+			// the partial previews show the rows not stretched yet black
+			img->fill(0);
+			for (int start_row = 0; start_row < img->m_height; start_row += PREVIEW_BAND_ROWS) {
+				const int end_row = std::min(start_row + PREVIEW_BAND_ROWS, img->m_height);
+				s.stretchRows((const uint8_t*)img->m_raw_data, img, start_row, end_row);
+				band_cb(img, end_row);
+			}
+		} else {
+			s.stretch((const uint8_t*)img->m_raw_data, img, 1);
+		}
+		img->m_pyramid = std::make_shared<preview_pyramid>();
 	} else {
 		char *c = (char*)&img->m_pix_format;
 		indigo_error("%s(): Unsupported pixel format (%c%c%c%c)", __FUNCTION__, c[0], c[1], c[2], c[3]);
 	}
 }
 
+preview_image* create_tiled_preview(int width, int height, int pix_format, std::shared_ptr<char> image_owner, char *image_data, const stretch_config_t sconfig, std::shared_ptr<const ImageHistogram> histogram) {
+	if (image_owner && sconfig.debayer_mode == DEBAYER_MODE_BILINEAR) {
+		preview_image* img = create_cfa_preview(width, height, pix_format, image_owner, image_data, sconfig, nullptr, histogram);
+		if (img) {
+			return img;
+		}
+	}
+	if (!image_owner || !stretchable_pix_format(pix_format)) {
+		return create_preview(width, height, pix_format, image_owner, image_data, sconfig);
+	}
+	preview_image* img = new preview_image();
+	img->m_raw_owner = image_owner;
+	img->m_raw_data = image_data;
+	img->m_pix_format = pix_format;
+	img->m_height = height;
+	img->m_width = width;
+	if (histogram && histogram->pix_fmt == pix_format && histogram->count == (size_t)width * height) {
+		img->m_histogram = histogram;
+	}
+
+	Stretcher s(width, height, pix_format);
+	set_preview_params(img, sconfig, s);
+	img->m_pyramid = std::make_shared<preview_pyramid>();
+	img->m_tiles = std::make_shared<preview_tiles>(width, height, QImage::Format_RGB32, s, image_data, image_owner, img->m_pyramid);
+	// the tiles own the pixels, the preview and its copies only read them until the tiles are complete
+	img->QImage::operator=(img->m_tiles->image());
+	set_sampled_level(img, s);
+	return img;
+}
+
+static bool image_layout(int pixel_format, int &bitpix, int &channels, int &planar) {
+	bitpix = 0;
+	channels = 1;
+	planar = 0;
+	switch (pixel_format) {
+		case PIX_FMT_Y8: bitpix = 8; break;
+		case PIX_FMT_Y16: bitpix = 16; break;
+		case PIX_FMT_Y32: bitpix = 32; break;
+		case PIX_FMT_F32: bitpix = -32; break;
+		case PIX_FMT_RGB24: bitpix = 8; channels = 3; break;
+		case PIX_FMT_RGB48: bitpix = 16; channels = 3; break;
+		case PIX_FMT_RGB96: bitpix = 32; channels = 3; break;
+		case PIX_FMT_RGBF: bitpix = -32; channels = 3; break;
+		case PIX_FMT_3RGB24: bitpix = 8; channels = 3; planar = 1; break;
+		case PIX_FMT_3RGB48: bitpix = 16; channels = 3; planar = 1; break;
+		case PIX_FMT_3RGB96: bitpix = 32; channels = 3; planar = 1; break;
+		case PIX_FMT_3RGBF: bitpix = -32; channels = 3; planar = 1; break;
+		default: {
+			const char *c = (const char*)&pixel_format;
+			indigo_error("%s(): Unsupported pixel format (%c%c%c%c)", __FUNCTION__, c[0], c[1], c[2], c[3]);
+			return false;
+		}
+	}
+	return true;
+}
+
+int save_fits_image(const char *file_name, int width, int height, int pixel_format, const char *image_data, const char *const *cards) {
+	int bitpix, channels, planar;
+	if (!image_layout(pixel_format, bitpix, channels, planar)) {
+		return FITS_INVALIDPARAM;
+	}
+	return fits_write(file_name, width, height, bitpix, channels, planar, image_data, cards);
+}
+
+int save_xisf_image(const char *file_name, int width, int height, int pixel_format, const char *image_data, const char *compression) {
+	int bitpix, channels, planar;
+	if (!image_layout(pixel_format, bitpix, channels, planar)) {
+		return XISF_INVALIDPARAM;
+	}
+	xisf_metadata metadata;
+	xisf_metadata_init(&metadata);
+	metadata.width = width;
+	metadata.height = height;
+	metadata.bitpix = bitpix;
+	metadata.channels = channels;
+	metadata.normal_pixel_storage = !planar;
+	if (compression) {
+		snprintf(metadata.compression, sizeof(metadata.compression), "%s", compression);
+	}
+	return xisf_write(file_name, &metadata, (const uint8_t *)image_data);
+}
+
 preview_image* create_preview(indigo_property *property, indigo_item *item, const stretch_config_t sconfig) {
 	preview_image *preview = nullptr;
 	if (property->type == INDIGO_BLOB_VECTOR ) { //&& property->state == INDIGO_OK_STATE) {
@@ -960,17 +1742,33 @@ preview_image* create_preview(indigo_item *item, const stretch_config_t sconfig)
 	return create_preview((unsigned char*)item->blob.value, item->blob.size, item->blob.format, sconfig);
 }
 
+preview_image* create_preview(indigo_property *property, indigo_item *item, std::shared_ptr<char> blob_owner, bool blob_writable, const stretch_config_t sconfig) {
+	preview_image *preview = nullptr;
+	if (property->type == INDIGO_BLOB_VECTOR) {
+		preview = create_preview(item, blob_owner, blob_writable, sconfig);
+	}
+	return preview;
+}
+
+preview_image* create_preview(indigo_item *item, std::shared_ptr<char> blob_owner, bool blob_writable, const stretch_config_t sconfig) {
+	return create_preview(blob_owner, (unsigned char*)item->blob.value, item->blob.size, item->blob.format, sconfig, nullptr, blob_writable);
+}
+
 preview_image* create_preview(unsigned char *data, size_t size, const char* format, const stretch_config_t sconfig) {
+	return create_preview(nullptr, data, size, format, sconfig);
+}
+
+preview_image* create_preview(std::shared_ptr<char> data_owner, unsigned char *data, size_t size, const char* format, const stretch_config_t sconfig, const preview_band_cb &band_cb, bool data_writable) {
 	preview_image *preview = nullptr;
 	if (data != NULL && format != NULL) {
 		if ((((uint8_t *)data)[0] == 0xFF && ((uint8_t *)data)[1] == 0xD8 && ((uint8_t *)data)[2] == 0xFF)) {
 			preview = create_jpeg_preview(data, size);
 		} else if (!strncmp((const char*)data, "SIMPLE", 6)) {
-			preview = create_fits_preview(data, size, sconfig);
+			preview = create_fits_preview(data_owner, data, size, sconfig, band_cb, data_writable);
 		} else if (!strncmp((const char*)data, "RAW", 3)) {
-			preview = create_raw_preview(data, size, sconfig);
+			preview = create_raw_preview(data_owner, data, size, sconfig, band_cb);
 		} else if (!strncmp((const char*)data, "XISF0100", 8)) {
-			preview = create_xisf_preview(data, size, sconfig);
+			preview = create_xisf_preview(data_owner, data, size, sconfig, band_cb);
 		//} else if (!strncmp((const char*)data, "II*", 3) || !strncmp((const char*)data, "MM*", 3)) {
 		//	preview = create_tiff_preview(data, size);
 		} else if (format[0] != '\0') {
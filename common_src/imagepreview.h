@@ -27,6 +27,11 @@
 #include <coordconv.h>
 #include <stretcher.h>
 #include <memory>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
 
 #if !defined(INDIGO_WINDOWS)
 #define USE_LIBJPEG
@@ -35,6 +40,72 @@
 #include <jpeglib.h>
 #endif
 
+/* Half, quarter, ... size copies of a preview, used to draw it zoomed out. Level n is 1/2^n of the
+   preview and is built from level n-1 the first time it is asked for. While the preview is being
+   stretched a coarse level sampled from the raw frame stands in for all the levels (see stretch_preview()).
+   The levels are shared by the copies of a preview and may be asked for from any thread. */
+class preview_pyramid {
+public:
+	preview_pyramid(): m_sampled_level(0) {};
+
+	// the level to draw base at scale (< 1), a null image when base itself should be drawn,
+	// sampled_only when the pixels of base are not all stretched yet
+	QImage level_for_scale(const QImage &base, double scale, bool sampled_only = false);
+	void set_sampled_level(int level, const QImage &image);
+	// drops the sampled level and the built levels once the preview is fully stretched
+	void clear();
+
+private:
+	std::mutex m_mutex;
+	std::vector<QImage> m_levels;
+	int m_sampled_level;
+};
+
+#define PREVIEW_TILE_SIZE 512
+
+/* The pixels of a preview stretched one tile at a time (see create_tiled_preview()). The viewer stretches
+   the tiles it draws first and fills in the rest in the background, so a new stretch shows at once.
+   The tiles own the pixels and write them after the preview and its copies share them, so the previews
+   must not change them while tiles are pending (see preview_image::pixels_writable()).
+   Safe to use from several threads at once. */
+class preview_tiles {
+public:
+	preview_tiles(int width, int height, QImage::Format format, const Stretcher &stretcher, const char *raw_data, std::shared_ptr<char> raw_owner, std::shared_ptr<preview_pyramid> pyramid);
+
+	// stretches the tiles intersecting rect that are not stretched yet
+	void stretch(const QRect &rect);
+	// stretches all the pending tiles, returns early when cancelled is set
+	void stretch_all(const std::atomic<bool> &cancelled);
+	bool complete() const { return m_pending.load() == 0; }
+	// the pixels, valid where the tiles are stretched
+	const QImage &image() const { return m_image; }
+
+private:
+	enum { TILE_PENDING, TILE_BUSY, TILE_DONE };
+	void stretch_tile(int index);
+
+	QImage m_image;
+	uchar *m_bits;
+	Stretcher m_stretcher;
+	const uint8_t *m_raw_data;
+	std::shared_ptr<char> m_raw_owner;
+	std::shared_ptr<preview_pyramid> m_pyramid;
+	int m_columns;
+	int m_rows;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::vector<uint8_t> m_state;
+	std::atomic<int> m_pending;
+};
+
+/* The debayered frame of a full resolution CFA preview (see create_preview()), made the first time
+   something asks for it and shared by the copies of the preview. */
+struct preview_debayered {
+	std::mutex mutex;
+	std::shared_ptr<char> owner;
+	int pix_format;
+};
+
 class preview_image: public QImage {
 public:
 	preview_image():
@@ -103,6 +174,10 @@ public:
 
 		m_raw_owner = image.m_raw_owner; // share the underlying buffer
 		m_raw_data = image.m_raw_data;
+		m_pyramid = image.m_pyramid;
+		m_tiles = image.m_tiles;
+		m_histogram = image.m_histogram;
+		m_debayered = image.m_debayered;
 	};
 
 	preview_image& operator=(preview_image &image) {
@@ -121,6 +196,10 @@ public:
 		// share buffer instead of copying
 		m_raw_owner = image.m_raw_owner;
 		m_raw_data = image.m_raw_data;
+		m_pyramid = image.m_pyramid;
+		m_tiles = image.m_tiles;
+		m_histogram = image.m_histogram;
+		m_debayered = image.m_debayered;
 		return *this;
 	}
 
@@ -142,6 +221,9 @@ public:
 		}
 
 		if (x < 0 || x >= m_width || y < 0 || y >= m_height) return 0;
+		if (m_debayered) {
+			return debayered_pixel_value(x, y, r, g, b);
+		}
 		if (m_pix_format == PIX_FMT_Y8) {
 			uint8_t* pixels = (uint8_t*) m_raw_data;
 			r = pixels[y * m_width + x];
@@ -182,10 +264,40 @@ public:
 			r = pixels[3 * (y * m_width + x)];
 			g = pixels[3 * (y * m_width + x) + 1];
 			b = pixels[3 * (y * m_width + x) + 2];
+		} else if (m_pix_format == PIX_FMT_3RGB24) {
+			uint8_t* pixels = (uint8_t*) m_raw_data;
+			r = pixels[y * m_width + x];
+			g = pixels[(m_height + y) * m_width + x];
+			b = pixels[(2 * m_height + y) * m_width + x];
+		} else if (m_pix_format == PIX_FMT_3RGB48) {
+			uint16_t* pixels = (uint16_t*) m_raw_data;
+			r = pixels[y * m_width + x];
+			g = pixels[(m_height + y) * m_width + x];
+			b = pixels[(2 * m_height + y) * m_width + x];
+		} else if (m_pix_format == PIX_FMT_3RGB96) {
+			uint32_t* pixels = (uint32_t*) m_raw_data;
+			r = pixels[y * m_width + x];
+			g = pixels[(m_height + y) * m_width + x];
+			b = pixels[(2 * m_height + y) * m_width + x];
+		} else if (m_pix_format == PIX_FMT_3RGBF) {
+			float* pixels = (float*) m_raw_data;
+			r = pixels[y * m_width + x];
+			g = pixels[(m_height + y) * m_width + x];
+			b = pixels[(2 * m_height + y) * m_width + x];
 		}
 		return m_pix_format;
 	};
 
+	// false while the tiles of a tiled preview are still written into the pixels, painting on them or
+	// calling bits() would detach this copy and the pending tiles would never show up in it
+	bool pixels_writable() const {
+		return m_tiles == nullptr || m_tiles->complete();
+	}
+
+	// m_raw_data and m_pix_format as three channel pixels for the previews that keep a CFA frame,
+	// the frame is debayered on the first call. Returns m_raw_data as is for the other previews.
+	const char *debayered_data(int &pix_format) const;
+
 	void set_wcs_data(double center_ra, double center_dec, double telescope_ra, double telescope_dec, double rotation_angle, int parity, double pix_scale) {
 		m_center_ra = center_ra;
 		m_center_dec = center_dec;
@@ -261,20 +373,64 @@ public:
 	int m_parity;
 	double m_pix_scale;
 	StretchParams m_strech_params;
+	// zoomed out levels of this preview, replaced whenever the preview is stretched again
+	std::shared_ptr<preview_pyramid> m_pyramid;
+	// set while the pixels are stretched a tile at a time
+	std::shared_ptr<preview_tiles> m_tiles;
+	// median, MAD and min/max of the native pixels, taken on the first auto stretch and kept by every
+	// preview made from the same pixels, so another stretch level or balance does not read them again
+	std::shared_ptr<const ImageHistogram> m_histogram;
+	// set when m_raw_data is an 8 or 16 bit CFA frame shown at full resolution, its rows are
+	// debayered as they are stretched and the debayered frame is only kept once asked for
+	std::shared_ptr<preview_debayered> m_debayered;
+
+private:
+	int debayered_pixel_value(int x, int y, double &r, double &g, double &b) const;
 };
 
+/* Called on the calling thread each time a band of rows has been stretched into img,
+   rows_done rows from the top are final. Lets the caller show large frames as they fill in. */
+typedef std::function<void(preview_image *img, int rows_done)> preview_band_cb;
+
 int get_bayer_offsets(uint32_t pix_format);
 template <typename T> void parallel_debayer(T *input_buffer, int width, int height, int offsets, T *output_buffer);
 
-preview_image* create_jpeg_preview(unsigned char *jpg_buffer, unsigned long jpg_size);
+/* The preview builders keep all their state in the preview being built, so previews of different frames
+   (imager, guider, solver) can be built concurrently. stretch_preview() changes img in place, one thread
+   at a time may stretch or read a given preview. */
+
+/* scale_denom 2, 4 or 8 decodes at 1/2, 1/4 or 1/8 of the size in the DCT domain, which is much cheaper than
+   decoding at full size and scaling down. Safe to call from several threads at once. */
+preview_image* create_jpeg_preview(unsigned char *jpg_buffer, unsigned long jpg_size, int scale_denom = 1);
 preview_image* create_fits_preview(unsigned char *fits_buffer, unsigned long fits_size, const stretch_config_t sconfig);
+preview_image* create_fits_preview(std::shared_ptr<char> fits_owner, unsigned char *fits_buffer, unsigned long fits_size, const stretch_config_t sconfig, const preview_band_cb &band_cb = nullptr, bool fits_writable = false);
 preview_image* create_xisf_preview(unsigned char *xisf_buffer, unsigned long xisf_size, const stretch_config_t sconfig);
+preview_image* create_xisf_preview(std::shared_ptr<char> xisf_owner, unsigned char *xisf_buffer, unsigned long xisf_size, const stretch_config_t sconfig, const preview_band_cb &band_cb = nullptr);
 preview_image* create_raw_preview(unsigned char *raw_image_buffer, unsigned long raw_size, const stretch_config_t sconfig);
+preview_image* create_raw_preview(std::shared_ptr<char> raw_owner, unsigned char *raw_image_buffer, unsigned long raw_size, const stretch_config_t sconfig, const preview_band_cb &band_cb = nullptr);
 preview_image* create_preview(unsigned char *data, size_t size, const char* format, const stretch_config_t sconfig);
+/* When data_owner is set the decoders may keep pointers into data (e.g. a mapped file) instead of copying it.
+   data_writable means nobody else reads data any more, so it may also be converted in place (e.g. FITS byte swap). */
+preview_image* create_preview(std::shared_ptr<char> data_owner, unsigned char *data, size_t size, const char* format, const stretch_config_t sconfig, const preview_band_cb &band_cb = nullptr, bool data_writable = false);
 preview_image* create_preview(int width, int height, int pixel_format, char *image_data, const stretch_config_t sconfig);
-preview_image* create_preview(int width, int height, int pixel_format, std::shared_ptr<char> image_owner, char *image_data, const stretch_config_t sconfig);
+preview_image* create_preview(int width, int height, int pixel_format, std::shared_ptr<char> image_owner, char *image_data, const stretch_config_t sconfig, const preview_band_cb &band_cb = nullptr);
 preview_image* create_preview(indigo_property *property, indigo_item *item, const stretch_config_t sconfig);
 preview_image* create_preview(indigo_item *item, const stretch_config_t sconfig);
-void stretch_preview(preview_image *img, const stretch_config_t sconfig);
+/* blob_owner owns item->blob.value, the preview keeps a reference to it instead of copying the pixels */
+preview_image* create_preview(indigo_property *property, indigo_item *item, std::shared_ptr<char> blob_owner, bool blob_writable, const stretch_config_t sconfig);
+preview_image* create_preview(indigo_item *item, std::shared_ptr<char> blob_owner, bool blob_writable, const stretch_config_t sconfig);
+void stretch_preview(preview_image *img, const stretch_config_t sconfig, const preview_band_cb &band_cb = nullptr);
+/* Statistics of the native pixels of img, taken from the histogram kept in img when it has one */
+ImageStats preview_stats(preview_image *img);
+/* Like create_preview() of native pixels but only computes the stretch and a coarse zoomed out level,
+   the pixels are stretched through m_tiles as they are drawn. histogram is the m_histogram of an earlier
+   preview of image_data, if any. CFA frames kept by the preview are debayered and stretched at once,
+   other frames that need converting fall back to create_preview(). */
+preview_image* create_tiled_preview(int width, int height, int pixel_format, std::shared_ptr<char> image_owner, char *image_data, const stretch_config_t sconfig, std::shared_ptr<const ImageHistogram> histogram = nullptr);
+/* Writes native pixels as FITS and returns a fits_error, cards are extra header cards (see fits_write()).
+   Does not use the preview, so it can run on a worker thread while image_data is kept alive. */
+int save_fits_image(const char *file_name, int width, int height, int pixel_format, const char *image_data, const char *const *cards = nullptr);
+/* Like save_fits_image() but writes XISF compressed as set by compression (see xisf_write()), returns a xisf_error */
+int save_xisf_image(const char *file_name, int width, int height, int pixel_format, const char *image_data, const char *compression = nullptr);
 
 #endif /* _IMAGEPREVIEW_H */
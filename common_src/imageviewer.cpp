@@ -5,6 +5,10 @@
 #include <QActionGroup>
 #include <QGraphicsView>
 #include <QGraphicsSceneHoverEvent>
+#include <QStyleOptionGraphicsItem>
+#include <QPainter>
+#include <QFutureWatcher>
+#include <QtConcurrentRun>
 #include <QWheelEvent>
 #include <QApplication>
 #include <QVBoxLayout>
@@ -347,6 +351,29 @@ void ImageViewer::makeToolbar(bool show_prev_next, bool show_debayer) {
 	debayer_group->addAction(act);
 	m_debayer_act[DEBAYER_BGGR] = act;
 
+	sub_menu->addSeparator();
+
+	QActionGroup *debayer_mode_group = new QActionGroup(this);
+	debayer_mode_group->setExclusive(true);
+	act = sub_menu->addAction("B&ilinear");
+	act->setCheckable(true);
+	act->setChecked(true);
+	connect(act, &QAction::triggered, this, &ImageViewer::debayerBilinear);
+	debayer_mode_group->addAction(act);
+	m_debayer_mode_act[DEBAYER_MODE_BILINEAR] = act;
+
+	act = sub_menu->addAction("&Superpixel (half size)");
+	act->setCheckable(true);
+	connect(act, &QAction::triggered, this, &ImageViewer::debayerSuperpixel);
+	debayer_mode_group->addAction(act);
+	m_debayer_mode_act[DEBAYER_MODE_SUPERPIXEL] = act;
+
+	act = sub_menu->addAction("Binned &Luma (half size)");
+	act->setCheckable(true);
+	connect(act, &QAction::triggered, this, &ImageViewer::debayerBinnedLuma);
+	debayer_mode_group->addAction(act);
+	m_debayer_mode_act[DEBAYER_MODE_BINNED_LUMA] = act;
+
 	m_stretch_button = new QToolButton(this);
 	m_stretch_button->setToolTip(tr("Histogram stretching / Background neutralization / Debayer"));
 	m_stretch_button->setIcon(QIcon(":resource/histogram.png"));
@@ -427,6 +454,10 @@ void ImageViewer::showStackButton(bool show) {
 		if (m_debayer_act[i])
 			m_debayer_act[i]->setEnabled(!show);
 	}
+	for (int i = 0; i < DEBAYER_MODE_COUNT; ++i) {
+		if (m_debayer_mode_act[i])
+			m_debayer_mode_act[i]->setEnabled(!show);
+	}
 	// When the stack button is hidden the user has no way to switch back to
 	// Stack mode, so reset the internal flag to Frame.  This keeps
 	// isShowingStack() consistent with the visible UI state.
@@ -484,6 +515,7 @@ void ImageViewer::setImageStats(const ImageStats &stats) {
 		stats_str += "<tr><td><b>Min </b></td><td align=right> " + QString::number(stats.grey_red.min) + "</td></tr>";
 		stats_str += "<tr><td><b>Max </b></td><td align=right> " + QString::number(stats.grey_red.max) + "</td></tr>";
 		stats_str += "<tr><td><b>Mean </b></td><td align=right> " + QString::number(stats.grey_red.mean) + "</td></tr>";
+		stats_str += "<tr><td><b>Median </b></td><td align=right> " + QString::number(stats.grey_red.median) + "</td></tr>";
 		stats_str += "<tr><td><b>StdDev </b></td><td align=right> " + QString::number(stats.grey_red.stddev) + "</td></tr>";
 		stats_str += "<tr><td><b>MAD </b></td><td align=right> "  + QString::number(stats.grey_red.mad) + "</td></tr>";
 		stats_str += "</table>";
@@ -525,6 +557,12 @@ void ImageViewer::setImageStats(const ImageStats &stats) {
 		stats_str += "<td align=right><font color=\"#5050FF\"> " + QString::number(stats.blue.mean) + " </font></td>";
 		stats_str += "</tr>";
 
+		stats_str += "<tr><td><b>Median </b></td>";
+		stats_str += "<td align=right><font color=\"#C05050\"> " + QString::number(stats.grey_red.median) + " </font></td>";
+		stats_str += "<td align=right><font color=\"#50C050\"> " + QString::number(stats.green.median) + " </font></td>";
+		stats_str += "<td align=right><font color=\"#5050FF\"> " + QString::number(stats.blue.median) + " </font></td>";
+		stats_str += "</tr>";
+
 		stats_str += "<tr><td><b>StdDev </b></td>";
 		stats_str += "<td align=right><font color=\"#C05050\"> " + QString::number(stats.grey_red.stddev) + " </font></td>";
 		stats_str += "<td align=right><font color=\"#50C050\"> " + QString::number(stats.green.stddev) + " </font></td>";
@@ -579,7 +617,7 @@ void ImageViewer::setToolTip(const QString &txt) {
 void ImageViewer::showSelection(bool show) {
 	if (show) {
 		m_selection_visible = true;
-		if (!m_pixmap->pixmap().isNull() && !m_selection_p.isNull()) {
+		if (!m_pixmap->image().isNull() && !m_selection_p.isNull()) {
 			m_selection->setVisible(true);
 		}
 	} else {
@@ -595,14 +633,14 @@ void ImageViewer::moveResizeSelection(double x, double y, int size) {
 	m_selection_p.setX(x);
 	m_selection_p.setY(y);
 
-	if (!m_pixmap->pixmap().isNull() && ((cor_x < 0) || (cor_y < 0) ||
-		(cor_x > m_pixmap->pixmap().width() - size + 1) ||
-		(cor_y > m_pixmap->pixmap().height() - size + 1))) {
+	if (!m_pixmap->image().isNull() && ((cor_x < 0) || (cor_y < 0) ||
+		(cor_x > m_pixmap->image().width() - size + 1) ||
+		(cor_y > m_pixmap->image().height() - size + 1))) {
 		m_selection->setVisible(false);
 		return;
 	}
 	indigo_debug("%s(): %.2f -> %.2f, %.2f -> %.2f, %d", __FUNCTION__, x, cor_x, y, cor_y, size);
-	if (m_selection_p.isNull() || m_pixmap->pixmap().isNull()) {
+	if (m_selection_p.isNull() || m_pixmap->image().isNull()) {
 		m_selection->setVisible(false);
 	} else if (m_selection_visible){
 		m_selection->setVisible(true);
@@ -616,9 +654,9 @@ void ImageViewer::moveSelection(double x, double y) {
 	double cor_x = x - (br.width() - 1) / 2.0;
 	double cor_y = y - (br.height() - 1) / 2.0;
 
-	if (!m_pixmap->pixmap().isNull() && ((cor_x < 0) || (cor_y < 0) ||
-		(cor_x > m_pixmap->pixmap().width() - (int)br.width() + 1) ||
-		(cor_y > m_pixmap->pixmap().height() - (int)br.height() + 1))) {
+	if (!m_pixmap->image().isNull() && ((cor_x < 0) || (cor_y < 0) ||
+		(cor_x > m_pixmap->image().width() - (int)br.width() + 1) ||
+		(cor_y > m_pixmap->image().height() - (int)br.height() + 1))) {
 		return;
 	}
 	indigo_debug("%s(): %.2f -> %.2f, %.2f -> %.2f, %d", __FUNCTION__, x, cor_x, y, cor_y, (int)br.width()-1);
@@ -631,7 +669,7 @@ void ImageViewer::showExtraSelection(bool show) {
 	m_extra_selections_visible = show;
 	QList<AntialiasedEllipseItem*>::iterator sel;
 	for (sel = m_extra_selections.begin(); sel != m_extra_selections.end(); ++sel) {
-		if (!m_pixmap->pixmap().isNull()) (*sel)->setVisible(show);
+		if (!m_pixmap->image().isNull()) (*sel)->setVisible(show);
 		else (*sel)->setVisible(false);
 	}
 }
@@ -653,7 +691,7 @@ void ImageViewer::moveResizeExtraSelection(QList<QPointF> &point_list, int size)
 		selection->setBrush(QBrush(Qt::NoBrush));
 		selection->setPen(pen);
 		selection->setOpacity(0.7);
-		if (x <= size / 2.0 || y <= size / 2.0 || !m_extra_selections_visible || m_pixmap->pixmap().isNull()) {
+		if (x <= size / 2.0 || y <= size / 2.0 || !m_extra_selections_visible || m_pixmap->image().isNull()) {
 			selection->setVisible(false);
 		} else {
 			selection->setVisible(true);
@@ -665,7 +703,7 @@ void ImageViewer::moveResizeExtraSelection(QList<QPointF> &point_list, int size)
 void ImageViewer::showReference(bool show) {
 	if (show) {
 		m_ref_visible = true;
-		if (!m_pixmap->pixmap().isNull() && !m_ref_p.isNull()) {
+		if (!m_pixmap->image().isNull() && !m_ref_p.isNull()) {
 			m_ref_x->setVisible(true);
 			m_ref_y->setVisible(true);
 		}
@@ -677,11 +715,11 @@ void ImageViewer::showReference(bool show) {
 }
 
 void ImageViewer::centerReference() {
-	double x_len = m_pixmap->pixmap().width();
-	double y_len = m_pixmap->pixmap().height();
+	double x_len = m_pixmap->image().width();
+	double y_len = m_pixmap->image().height();
 	double x = x_len / 2;
 	double y = y_len / 2;
-	if (m_pixmap->pixmap().isNull()) {
+	if (m_pixmap->image().isNull()) {
 		return;
 	}
 	indigo_debug("X = %.2f, Y = %.2f, X_len = %.2f, y_len = %.2f", x, y, x_len, y_len);
@@ -702,9 +740,9 @@ void ImageViewer::centerReference() {
 void ImageViewer::moveReference(double x, double y) {
 	double cor_x = x;
 	double cor_y = y;
-	double x_len = m_pixmap->pixmap().width();
-	double y_len = m_pixmap->pixmap().height();
-	if (!m_pixmap->pixmap().isNull() && ((cor_x < 0) || (cor_y < 0) || (cor_x > x_len) || (cor_y > y_len))) {
+	double x_len = m_pixmap->image().width();
+	double y_len = m_pixmap->image().height();
+	if (!m_pixmap->image().isNull() && ((cor_x < 0) || (cor_y < 0) || (cor_x > x_len) || (cor_y > y_len))) {
 		return;
 	}
 	indigo_debug("X = %.2f, Y = %.2f, X_len = %.2f, y_len = %.2f", cor_x, cor_y, x_len, y_len);
@@ -729,7 +767,7 @@ void ImageViewer::showWCS(bool show) {
 void ImageViewer::showEdgeClipping(bool show) {
 	if (show) {
 		m_edge_clipping_visible = true;
-		if (!m_pixmap->pixmap().isNull()) {
+		if (!m_pixmap->image().isNull()) {
 			m_edge_clipping->setVisible(true);
 		}
 	} else {
@@ -743,17 +781,17 @@ void ImageViewer::resizeEdgeClipping(double edge_clipping) {
 
 	if (!m_pixmap) return;
 
-	double width = m_pixmap->pixmap().width() - 2 * edge_clipping;
-	double height = m_pixmap->pixmap().height() - 2 * edge_clipping;
+	double width = m_pixmap->image().width() - 2 * edge_clipping;
+	double height = m_pixmap->image().height() - 2 * edge_clipping;
 
 	indigo_debug("%s(): width = %.2f, height = %.2f, edge_clipping = %.2f", __FUNCTION__, width, height, edge_clipping);
 
 	if (width <= 1 || height <= 1) {
-		int ech = m_pixmap->pixmap().height() / 2;
-		int ecw = m_pixmap->pixmap().width() / 2;
+		int ech = m_pixmap->image().height() / 2;
+		int ecw = m_pixmap->image().width() / 2;
 		edge_clipping = (ecw < ech) ? ecw : ech;
-		width = m_pixmap->pixmap().width() - 2 * edge_clipping + 1;
-		height = m_pixmap->pixmap().height() - 2 * edge_clipping + 1;
+		width = m_pixmap->image().width() - 2 * edge_clipping + 1;
+		height = m_pixmap->image().height() - 2 * edge_clipping + 1;
 	} else if (m_edge_clipping_visible){
 		m_edge_clipping->setVisible(true);
 	}
@@ -770,7 +808,7 @@ void ImageViewer::onSetImage(preview_image &im) {
 	// clear any existing inspection overlay immediately before updating the image
 	if (m_inspection_overlay) m_inspection_overlay->clearInspection();
 	m_pixmap->setImage(im);
-	if (!m_pixmap->pixmap().isNull()) {
+	if (!m_pixmap->image().isNull()) {
 		if (m_selection_visible && !m_selection_p.isNull()) {
 			m_selection->setVisible(true);
 		} else {
@@ -963,7 +1001,7 @@ void ImageViewer::mouseAt(double x, double y) {
 					.arg(x, 5, 'f', 1)
 					.arg(y, 5, 'f', 1);
 
-			} else if (pix_format == PIX_FMT_F32 || pix_format == PIX_FMT_RGBF){
+			} else if (pix_format == PIX_FMT_F32 || pix_format == PIX_FMT_RGBF || pix_format == PIX_FMT_3RGBF){
 				if (g == -1) {
 					s = QString("%1% [%2, %3] (%4)")
 						.arg(m_zoom_level, 0, 'f', 0)
@@ -1278,6 +1316,18 @@ void ImageViewer::debayerBGGR() {
 	emit debayerChanged(BAYER_PAT_BGGR);
 }
 
+void ImageViewer::debayerBilinear() {
+	emit debayerModeChanged(DEBAYER_MODE_BILINEAR);
+}
+
+void ImageViewer::debayerSuperpixel() {
+	emit debayerModeChanged(DEBAYER_MODE_SUPERPIXEL);
+}
+
+void ImageViewer::debayerBinnedLuma() {
+	emit debayerModeChanged(DEBAYER_MODE_BINNED_LUMA);
+}
+
 void ImageViewer::onAutoBalance() {
 	emit BalanceChanged(COLOR_BALANCE_AUTO);
 }
@@ -1355,6 +1405,23 @@ void ImageViewer::setDebayer(uint32_t bayer_pat) {
 	}
 }
 
+void ImageViewer::setDebayer(uint32_t bayer_pat, int debayer_mode) {
+	setDebayer(bayer_pat);
+	switch (debayer_mode) {
+		case DEBAYER_MODE_SUPERPIXEL:
+			m_debayer_mode_act[DEBAYER_MODE_SUPERPIXEL]->setChecked(true);
+			debayerSuperpixel();
+			break;
+		case DEBAYER_MODE_BINNED_LUMA:
+			m_debayer_mode_act[DEBAYER_MODE_BINNED_LUMA]->setChecked(true);
+			debayerBinnedLuma();
+			break;
+		default:
+			m_debayer_mode_act[DEBAYER_MODE_BILINEAR]->setChecked(true);
+			debayerBilinear();
+	}
+}
+
 void ImageViewer::setBalance(int balance) {
 	switch (balance) {
 		case COLOR_BALANCE_AUTO:
@@ -1388,20 +1455,40 @@ QRect ImageViewer::getImageFrameRect() const {
 }
 
 PixmapItem::PixmapItem(QGraphicsItem *parent) :
-	QObject(), QGraphicsPixmapItem(parent), m_is_double_click(false)
+	QObject(), QGraphicsPixmapItem(parent), m_is_double_click(false), m_level_key(0)
 {
 	//setTransformationMode(Qt::SmoothTransformation);
 	setAcceptHoverEvents(true);
+	// paint() gets the exposed rect, only the visible tiles of a tiled preview are stretched
+	setFlag(QGraphicsItem::ItemUsesExtendedStyleOption);
 }
 
 void PixmapItem::setImage(preview_image im) {
 	//if (im.isNull()) return;
 
 	auto image_size = m_image.size();
+	if (image_size != im.size())
+		prepareGeometryChange();
+	if (m_tiles_cancelled) {
+		*m_tiles_cancelled = true;
+	}
+	m_tiles.reset();
+	m_tiles_cancelled.reset();
 	m_image = im;
 	indigo_debug("%s MIMAGE m_raw_data = %p",__FUNCTION__, m_image.m_raw_data);
+	if (!m_image.m_pyramid) {
+		m_image.m_pyramid = std::make_shared<preview_pyramid>();
+	}
+	m_level_pixmap = QPixmap();
+	m_level_key = 0;
 
-	setPixmap(QPixmap::fromImage(m_image));
+	if (m_image.m_tiles && !m_image.m_tiles->complete()) {
+		// the pixels are stretched as they are drawn, no pixmap is made until all of them are
+		setPixmap(QPixmap());
+		fillTiles();
+	} else {
+		setPixmap(QPixmap::fromImage(m_image));
+	}
 
 	if (image_size != m_image.size())
 		emit sizeChanged(m_image.width(), m_image.height());
@@ -1409,6 +1496,66 @@ void PixmapItem::setImage(preview_image im) {
 	emit imageChanged(m_image);
 }
 
+QRectF PixmapItem::boundingRect() const {
+	if (m_image.isNull()) return QRectF();
+	return QRectF(offset(), QSizeF(m_image.size()));
+}
+
+QPainterPath PixmapItem::shape() const {
+	QPainterPath path;
+	path.addRect(boundingRect());
+	return path;
+}
+
+// The rest of a tiled preview is stretched on a worker, the pixmap is made once all the tiles are done
+void PixmapItem::fillTiles() {
+	std::shared_ptr<preview_tiles> tiles = m_image.m_tiles;
+	std::shared_ptr<std::atomic<bool>> cancelled = std::make_shared<std::atomic<bool>>(false);
+	m_tiles = tiles;
+	m_tiles_cancelled = cancelled;
+	QFutureWatcher<void> *watcher = new QFutureWatcher<void>(this);
+	connect(watcher, &QFutureWatcher<void>::finished, this, [this, watcher, tiles]() {
+		watcher->deleteLater();
+		if (m_tiles == tiles && tiles->complete()) {
+			m_tiles.reset();
+			m_tiles_cancelled.reset();
+			setPixmap(QPixmap::fromImage(tiles->image()));
+		}
+	});
+	watcher->setFuture(QtConcurrent::run([tiles, cancelled]() {
+		tiles->stretch_all(*cancelled);
+	}));
+}
+
+// Zoomed out the image is drawn from the pyramid level closest above the view scale,
+// so Qt scales it down by less than 2x instead of scaling the full frame on every paint.
+// While a tiled preview is filled in, the visible tiles are stretched here before they are drawn.
+void PixmapItem::paint(QPainter *painter, const QStyleOptionGraphicsItem *option, QWidget *widget) {
+	if (m_image.isNull()) {
+		return;
+	}
+	const qreal scale = QStyleOptionGraphicsItem::levelOfDetailFromTransform(painter->worldTransform());
+	painter->setRenderHint(QPainter::SmoothPixmapTransform, transformationMode() == Qt::SmoothTransformation);
+	QImage level;
+	if (scale < 0.5 && m_image.m_pyramid) {
+		// the pending tiles leave holes in the pixels, only a sampled level shows the whole frame until they are done
+		level = m_image.m_pyramid->level_for_scale(m_image, scale, m_tiles && !m_tiles->complete());
+	}
+	if (!level.isNull()) {
+		if (level.cacheKey() != m_level_key) {
+			m_level_pixmap = QPixmap::fromImage(level);
+			m_level_key = level.cacheKey();
+		}
+		painter->drawPixmap(boundingRect(), m_level_pixmap, QRectF(m_level_pixmap.rect()));
+	} else if (m_tiles) {
+		const QRect exposed = option->exposedRect.toAlignedRect().intersected(m_tiles->image().rect());
+		m_tiles->stretch(exposed);
+		painter->drawImage(QRectF(exposed).translated(offset()), m_tiles->image(), QRectF(exposed));
+	} else {
+		QGraphicsPixmapItem::paint(painter, option, widget);
+	}
+}
+
 void PixmapItem::mousePressEvent(QGraphicsSceneMouseEvent *event) {
 	if(event->button() == Qt::RightButton) {
 		auto pos = event->pos();
@@ -65,6 +65,8 @@ public:
 	void enableAntialiasing(bool on = true);
 	void setStretch(int level);
 	void setDebayer(uint32_t bayer_pat);
+	// debayer_mode is DEBAYER_MODE_XXX, the reduced modes give half size previews
+	void setDebayer(uint32_t bayer_pat, int debayer_mode);
 	void setBalance(int Balance);
 	void showStretchButton(bool show);
 	void showZoomButtons(bool show);
@@ -120,6 +122,9 @@ public slots:
 	void debayerGRBG();
 	void debayerRGGB();
 	void debayerBGGR();
+	void debayerBilinear();
+	void debayerSuperpixel();
+	void debayerBinnedLuma();
 
 	void onAutoBalance();
 	void onNoBalance();
@@ -145,6 +150,7 @@ signals:
 	void zoomChanged(double scale);
 	void stretchChanged(int level);
 	void debayerChanged(uint32_t bayer_pat);
+	void debayerModeChanged(int debayer_mode);
 	void BalanceChanged(int balance);
 	void previousRequested();
 	void nextRequested();
@@ -201,6 +207,7 @@ private:
 	QToolButton *m_zoomin_button;
 	QAction *m_stretch_act[PREVIEW_STRETCH_COUNT];
 	QAction *m_debayer_act[DEBAYER_COUNT];
+	QAction *m_debayer_mode_act[DEBAYER_MODE_COUNT];
 	QAction *m_color_reference_act[COLOR_BALANCE_COUNT];
 	SNROverlay *m_snr_overlay;
 	ImageInspectorOverlay *m_inspection_overlay;
@@ -227,6 +234,9 @@ class PixmapItem : public QObject, public QGraphicsPixmapItem {
 public:
 	PixmapItem(QGraphicsItem *parent = nullptr);
 	const preview_image & image() const { return m_image; }
+	// the item is as large as the image, the pixmap stays empty while the tiles are filled in
+	QRectF boundingRect() const override;
+	QPainterPath shape() const override;
 
 public slots:
 	void setImage(preview_image im);
@@ -240,6 +250,7 @@ signals:
 	void mouseMoved(double x, double y);
 
 protected:
+	void paint(QPainter *painter, const QStyleOptionGraphicsItem *option, QWidget *widget) override;
 	void mousePressEvent(QGraphicsSceneMouseEvent *) override;
 	void mouseReleaseEvent(QGraphicsSceneMouseEvent *) override;
 	void mouseDoubleClickEvent(QGraphicsSceneMouseEvent *) override;
@@ -248,6 +259,14 @@ protected:
 private:
 	preview_image m_image;
 	bool m_is_double_click;
+	// the pyramid level drawn when zoomed out, kept until the image or the level changes
+	QPixmap m_level_pixmap;
+	qint64 m_level_key;
+	// the tiles of m_image still being stretched in the background, set stops the fill
+	std::shared_ptr<preview_tiles> m_tiles;
+	std::shared_ptr<std::atomic<bool>> m_tiles_cancelled;
+
+	void fillTiles();
 };
 
 #endif // IMAGEVIEWER_H
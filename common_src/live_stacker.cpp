@@ -22,9 +22,8 @@
 #include <algorithm>
 #include <numeric>
 #include <limits>
-#include <thread>
-#include <future>
 #include <utils.h>
+#include <pixel_layout.h>
 #include <chrono>
 
 // ---------------------------------------------------------------------------
@@ -142,7 +141,10 @@ static int channelsForFormat(int pix_format) {
 		case PIX_FMT_F32:   return 1;
 		case PIX_FMT_RGB24:
 		case PIX_FMT_RGB48:
-		case PIX_FMT_RGBF:  return 3;
+		case PIX_FMT_RGBF:
+		case PIX_FMT_3RGB24:
+		case PIX_FMT_3RGB48:
+		case PIX_FMT_3RGBF:  return 3;
 		default:            return 0;
 	}
 }
@@ -155,6 +157,9 @@ static int bytesPerSample(int pix_format) {
 		case PIX_FMT_RGB24: return 1;
 		case PIX_FMT_RGB48: return 2;
 		case PIX_FMT_RGBF:  return 4;
+		case PIX_FMT_3RGB24: return 1;
+		case PIX_FMT_3RGB48: return 2;
+		case PIX_FMT_3RGBF:  return 4;
 		default:            return 0;
 	}
 }
@@ -190,8 +195,10 @@ void LiveStacker::resetStack() {
 // ---------------------------------------------------------------------------
 // parallelSum
 //
-// Chunked parallel reduction of f(i) over [0, total).  Each thread keeps a
-// private partial sum, so there is no sharing on the hot path and no atomics.
+// Chunked parallel reduction of f(i) over [0, total) on the shared pool.
+// Each chunk keeps a private partial sum, so there is no sharing on the hot
+// path and no atomics; the partial sums are added in chunk order, so the
+// result does not depend on the scheduling.
 //
 // The summation order differs from a serial loop, so results are not
 // bit-identical to it — for the mean and variance estimates below that is
@@ -200,28 +207,12 @@ void LiveStacker::resetStack() {
 // ---------------------------------------------------------------------------
 
 template <typename F>
-static double parallelSum(size_t total, int num_threads, F f) {
-	if (total == 0) return 0.0;
-
-	std::vector<double> partial(static_cast<size_t>(num_threads), 0.0);
-	std::vector<std::thread> threads;
-	const size_t chunk = static_cast<size_t>(std::ceil(total / (double)num_threads));
-	double *partialData = partial.data();
-
-	for (int rank = 0; rank < num_threads; rank++) {
-		threads.emplace_back([=]() {
-			const size_t start = chunk * static_cast<size_t>(rank);
-			const size_t end = std::min(start + chunk, total);
-			double s = 0.0;
-			for (size_t i = start; i < end; ++i) s += f(i);
-			partialData[rank] = s;
-		});
-	}
-	for (auto &t : threads) t.join();
-
-	double sum = 0.0;
-	for (double v : partial) sum += v;
-	return sum;
+static double parallelSum(size_t total, F f) {
+	return parallel_reduce(0, total, 0.0, [&f](size_t start, size_t end) {
+		double s = 0.0;
+		for (size_t i = start; i < end; ++i) s += f(i);
+		return s;
+	}, [](double a, double b) { return a + b; });
 }
 
 // ---------------------------------------------------------------------------
@@ -236,100 +227,91 @@ std::vector<float> LiveStacker::buildLuminanceMap(preview_image *image, int ds)
 	const int H = image->m_height;
 	const int dW = W / ds;
 	const int dH = H / ds;
-	const char *raw = image->m_raw_data;
+	int pix_format = 0;
+	const char *raw = image->debayered_data(pix_format);
+	// planar frames keep one full plane per channel
+	const bool planar = pix_format_is_planar(m_pix_format);
+	const int pixel_stride = planar ? 1 : 3;
+	const size_t channel_stride = planar ? static_cast<size_t>(W) * H : 1;
 
 	std::vector<float> lum(static_cast<size_t>(dW) * dH, 0.0f);
 
-	int num_threads = get_number_of_cores();
-	num_threads = (num_threads > 0) ? num_threads : AIN_DEFAULT_THREADS;
-	std::vector<std::thread> threads;
 	float *lumData = lum.data();
 
-	for (int rank = 0; rank < num_threads; rank++) {
-		const int chunk = static_cast<int>(std::ceil(dH / (double)num_threads));
-		threads.emplace_back([=]() {
-			const int start_by = chunk * rank;
-			const int end_by = std::min(start_by + chunk, dH);
-			for (int by = start_by; by < end_by; ++by) {
-				for (int bx = 0; bx < dW; ++bx) {
-					double sum = 0.0;
-					int cnt = 0;
-					for (int dy = 0; dy < ds; ++dy) {
-						int y = by * ds + dy;
-						if (y >= H) continue;
-						for (int dx = 0; dx < ds; ++dx) {
-							int x = bx * ds + dx;
-							if (x >= W) continue;
-							int idx = y * W + x;
-							double val;
-							if (m_channels == 1) {
-								switch (m_pix_format) {
-									case PIX_FMT_Y8:
-										val = reinterpret_cast<const uint8_t*>(raw)[idx];
-										break;
-									case PIX_FMT_Y16:
-										val = reinterpret_cast<const uint16_t*>(raw)[idx];
-										break;
-									default:
-										val = reinterpret_cast<const float*>(raw)[idx];
-										break;
+	parallel_for(0, dH, [=](size_t start_by, size_t end_by) {
+		for (int by = start_by; by < (int)end_by; ++by) {
+			for (int bx = 0; bx < dW; ++bx) {
+				double sum = 0.0;
+				int cnt = 0;
+				for (int dy = 0; dy < ds; ++dy) {
+					int y = by * ds + dy;
+					if (y >= H) continue;
+					for (int dx = 0; dx < ds; ++dx) {
+						int x = bx * ds + dx;
+						if (x >= W) continue;
+						int idx = y * W + x;
+						double val;
+						if (m_channels == 1) {
+							switch (m_pix_format) {
+								case PIX_FMT_Y8:
+									val = reinterpret_cast<const uint8_t*>(raw)[idx];
+									break;
+								case PIX_FMT_Y16:
+									val = reinterpret_cast<const uint16_t*>(raw)[idx];
+									break;
+								default:
+									val = reinterpret_cast<const float*>(raw)[idx];
+									break;
+							}
+						} else {
+							size_t base = static_cast<size_t>(idx) * pixel_stride;
+							double r, g, b;
+							switch (m_pix_format) {
+								case PIX_FMT_RGB24:
+								case PIX_FMT_3RGB24: {
+									const auto *p = reinterpret_cast<const uint8_t *>(raw);
+									r=p[base];
+									g=p[base+channel_stride];
+									b=p[base+2*channel_stride];
+									break;
+								}
+								case PIX_FMT_RGB48:
+								case PIX_FMT_3RGB48: {
+									const auto *p = reinterpret_cast<const uint16_t*>(raw);
+									r=p[base];
+									g=p[base+channel_stride];
+									b=p[base+2*channel_stride];
+									break;
 								}
-							} else {
-								int base = idx * 3;
-								double r, g, b;
-								switch (m_pix_format) {
-									case PIX_FMT_RGB24: {
-										const auto *p = reinterpret_cast<const uint8_t *>(raw);
-										r=p[base];
-										g=p[base+1];
-										b=p[base+2];
-										break;
-									}
-									case PIX_FMT_RGB48: {
-										const auto *p = reinterpret_cast<const uint16_t*>(raw);
-										r=p[base];
-										g=p[base+1];
-										b=p[base+2];
-										break;
-									}
-									default: {
-										const auto *p = reinterpret_cast<const float*>(raw);
-										r=p[base];
-										g=p[base+1];
-										b=p[base+2];
-										break;
-									}
+								default: {
+									const auto *p = reinterpret_cast<const float*>(raw);
+									r=p[base];
+									g=p[base+channel_stride];
+									b=p[base+2*channel_stride];
+									break;
 								}
-								val = 0.2126*r + 0.7152*g + 0.0722*b;
 							}
-							sum += val;
-							++cnt;
+							val = 0.2126*r + 0.7152*g + 0.0722*b;
 						}
+						sum += val;
+						++cnt;
 					}
-					lumData[by * dW + bx] = (cnt > 0) ? static_cast<float>(sum / cnt) : 0.0f;
 				}
+				lumData[by * dW + bx] = (cnt > 0) ? static_cast<float>(sum / cnt) : 0.0f;
 			}
-		});
-	}
-	for (auto &t : threads) t.join();
+		}
+	});
 
 	const size_t total = static_cast<size_t>(dW) * dH;
-	const double mean = parallelSum(total, num_threads, [=](size_t i) {
+	const double mean = parallelSum(total, [=](size_t i) {
 		return static_cast<double>(lumData[i]);
 	}) / static_cast<double>(total);
 
-	threads.clear();
-	for (int rank = 0; rank < num_threads; rank++) {
-		const size_t chunk = static_cast<size_t>(std::ceil(total / (double)num_threads));
-		threads.emplace_back([=]() {
-			const size_t start = chunk * rank;
-			const size_t end = std::min(start + chunk, total);
-			for (size_t i = start; i < end; ++i) {
-				lumData[i] = static_cast<float>(lumData[i] - mean);
-			}
-		});
-	}
-	for (auto &t : threads) t.join();
+	parallel_for(0, total, [=](size_t start, size_t end) {
+		for (size_t i = start; i < end; ++i) {
+			lumData[i] = static_cast<float>(lumData[i] - mean);
+		}
+	});
 
 	return lum;
 }
@@ -345,45 +327,46 @@ std::vector<float> LiveStacker::buildLuminanceMap(preview_image *image, int ds)
 // index arithmetic folds to constants, and the vectoriser can see the access
 // pattern.
 //
+// Planar (FITS) colour frames are read in place: PLANAR selects the sample
+// layout at compile time as well, so the source pixel stride is CH for
+// interleaved data and 1 for planar data, where the channels are W*H apart.
+//
 // Each kernel also takes an unclamped fast path whenever the whole
 // interpolation footprint lies inside the frame, which is every pixel except a
 // 1-2 px border and the region that maps outside the source frame entirely.
 // ---------------------------------------------------------------------------
 
-template <typename T, int CH>
+template <typename T, int CH, bool PLANAR>
 static inline double fetchClamped(const T *src, int W, int H, int sx, int sy, int ch) {
+	constexpr int PS = PLANAR ? 1 : CH;
+	const size_t cs = PLANAR ? static_cast<size_t>(W) * H : 1;
 	sx = std::max(0, std::min(W - 1, sx));
 	sy = std::max(0, std::min(H - 1, sy));
-	return static_cast<double>(src[(static_cast<size_t>(sy) * W + sx) * CH + ch]);
+	return static_cast<double>(src[(static_cast<size_t>(sy) * W + sx) * PS + ch * cs]);
 }
 
-// Run @p body(y) for every row in [0, H), split across @p num_threads.
+// Run @p body(y) for every row in [0, H) on the shared pool.
 template <typename F>
-static void parallelRows(int H, int num_threads, F body) {
-	std::vector<std::thread> threads;
-	const int chunk = static_cast<int>(std::ceil(H / (double)num_threads));
-	for (int rank = 0; rank < num_threads; rank++) {
-		threads.emplace_back([=]() {
-			const int start_row = chunk * rank;
-			const int end_row = std::min(start_row + chunk, H);
-			for (int y = start_row; y < end_row; ++y) body(y);
-		});
-	}
-	for (auto &t : threads) t.join();
+static void parallelRows(int H, F body) {
+	parallel_for(0, H, [&body](size_t start_row, size_t end_row) {
+		for (int y = start_row; y < (int)end_row; ++y) body(y);
+	});
 }
 
 // ---------------------------------------------------------------------------
 // accumulateNearestT
 // ---------------------------------------------------------------------------
 
-template <typename T, int CH>
-static void accumulateNearestT(const T *src, double *acc, int W, int H, const AlignTransform &tr, int num_threads) {
+template <typename T, int CH, bool PLANAR>
+static void accumulateNearestT(const T *src, double *acc, int W, int H, const AlignTransform &tr) {
+	constexpr int PS = PLANAR ? 1 : CH;
+	const size_t cs = PLANAR ? static_cast<size_t>(W) * H : 1;
 	const double cx = (W - 1) * 0.5;
 	const double cy = (H - 1) * 0.5;
 	const double t_a = tr.a, t_b = tr.b, t_tx = tr.tx;
 	const double t_c = tr.c, t_d = tr.d, t_ty = tr.ty;
 
-	parallelRows(H, num_threads, [=](int y) {
+	parallelRows(H, [=](int y) {
 		const double ry = y - cy;
 		double *out = acc + static_cast<size_t>(y) * W * CH;
 		for (int x = 0; x < W; ++x) {
@@ -393,9 +376,9 @@ static void accumulateNearestT(const T *src, double *acc, int W, int H, const Al
 
 			if (sx < 0 || sx >= W || sy < 0 || sy >= H) continue;
 
-			const T *p = src + (static_cast<size_t>(sy) * W + sx) * CH;
+			const T *p = src + (static_cast<size_t>(sy) * W + sx) * PS;
 			double *o = out + static_cast<size_t>(x) * CH;
-			for (int c = 0; c < CH; ++c) o[c] += static_cast<double>(p[c]);
+			for (int c = 0; c < CH; ++c) o[c] += static_cast<double>(p[c * cs]);
 		}
 	});
 }
@@ -404,14 +387,16 @@ static void accumulateNearestT(const T *src, double *acc, int W, int H, const Al
 // accumulateBilinearT
 // ---------------------------------------------------------------------------
 
-template <typename T, int CH>
-static void accumulateBilinearT(const T *src, double *acc, int W, int H, const AlignTransform &tr, int num_threads) {
+template <typename T, int CH, bool PLANAR>
+static void accumulateBilinearT(const T *src, double *acc, int W, int H, const AlignTransform &tr) {
+	constexpr int PS = PLANAR ? 1 : CH;
+	const size_t cs = PLANAR ? static_cast<size_t>(W) * H : 1;
 	const double cx = (W - 1) * 0.5;
 	const double cy = (H - 1) * 0.5;
 	const double t_a = tr.a, t_b = tr.b, t_tx = tr.tx;
 	const double t_c = tr.c, t_d = tr.d, t_ty = tr.ty;
 
-	parallelRows(H, num_threads, [=](int y) {
+	parallelRows(H, [=](int y) {
 		const double ry = y - cy;
 		double *out = acc + static_cast<size_t>(y) * W * CH;
 		for (int x = 0; x < W; ++x) {
@@ -429,20 +414,20 @@ static void accumulateBilinearT(const T *src, double *acc, int W, int H, const A
 			double *o = out + static_cast<size_t>(x) * CH;
 
 			if (x0 >= 0 && x0 + 1 < W && y0 >= 0 && y0 + 1 < H) {
-				const T *p0 = src + (static_cast<size_t>(y0) * W + x0) * CH;
-				const T *p1 = p0 + static_cast<size_t>(W) * CH;
+				const T *p0 = src + (static_cast<size_t>(y0) * W + x0) * PS;
+				const T *p1 = p0 + static_cast<size_t>(W) * PS;
 				for (int c = 0; c < CH; ++c) {
-					o[c] += w00 * static_cast<double>(p0[c])
-					      + w10 * static_cast<double>(p0[CH + c])
-					      + w01 * static_cast<double>(p1[c])
-					      + w11 * static_cast<double>(p1[CH + c]);
+					o[c] += w00 * static_cast<double>(p0[c * cs])
+					      + w10 * static_cast<double>(p0[PS + c * cs])
+					      + w01 * static_cast<double>(p1[c * cs])
+					      + w11 * static_cast<double>(p1[PS + c * cs]);
 				}
 			} else {
 				for (int c = 0; c < CH; ++c) {
-					o[c] += w00 * fetchClamped<T, CH>(src, W, H, x0,     y0,     c)
-					      + w10 * fetchClamped<T, CH>(src, W, H, x0 + 1, y0,     c)
-					      + w01 * fetchClamped<T, CH>(src, W, H, x0,     y0 + 1, c)
-					      + w11 * fetchClamped<T, CH>(src, W, H, x0 + 1, y0 + 1, c);
+					o[c] += w00 * fetchClamped<T, CH, PLANAR>(src, W, H, x0,     y0,     c)
+					      + w10 * fetchClamped<T, CH, PLANAR>(src, W, H, x0 + 1, y0,     c)
+					      + w01 * fetchClamped<T, CH, PLANAR>(src, W, H, x0,     y0 + 1, c)
+					      + w11 * fetchClamped<T, CH, PLANAR>(src, W, H, x0 + 1, y0 + 1, c);
 				}
 			}
 		}
@@ -481,14 +466,16 @@ static inline void solveRange(double m, double k, double lo, double hi, int W, i
 	if (x1 < x0) x1 = x0;
 }
 
-template <typename T, int CH>
-static void accumulateBicubicT(const T *src, double *acc, int W, int H, const AlignTransform &tr, int num_threads) {
+template <typename T, int CH, bool PLANAR>
+static void accumulateBicubicT(const T *src, double *acc, int W, int H, const AlignTransform &tr) {
+	constexpr int PS = PLANAR ? 1 : CH;
+	const size_t cs = PLANAR ? static_cast<size_t>(W) * H : 1;
 	const double cx = (W - 1) * 0.5;
 	const double cy = (H - 1) * 0.5;
 	const double t_a = tr.a, t_b = tr.b, t_tx = tr.tx;
 	const double t_c = tr.c, t_d = tr.d, t_ty = tr.ty;
 
-	parallelRows(H, num_threads, [=](int y) {
+	parallelRows(H, [=](int y) {
 
 		auto cubic = [](double v) -> double {
 			v = std::abs(v);
@@ -521,16 +508,16 @@ static void accumulateBicubicT(const T *src, double *acc, int W, int H, const Al
 			double *o = out + static_cast<size_t>(x) * CH;
 
 			if (fast) {
-				const size_t stride = static_cast<size_t>(W) * CH;
-				const T *base = src + (static_cast<size_t>(yi - 1) * W + (xi - 1)) * CH;
+				const size_t stride = static_cast<size_t>(W) * PS;
+				const T *base = src + (static_cast<size_t>(yi - 1) * W + (xi - 1)) * PS;
 				for (int c = 0; c < CH; ++c) {
-					const T *row = base + c;
+					const T *row = base + c * cs;
 					double val = 0.0;
 					for (int j = 0; j < 4; ++j) {
 						val += wy[j] * ( wx[0] * static_cast<double>(row[0])
-						               + wx[1] * static_cast<double>(row[CH])
-						               + wx[2] * static_cast<double>(row[2 * CH])
-						               + wx[3] * static_cast<double>(row[3 * CH]) );
+						               + wx[1] * static_cast<double>(row[PS])
+						               + wx[2] * static_cast<double>(row[2 * PS])
+						               + wx[3] * static_cast<double>(row[3 * PS]) );
 						row += stride;
 					}
 					o[c] += val;
@@ -541,7 +528,7 @@ static void accumulateBicubicT(const T *src, double *acc, int W, int H, const Al
 					for (int j = 0; j < 4; ++j) {
 						double row_sum = 0.0;
 						for (int i = 0; i < 4; ++i) {
-							row_sum += wx[i] * fetchClamped<T, CH>(src, W, H, xi + i - 1, yi + j - 1, c);
+							row_sum += wx[i] * fetchClamped<T, CH, PLANAR>(src, W, H, xi + i - 1, yi + j - 1, c);
 						}
 						val += wy[j] * row_sum;
 					}
@@ -571,30 +558,29 @@ static void accumulateBicubicT(const T *src, double *acc, int W, int H, const Al
 // accumulate — dispatcher
 //
 // Two nested switches, both OUTSIDE the pixel loops: one binds the pixel format
-// to a (type, channel-count) pair, the other selects the interpolation kernel.
+// to a (type, channel-count, layout) triple, the other selects the interpolation
+// kernel.
 // ---------------------------------------------------------------------------
 
-template <typename T, int CH>
-static void accumulateTyped(const char *raw, double *acc, int W, int H, const AlignTransform &tr, int interp, int num_threads) {
+template <typename T, int CH, bool PLANAR = false>
+static void accumulateTyped(const char *raw, double *acc, int W, int H, const AlignTransform &tr, int interp) {
 	const T *src = reinterpret_cast<const T *>(raw);
 	switch (interp) {
 		case LiveStacker::INTERP_NEAREST:
-			accumulateNearestT<T, CH>(src, acc, W, H, tr, num_threads);
+			accumulateNearestT<T, CH, PLANAR>(src, acc, W, H, tr);
 			break;
 		case LiveStacker::INTERP_BILINEAR:
-			accumulateBilinearT<T, CH>(src, acc, W, H, tr, num_threads);
+			accumulateBilinearT<T, CH, PLANAR>(src, acc, W, H, tr);
 			break;
 		default:
-			accumulateBicubicT<T, CH>(src, acc, W, H, tr, num_threads);
+			accumulateBicubicT<T, CH, PLANAR>(src, acc, W, H, tr);
 			break;
 	}
 }
 
 void LiveStacker::accumulate(preview_image *image, const AlignTransform &transform) {
-	int num_threads = get_number_of_cores();
-	num_threads = (num_threads > 0) ? num_threads : AIN_DEFAULT_THREADS;
-
-	const char *raw = image->m_raw_data;
+	int pix_format = 0;
+	const char *raw = image->debayered_data(pix_format);
 	double *acc = m_acc.data();
 	const int W = m_width;
 	const int H = m_height;
@@ -602,22 +588,31 @@ void LiveStacker::accumulate(preview_image *image, const AlignTransform &transfo
 
 	switch (m_pix_format) {
 		case PIX_FMT_Y8:
-			accumulateTyped<uint8_t,  1>(raw, acc, W, H, transform, interp, num_threads);
+			accumulateTyped<uint8_t,  1>(raw, acc, W, H, transform, interp);
 			break;
 		case PIX_FMT_Y16:
-			accumulateTyped<uint16_t, 1>(raw, acc, W, H, transform, interp, num_threads);
+			accumulateTyped<uint16_t, 1>(raw, acc, W, H, transform, interp);
 			break;
 		case PIX_FMT_F32:
-			accumulateTyped<float,    1>(raw, acc, W, H, transform, interp, num_threads);
+			accumulateTyped<float,    1>(raw, acc, W, H, transform, interp);
 			break;
 		case PIX_FMT_RGB24:
-			accumulateTyped<uint8_t,  3>(raw, acc, W, H, transform, interp, num_threads);
+			accumulateTyped<uint8_t,  3>(raw, acc, W, H, transform, interp);
 			break;
 		case PIX_FMT_RGB48:
-			accumulateTyped<uint16_t, 3>(raw, acc, W, H, transform, interp, num_threads);
+			accumulateTyped<uint16_t, 3>(raw, acc, W, H, transform, interp);
+			break;
+		case PIX_FMT_3RGB24:
+			accumulateTyped<uint8_t,  3, true>(raw, acc, W, H, transform, interp);
+			break;
+		case PIX_FMT_3RGB48:
+			accumulateTyped<uint16_t, 3, true>(raw, acc, W, H, transform, interp);
+			break;
+		case PIX_FMT_3RGBF:
+			accumulateTyped<float,    3, true>(raw, acc, W, H, transform, interp);
 			break;
 		default:
-			accumulateTyped<float,    3>(raw, acc, W, H, transform, interp, num_threads);
+			accumulateTyped<float,    3>(raw, acc, W, H, transform, interp);
 			break;
 	}
 }
@@ -649,12 +644,10 @@ std::vector<StarCentroid> LiveStacker::detectStars(preview_image *image) const {
 	// Mean-subtracted luminance: background ≈ 0, stars > 0.
 	std::vector<float> lum = buildLuminanceMap(image, ds);
 
-	int num_threads = get_number_of_cores();
-	num_threads = (num_threads > 0) ? num_threads : AIN_DEFAULT_THREADS;
 	const float *lumData = lum.data();
 
 	// Noise sigma: RMS of all pixels (mean is already 0 after buildLuminanceMap).
-	const double var = parallelSum(lum.size(), num_threads, [=](size_t i) {
+	const double var = parallelSum(lum.size(), [=](size_t i) {
 		return static_cast<double>(lumData[i]) * lumData[i];
 	}) / static_cast<double>(lum.size());
 	const double sigma = std::sqrt(var);
@@ -674,70 +667,64 @@ std::vector<StarCentroid> LiveStacker::detectStars(preview_image *image) const {
 	// Overlapping the chunks made each boundary band get scanned twice, which
 	// both duplicated work and pushed two identical entries for every peak
 	// falling in it.
-	std::vector<std::future<std::vector<StarCentroid>>> futures;
 	const int y_min = nr;
-	const int y_max = dH - nr; // exclusive upper bound
-
-	for (int rank = 0; rank < num_threads; rank++) {
-		const int chunk = static_cast<int>(std::ceil((double)(y_max - y_min) / (double)num_threads));
-		const int start = y_min + rank * chunk;
-		const int end = std::min(y_max, start + chunk);
-		if (start >= end) continue;
-		futures.push_back(std::async(std::launch::async, [=]() -> std::vector<StarCentroid> {
-			std::vector<StarCentroid> local;
-			const double ds_center_offset = 0.5 * (ds - 1);
-			for (int y = start; y < end; ++y) {
-				for (int x = nr; x < dW - nr; ++x) {
-					float v = lumData[y * dW + x];
-					if (v < threshold) continue;
-					bool isMax = true;
-					for (int dy = -nr; dy <= nr && isMax; ++dy) {
-						for (int dx = -nr; dx <= nr && isMax; ++dx) {
-							if (dx == 0 && dy == 0) continue;
-							if (lumData[(y + dy) * dW + (x + dx)] >= v) isMax = false;
-						}
+	const int y_max = std::max(y_min, dH - nr); // exclusive upper bound
+	std::vector<std::vector<StarCentroid>> found(parallel_chunk_count(y_max - y_min, 0));
+
+	parallel_chunks(y_min, y_max, 0, [&](size_t chunk, size_t chunk_start, size_t chunk_end) {
+		std::vector<StarCentroid> &local = found[chunk];
+		const int start = chunk_start;
+		const int end = chunk_end;
+		const double ds_center_offset = 0.5 * (ds - 1);
+		for (int y = start; y < end; ++y) {
+			for (int x = nr; x < dW - nr; ++x) {
+				float v = lumData[y * dW + x];
+				if (v < threshold) continue;
+				bool isMax = true;
+				for (int dy = -nr; dy <= nr && isMax; ++dy) {
+					for (int dx = -nr; dx <= nr && isMax; ++dx) {
+						if (dx == 0 && dy == 0) continue;
+						if (lumData[(y + dy) * dW + (x + dx)] >= v) isMax = false;
 					}
-					if (!isMax) continue;
-
-					// Intensity-weighted centroid within the refinement window.
-					double cx = 0.0, cy = 0.0, flux = 0.0;
-					const int x0 = std::max(0, x - wh);
-					const int x1 = std::min(dW - 1, x + wh);
-					const int y0 = std::max(0, y - wh);
-					const int y1 = std::min(dH - 1, y + wh);
-					for (int py = y0; py <= y1; ++py) {
-						for (int px = x0; px <= x1; ++px) {
-							float w = std::max(0.0f, lumData[py * dW + px]);
-							cx += w * px;
-							cy += w * py;
-							flux += w;
-						}
+				}
+				if (!isMax) continue;
+
+				// Intensity-weighted centroid within the refinement window.
+				double cx = 0.0, cy = 0.0, flux = 0.0;
+				const int x0 = std::max(0, x - wh);
+				const int x1 = std::min(dW - 1, x + wh);
+				const int y0 = std::max(0, y - wh);
+				const int y1 = std::min(dH - 1, y + wh);
+				for (int py = y0; py <= y1; ++py) {
+					for (int px = x0; px <= x1; ++px) {
+						float w = std::max(0.0f, lumData[py * dW + px]);
+						cx += w * px;
+						cy += w * py;
+						flux += w;
 					}
-					if (flux < 1e-6f) continue;
-					cx /= flux;
-					cy /= flux;
-
-					StarCentroid sc;
-					// Convert the centroid from downsampled-cell coordinates back to
-					// original pixel coordinates using the centre of each ds×ds box.
-					// Without this offset the detected stars are all biased by
-					// (ds-1)/2 pixels, which is mostly absorbed by translation-only
-					// alignment but shifts the effective rotation centre.  At 180°
-					// that bias turns into an apparent ~1 px translation for ds=2.
-					sc.x = static_cast<float>(cx * ds + ds_center_offset);
-					sc.y = static_cast<float>(cy * ds + ds_center_offset);
-					sc.flux = static_cast<float>(flux);
-					local.push_back(sc);
 				}
+				if (flux < 1e-6f) continue;
+				cx /= flux;
+				cy /= flux;
+
+				StarCentroid sc;
+				// Convert the centroid from downsampled-cell coordinates back to
+				// original pixel coordinates using the centre of each ds×ds box.
+				// Without this offset the detected stars are all biased by
+				// (ds-1)/2 pixels, which is mostly absorbed by translation-only
+				// alignment but shifts the effective rotation centre.  At 180°
+				// that bias turns into an apparent ~1 px translation for ds=2.
+				sc.x = static_cast<float>(cx * ds + ds_center_offset);
+				sc.y = static_cast<float>(cy * ds + ds_center_offset);
+				sc.flux = static_cast<float>(flux);
+				local.push_back(sc);
 			}
-			return local;
-		}));
-	}
+		}
+	});
 
 	// Gather results and keep the brightest stars.
 	std::vector<StarCentroid> candidates;
-	for (auto &f : futures) {
-		std::vector<StarCentroid> part = f.get();
+	for (auto &part : found) {
 		candidates.insert(candidates.end(), part.begin(), part.end());
 	}
 
@@ -1408,7 +1395,10 @@ bool LiveStacker::addImage(preview_image *image, bool align) {
 	if (!image || !image->m_raw_data)
 		return false;
 
-	const int fmt = image->m_pix_format;
+	// CFA frames are stacked debayered
+	int fmt = 0;
+	if (!image->debayered_data(fmt))
+		return false;
 	const int ch  = channelsForFormat(fmt);
 	if (ch == 0 || bytesPerSample(fmt) == 0)
 		return false;
@@ -1491,9 +1481,7 @@ bool LiveStacker::addImage(preview_image *image, bool align) {
 
 	const auto t1 = std::chrono::steady_clock::now();
 	const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count();
-	int num_threads = get_number_of_cores();
-	num_threads = (num_threads > 0) ? num_threads : AIN_DEFAULT_THREADS;
-	indigo_debug("LiveStacker::addImage: frame added in %lld ms using %d cores\n", (long long)ms, num_threads);
+	indigo_debug("LiveStacker::addImage: frame added in %lld ms using %d cores\n", (long long)ms, parallel_threads());
 
 	return true;
 }
@@ -1513,21 +1501,12 @@ preview_image *LiveStacker::currentStack() const {
 
 	const double inv = 1.0 / m_frame_count;
 
-	int num_threads = get_number_of_cores();
-	num_threads = (num_threads > 0) ? num_threads : AIN_DEFAULT_THREADS;
-	std::vector<std::thread> threads;
 	const double *src = m_acc.data();
-	for (int rank = 0; rank < num_threads; rank++) {
-		const size_t chunk = static_cast<size_t>(std::ceil(samples / (double)num_threads));
-		threads.emplace_back([=]() {
-			const size_t start = chunk * rank;
-			const size_t end = std::min(start + chunk, static_cast<size_t>(samples));
-			for (size_t i = start; i < end; ++i) {
-				dst[i] = static_cast<float>(src[i] * inv);
-			}
-		});
-	}
-	for (auto &t : threads) t.join();
+	parallel_for(0, samples, [=](size_t start, size_t end) {
+		for (size_t i = start; i < end; ++i) {
+			dst[i] = static_cast<float>(src[i] * inv);
+		}
+	});
 
 	const int out_fmt = (m_channels == 1) ? PIX_FMT_F32 : PIX_FMT_RGBF;
 	stretch_config_t sconfig{};
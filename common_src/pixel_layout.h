@@ -0,0 +1,58 @@
+// Copyright (c) 2026 Rumen G.Bogdanovski
+// All rights reserved.
+//
+// You can use this software under the terms of 'INDIGO Astronomy
+// open-source license' (see LICENSE.md).
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHORS 'AS IS' AND ANY EXPRESS
+// OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <stddef.h>
+#include <pixelformat.h>
+
+// Three channel images come either interleaved (RGBRGB..., PIX_FMT_RGB*) or
+// planar (RR..GG..BB.., PIX_FMT_3RGB* as stored in FITS and XISF). RGBPixels
+// hides the difference, so the same loop walks both layouts in place. The
+// layout is a template parameter and the strides fold to constants.
+template <typename T, bool PLANAR>
+struct RGBPixels {
+	RGBPixels(T const *buffer, size_t pixel_count) : m_data(buffer), m_plane(pixel_count) {}
+
+	// distance between two neighbouring samples of one channel
+	static constexpr size_t pixelStride() { return PLANAR ? 1 : 3; }
+	// distance between the samples of one pixel
+	size_t channelStride() const { return PLANAR ? m_plane : 1; }
+
+	T const *channel(int c) const { return m_data + c * channelStride(); }
+	T red(size_t i) const { return m_data[i * pixelStride()]; }
+	T green(size_t i) const { return m_data[i * pixelStride() + channelStride()]; }
+	T blue(size_t i) const { return m_data[i * pixelStride() + 2 * channelStride()]; }
+
+private:
+	T const *m_data;
+	size_t m_plane;
+};
+
+static inline bool pix_format_is_planar(int pix_format) {
+	return
+		pix_format == PIX_FMT_3RGB24 || pix_format == PIX_FMT_3RGB48 ||
+		pix_format == PIX_FMT_3RGB96 || pix_format == PIX_FMT_3RGBF;
+}
+
+static inline bool pix_format_is_rgb(int pix_format) {
+	return
+		pix_format == PIX_FMT_RGB24 || pix_format == PIX_FMT_RGB48 ||
+		pix_format == PIX_FMT_RGB96 || pix_format == PIX_FMT_RGBF ||
+		pix_format_is_planar(pix_format);
+}
@@ -21,7 +21,6 @@
 
 #include <indigo/indigo_bus.h>
 #include <indigo/indigo_io.h>
-#include <indigo/indigo_fits.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -31,6 +30,8 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <limits.h>
+#include <xisf.h>
+#include <fits.h>
 #define FITS_HEADER_SIZE 2880
 
 int save_file(char *file_name, char *data, int size) {
@@ -76,25 +77,94 @@ int open_file(const char *file_name, char **data, int *size) {
 	return -1;
 }
 
+#define RAW_MAX_KEYWORDS 64
+
+/* keywords may follow the data as "SIMPLE=T;KEYWORD=VALUE;...", the structural ones are written by fits_write() */
+static int raw_keywords_to_cards(char *extension, char cards[][81], int max_cards) {
+	static const char *skip[] = { "SIMPLE", "BITPIX", "NAXIS", "NAXIS1", "NAXIS2", "NAXIS3", "BZERO", "BSCALE", "ROWORDER", "END", NULL };
+	int count = 0;
+	char *keyword = extension;
+	while (keyword && *keyword && count < max_cards) {
+		char *next = strchr(keyword, ';');
+		if (next) *next++ = '\0';
+		char *value = strchr(keyword, '=');
+		if (value) {
+			*value++ = '\0';
+			while (*keyword == ' ') keyword++;
+			while (*value == ' ') value++;
+			bool structural = false;
+			for (int i = 0; skip[i]; i++) {
+				if (!strcmp(keyword, skip[i])) structural = true;
+			}
+			if (!structural && *keyword != '\0') {
+				if (*value == '\'') {
+					snprintf(cards[count++], 81, "%-8.8s= %-20s", keyword, value);
+				} else {
+					snprintf(cards[count++], 81, "%-8.8s= %20s", keyword, value);
+				}
+			}
+		}
+		keyword = next;
+	}
+	return count;
+}
+
 int convert_raw_to_fits(char *infile_name) {
 	char *in_data = NULL;
-	char *out_data = NULL;
 	int in_data_size = 0;
-	int fits_size = 0;
 
 	int res = open_file(infile_name, &in_data, &in_data_size);
-	if (res != 0) {
+	if (res != 0 || in_data_size < (int)sizeof(indigo_raw_header)) {
 		if (in_data) free(in_data);
 		return -1;
 	}
 
-	res = indigo_raw_to_fits(in_data, in_data_size, &out_data, &fits_size, NULL);
-	if (res != 0) {
-		if (in_data) free(in_data);
-		if (out_data) free(out_data);
+	indigo_raw_header *header = (indigo_raw_header *)in_data;
+	int bitpix, channels;
+	switch (header->signature) {
+		case INDIGO_RAW_MONO8:
+			bitpix = 8;
+			channels = 1;
+			break;
+		case INDIGO_RAW_MONO16:
+			bitpix = 16;
+			channels = 1;
+			break;
+		case INDIGO_RAW_RGB24:
+			bitpix = 8;
+			channels = 3;
+			break;
+		case INDIGO_RAW_RGB48:
+			bitpix = 16;
+			channels = 3;
+			break;
+		default:
+			free(in_data);
+			return -1;
+	}
+	/* computed in size_t, large colour frames overflow int */
+	size_t data_size = (size_t)header->width * header->height * channels * bitpix / 8;
+	if (data_size > (size_t)in_data_size - sizeof(indigo_raw_header)) {
+		free(in_data);
 		return -1;
 	}
 
+	char cards[RAW_MAX_KEYWORDS][81];
+	const char *card_list[RAW_MAX_KEYWORDS + 1];
+	int card_count = 0;
+	size_t extension_size = (size_t)in_data_size - sizeof(indigo_raw_header) - data_size;
+	if (extension_size > 0) {
+		char *extension = (char *)malloc(extension_size + 1);
+		memcpy(extension, in_data + sizeof(indigo_raw_header) + data_size, extension_size);
+		extension[extension_size] = '\0';
+		card_count = raw_keywords_to_cards(extension, cards, RAW_MAX_KEYWORDS);
+		free(extension);
+	}
+	for (int i = 0; i < card_count; i++) {
+		card_list[i] = cards[i];
+	}
+	card_list[card_count] = NULL;
+
 	char outfile_name[PATH_MAX];
 	strncpy(outfile_name, infile_name, PATH_MAX);
 	/* relace replace suffix with .fits */
@@ -105,9 +175,97 @@ int convert_raw_to_fits(char *infile_name) {
 		snprintf(outfile_name, PATH_MAX, "%s.fits", infile_name);
 	}
 
-	res = save_file(outfile_name, out_data, fits_size);
-	if (in_data) free(in_data);
-	if (out_data) free(out_data);
+	/* RAW data is interleaved little endian, fits_write() converts it on all cores */
+	res = fits_write(outfile_name, header->width, header->height, bitpix, channels, 0, in_data + sizeof(indigo_raw_header), card_list);
+	free(in_data);
+
+	return (res == FITS_OK) ? 0 : -1;
+}
+
+int raw_to_xisf_file(const char *raw_data, int raw_size, const char *file_name, const char *compression) {
+	if (raw_size < (int)sizeof(indigo_raw_header)) {
+		return -1;
+	}
+
+	indigo_raw_header *header = (indigo_raw_header *)raw_data;
+	xisf_metadata metadata;
+	xisf_metadata_init(&metadata);
+	metadata.width = header->width;
+	metadata.height = header->height;
+	metadata.normal_pixel_storage = true;
+	switch (header->signature) {
+		case INDIGO_RAW_MONO8:
+			metadata.bitpix = 8;
+			metadata.channels = 1;
+			break;
+		case INDIGO_RAW_MONO16:
+			metadata.bitpix = 16;
+			metadata.channels = 1;
+			break;
+		case INDIGO_RAW_RGB24:
+			metadata.bitpix = 8;
+			metadata.channels = 3;
+			break;
+		case INDIGO_RAW_RGB48:
+			metadata.bitpix = 16;
+			metadata.channels = 3;
+			break;
+		default:
+			return -1;
+	}
+	size_t data_size = (size_t)metadata.width * metadata.height * metadata.channels * metadata.bitpix / 8;
+	if (data_size > (size_t)raw_size - sizeof(indigo_raw_header)) {
+		return -1;
+	}
+
+	/* keywords may follow the data as "SIMPLE=T;KEYWORD=VALUE;..." */
+	size_t extension_size = (size_t)raw_size - sizeof(indigo_raw_header) - data_size;
+	if (extension_size > 0) {
+		char *extension = (char *)malloc(extension_size + 1);
+		memcpy(extension, raw_data + sizeof(indigo_raw_header) + data_size, extension_size);
+		extension[extension_size] = '\0';
+		char *bayerpat = strstr(extension, "BAYERPAT=");
+		if (bayerpat) {
+			bayerpat += 9;
+			while (*bayerpat == '\'' || *bayerpat == ' ') bayerpat++;
+			int i = 0;
+			while (i < (int)sizeof(metadata.bayer_pattern) - 1 && bayerpat[i] != '\'' && bayerpat[i] != ' ' && bayerpat[i] != ';' && bayerpat[i] != '\0') {
+				metadata.bayer_pattern[i] = bayerpat[i];
+				i++;
+			}
+			metadata.bayer_pattern[i] = '\0';
+		}
+		free(extension);
+	}
+	if (compression) {
+		snprintf(metadata.compression, sizeof(metadata.compression), "%s", compression);
+	}
+
+	int res = xisf_write(file_name, &metadata, (const uint8_t *)raw_data + sizeof(indigo_raw_header));
+	return (res == XISF_OK) ? 0 : -1;
+}
+
+int convert_raw_to_xisf(char *infile_name, const char *compression) {
+	char *in_data = NULL;
+	int in_data_size = 0;
+
+	int res = open_file(infile_name, &in_data, &in_data_size);
+	if (res != 0) {
+		if (in_data) free(in_data);
+		return -1;
+	}
+
+	char outfile_name[PATH_MAX];
+	snprintf(outfile_name, PATH_MAX, "%s", infile_name);
+	/* relace replace suffix with .xisf */
+	char *dot = strrchr(outfile_name, '.');
+	if (dot) {
+		strcpy(dot, ".xisf");
+	} else {
+		snprintf(outfile_name, PATH_MAX, "%s.xisf", infile_name);
+	}
 
+	res = raw_to_xisf_file(in_data, in_data_size, outfile_name, compression);
+	free(in_data);
 	return res;
 }
@@ -30,6 +30,9 @@ int save_file(char *file_name, char *data, int size);
 int open_file(const char *file_name, char **data, int *size);
 int raw_to_fists(char *image, char **fits, int *size);
 int convert_raw_to_fits(char *infile_name);
+int convert_raw_to_xisf(char *infile_name, const char *compression);
+/* writes an INDIGO RAW image held in memory as XISF, compression as in xisf_write() */
+int raw_to_xisf_file(const char *raw_data, int raw_size, const char *file_name, const char *compression);
 
 #ifdef __cplusplus
 }
@@ -6,246 +6,199 @@
 
 #include <algorithm>
 #include <cstring>
-#include <future>
 #include <math.h>
-#include <QCoreApplication>
-#include <thread>
 #include <vector>
 #include <utils.h>
+#include <pixel_layout.h>
 
-// Returns the median value of the vector.
-// The values is modified
+// The midtones transfer function of one channel scaled to the 0-255 display range
 template <typename T>
-T median(std::vector<T> &values) {
-	const int middle = values.size() / 2;
-	std::nth_element(values.begin(), values.begin() + middle, values.end());
-	return values[middle];
+struct ChannelStretch {
+	static constexpr int maxOutput = 255;
+
+	ChannelStretch(const StretchParams1Channel &params, double maxInput) {
+		const float hsRangeFactor = params.highlights == params.shadows ? 1.0f : 1.0f / (params.highlights - params.shadows);
+		nativeShadows = params.shadows * maxInput;
+		nativeHighlights = params.highlights * maxInput;
+		midtones = params.midtones;
+		k1 = (midtones - 1) * hsRangeFactor * maxOutput / maxInput;
+		k2 = ((2 * midtones) - 1) * hsRangeFactor / maxInput;
+	}
+
+	uint8_t operator()(T input) const {
+		if (input < nativeShadows) return 0;
+		if (input >= nativeHighlights) return maxOutput;
+		const T inputFloored = (input - nativeShadows);
+		const int val = (inputFloored * k1) / (inputFloored * k2 - midtones);
+		return val;
+	}
+
+	// not truncated, for the quantized tables
+	double curve(double inputFloored) const {
+		return (inputFloored * k1) / (inputFloored * k2 - midtones);
+	}
+
+	T nativeShadows;
+	T nativeHighlights;
+	float midtones;
+	float k1;
+	float k2;
+};
+
+static void fillLut(const ChannelStretch<uint8_t> &stretch, StretchLut1Channel *lut) {
+	lut->table.resize(UINT8_MAX + 1);
+	for (int value = 0; value <= UINT8_MAX; value++) {
+		lut->table[value] = stretch(value);
+	}
+}
+
+static void fillLut(const ChannelStretch<uint16_t> &stretch, StretchLut1Channel *lut) {
+	lut->table.resize(UINT16_MAX + 1);
+	for (int value = 0; value <= UINT16_MAX; value++) {
+		lut->table[value] = stretch(value);
+	}
+}
+
+// float bits of a sample distance from the shadows to its table index
+static const int lutShift = 23 - STRETCH_LUT_MANTISSA_BITS;
+
+static inline uint32_t lutIndex(float inputFloored) {
+	uint32_t bits;
+	memcpy(&bits, &inputFloored, sizeof(bits));
+	return bits >> lutShift;
 }
 
-// Returns the median of the sample values.
-// The values not modified
 template <typename T>
-T median(T const *values, int size, int sampleBy) {
-	const int downsampled_size = size / sampleBy;
-	std::vector<T> samples(downsampled_size);
-	for (int index = 0, i = 0; i < downsampled_size; ++i, index += sampleBy) {
-		samples[i] = values[index];
+static void fillLut(const ChannelStretch<T> &stretch, StretchLut1Channel *lut) {
+	lut->shadows = stretch.nativeShadows;
+	lut->highlights = stretch.nativeHighlights;
+	lut->table.clear();
+	// everything is either black or white otherwise
+	if (!(stretch.nativeHighlights > stretch.nativeShadows)) return;
+	const T range = stretch.nativeHighlights - stretch.nativeShadows;
+	const uint32_t size = lutIndex(range) + 1;
+	lut->table.resize(size);
+	for (uint32_t index = 0; index < size; index++) {
+		// the middle of the interval of samples that fall in this entry
+		const uint32_t bits = (index << lutShift) | (1u << (lutShift - 1));
+		float inputFloored;
+		memcpy(&inputFloored, &bits, sizeof(bits));
+		const double val = stretch.curve(index ? inputFloored : 0);
+		lut->table[index] = (int)std::min(std::max(val, 0.0), (double)ChannelStretch<T>::maxOutput);
 	}
-	return median(samples);
 }
 
+// Looks the stretched value of a sample up in the table of its channel
+template <typename T>
+struct LutReader {
+	explicit LutReader(const StretchLut1Channel &lut) :
+		table(lut.table.data()),
+		shadows(lut.shadows),
+		highlights(lut.highlights) {}
+
+	inline uint8_t operator()(T input) const {
+		// NaN samples (blank float pixels) compare false both ways, they are shown black
+		if (!(input >= shadows)) return 0;
+		if (input >= highlights) return ChannelStretch<T>::maxOutput;
+		const T inputFloored = input - shadows;
+		return table[lutIndex(inputFloored)];
+	}
+
+	const uint8_t *table;
+	const T shadows;
+	const T highlights;
+};
+
+template <>
+struct LutReader<uint8_t> {
+	explicit LutReader(const StretchLut1Channel &lut) : table(lut.table.data()) {}
+	inline uint8_t operator()(uint8_t input) const { return table[input]; }
+	const uint8_t *table;
+};
+
+template <>
+struct LutReader<uint16_t> {
+	explicit LutReader(const StretchLut1Channel &lut) : table(lut.table.data()) {}
+	inline uint8_t operator()(uint16_t input) const { return table[input]; }
+	const uint8_t *table;
+};
+
+// The kernels write output rows [start_row, end_row) and columns [start_col, end_col) through output_bits,
+// the output pixel (iout, jout) is the input pixel (iout * sampling, jout * sampling).
 template <typename T>
 void stretchOneChannel(
-	T *input_buffer,
-	QImage *output_image,
-	const StretchParams &stretch_params,
-	double input_range,
-	int image_height,
+	T const *input_buffer,
+	uchar *output_bits,
+	size_t bytes_per_line,
+	const StretchLut1Channel &lut,
 	int image_width,
-	int sampling
+	int sampling,
+	int start_row,
+	int end_row,
+	int start_col,
+	int end_col
 ) {
-	constexpr int maxOutput = 255;
-
-	const double maxInput = input_range > 1 ? input_range - 1 : input_range;
-
-	const float midtones   = stretch_params.grey_red.midtones;
-	const float highlights = stretch_params.grey_red.highlights;
-	const float shadows    = stretch_params.grey_red.shadows;
-
-	const float hsRangeFactor = highlights == shadows ? 1.0f : 1.0f / (highlights - shadows);
-
-	const T nativeShadows = shadows * maxInput;
-	const T nativeHighlights = highlights * maxInput;
-
-	const float k1 = (midtones - 1) * hsRangeFactor * maxOutput / maxInput;
-	const float k2 = ((2 * midtones) - 1) * hsRangeFactor / maxInput;
-
-	const int output_width = (image_width + sampling - 1) / sampling;
-	const int output_height = (image_height + sampling - 1) / sampling;
-	std::vector<QRgb> pixels(static_cast<size_t>(output_width) * output_height);
-
-	int num_threads = get_number_of_cores();
-	num_threads = (num_threads > 0) ? num_threads : AIN_DEFAULT_THREADS;
-	num_threads = std::min(num_threads, output_height > 0 ? output_height : 1);
-	std::vector<std::future<void>> futures;
-	futures.reserve(num_threads);
-	for (int rank = 0; rank < num_threads; rank++) {
-		const int chunk = static_cast<int>(ceil(output_height / (double)num_threads));
-		futures.emplace_back(std::async(std::launch::async, [=, &pixels]() {
-			const int start_row = chunk * rank;
-			const int end_row = std::min(start_row + chunk, output_height);
-			for (int jout = start_row; jout < end_row; ++jout) {
-				const int j = jout * sampling;
-				T *inputLine = input_buffer + j * image_width;
-				QRgb *scanLine = pixels.data() + static_cast<size_t>(jout) * output_width;
-				for (int i = 0, iout = 0; i < image_width; i += sampling, iout++) {
-					const T input = inputLine[i];
-					if (input < nativeShadows) scanLine[iout] = qRgb(0, 0, 0);
-					else if (input >= nativeHighlights) scanLine[iout] = qRgb(maxOutput, maxOutput, maxOutput);
-					else {
-						const T inputFloored = (input - nativeShadows);
-						int val = (inputFloored * k1) / (inputFloored * k2 - midtones);
-						scanLine[iout] = qRgb(val, val, val);
-					}
-				}
+	const LutReader<T> stretch(lut);
+
+	parallel_for(start_row, end_row, [=](size_t chunk_start, size_t chunk_end) {
+		for (int jout = chunk_start; jout < (int)chunk_end; ++jout) {
+			const int j = jout * sampling;
+			T const *inputLine = input_buffer + (size_t)j * image_width;
+			QRgb *scanLine = reinterpret_cast<QRgb*>(output_bits + jout * bytes_per_line);
+			for (int i = start_col * sampling, iout = start_col; iout < end_col; i += sampling, iout++) {
+				const uint8_t val = stretch(inputLine[i]);
+				scanLine[iout] = qRgb(val, val, val);
 			}
-		}));
-	}
-	for (auto &future : futures) {
-		while (future.wait_for(std::chrono::milliseconds(10)) != std::future_status::ready)
-			QCoreApplication::processEvents();
-		future.get();
-	}
-
-	for (int y = 0; y < output_height; ++y) {
-		std::memcpy(output_image->scanLine(y), pixels.data() + static_cast<size_t>(y) * output_width, static_cast<size_t>(output_width) * sizeof(QRgb));
-	}
+		}
+	});
 }
 
-template <typename T>
+template <typename T, bool PLANAR>
 void stretchThreeChannels(
-	T *inputBuffer, QImage *outputImage,
-	const StretchParams &stretchParams,
-	double inputRange,
+	T const *inputBuffer,
+	uchar *output_bits,
+	size_t bytes_per_line,
+	const StretchLut1Channel *luts,
 	int imageHeight,
 	int imageWidth,
-	int sampling
+	int sampling,
+	int startRow,
+	int endRow,
+	int startCol,
+	int endCol
 ) {
-	constexpr int maxOutput = 255;
-
-	const double maxInput = inputRange > 1 ? inputRange - 1 : inputRange;
-
-	float midtonesR   = stretchParams.grey_red.midtones;
-	float highlightsR = stretchParams.grey_red.highlights;
-	float shadowsR    = stretchParams.grey_red.shadows;
-	float midtonesG   = stretchParams.green.midtones;
-	float highlightsG = stretchParams.green.highlights;
-	float shadowsG    = stretchParams.green.shadows;
-	float midtonesB   = stretchParams.blue.midtones;
-	float highlightsB = stretchParams.blue.highlights;
-	float shadowsB    = stretchParams.blue.shadows;
-
-	if (stretchParams.refChannel) {
-		midtonesR   = stretchParams.refChannel->midtones;
-		highlightsR = stretchParams.refChannel->highlights;
-		shadowsR    = stretchParams.refChannel->shadows;
-		midtonesG   = stretchParams.refChannel->midtones;
-		highlightsG = stretchParams.refChannel->highlights;
-		shadowsG    = stretchParams.refChannel->shadows;
-		midtonesB   = stretchParams.refChannel->midtones;
-		highlightsB = stretchParams.refChannel->highlights;
-		shadowsB    = stretchParams.refChannel->shadows;
-	}
-
-	const float hsRangeFactorR = highlightsR == shadowsR ? 1.0f : 1.0f / (highlightsR - shadowsR);
-	const float hsRangeFactorG = highlightsG == shadowsG ? 1.0f : 1.0f / (highlightsG - shadowsG);
-	const float hsRangeFactorB = highlightsB == shadowsB ? 1.0f : 1.0f / (highlightsB - shadowsB);
-
-	const T nativeShadowsR = shadowsR * maxInput;
-	const T nativeShadowsG = shadowsG * maxInput;
-	const T nativeShadowsB = shadowsB * maxInput;
-	const T nativeHighlightsR = highlightsR * maxInput;
-	const T nativeHighlightsG = highlightsG * maxInput;
-	const T nativeHighlightsB = highlightsB * maxInput;
-
-	const float k1R = (midtonesR - 1) * hsRangeFactorR * maxOutput / maxInput;
-	const float k1G = (midtonesG - 1) * hsRangeFactorG * maxOutput / maxInput;
-	const float k1B = (midtonesB - 1) * hsRangeFactorB * maxOutput / maxInput;
-	const float k2R = ((2 * midtonesR) - 1) * hsRangeFactorR / maxInput;
-	const float k2G = ((2 * midtonesG) - 1) * hsRangeFactorG / maxInput;
-	const float k2B = ((2 * midtonesB) - 1) * hsRangeFactorB / maxInput;
-
-	const int skip = sampling * 3;
-	const int imageWidth3 = imageWidth * 3;
-
-	const int output_width = (imageWidth + sampling - 1) / sampling;
-	const int output_height = (imageHeight + sampling - 1) / sampling;
-	std::vector<QRgb> pixels(static_cast<size_t>(output_width) * output_height);
-
-	int num_threads = get_number_of_cores();
-	num_threads = (num_threads > 0) ? num_threads : AIN_DEFAULT_THREADS;
-	num_threads = std::min(num_threads, output_height > 0 ? output_height : 1);
-	std::vector<std::future<void>> futures;
-	futures.reserve(num_threads);
-	for (int rank = 0; rank < num_threads; rank++) {
-		const int chunk = static_cast<int>(ceil(output_height / (double)num_threads));
-		futures.emplace_back(std::async(std::launch::async, [=, &pixels]() {
-			const int start_row = chunk * rank;
-			const int end_row = std::min(start_row + chunk, output_height);
-			for (int jout = start_row; jout < end_row; ++jout) {
-				const int j = jout * sampling;
-				const int base_index = j * imageWidth3;
-				QRgb *scanLine = pixels.data() + static_cast<size_t>(jout) * output_width;
-				for (int i = 0, iout = 0, index = base_index; i < imageWidth3; i += skip, iout++) {
-					const T inputR = inputBuffer[index + 0];
-					const T inputG = inputBuffer[index + 1];
-					const T inputB = inputBuffer[index + 2];
-					index += skip;
-
-					uint8_t red, green, blue;
-
-					if (inputR < nativeShadowsR) red = 0;
-					else if (inputR >= nativeHighlightsR) red = maxOutput;
-					else {
-						const T inputFloored = (inputR - nativeShadowsR);
-						red = (inputFloored * k1R) / (inputFloored * k2R - midtonesR);
-					}
-
-					if (inputG < nativeShadowsG) green = 0;
-					else if (inputG >= nativeHighlightsG) green = maxOutput;
-					else {
-						const T inputFloored = (inputG - nativeShadowsG);
-						green = (inputFloored * k1G) / (inputFloored * k2G - midtonesG);
-					}
-
-					if (inputB < nativeShadowsB) blue = 0;
-					else if (inputB >= nativeHighlightsB) blue = maxOutput;
-					else {
-						const T inputFloored = (inputB - nativeShadowsB);
-						blue = (inputFloored * k1B) / (inputFloored * k2B - midtonesB);
-					}
-					scanLine[iout] = qRgb(red, green, blue);
-				}
+	const LutReader<T> stretchR(luts[0]);
+	const LutReader<T> stretchG(luts[1]);
+	const LutReader<T> stretchB(luts[2]);
+
+	const RGBPixels<T, PLANAR> pixels(inputBuffer, (size_t)imageWidth * imageHeight);
+
+	parallel_for(startRow, endRow, [=](size_t chunk_start, size_t chunk_end) {
+		for (int jout = chunk_start; jout < (int)chunk_end; ++jout) {
+			const int j = jout * sampling;
+			const size_t base_index = (size_t)j * imageWidth;
+			QRgb *scanLine = reinterpret_cast<QRgb*>(output_bits + jout * bytes_per_line);
+			for (size_t i = (size_t)startCol * sampling, iout = startCol; iout < (size_t)endCol; i += sampling, iout++) {
+				scanLine[iout] = qRgb(
+					stretchR(pixels.red(base_index + i)),
+					stretchG(pixels.green(base_index + i)),
+					stretchB(pixels.blue(base_index + i))
+				);
 			}
-		}));
-	}
-	for (auto &future : futures) {
-		while (future.wait_for(std::chrono::milliseconds(10)) != std::future_status::ready)
-			QCoreApplication::processEvents();
-		future.get();
-	}
-
-	for (int y = 0; y < output_height; ++y) {
-		std::memcpy(outputImage->scanLine(y), pixels.data() + static_cast<size_t>(y) * output_width, static_cast<size_t>(output_width) * sizeof(QRgb));
-	}
+		}
+	});
 }
 
-template <typename T>
-void computeParamsOneChannel(
-	T const *buffer,
+// Auto stretch of one channel from its median and median absolute deviation
+static void computeParams1Channel(
+	double medianSample,
+	double medDev,
 	StretchParams1Channel *params,
 	double inputRange,
-	int height,
-	int width,
-	const float B = 0.25,
-	const float C = -2.8
+	const float B,
+	const float C
 ) {
-	constexpr int maxSamples = 50000;
-	const int sampleBy = width * height < maxSamples ? 1 : width * height / maxSamples;
-
-	T medianSample = median(buffer, width * height, sampleBy);
-	// Find the Median deviation: 1.4826 * median of abs(sample[i] - median).
-	const int numSamples = width * height / sampleBy;
-	std::vector<T> deviations(numSamples);
-	for (int index = 0, i = 0; i < numSamples; ++i, index += sampleBy) {
-		if (medianSample > buffer[index])
-			deviations[i] = medianSample - buffer[index];
-		else
-			deviations[i] = buffer[index] - medianSample;
-	}
-
 	// scale to 0 -> 1.0.
-	const float medDev = median(deviations);
 	const float normalizedMedian = medianSample / inputRange;
 	const float MADN = 1.4826 * medDev / inputRange;
 
@@ -259,7 +212,7 @@ void computeParamsOneChannel(
 	if (!upperHalf) {
 		X = normalizedMedian - shadows;
 		M = B;
-    } else {
+	} else {
 		X = B;
 		M = highlights - normalizedMedian;
 	}
@@ -276,152 +229,22 @@ void computeParamsOneChannel(
 	params->highlights_expansion = 1.0;
 }
 
-template <typename T>
-void computeParamsThreeChannels(
-	T const *buffer,
-	StretchParams *params,
-	double inputRange,
-	int height,
-	int width,
-	const float B = 0.25,
-	const float C = -2.8
-) {
-	constexpr int maxSamples = 50000;
-	const int sampleBy = width * height < maxSamples ? 1 : width * height / maxSamples;
-	const int sampleBy3 = sampleBy * 3;
-
-	T medianSampleR = median(buffer, width * height * 3, sampleBy3);
-	T medianSampleG = median(buffer+1, width * height * 3, sampleBy3);
-	T medianSampleB = median(buffer+2, width * height * 3, sampleBy3);
-
-	// Find the Median deviation: 1.4826 * median of abs(sample[i] - median).
-	const int numSamples = width * height / sampleBy;
-	std::vector<T> deviationsR(numSamples);
-	std::vector<T> deviationsG(numSamples);
-	std::vector<T> deviationsB(numSamples);
-
-	for (int index = 0, i = 0; i < numSamples; ++i, index += sampleBy3) {
-		T value = buffer[index];
-		if (medianSampleR > value)
-			deviationsR[i] = medianSampleR - value;
-		else
-			deviationsR[i] = value - medianSampleR;
-
-		value = buffer[index+1];
-		if (medianSampleG > value)
-			deviationsG[i] = medianSampleG - value;
-		else
-			deviationsG[i] = value - medianSampleG;
-
-		value = buffer[index+2];
-		if (medianSampleB > value)
-			deviationsB[i] = medianSampleB - value;
-		else
-			deviationsB[i] = value - medianSampleB;
-	}
-
-	// scale to 0 -> 1.0.
-	float medDev = median(deviationsR);
-	float normalizedMedian = medianSampleR / inputRange;
-	float MADN = 1.4826 * medDev / inputRange;
-
-	bool upperHalf = normalizedMedian > 0.5;
-
-	float shadowsR = (upperHalf || MADN == 0) ? 0.0 : fmin(1.0, fmax(0.0, (normalizedMedian + C * MADN)));
-
-	float highlightsR = (!upperHalf || MADN == 0) ? 1.0 : fmin(1.0, fmax(0.0, (normalizedMedian - C * MADN)));
-
-	float X, M;
-	if (!upperHalf) {
-		X = normalizedMedian - shadowsR;
-		M = B;
-	} else {
-		X = B;
-		M = highlightsR - normalizedMedian;
-	}
-	float midtonesR;
-	if (X == 0) midtonesR = 0.0f;
-	else if (X == M) midtonesR = 0.5f;
-	else if (X == 1) midtonesR = 1.0f;
-	else midtonesR = ((M - 1) * X) / ((2 * M - 1) * X - M);
-
-	// Green
-	medDev = median(deviationsG);
-	normalizedMedian = medianSampleG / inputRange;
-	MADN = 1.4826 * medDev / inputRange;
-
-	upperHalf = normalizedMedian > 0.5;
-
-	const float shadowsG = (upperHalf || MADN == 0) ? 0.0 : fmin(1.0, fmax(0.0, (normalizedMedian + -2.8 * MADN)));
-
-	const float highlightsG = (!upperHalf || MADN == 0) ? 1.0 : fmin(1.0, fmax(0.0, (normalizedMedian - -2.8 * MADN)));
-
-	if (!upperHalf) {
-		X = normalizedMedian - shadowsG;
-		M = B;
-	} else {
-		X = B;
-		M = highlightsG - normalizedMedian;
-	}
-	float midtonesG;
-	if (X == 0) midtonesG = 0.0f;
-	else if (X == M) midtonesG = 0.5f;
-	else if (X == 1) midtonesG = 1.0f;
-	else midtonesG = ((M - 1) * X) / ((2 * M - 1) * X - M);
-
-	// Blue
-	medDev = median(deviationsB);
-	normalizedMedian = medianSampleB / inputRange;
-	MADN = 1.4826 * medDev / inputRange;
-
-	upperHalf = normalizedMedian > 0.5;
-
-	const float shadowsB = (upperHalf || MADN == 0) ? 0.0 : fmin(1.0, fmax(0.0, (normalizedMedian + -2.8 * MADN)));
-
-	const float highlightsB = (!upperHalf || MADN == 0) ? 1.0 : fmin(1.0, fmax(0.0, (normalizedMedian - -2.8 * MADN)));
-
-	if (!upperHalf) {
-		X = normalizedMedian - shadowsB;
-		M = B;
-	} else {
-		X = B;
-		M = highlightsB - normalizedMedian;
-	}
-	float midtonesB;
-	if (X == 0) midtonesB = 0.0f;
-	else if (X == M) midtonesB = 0.5f;
-	else if (X == 1) midtonesB = 1.0f;
-	else midtonesB = ((M - 1) * X) / ((2 * M - 1) * X - M);
-
-	params->grey_red.shadows = shadowsR;
-	params->grey_red.highlights = highlightsR;
-	params->grey_red.midtones = midtonesR;
-	params->grey_red.shadows_expansion = 0.0;
-	params->grey_red.highlights_expansion = 1.0;
-	params->green.shadows = shadowsG;
-	params->green.highlights = highlightsG;
-	params->green.midtones = midtonesG;
-	params->green.shadows_expansion = 0.0;
-	params->green.highlights_expansion = 1.0;
-	params->blue.shadows = shadowsB;
-	params->blue.highlights = highlightsB;
-	params->blue.midtones = midtonesB;
-	params->blue.shadows_expansion = 0.0;
-	params->blue.highlights_expansion = 1.0;
-}
-
 double getRange(int data_type) {
 	switch (data_type) {
 		case PIX_FMT_Y8:
 		case PIX_FMT_RGB24:
+		case PIX_FMT_3RGB24:
 			return (double)0xFF;
 		case PIX_FMT_Y16:
 		case PIX_FMT_RGB48:
+		case PIX_FMT_3RGB48:
 			return (double)0xFFFF;
 		case PIX_FMT_Y32:
 		case PIX_FMT_F32:
 		case PIX_FMT_RGB96:
 		case PIX_FMT_RGBF:
+		case PIX_FMT_3RGB96:
+		case PIX_FMT_3RGBF:
 			return (double)0xFFFFFFFF;
 		default:
 			return 1.0;
@@ -433,11 +256,60 @@ Stretcher::Stretcher(int width, int height, int data_type) {
 	m_image_height = height;
 	m_pix_fmt = data_type;
 	m_input_range = getRange(m_pix_fmt);
+	m_lut_ready = false;
+}
+
+template <typename T>
+static void fillLuts(StretchLut1Channel *luts, const StretchParams1Channel *const *channels, int count, double maxInput) {
+	for (int channel = 0; channel < count; channel++) {
+		fillLut(ChannelStretch<T>(*channels[channel], maxInput), &luts[channel]);
+	}
+}
+
+void Stretcher::prepareLut() {
+	if (m_lut_ready) return;
+	const double maxInput = m_input_range > 1 ? m_input_range - 1 : m_input_range;
+	const StretchParams1Channel *channels[3] = { &m_params.grey_red, &m_params.green, &m_params.blue };
+	// mono frames always use grey_red, colour frames may be stretched all by one channel
+	if (m_params.refChannel && pix_format_is_rgb(m_pix_fmt)) {
+		channels[0] = channels[1] = channels[2] = m_params.refChannel;
+	}
+	const int count = pix_format_is_rgb(m_pix_fmt) ? 3 : 1;
+	switch (m_pix_fmt) {
+		case PIX_FMT_Y8:
+		case PIX_FMT_RGB24:
+		case PIX_FMT_3RGB24:
+			fillLuts<uint8_t>(m_lut, channels, count, maxInput);
+			break;
+		case PIX_FMT_Y16:
+		case PIX_FMT_RGB48:
+		case PIX_FMT_3RGB48:
+			fillLuts<uint16_t>(m_lut, channels, count, maxInput);
+			break;
+		case PIX_FMT_Y32:
+		case PIX_FMT_RGB96:
+		case PIX_FMT_3RGB96:
+			fillLuts<uint32_t>(m_lut, channels, count, maxInput);
+			break;
+		case PIX_FMT_F32:
+		case PIX_FMT_RGBF:
+		case PIX_FMT_3RGBF:
+			fillLuts<float>(m_lut, channels, count, maxInput);
+			break;
+		default:
+			break;
+	}
+	m_lut_ready = true;
 }
 
 void Stretcher::stretch(uint8_t const *input, QImage *outputImage, int sampling) {
 	Q_ASSERT(outputImage->width() == (m_image_width + sampling - 1) / sampling);
 	Q_ASSERT(outputImage->height() == (m_image_height + sampling - 1) / sampling);
+	stretchRows(input, outputImage, 0, outputImage->height(), sampling);
+}
+
+void Stretcher::stretchRows(uint8_t const *input, QImage *outputImage, int start_row, int end_row, int sampling) {
+	Q_ASSERT(start_row >= 0 && end_row <= (m_image_height + sampling - 1) / sampling);
 	/*
 	{
 		indigo_raw_type rt = INDIGO_RAW_MONO8;
@@ -486,38 +358,66 @@ void Stretcher::stretch(uint8_t const *input, QImage *outputImage, int sampling)
 		indigo_error("frame contrast = %f %s", contrast * mul, saturated ? "(saturated)" : "");
 	}
 	*/
+	// detach once here, the workers write the rows through the raw pointer
+	uchar *output_bits = outputImage->bits();
+	stretchBlock(input, output_bits, outputImage->bytesPerLine(), sampling, start_row, end_row, 0, (m_image_width + sampling - 1) / sampling);
+}
+
+void Stretcher::stretchRect(uint8_t const *input, uchar *output_bits, size_t bytes_per_line, int x, int y, int width, int height) {
+	Q_ASSERT(x >= 0 && y >= 0 && x + width <= m_image_width && y + height <= m_image_height);
+	stretchBlock(input, output_bits, bytes_per_line, 1, y, y + height, x, x + width);
+}
+
+void Stretcher::stretchBlock(uint8_t const *input, uchar *output_bits, size_t bytes_per_line, int sampling, int start_row, int end_row, int start_col, int end_col) {
+	prepareLut();
 	switch (m_pix_fmt) {
 		case PIX_FMT_Y8:
-			stretchOneChannel(reinterpret_cast<uint8_t const*>(input), outputImage, m_params,
-			                m_input_range, m_image_height, m_image_width, sampling);
+			stretchOneChannel(reinterpret_cast<uint8_t const*>(input), output_bits, bytes_per_line, m_lut[0],
+			                m_image_width, sampling, start_row, end_row, start_col, end_col);
 		break;
 		case PIX_FMT_Y16:
-			stretchOneChannel(reinterpret_cast<uint16_t const*>(input), outputImage, m_params,
-			                m_input_range, m_image_height, m_image_width, sampling);
+			stretchOneChannel(reinterpret_cast<uint16_t const*>(input), output_bits, bytes_per_line, m_lut[0],
+			                m_image_width, sampling, start_row, end_row, start_col, end_col);
 			break;
 		case PIX_FMT_Y32:
-			stretchOneChannel(reinterpret_cast<uint32_t const*>(input), outputImage, m_params,
-			                m_input_range, m_image_height, m_image_width, sampling);
+			stretchOneChannel(reinterpret_cast<uint32_t const*>(input), output_bits, bytes_per_line, m_lut[0],
+			                m_image_width, sampling, start_row, end_row, start_col, end_col);
 			break;
 		case PIX_FMT_F32:
-			stretchOneChannel(reinterpret_cast<float const*>(input), outputImage, m_params,
-			                m_input_range, m_image_height, m_image_width, sampling);
+			stretchOneChannel(reinterpret_cast<float const*>(input), output_bits, bytes_per_line, m_lut[0],
+			                m_image_width, sampling, start_row, end_row, start_col, end_col);
 			break;
 		case PIX_FMT_RGB24:
-			stretchThreeChannels(reinterpret_cast<uint8_t const*>(input), outputImage, m_params,
-			                m_input_range, m_image_height, m_image_width, sampling);
+			stretchThreeChannels<uint8_t, false>(reinterpret_cast<uint8_t const*>(input), output_bits, bytes_per_line, m_lut,
+			                m_image_height, m_image_width, sampling, start_row, end_row, start_col, end_col);
 			break;
 		case PIX_FMT_RGB48:
-			stretchThreeChannels(reinterpret_cast<uint16_t const*>(input), outputImage, m_params,
-			                m_input_range, m_image_height, m_image_width, sampling);
+			stretchThreeChannels<uint16_t, false>(reinterpret_cast<uint16_t const*>(input), output_bits, bytes_per_line, m_lut,
+			                m_image_height, m_image_width, sampling, start_row, end_row, start_col, end_col);
 			break;
 		case PIX_FMT_RGB96:
-			stretchThreeChannels(reinterpret_cast<uint32_t const*>(input), outputImage, m_params,
-			                m_input_range, m_image_height, m_image_width, sampling);
+			stretchThreeChannels<uint32_t, false>(reinterpret_cast<uint32_t const*>(input), output_bits, bytes_per_line, m_lut,
+			                m_image_height, m_image_width, sampling, start_row, end_row, start_col, end_col);
 		break;
 		case PIX_FMT_RGBF:
-			stretchThreeChannels(reinterpret_cast<float const*>(input), outputImage, m_params,
-			                m_input_range, m_image_height, m_image_width, sampling);
+			stretchThreeChannels<float, false>(reinterpret_cast<float const*>(input), output_bits, bytes_per_line, m_lut,
+			                m_image_height, m_image_width, sampling, start_row, end_row, start_col, end_col);
+			break;
+		case PIX_FMT_3RGB24:
+			stretchThreeChannels<uint8_t, true>(reinterpret_cast<uint8_t const*>(input), output_bits, bytes_per_line, m_lut,
+			                m_image_height, m_image_width, sampling, start_row, end_row, start_col, end_col);
+			break;
+		case PIX_FMT_3RGB48:
+			stretchThreeChannels<uint16_t, true>(reinterpret_cast<uint16_t const*>(input), output_bits, bytes_per_line, m_lut,
+			                m_image_height, m_image_width, sampling, start_row, end_row, start_col, end_col);
+			break;
+		case PIX_FMT_3RGB96:
+			stretchThreeChannels<uint32_t, true>(reinterpret_cast<uint32_t const*>(input), output_bits, bytes_per_line, m_lut,
+			                m_image_height, m_image_width, sampling, start_row, end_row, start_col, end_col);
+			break;
+		case PIX_FMT_3RGBF:
+			stretchThreeChannels<float, true>(reinterpret_cast<float const*>(input), output_bits, bytes_per_line, m_lut,
+			                m_image_height, m_image_width, sampling, start_row, end_row, start_col, end_col);
 			break;
 		default:
 			break;
@@ -525,52 +425,17 @@ void Stretcher::stretch(uint8_t const *input, QImage *outputImage, int sampling)
 }
 
 StretchParams Stretcher::computeParams(uint8_t const *input, const float B, const float C) {
+	return computeParams(imageHistogram(input, m_image_width, m_image_height, m_pix_fmt), B, C);
+}
+
+StretchParams Stretcher::computeParams(const ImageHistogram &histogram, const float B, const float C) {
 	StretchParams result;
+	if (histogram.channels == 0) return result;
 
-	StretchParams1Channel *params = &result.grey_red;
-	switch (m_pix_fmt) {
-		case PIX_FMT_Y8: {
-			auto buffer = reinterpret_cast<uint8_t const*>(input);
-			computeParamsOneChannel(buffer, params, m_input_range, m_image_height, m_image_width, B, C);
-			break;
-		}
-		case PIX_FMT_Y16: {
-			auto buffer = reinterpret_cast<uint16_t const*>(input);
-			computeParamsOneChannel(buffer, params, m_input_range, m_image_height, m_image_width, B, C);
-			break;
-		}
-		case PIX_FMT_Y32: {
-			auto buffer = reinterpret_cast<uint32_t const*>(input);
-			computeParamsOneChannel(buffer, params, m_input_range, m_image_height, m_image_width, B, C);
-			break;
-		}
-		case PIX_FMT_F32: {
-			auto buffer = reinterpret_cast<float const*>(input);
-			computeParamsOneChannel(buffer, params, m_input_range, m_image_height, m_image_width, B, C);
-			break;
-		}
-		case PIX_FMT_RGB24:{
-			auto buffer = reinterpret_cast<uint8_t const*>(input);
-			computeParamsThreeChannels(buffer, &result, m_input_range, m_image_height, m_image_width, B, C);
-			break;
-		}
-		case PIX_FMT_RGB48: {
-			auto buffer = reinterpret_cast<uint16_t const*>(input);
-			computeParamsThreeChannels(buffer, &result, m_input_range, m_image_height, m_image_width, B, C);
-			break;
-		}
-		case PIX_FMT_RGB96: {
-			auto buffer = reinterpret_cast<uint32_t const*>(input);
-			computeParamsThreeChannels(buffer, &result, m_input_range, m_image_height, m_image_width, B, C);
-			break;
-		}
-		case PIX_FMT_RGBF: {
-			auto buffer = reinterpret_cast<float const*>(input);
-			computeParamsThreeChannels(buffer, &result, m_input_range, m_image_height, m_image_width, B, C);
-			break;
-		}
-		default:
-			break;
+	computeParams1Channel(histogram.grey_red.median, histogram.grey_red.mad, &result.grey_red, m_input_range, B, C);
+	if (histogram.channels == 3) {
+		computeParams1Channel(histogram.green.median, histogram.green.mad, &result.green, m_input_range, B, C);
+		computeParams1Channel(histogram.blue.median, histogram.blue.mad, &result.blue, m_input_range, B, C);
 	}
 	return result;
 }
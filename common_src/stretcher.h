@@ -3,11 +3,14 @@
 #pragma once
 
 #include <memory>
+#include <vector>
 #include <QImage>
 #include <pixelformat.h>
+#include <image_stats.h>
 
 #define DEFAULT_B (0.25)
 #define DEFAULT_C (-2.8)
+#define STRETCH_LUT_MANTISSA_BITS 10
 
 struct StretchParams1Channel {
 	// Stretch algorithm parameters
@@ -39,15 +42,34 @@ struct StretchParams {
 	}
 };
 
+// The display stretch of one channel as a lookup table, built by Stretcher once per StretchParams.
+// 8 and 16 bit samples index the table directly. For 32 bit and float samples the distance from
+// the shadows is quantized to its float exponent and the top STRETCH_LUT_MANTISSA_BITS of the
+// mantissa, so the table is piecewise constant with the same relative precision at any level.
+struct StretchLut1Channel {
+	std::vector<uint8_t> table;
+	double shadows;
+	double highlights;
+};
+
 class Stretcher {
 public:
 	explicit Stretcher(int width, int height, int pix_fmt);
 	~Stretcher() {}
 
-	void setParams(StretchParams input_params) { m_params = input_params; }
+	void setParams(StretchParams input_params) { m_params = input_params; m_lut_ready = false; }
 	StretchParams getParams() { return m_params; }
 	StretchParams computeParams(const uint8_t *input, const float B = DEFAULT_B, const float C = DEFAULT_C);
+	StretchParams computeParams(const ImageHistogram &histogram, const float B = DEFAULT_B, const float C = DEFAULT_C);
 	void stretch(uint8_t const *input, QImage *output_image, int sampling=1);
+	// stretches only the output rows [start_row, end_row), used to fill the image in bands
+	void stretchRows(uint8_t const *input, QImage *output_image, int start_row, int end_row, int sampling=1);
+	// stretches the pixels [x, x + width) x [y, y + height) into output_bits laid out as the whole image,
+	// used to fill an image a tile at a time without detaching it. Call prepareLut() first when tiles
+	// are stretched from several threads at once.
+	void stretchRect(uint8_t const *input, uchar *output_bits, size_t bytes_per_line, int x, int y, int width, int height);
+	// builds the lookup tables for the current params, done on the first stretch otherwise
+	void prepareLut();
 
 private:
 	int m_image_width;
@@ -56,4 +78,8 @@ private:
 	uint32_t m_pix_fmt;
 
 	StretchParams m_params;
+	StretchLut1Channel m_lut[3];
+	bool m_lut_ready;
+
+	void stretchBlock(uint8_t const *input, uchar *output_bits, size_t bytes_per_line, int sampling, int start_row, int end_row, int start_col, int end_col);
 };
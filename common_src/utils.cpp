@@ -22,6 +22,15 @@
 #include <time.h>
 #include <sys/time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 
 #include <QDir>
 #include <QString>
@@ -32,9 +41,11 @@
 
 #ifdef INDIGO_WINDOWS
 #include <windows.h>
+#else
+#include <sys/mman.h>
 #endif
 
-int get_number_of_cores() {
+int get_number_of_cores(void) {
 #ifdef INDIGO_WINDOWS
 	SYSTEM_INFO sysinfo;
 	GetSystemInfo(&sysinfo);
@@ -46,6 +57,195 @@ int get_number_of_cores() {
 #endif
 }
 
+// One parallel_chunks() call, the chunks are handed out by bumping next
+struct parallel_job {
+	const std::function<void(size_t, size_t, size_t)> *body;
+	size_t begin;
+	size_t end;
+	size_t grain;
+	size_t chunks;
+	std::atomic<size_t> next;
+	std::atomic<size_t> done;
+	std::mutex mutex;
+	std::condition_variable finished;
+
+	// runs chunks until there are none left to take
+	void run() {
+		for (size_t chunk = next++; chunk < chunks; chunk = next++) {
+			const size_t chunk_begin = begin + chunk * grain;
+			(*body)(chunk, chunk_begin, std::min(chunk_begin + grain, end));
+			if (++done == chunks) {
+				std::lock_guard<std::mutex> lock(mutex);
+				finished.notify_all();
+			}
+		}
+	}
+};
+
+class parallel_pool {
+public:
+	explicit parallel_pool(int workers) : m_workers(workers) {
+		for (int i = 0; i < workers; i++) {
+			std::thread(&parallel_pool::worker, this).detach();
+		}
+	}
+
+	int threads() const { return m_workers + 1; }
+
+	void run(const std::shared_ptr<parallel_job> &job) {
+		if (m_workers > 0 && job->chunks > 1) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_jobs.push_back(job);
+			m_wakeup.notify_all();
+		}
+		job->run();
+		{
+			std::unique_lock<std::mutex> lock(job->mutex);
+			job->finished.wait(lock, [&job]() { return job->done == job->chunks; });
+		}
+		if (m_workers > 0 && job->chunks > 1) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for (auto it = m_jobs.begin(); it != m_jobs.end(); ++it) {
+				if (*it == job) {
+					m_jobs.erase(it);
+					break;
+				}
+			}
+		}
+	}
+
+private:
+	int m_workers;
+	std::mutex m_mutex;
+	std::condition_variable m_wakeup;
+	std::deque<std::shared_ptr<parallel_job>> m_jobs;
+
+	void worker() {
+		while (true) {
+			std::shared_ptr<parallel_job> job;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_wakeup.wait(lock, [this]() { return !m_jobs.empty(); });
+				job = m_jobs.front();
+				// all chunks are taken, the next loop in line is up
+				if (job->next >= job->chunks) {
+					m_jobs.pop_front();
+					continue;
+				}
+			}
+			job->run();
+		}
+	}
+};
+
+// never destroyed, the detached workers may still be waiting when the process exits
+static parallel_pool *get_parallel_pool() {
+	static parallel_pool *pool = nullptr;
+	static std::once_flag once;
+	std::call_once(once, []() {
+		int cores = get_number_of_cores();
+		cores = (cores > 0) ? cores : AIN_DEFAULT_THREADS;
+		pool = new parallel_pool(cores - 1);
+	});
+	return pool;
+}
+
+int parallel_threads(void) {
+	return get_parallel_pool()->threads();
+}
+
+static size_t parallel_grain(size_t count, size_t grain) {
+	if (grain > 0) return grain;
+	// a few chunks per thread, so the ones that finish early help the others
+	const size_t chunks = (size_t)parallel_threads() * 4;
+	return std::max<size_t>(1, (count + chunks - 1) / chunks);
+}
+
+size_t parallel_chunk_count(size_t count, size_t grain) {
+	grain = parallel_grain(count, grain);
+	return (count + grain - 1) / grain;
+}
+
+void parallel_chunks(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t, size_t)> &body) {
+	if (end <= begin) return;
+	std::shared_ptr<parallel_job> job = std::make_shared<parallel_job>();
+	job->body = &body;
+	job->begin = begin;
+	job->end = end;
+	job->grain = parallel_grain(end - begin, grain);
+	job->chunks = (end - begin + job->grain - 1) / job->grain;
+	job->next = 0;
+	job->done = 0;
+	get_parallel_pool()->run(job);
+}
+
+void parallel_for(size_t begin, size_t end, size_t grain, void (*body)(void *context, size_t chunk_begin, size_t chunk_end), void *context) {
+	parallel_chunks(begin, end, grain, [body, context](size_t, size_t chunk_begin, size_t chunk_end) {
+		body(context, chunk_begin, chunk_end);
+	});
+}
+
+static std::shared_ptr<char> read_file(const char *file_name, size_t *size, size_t max_size) {
+	FILE *file = fopen(file_name, "rb");
+	if (file == nullptr) return nullptr;
+	fseek(file, 0, SEEK_END);
+	size_t file_size = (size_t)ftell(file);
+	fseek(file, 0, SEEK_SET);
+	if (max_size && file_size > max_size) file_size = max_size;
+	char *data = (char *)malloc(file_size + 1);
+	if (data == nullptr || fread(data, file_size, 1, file) != 1) {
+		free(data);
+		fclose(file);
+		return nullptr;
+	}
+	fclose(file);
+	*size = file_size;
+	return std::shared_ptr<char>(data, [](char *p){ free(p); });
+}
+
+std::shared_ptr<char> map_file(const char *file_name, size_t *size, size_t max_size) {
+	assert(size != nullptr);
+	*size = 0;
+	if (file_name == nullptr || file_name[0] == '\0') return nullptr;
+#if defined(INDIGO_WINDOWS)
+	HANDLE file = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return nullptr;
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+		CloseHandle(file);
+		return read_file(file_name, size, max_size);
+	}
+	size_t map_size = (size_t)file_size.QuadPart;
+	if (max_size && map_size > max_size) map_size = max_size;
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (mapping == NULL) return read_file(file_name, size, max_size);
+	char *data = (char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, map_size);
+	CloseHandle(mapping);
+	if (data == NULL) return read_file(file_name, size, max_size);
+	*size = map_size;
+	return std::shared_ptr<char>(data, [](char *p){ UnmapViewOfFile(p); });
+#else
+	int fd = open(file_name, O_RDONLY);
+	if (fd < 0) return nullptr;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return read_file(file_name, size, max_size);
+	}
+	size_t file_size = (size_t)st.st_size;
+	if (max_size && file_size > max_size) file_size = max_size;
+	/* read-only: a stray write faults here instead of silently copying the page.
+	   If another process truncates the file the pages past the new end raise SIGBUS when read. */
+	void *data = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) return read_file(file_name, size, max_size);
+	madvise(data, file_size, MADV_WILLNEED);
+	*size = file_size;
+	return std::shared_ptr<char>((char *)data, [file_size](char *p){ munmap(p, file_size); });
+#endif
+}
+
 void get_timestamp(char *timestamp_str) {
 	assert(timestamp_str != nullptr);
 	struct timeval tmnow;
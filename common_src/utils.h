@@ -19,10 +19,72 @@
 #ifndef _UTILS_H
 #define _UTILS_H
 
+#include <stddef.h>
+
 #define AIN_DEFAULT_THREADS 4
 #define AIN_DATA_DIR "ain_data"
 
-int get_number_of_cores();
+/* The image kernels share one pool of worker threads, sized from get_number_of_cores() and started on
+   first use. A parallel loop is cut in chunks that idle workers take from whichever loops are running,
+   the calling thread works on its own loop too. So concurrent pipelines share the cores instead of
+   oversubscribing them and a loop may be started from inside another one. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int get_number_of_cores(void);
+
+/* Number of threads a loop can run on, the workers and the caller */
+int parallel_threads(void);
+
+/* The pool for the C kernels (FITS, XISF): calls body(context, chunk_begin, chunk_end) for the chunks
+   of grain items that [begin, end) is cut in, grain 0 makes a few chunks per thread. */
+void parallel_for(size_t begin, size_t end, size_t grain, void (*body)(void *context, size_t chunk_begin, size_t chunk_end), void *context);
+
+#ifdef __cplusplus
+}
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+/* Calls body(chunk, chunk_begin, chunk_end) for the chunks of grain items that [begin, end) is cut in,
+   grain 0 makes a few chunks per thread. Returns when all of them are done. */
+void parallel_chunks(size_t begin, size_t end, size_t grain, const std::function<void(size_t chunk, size_t chunk_begin, size_t chunk_end)> &body);
+
+/* Number of chunks parallel_chunks() cuts count items in */
+size_t parallel_chunk_count(size_t count, size_t grain);
+
+/* Calls body(chunk_begin, chunk_end) for all of [begin, end) on the pool */
+template <typename F>
+void parallel_for(size_t begin, size_t end, F body, size_t grain = 0) {
+	parallel_chunks(begin, end, grain, [&body](size_t, size_t chunk_begin, size_t chunk_end) {
+		body(chunk_begin, chunk_end);
+	});
+}
+
+/* Folds the results of body(chunk_begin, chunk_end) over [begin, end) with reduce(a, b), starting from identity.
+   The chunk results are combined in order, so the result does not depend on the scheduling. */
+template <typename T, typename F, typename R>
+T parallel_reduce(size_t begin, size_t end, const T &identity, F body, R reduce, size_t grain = 0) {
+	std::vector<T> partial(parallel_chunk_count(end > begin ? end - begin : 0, grain), identity);
+	parallel_chunks(begin, end, grain, [&partial, &body](size_t chunk, size_t chunk_begin, size_t chunk_end) {
+		partial[chunk] = body(chunk_begin, chunk_end);
+	});
+	T result = identity;
+	for (const T &value : partial) result = reduce(result, value);
+	return result;
+}
+
+/* Maps file_name read-only in memory and returns an owner that unmaps it when the last reference
+   goes away. Falls back to reading the file if it can not be mapped.
+   The data must not be written, decoders get it with data_writable = false and copy what they convert.
+   The file should not be changed while it is mapped: on POSIX systems reading a page past the end of
+   a truncated file raises SIGBUS (Windows refuses to truncate a mapped file).
+   If max_size is not 0 only the first max_size bytes are mapped, *size is set to the mapped size.
+   Returns nullptr on error. */
+std::shared_ptr<char> map_file(const char *file_name, size_t *size, size_t max_size = 0);
 
 void get_timestamp(char *timestamp_str);
 void get_date(char *date_str);
@@ -36,4 +98,6 @@ void get_indigo_device_domain(char *device_domain, const char *device_name);
 void remove_indigo_device_domain(char *device_name, int levels);
 void add_indigo_device_domain(char *device_name, const char *domain_name);
 
+#endif /* __cplusplus */
+
 #endif /* _UTILS_H */
@@ -17,14 +17,31 @@
 // SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <stdbool.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <xml.h>
 #include <xisf.h>
+#include <fits.h>
+#include <utils.h>
 #include <zlib.h>
 #include <lz4.h>
+#include <lz4hc.h>
 
-static int xisf_metadata_init(xisf_metadata *metadata) {
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define XISF_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+#define XISF_MIN_SIZE_TO_PARALLELIZE 0x3FFFF
+#define XISF_INFLATE_CHUNK 0x10000
+#define XISF_MIN_SUBBLOCK_SIZE 0x40000
+#define XISF_MAX_SUBBLOCK_SIZE 0x400000
+#define XISF_BLOCK_ALIGNMENT 4096
+
+void xisf_metadata_init(xisf_metadata *metadata) {
 	metadata->bitpix = 0;
 	metadata->width = 0;
 	metadata->height = 0;
@@ -35,38 +52,287 @@ static int xisf_metadata_init(xisf_metadata *metadata) {
 	metadata->data_size = 0;
 	metadata->uncompressed_data_size = 0;
 	metadata->shuffle_size = 0;
+	metadata->subblocks = 0;
+	metadata->subblock_compressed_size = NULL;
+	metadata->subblock_uncompressed_size = NULL;
 	metadata->compression[0] = '\0';
 	metadata->color_space[0] = '\0';
 	metadata->bayer_pattern[0] = '\0';
 	metadata->camera_name[0] = '\0';
 	metadata->image_type[0] = '\0';
 	metadata->observation_time[0] = '\0';
+	metadata->filter_name[0] = '\0';
+	metadata->object_name[0] = '\0';
 	metadata->exposure_time = -1;
 	metadata->sensor_temperature = -1;
 }
 
+void xisf_metadata_free(xisf_metadata *metadata) {
+	/* both tables are one allocation */
+	free(metadata->subblock_compressed_size);
+	metadata->subblock_compressed_size = NULL;
+	metadata->subblock_uncompressed_size = NULL;
+	metadata->subblocks = 0;
+}
+
+typedef struct {
+	void *(*worker)(void *);
+	uint8_t *jobs;
+	size_t job_size;
+} xisf_jobs;
+
+static void xisf_run_job_range(void *context, size_t first, size_t last) {
+	xisf_jobs *jobs = (xisf_jobs *)context;
+	for (size_t i = first; i < last; i++) {
+		jobs->worker(jobs->jobs + i * jobs->job_size);
+	}
+}
+
+/* Runs worker on each of the count jobs on the shared pool */
+static void xisf_run_jobs(void *(*worker)(void *), void *jobs, size_t job_size, int count) {
+	if (count <= 1) {
+		if (count == 1) worker(jobs);
+		return;
+	}
+	xisf_jobs context = { worker, (uint8_t *)jobs, job_size };
+	parallel_for(0, count, 1, xisf_run_job_range, &context);
+}
+
+/* Un-shuffles items [first, last) when all byte planes of the shuffled block are in input */
+static void un_shuffle_items(uint8_t *output, const uint8_t *input, size_t items, size_t item_size, size_t first, size_t last) {
+	size_t i = first;
+#if defined(XISF_USE_SSE2)
+	if (item_size == 2) {
+		const uint8_t *p0 = input, *p1 = input + items;
+		for (; i + 16 <= last; i += 16) {
+			__m128i a = _mm_loadu_si128((const __m128i *)(p0 + i));
+			__m128i b = _mm_loadu_si128((const __m128i *)(p1 + i));
+			_mm_storeu_si128((__m128i *)(output + 2 * i), _mm_unpacklo_epi8(a, b));
+			_mm_storeu_si128((__m128i *)(output + 2 * i + 16), _mm_unpackhi_epi8(a, b));
+		}
+	} else if (item_size == 4) {
+		const uint8_t *p0 = input, *p1 = input + items, *p2 = input + 2 * items, *p3 = input + 3 * items;
+		for (; i + 16 <= last; i += 16) {
+			__m128i a = _mm_loadu_si128((const __m128i *)(p0 + i));
+			__m128i b = _mm_loadu_si128((const __m128i *)(p1 + i));
+			__m128i c = _mm_loadu_si128((const __m128i *)(p2 + i));
+			__m128i d = _mm_loadu_si128((const __m128i *)(p3 + i));
+			__m128i ab_lo = _mm_unpacklo_epi8(a, b), ab_hi = _mm_unpackhi_epi8(a, b);
+			__m128i cd_lo = _mm_unpacklo_epi8(c, d), cd_hi = _mm_unpackhi_epi8(c, d);
+			_mm_storeu_si128((__m128i *)(output + 4 * i), _mm_unpacklo_epi16(ab_lo, cd_lo));
+			_mm_storeu_si128((__m128i *)(output + 4 * i + 16), _mm_unpackhi_epi16(ab_lo, cd_lo));
+			_mm_storeu_si128((__m128i *)(output + 4 * i + 32), _mm_unpacklo_epi16(ab_hi, cd_hi));
+			_mm_storeu_si128((__m128i *)(output + 4 * i + 48), _mm_unpackhi_epi16(ab_hi, cd_hi));
+		}
+	}
+#endif
+	for (; i < last; i++) {
+		for (size_t j = 0; j < item_size; j++) {
+			output[i * item_size + j] = input[j * items + i];
+		}
+	}
+}
+
+#if defined(XISF_USE_SSE2)
+/* even and odd bytes of the 32 bytes in a and b */
+static inline void deinterleave_sse2(__m128i a, __m128i b, __m128i *even, __m128i *odd) {
+	const __m128i mask = _mm_set1_epi16(0x00FF);
+	*even = _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+	*odd = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+}
+#endif
+
+/* Shuffles items [first, last) of input into the byte planes of output */
+static void shuffle_items(uint8_t *output, const uint8_t *input, size_t items, size_t item_size, size_t first, size_t last) {
+	size_t i = first;
+#if defined(XISF_USE_SSE2)
+	if (item_size == 2) {
+		uint8_t *p0 = output, *p1 = output + items;
+		for (; i + 16 <= last; i += 16) {
+			__m128i even, odd;
+			deinterleave_sse2(_mm_loadu_si128((const __m128i *)(input + 2 * i)), _mm_loadu_si128((const __m128i *)(input + 2 * i + 16)), &even, &odd);
+			_mm_storeu_si128((__m128i *)(p0 + i), even);
+			_mm_storeu_si128((__m128i *)(p1 + i), odd);
+		}
+	} else if (item_size == 4) {
+		uint8_t *p0 = output, *p1 = output + items, *p2 = output + 2 * items, *p3 = output + 3 * items;
+		for (; i + 16 <= last; i += 16) {
+			__m128i e1, o1, e2, o2, b0, b1, b2, b3;
+			deinterleave_sse2(_mm_loadu_si128((const __m128i *)(input + 4 * i)), _mm_loadu_si128((const __m128i *)(input + 4 * i + 16)), &e1, &o1);
+			deinterleave_sse2(_mm_loadu_si128((const __m128i *)(input + 4 * i + 32)), _mm_loadu_si128((const __m128i *)(input + 4 * i + 48)), &e2, &o2);
+			deinterleave_sse2(e1, e2, &b0, &b2);
+			deinterleave_sse2(o1, o2, &b1, &b3);
+			_mm_storeu_si128((__m128i *)(p0 + i), b0);
+			_mm_storeu_si128((__m128i *)(p1 + i), b1);
+			_mm_storeu_si128((__m128i *)(p2 + i), b2);
+			_mm_storeu_si128((__m128i *)(p3 + i), b3);
+		}
+	}
+#endif
+	for (; i < last; i++) {
+		for (size_t j = 0; j < item_size; j++) {
+			output[j * items + i] = input[i * item_size + j];
+		}
+	}
+}
+
+typedef struct {
+	uint8_t *output;
+	const uint8_t *input;
+	size_t items;
+	size_t item_size;
+	size_t first;
+	size_t last;
+	bool unshuffle;
+} xisf_shuffle_job;
+
+static void *shuffle_worker(void *arg) {
+	xisf_shuffle_job *job = (xisf_shuffle_job *)arg;
+	if (job->unshuffle) {
+		un_shuffle_items(job->output, job->input, job->items, job->item_size, job->first, job->last);
+	} else {
+		shuffle_items(job->output, job->input, job->items, job->item_size, job->first, job->last);
+	}
+	return NULL;
+}
+
+static void shuffle_block(uint8_t *output, const uint8_t *input, size_t size, size_t item_size, bool unshuffle) {
+	size_t items = size / item_size;
+	int threads = (size < XISF_MIN_SIZE_TO_PARALLELIZE) ? 1 : parallel_threads();
+	size_t chunk = (items / threads + 15) & ~(size_t)15;
+	xisf_shuffle_job jobs[threads];
+	for (int rank = 0; rank < threads; rank++) {
+		size_t first = chunk * rank;
+		size_t last = first + chunk;
+		if (first > items) first = items;
+		if (last > items) last = items;
+		xisf_shuffle_job job = { output, input, items, item_size, first, last, unshuffle };
+		jobs[rank] = job;
+	}
+	xisf_run_jobs(shuffle_worker, jobs, sizeof(xisf_shuffle_job), threads);
+	memcpy(output + items * item_size, input + items * item_size, size % item_size);
+}
+
 static void un_shuffle(uint8_t *output, const uint8_t *input, size_t size, size_t item_size) {
-	if (size > 0) {
-		if (item_size > 0) {
-			if (input != NULL) {
-				if (output != NULL) {
-					size_t items = size / item_size;
-					const uint8_t* s = input;
-					for (size_t j = 0; j < item_size; ++j) {
-						uint8_t* u = output + j;
-						for (size_t i = 0; i < items; ++i, ++s, u += item_size) {
-							*u = *s;
-						}
-					}
-					memcpy(output + items * item_size, s, size % item_size);
-				}
-			}
+	if (size == 0 || item_size == 0 || input == NULL || output == NULL) {
+		return;
+	}
+	shuffle_block(output, input, size, item_size, true);
+}
+
+static void shuffle(uint8_t *output, const uint8_t *input, size_t size, size_t item_size) {
+	if (size == 0 || item_size == 0 || input == NULL || output == NULL) {
+		return;
+	}
+	shuffle_block(output, input, size, item_size, false);
+}
+
+/* Scatters bytes [offset, offset + length) of a shuffled block of size bytes to their un-shuffled places */
+static void un_shuffle_range(uint8_t *output, const uint8_t *input, size_t offset, size_t length, size_t size, size_t item_size) {
+	const size_t items = size / item_size;
+	const size_t shuffled_size = items * item_size;
+	while (length > 0 && offset < shuffled_size) {
+		const size_t plane = offset / items;
+		size_t i = offset % items;
+		size_t run = items - i;
+		if (run > length) run = length;
+		uint8_t *out = output + i * item_size + plane;
+		for (size_t k = 0; k < run; k++, out += item_size) {
+			*out = input[k];
 		}
+		input += run;
+		offset += run;
+		length -= run;
+	}
+	if (length > 0) {
+		memcpy(output + offset, input, length);
 	}
 }
 
-int xisf_read_metadata(uint8_t *xisf_data, int xisf_size, xisf_metadata *metadata) {
-	if (!xisf_data || !xisf_size || !metadata) {
+typedef struct {
+	const uint8_t *compressed;
+	size_t compressed_size;
+	size_t offset;              // offset of the subblock in the uncompressed (shuffled) block
+	size_t size;
+	const xisf_metadata *metadata;
+	bool zlib;
+	size_t item_size;           // 0 if not shuffled
+	uint8_t *output;
+	int result;
+} xisf_subblock_job;
+
+static int inflate_subblock(xisf_subblock_job *job) {
+	if (job->item_size == 0) {
+		uLongf size = job->size;
+		int err = uncompress(job->output + job->offset, &size, job->compressed, job->compressed_size);
+		return (err == Z_OK && size == job->size) ? XISF_OK : XISF_INVALIDDATA;
+	}
+	/* shuffled data is inflated through a small buffer and scattered straight to the output */
+	uint8_t *chunk = (uint8_t *)malloc(XISF_INFLATE_CHUNK);
+	if (chunk == NULL) {
+		return XISF_INVALIDDATA;
+	}
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (inflateInit(&stream) != Z_OK) {
+		free(chunk);
+		return XISF_INVALIDDATA;
+	}
+	stream.next_in = (Bytef *)job->compressed;
+	stream.avail_in = job->compressed_size;
+	size_t done = 0;
+	int err = Z_OK;
+	while (err == Z_OK) {
+		stream.next_out = chunk;
+		stream.avail_out = XISF_INFLATE_CHUNK;
+		err = inflate(&stream, Z_NO_FLUSH);
+		if (err != Z_OK && err != Z_STREAM_END) {
+			break;
+		}
+		size_t produced = XISF_INFLATE_CHUNK - stream.avail_out;
+		if (done + produced > job->size) {
+			err = Z_DATA_ERROR;
+			break;
+		}
+		un_shuffle_range(job->output, chunk, job->offset + done, produced, job->metadata->uncompressed_data_size, job->item_size);
+		done += produced;
+		if (produced == 0 && err == Z_OK && stream.avail_in == 0) {
+			err = Z_DATA_ERROR;
+		}
+	}
+	inflateEnd(&stream);
+	free(chunk);
+	return (err == Z_STREAM_END && done == job->size) ? XISF_OK : XISF_INVALIDDATA;
+}
+
+static int lz4_subblock(xisf_subblock_job *job) {
+	if (job->item_size == 0) {
+		int result = LZ4_decompress_safe((const char *)job->compressed, (char *)job->output + job->offset, job->compressed_size, job->size);
+		return (result == (int)job->size) ? XISF_OK : XISF_INVALIDDATA;
+	}
+	/* LZ4 blocks can not be decoded in pieces, the subblock needs a buffer of its own */
+	uint8_t *shuffled_data = (uint8_t *)malloc(job->size);
+	if (shuffled_data == NULL) {
+		return XISF_INVALIDDATA;
+	}
+	int result = LZ4_decompress_safe((const char *)job->compressed, (char *)shuffled_data, job->compressed_size, job->size);
+	if (result != (int)job->size) {
+		free(shuffled_data);
+		return XISF_INVALIDDATA;
+	}
+	un_shuffle_range(job->output, shuffled_data, job->offset, job->size, job->metadata->uncompressed_data_size, job->item_size);
+	free(shuffled_data);
+	return XISF_OK;
+}
+
+static void *decompress_worker(void *arg) {
+	xisf_subblock_job *job = (xisf_subblock_job *)arg;
+	job->result = job->zlib ? inflate_subblock(job) : lz4_subblock(job);
+	return NULL;
+}
+
+static int xisf_parse_metadata(uint8_t *xisf_data, int xisf_size, xisf_metadata *metadata) {
+	if (!xisf_data || xisf_size < (int)sizeof(xisf_header) || !metadata) {
 		return XISF_INVALIDPARAM;
 	}
 
@@ -78,6 +344,10 @@ int xisf_read_metadata(uint8_t *xisf_data, int xisf_size, xisf_metadata *metadat
 		return XISF_NOT_XISF;
 	}
 
+	if ((uint64_t)header->xml_length + sizeof(xisf_header) > (uint64_t)xisf_size) {
+		return XISF_INVALIDDATA;
+	}
+
 	uint32_t xml_offset = 0;
 	while (strncmp((char*)xisf_data + xml_offset, "<xisf", 5)) {
 		xml_offset++;
@@ -193,6 +463,41 @@ int xisf_read_metadata(uint8_t *xisf_data, int xisf_size, xisf_metadata *metadat
 			strncpy(metadata->compression, compression, sizeof(metadata->compression));
 			metadata->uncompressed_data_size = data_size;
 			metadata->shuffle_size = shuffle_size;
+		} else if (!strncmp(name, "subblocks", strlen(name))) {
+			// "cs0,us0:cs1,us1:..." compressed and uncompressed size of each subblock
+			int entries = 1;
+			for (const char *pos = content; *pos != '\0'; pos++) {
+				if (*pos == ':') entries++;
+			}
+			xisf_metadata_free(metadata);
+			metadata->subblock_compressed_size = (int *)malloc(2 * entries * sizeof(int));
+			if (metadata->subblock_compressed_size == NULL) {
+				free(name);
+				free(content);
+				xml_document_free(document, false);
+				return XISF_INVALIDDATA;
+			}
+			metadata->subblock_uncompressed_size = metadata->subblock_compressed_size + entries;
+			const char *pos = content;
+			int count = 0;
+			while (*pos != '\0') {
+				int compressed_size = 0;
+				int uncompressed_size = 0;
+				int consumed = 0;
+				int scanned = sscanf(pos, "%d,%d%n", &compressed_size, &uncompressed_size, &consumed);
+				if (scanned != 2 || compressed_size <= 0 || uncompressed_size <= 0 || count >= entries) {
+					free(name);
+					free(content);
+					xml_document_free(document, false);
+					return XISF_INVALIDDATA;
+				}
+				metadata->subblock_compressed_size[count] = compressed_size;
+				metadata->subblock_uncompressed_size[count] = uncompressed_size;
+				count++;
+				pos += consumed;
+				if (*pos == ':') pos++;
+			}
+			metadata->subblocks = count;
 		}
 		free(name);
 		free(content);
@@ -258,6 +563,10 @@ int xisf_read_metadata(uint8_t *xisf_data, int xisf_size, xisf_metadata *metadat
 					metadata->sensor_temperature = atof(value);
 				} else if (!strcmp(id, "Observation:Time:Start")) {
 					strncpy(metadata->observation_time, value, sizeof(metadata->observation_time));
+				} else if (!strcmp(id, "Instrument:Filter:Name")) {
+					strncpy(metadata->filter_name, node_content, sizeof(metadata->filter_name) - 1);
+				} else if (!strcmp(id, "Observation:Object:Name")) {
+					strncpy(metadata->object_name, node_content, sizeof(metadata->object_name) - 1);
 				} else if (!strcmp(id, "PCL:CFASourcePattern") && (metadata->bayer_pattern[0] == '\0') && !strcmp(metadata->color_space, "Gray")) {
 					// Pixinsight does not follow its own specs. It writes PCL:CFASourcePattern. It writes it even with debayered images!!!
 					strncpy(metadata->bayer_pattern, node_content, sizeof(metadata->bayer_pattern));
@@ -266,8 +575,8 @@ int xisf_read_metadata(uint8_t *xisf_data, int xisf_size, xisf_metadata *metadat
 				free(node_content);
 			} else if (!strcmp(node_name, "FITSKeyword")) {
 				int attr = xml_node_attributes(child);
-				char name[255];
-				char value[255];
+				char name[255] = "";
+				char value[255] = "";
 				for (int i = 0; i < attr; i++) {
 					struct xml_string* attr_name_s = xml_node_attribute_name(child, i);
 					char* attr_name = calloc(xml_string_length(attr_name_s) + 1, sizeof(uint8_t));
@@ -296,6 +605,14 @@ int xisf_read_metadata(uint8_t *xisf_data, int xisf_size, xisf_metadata *metadat
 					while (*end != '\'' && *end != ' ' && *end != '\0') end++;
 					*end = '\0';
 					strncpy(metadata->bayer_pattern, start, sizeof(metadata->bayer_pattern));
+				} else if (!strcmp(name, "FILTER") && metadata->filter_name[0] == '\0') {
+					fits_copy_string_value(metadata->filter_name, value, sizeof(metadata->filter_name));
+				} else if (!strcmp(name, "OBJECT") && metadata->object_name[0] == '\0') {
+					fits_copy_string_value(metadata->object_name, value, sizeof(metadata->object_name));
+				} else if (!strcmp(name, "DATE-OBS") && metadata->observation_time[0] == '\0') {
+					fits_copy_string_value(metadata->observation_time, value, sizeof(metadata->observation_time));
+				} else if ((!strcmp(name, "EXPTIME") || !strcmp(name, "EXPOSURE")) && metadata->exposure_time < 0) {
+					metadata->exposure_time = atof(value);
 				}
 			}
 			free(node_name);
@@ -305,43 +622,452 @@ int xisf_read_metadata(uint8_t *xisf_data, int xisf_size, xisf_metadata *metadat
 	return XISF_OK;
 }
 
+int xisf_read_metadata(uint8_t *xisf_data, int xisf_size, xisf_metadata *metadata) {
+	int res = xisf_parse_metadata(xisf_data, xisf_size, metadata);
+	if (res != XISF_OK && metadata) {
+		xisf_metadata_free(metadata);
+	}
+	return res;
+}
+
 int xisf_decompress(uint8_t *xisf_data, xisf_metadata *metadata, uint8_t *decompressed_data) {
 	//indigo_error("XISF decompress: %s %d %d", metadata->compression, metadata->uncompressed_data_size, metadata->shuffle_size);
-	size_t uncompressed_data_size = metadata->uncompressed_data_size;
-	if (!strcmp(metadata->compression, "zlib")) {
-		int err = uncompress(decompressed_data, &uncompressed_data_size, xisf_data + metadata->data_offset, metadata->data_size);
-		if (err == Z_OK) {
-			return XISF_OK;
-		} else {
-			return XISF_INVALIDDATA;
+	bool zlib;
+	bool shuffled;
+	if (!strcmp(metadata->compression, "zlib") || !strcmp(metadata->compression, "zlib+sh")) {
+		zlib = true;
+		shuffled = !strcmp(metadata->compression, "zlib+sh");
+	} else if (!strcmp(metadata->compression, "lz4") || !strcmp(metadata->compression, "lz4hc")) {
+		zlib = false;
+		shuffled = false;
+	} else if (!strcmp(metadata->compression, "lz4+sh") || !strcmp(metadata->compression, "lz4hc+sh")) {
+		zlib = false;
+		shuffled = true;
+	} else {
+		return XISF_UNSUPPORTED;
+	}
+	const size_t item_size = (shuffled && metadata->shuffle_size > 1) ? metadata->shuffle_size : 0;
+
+	/* the whole block compressed at once is handled as a single subblock */
+	int count = (metadata->subblocks > 0) ? metadata->subblocks : 1;
+	xisf_subblock_job *jobs = (xisf_subblock_job *)malloc(count * sizeof(xisf_subblock_job));
+	if (jobs == NULL) {
+		return XISF_INVALIDDATA;
+	}
+	size_t compressed_offset = 0;
+	size_t uncompressed_offset = 0;
+	for (int i = 0; i < count; i++) {
+		jobs[i].compressed = xisf_data + metadata->data_offset + compressed_offset;
+		jobs[i].compressed_size = (metadata->subblocks > 0) ? metadata->subblock_compressed_size[i] : metadata->data_size;
+		jobs[i].offset = uncompressed_offset;
+		jobs[i].size = (metadata->subblocks > 0) ? metadata->subblock_uncompressed_size[i] : metadata->uncompressed_data_size;
+		jobs[i].metadata = metadata;
+		jobs[i].zlib = zlib;
+		jobs[i].item_size = item_size;
+		jobs[i].output = decompressed_data;
+		jobs[i].result = XISF_OK;
+		compressed_offset += jobs[i].compressed_size;
+		uncompressed_offset += jobs[i].size;
+	}
+	if (compressed_offset > (size_t)metadata->data_size || uncompressed_offset != (size_t)metadata->uncompressed_data_size) {
+		free(jobs);
+		return XISF_INVALIDDATA;
+	}
+
+	/* the SIMD un-shuffle needs all byte planes of the block, so the subblocks are decompressed into
+	   one scratch block and un-shuffled in one parallel pass. Without memory for it they are scattered
+	   to the output one subblock at a time. */
+	uint8_t *shuffled_data = NULL;
+	if (item_size > 0 && (shuffled_data = (uint8_t *)malloc(uncompressed_offset)) != NULL) {
+		for (int i = 0; i < count; i++) {
+			jobs[i].output = shuffled_data;
+			jobs[i].item_size = 0;
 		}
-	} else if (!strcmp(metadata->compression, "zlib+sh")) {
-		char *shuffled_data = (char*)malloc(uncompressed_data_size);
-		int err = uncompress(shuffled_data, &uncompressed_data_size, xisf_data + metadata->data_offset, metadata->data_size);
-		if (err != Z_OK) {
+	}
+
+	if (count == 1) {
+		decompress_worker(&jobs[0]);
+	} else {
+		xisf_run_jobs(decompress_worker, jobs, sizeof(xisf_subblock_job), count);
+	}
+	for (int i = 0; i < count; i++) {
+		if (jobs[i].result != XISF_OK) {
+			int res = jobs[i].result;
 			free(shuffled_data);
-			return XISF_INVALIDDATA;
+			free(jobs);
+			return res;
 		}
-		un_shuffle(decompressed_data, shuffled_data, uncompressed_data_size, metadata->shuffle_size);
+	}
+	free(jobs);
+	if (shuffled_data) {
+		un_shuffle(decompressed_data, shuffled_data, uncompressed_offset, item_size);
 		free(shuffled_data);
-		return XISF_OK;
-	} else if (!strcmp(metadata->compression, "lz4") || !strcmp(metadata->compression, "lz4hc")) {
-		int result = LZ4_decompress_safe(xisf_data + metadata->data_offset, decompressed_data, metadata->data_size, uncompressed_data_size);
-		if (result > 0) {
+	}
+	return XISF_OK;
+}
+
+typedef enum {
+	XISF_CODEC_NONE,
+	XISF_CODEC_ZLIB,
+	XISF_CODEC_LZ4,
+	XISF_CODEC_LZ4HC
+} xisf_codec;
+
+typedef struct {
+	const uint8_t *input;
+	size_t size;
+	xisf_codec codec;
+	uint8_t *output;
+	size_t compressed_size;
+	int result;
+} xisf_compress_job;
+
+static void *compress_worker(void *arg) {
+	xisf_compress_job *job = (xisf_compress_job *)arg;
+	job->result = XISF_INVALIDDATA;
+	if (job->codec == XISF_CODEC_ZLIB) {
+		uLongf capacity = compressBound(job->size);
+		job->output = (uint8_t *)malloc(capacity);
+		if (job->output != NULL && compress2(job->output, &capacity, job->input, job->size, Z_DEFAULT_COMPRESSION) == Z_OK) {
+			job->compressed_size = capacity;
+			job->result = XISF_OK;
+		}
+	} else {
+		int capacity = LZ4_compressBound(job->size);
+		job->output = (uint8_t *)malloc(capacity);
+		if (job->output != NULL) {
+			int compressed_size;
+			if (job->codec == XISF_CODEC_LZ4HC) {
+				compressed_size = LZ4_compress_HC((const char *)job->input, (char *)job->output, job->size, capacity, LZ4HC_CLEVEL_DEFAULT);
+			} else {
+				compressed_size = LZ4_compress_default((const char *)job->input, (char *)job->output, job->size, capacity);
+			}
+			if (compressed_size > 0) {
+				job->compressed_size = compressed_size;
+				job->result = XISF_OK;
+			}
+		}
+	}
+	return NULL;
+}
+
+static const char *sample_format_name(int bitpix) {
+	switch (bitpix) {
+		case 8: return "UInt8";
+		case 16: return "UInt16";
+		case 32: return "UInt32";
+		case -32: return "Float32";
+		case -64: return "Float64";
+	}
+	return NULL;
+}
+
+static int xml_append(char **xml, size_t *length, size_t *capacity, const char *format, ...) {
+	va_list args;
+	while (true) {
+		va_start(args, format);
+		int written = vsnprintf(*xml + *length, *capacity - *length, format, args);
+		va_end(args);
+		if (written < 0) {
+			return XISF_INVALIDDATA;
+		}
+		if ((size_t)written < *capacity - *length) {
+			*length += written;
 			return XISF_OK;
-		} else {
+		}
+		char *bigger = (char *)realloc(*xml, *capacity * 2 + written);
+		if (bigger == NULL) {
 			return XISF_INVALIDDATA;
 		}
-	} else if (!strcmp(metadata->compression, "lz4+sh") || !strcmp(metadata->compression, "lz4hc+sh")) {
-		char *shuffled_data = (char*)malloc(uncompressed_data_size);
-		int result = LZ4_decompress_safe(xisf_data + metadata->data_offset, shuffled_data, metadata->data_size, uncompressed_data_size);
-		if (result <= 0) {
+		*xml = bigger;
+		*capacity = *capacity * 2 + written;
+	}
+}
+
+/* copies text to escaped with the XML special characters replaced by entities */
+static void xml_escape(char *escaped, size_t size, const char *text) {
+	size_t length = 0;
+	for (; *text != '\0'; text++) {
+		const char *entity = NULL;
+		switch (*text) {
+			case '&': entity = "&amp;"; break;
+			case '<': entity = "&lt;"; break;
+			case '>': entity = "&gt;"; break;
+			case '"': entity = "&quot;"; break;
+		}
+		size_t entity_length = entity ? strlen(entity) : 1;
+		if (length + entity_length + 1 > size) {
+			break;
+		}
+		if (entity) {
+			memcpy(escaped + length, entity, entity_length);
+		} else {
+			escaped[length] = *text;
+		}
+		length += entity_length;
+	}
+	escaped[length] = '\0';
+}
+
+typedef struct {
+	const uint8_t *data;
+	int bitpix;
+	size_t first;
+	size_t last;
+	bool found;
+	double min;
+	double max;
+} xisf_bounds_job;
+
+static void *bounds_worker(void *arg) {
+	xisf_bounds_job *job = (xisf_bounds_job *)arg;
+	for (size_t i = job->first; i < job->last; i++) {
+		double value = (job->bitpix == -32) ? ((const float *)job->data)[i] : ((const double *)job->data)[i];
+		if (value != value) {
+			/* NaN marks blank pixels, it is no bound */
+			continue;
+		}
+		if (!job->found || value < job->min) job->min = value;
+		if (!job->found || value > job->max) job->max = value;
+		job->found = true;
+	}
+	return NULL;
+}
+
+/* bounds of the floating point samples, each thread scans a contiguous range */
+static void sample_bounds(const uint8_t *data, int bitpix, size_t samples, double *min, double *max) {
+	int threads = (samples * abs(bitpix) / 8 < XISF_MIN_SIZE_TO_PARALLELIZE) ? 1 : parallel_threads();
+	size_t chunk = (samples + threads - 1) / threads;
+	xisf_bounds_job jobs[threads];
+	for (int rank = 0; rank < threads; rank++) {
+		size_t first = chunk * rank;
+		size_t last = first + chunk;
+		if (first > samples) first = samples;
+		if (last > samples) last = samples;
+		xisf_bounds_job job = { data, bitpix, first, last, false, 0, 0 };
+		jobs[rank] = job;
+	}
+	xisf_run_jobs(bounds_worker, jobs, sizeof(xisf_bounds_job), threads);
+	bool found = false;
+	*min = 0;
+	*max = 1;
+	for (int rank = 0; rank < threads; rank++) {
+		if (!jobs[rank].found) continue;
+		if (!found || jobs[rank].min < *min) *min = jobs[rank].min;
+		if (!found || jobs[rank].max > *max) *max = jobs[rank].max;
+		found = true;
+	}
+	if (*max <= *min) *max = *min + 1;
+}
+
+static int xisf_build_header(char **xml, size_t *length, const xisf_metadata *metadata, double min, double max, const xisf_compress_job *jobs, int count) {
+	size_t capacity = 4096 + count * 24;
+	*length = 0;
+	*xml = (char *)malloc(capacity);
+	if (*xml == NULL) {
+		return XISF_INVALIDDATA;
+	}
+	char escaped[sizeof(metadata->camera_name) * 6];
+	int res = xml_append(xml, length, &capacity,
+		"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<xisf version=\"1.0\" xmlns=\"http://www.pixinsight.com/xisf\" xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" xsi:schemaLocation=\"http://www.pixinsight.com/xisf http://pixinsight.com/xisf/xisf-1.0.xsd\">\n"
+		"<Image geometry=\"%d:%d:%d\" sampleFormat=\"%s\" colorSpace=\"%s\" pixelStorage=\"%s\" location=\"attachment:%d:%d\"",
+		metadata->width, metadata->height, metadata->channels, sample_format_name(metadata->bitpix),
+		metadata->color_space[0] ? metadata->color_space : (metadata->channels == 3 ? "RGB" : "Gray"),
+		metadata->normal_pixel_storage ? "Normal" : "Planar",
+		metadata->data_offset, metadata->data_size
+	);
+	if (res == XISF_OK && (metadata->bitpix == -32 || metadata->bitpix == -64)) {
+		/* bounds are mandatory for floating point images */
+		res = xml_append(xml, length, &capacity, " bounds=\"%.9g:%.9g\"", min, max);
+	}
+	if (res == XISF_OK && metadata->compression[0] != '\0') {
+		if (metadata->shuffle_size > 0) {
+			res = xml_append(xml, length, &capacity, " compression=\"%s:%d:%d\"", metadata->compression, metadata->uncompressed_data_size, metadata->shuffle_size);
+		} else {
+			res = xml_append(xml, length, &capacity, " compression=\"%s:%d\"", metadata->compression, metadata->uncompressed_data_size);
+		}
+		if (res == XISF_OK && metadata->subblocks > 1) {
+			res = xml_append(xml, length, &capacity, " subblocks=\"");
+			for (int i = 0; res == XISF_OK && i < count; i++) {
+				res = xml_append(xml, length, &capacity, "%s%d,%d", i ? ":" : "", (int)jobs[i].compressed_size, (int)jobs[i].size);
+			}
+			if (res == XISF_OK) res = xml_append(xml, length, &capacity, "\"");
+		}
+	}
+	if (res == XISF_OK && metadata->image_type[0] != '\0') {
+		xml_escape(escaped, sizeof(escaped), metadata->image_type);
+		res = xml_append(xml, length, &capacity, " imageType=\"%s\"", escaped);
+	}
+	if (res == XISF_OK) res = xml_append(xml, length, &capacity, ">\n");
+	if (res == XISF_OK && metadata->exposure_time >= 0) {
+		res = xml_append(xml, length, &capacity, "<Property id=\"Instrument:ExposureTime\" type=\"Float32\" value=\"%g\"/>\n", metadata->exposure_time);
+	}
+	if (res == XISF_OK && metadata->sensor_temperature != -1) {
+		res = xml_append(xml, length, &capacity, "<Property id=\"Instrument:Sensor:Temperature\" type=\"Float32\" value=\"%g\"/>\n", metadata->sensor_temperature);
+	}
+	if (res == XISF_OK && metadata->camera_name[0] != '\0') {
+		xml_escape(escaped, sizeof(escaped), metadata->camera_name);
+		res = xml_append(xml, length, &capacity, "<Property id=\"Instrument:Camera:Name\" type=\"String\">%s</Property>\n", escaped);
+	}
+	if (res == XISF_OK && metadata->observation_time[0] != '\0') {
+		xml_escape(escaped, sizeof(escaped), metadata->observation_time);
+		res = xml_append(xml, length, &capacity, "<Property id=\"Observation:Time:Start\" type=\"TimePoint\" value=\"%s\"/>\n", escaped);
+	}
+	if (res == XISF_OK && metadata->bayer_pattern[0] != '\0' && metadata->channels == 1) {
+		xml_escape(escaped, sizeof(escaped), metadata->bayer_pattern);
+		res = xml_append(xml, length, &capacity, "<ColorFilterArray pattern=\"%s\" width=\"2\" height=\"2\"/>\n", escaped);
+	}
+	if (res == XISF_OK) res = xml_append(xml, length, &capacity, "</Image>\n</xisf>\n");
+	if (res != XISF_OK) {
+		free(*xml);
+		*xml = NULL;
+	}
+	return res;
+}
+
+int xisf_write(const char *file_name, xisf_metadata *metadata, const uint8_t *data) {
+	if (!file_name || !metadata || !data) {
+		return XISF_INVALIDPARAM;
+	}
+	if (sample_format_name(metadata->bitpix) == NULL || metadata->width <= 0 || metadata->height <= 0 || (metadata->channels != 1 && metadata->channels != 3)) {
+		return XISF_INVALIDPARAM;
+	}
+	const size_t sample_size = abs(metadata->bitpix) / 8;
+	const size_t size = (size_t)metadata->width * metadata->height * metadata->channels * sample_size;
+
+	xisf_codec codec = XISF_CODEC_NONE;
+	bool shuffled = false;
+	if (metadata->compression[0] != '\0') {
+		char codec_name[sizeof(metadata->compression)];
+		strncpy(codec_name, metadata->compression, sizeof(codec_name));
+		codec_name[sizeof(codec_name) - 1] = '\0';
+		char *suffix = strstr(codec_name, "+sh");
+		if (suffix != NULL && suffix[3] == '\0') {
+			shuffled = true;
+			*suffix = '\0';
+		}
+		if (!strcmp(codec_name, "zlib")) {
+			codec = XISF_CODEC_ZLIB;
+		} else if (!strcmp(codec_name, "lz4")) {
+			codec = XISF_CODEC_LZ4;
+		} else if (!strcmp(codec_name, "lz4hc")) {
+			codec = XISF_CODEC_LZ4HC;
+		} else {
+			return XISF_UNSUPPORTED;
+		}
+	}
+
+	/* split in subblocks so that every core has some to compress */
+	size_t subblock_size = size / parallel_threads();
+	if (subblock_size < XISF_MIN_SUBBLOCK_SIZE) subblock_size = XISF_MIN_SUBBLOCK_SIZE;
+	if (subblock_size > XISF_MAX_SUBBLOCK_SIZE) subblock_size = XISF_MAX_SUBBLOCK_SIZE;
+	if ((size + subblock_size - 1) / subblock_size > XISF_MAX_SUBBLOCKS) {
+		subblock_size = (size + XISF_MAX_SUBBLOCKS - 1) / XISF_MAX_SUBBLOCKS;
+	}
+	int count = (codec == XISF_CODEC_NONE) ? 1 : (int)((size + subblock_size - 1) / subblock_size);
+	xisf_compress_job jobs[count];
+	memset(jobs, 0, sizeof(jobs));
+	uint8_t *shuffled_data = NULL;
+	int res = XISF_OK;
+
+	metadata->uncompressed_data_size = size;
+	metadata->shuffle_size = 0;
+	metadata->subblocks = 0;
+	if (codec != XISF_CODEC_NONE) {
+		const uint8_t *block = data;
+		if (shuffled && sample_size > 1) {
+			shuffled_data = (uint8_t *)malloc(size);
+			if (shuffled_data == NULL) {
+				return XISF_INVALIDDATA;
+			}
+			shuffle(shuffled_data, data, size, sample_size);
+			block = shuffled_data;
+		}
+		for (int i = 0; i < count; i++) {
+			jobs[i].input = block + i * subblock_size;
+			jobs[i].size = (i == count - 1) ? size - i * subblock_size : subblock_size;
+			jobs[i].codec = codec;
+		}
+		xisf_run_jobs(compress_worker, jobs, sizeof(xisf_compress_job), count);
+		size_t compressed_size = 0;
+		for (int i = 0; i < count; i++) {
+			if (jobs[i].result != XISF_OK) {
+				res = jobs[i].result;
+			}
+			compressed_size += jobs[i].compressed_size;
+		}
+		if (res == XISF_OK && compressed_size < size) {
+			metadata->data_size = compressed_size;
+			metadata->shuffle_size = shuffled ? sample_size : 0;
+			metadata->subblocks = count;
+		} else {
+			/* does not compress, store it as it is */
+			for (int i = 0; i < count; i++) {
+				free(jobs[i].output);
+			}
 			free(shuffled_data);
-			return XISF_INVALIDDATA;
+			shuffled_data = NULL;
+			codec = XISF_CODEC_NONE;
+			res = XISF_OK;
 		}
-		un_shuffle(decompressed_data, shuffled_data, uncompressed_data_size, metadata->shuffle_size);
-		free(shuffled_data);
-		return XISF_OK;
 	}
-	return XISF_UNSUPPORTED;
+	if (codec == XISF_CODEC_NONE) {
+		count = 1;
+		jobs[0].output = NULL;
+		jobs[0].input = data;
+		jobs[0].size = size;
+		jobs[0].compressed_size = size;
+		metadata->compression[0] = '\0';
+		metadata->data_size = size;
+	}
+
+	double min = 0, max = 1;
+	if (metadata->bitpix == -32 || metadata->bitpix == -64) {
+		sample_bounds(data, metadata->bitpix, (size_t)metadata->width * metadata->height * metadata->channels, &min, &max);
+	}
+
+	/* the attachment offset is part of the header, grow it until the header fits in front of the data */
+	char *xml = NULL;
+	size_t xml_length = 0;
+	metadata->data_offset = XISF_BLOCK_ALIGNMENT;
+	while (true) {
+		res = xisf_build_header(&xml, &xml_length, metadata, min, max, jobs, count);
+		if (res != XISF_OK || sizeof(xisf_header) + xml_length <= (size_t)metadata->data_offset) {
+			break;
+		}
+		free(xml);
+		metadata->data_offset += XISF_BLOCK_ALIGNMENT;
+	}
+
+	if (res == XISF_OK) {
+		FILE *file = fopen(file_name, "wb");
+		if (file == NULL) {
+			res = XISF_INVALIDPARAM;
+		} else {
+			xisf_header header;
+			memcpy(header.signature, "XISF0100", sizeof(header.signature));
+			header.xml_length = xml_length;
+			header.reserved = 0;
+			bool ok = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(xml, xml_length, 1, file) == 1;
+			for (size_t padding = metadata->data_offset - sizeof(header) - xml_length; ok && padding > 0; padding--) {
+				ok = fputc(0, file) != EOF;
+			}
+			for (int i = 0; ok && i < count; i++) {
+				ok = fwrite(jobs[i].output ? jobs[i].output : jobs[i].input, jobs[i].compressed_size, 1, file) == 1;
+			}
+			if (fclose(file) != 0) {
+				ok = false;
+			}
+			if (!ok) {
+				res = XISF_INVALIDDATA;
+			}
+		}
+	}
+	free(xml);
+	for (int i = 0; i < count; i++) {
+		free(jobs[i].output);
+	}
+	free(shuffled_data);
+	return res;
 }
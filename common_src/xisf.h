@@ -20,6 +20,7 @@
 #define _XISF_H
 
 #include <inttypes.h>
+#include <stdbool.h>
 #include <stdlib.h>
 
 #ifdef __cplusplus
@@ -34,6 +35,8 @@ typedef enum xisf_error {
 	XISF_NOT_XISF = -4
 } xisf_error;
 
+#define XISF_MAX_SUBBLOCKS 1024
+
 /**
  * Structure to store xisf metadata from the XML header
  */
@@ -48,6 +51,9 @@ typedef struct xisf_metadata {
 	int data_size;
 	int uncompressed_data_size;
 	int shuffle_size;
+	int subblocks;              // number of compressed subblocks, 0 if the block is compressed as a whole
+	int *subblock_compressed_size;    // subblocks sizes read by xisf_read_metadata(), see xisf_metadata_free()
+	int *subblock_uncompressed_size;
 	float exposure_time;
 	float sensor_temperature;
 	char observation_time[50];
@@ -56,6 +62,8 @@ typedef struct xisf_metadata {
 	char bayer_pattern[10];
 	char camera_name[256];
 	char image_type[256];
+	char filter_name[72];
+	char object_name[72];
 } xisf_metadata;
 
 /**
@@ -67,9 +75,19 @@ typedef struct xsif_header {
 	uint32_t reserved;        // reserved - must be zero
 } xisf_header;
 
+void xisf_metadata_init(xisf_metadata *metadata);
+/* frees the subblock table of metadata read by xisf_read_metadata(), it is freed already if that failed */
+void xisf_metadata_free(xisf_metadata *metadata);
 int xisf_read_metadata(uint8_t *xisf_data, int xisf_size, xisf_metadata *metadata);
 int xisf_decompress(uint8_t *xisf_data, xisf_metadata *metadata, uint8_t *decompressed_data);
 
+/**
+ * Writes a little endian image to file_name. Set bitpix, width, height, channels and pixel storage
+ * in metadata and optionally compression to "zlib", "lz4" or "lz4hc", with "+sh" for byte shuffling.
+ * The data is compressed in subblocks on all cores. Layout fields of metadata are updated.
+ */
+int xisf_write(const char *file_name, xisf_metadata *metadata, const uint8_t *data);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,60 @@
+#include <QCoreApplication>
+#include <QDebug>
+#include <math.h>
+#include <vector>
+#include "image_stats.h"
+#include "pixel_layout.h"
+
+// Exact order statistics of tiny frames: binned for 8 and 16 bit, ranked by key for 32 bit and float
+
+static int failures = 0;
+
+static void expect(const char *name, const char *what, double value, double expected) {
+    if (value != expected) {
+        qCritical() << name << what << "is" << value << "expected" << expected;
+        failures++;
+    }
+}
+
+static void expectChannel(const char *name, const ImageHistogram1Channel &channel, double min, double max, double median, double mad) {
+    expect(name, "min", channel.min, min);
+    expect(name, "max", channel.max, max);
+    expect(name, "median", channel.median, median);
+    expect(name, "mad", channel.mad, mad);
+}
+
+template <typename T>
+static ImageHistogram histogram(const std::vector<T> &frame, int pix_fmt) {
+    return imageHistogram(reinterpret_cast<const uint8_t*>(frame.data()), (int)frame.size(), 1, pix_fmt);
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    // the median is the sample at count / 2 of the sorted frame
+    expectChannel("Y8 odd", histogram(std::vector<uint8_t>{ 5, 1, 3 }, PIX_FMT_Y8).grey_red, 1, 5, 3, 2);
+    expectChannel("Y16 even", histogram(std::vector<uint16_t>{ 10, 40, 20, 30 }, PIX_FMT_Y16).grey_red, 10, 40, 30, 10);
+    expectChannel("Y16 constant", histogram(std::vector<uint16_t>(7, 1000), PIX_FMT_Y16).grey_red, 1000, 1000, 1000, 0);
+
+    expectChannel("Y32 even", histogram(std::vector<uint32_t>{ 7, 1, 100000, 3 }, PIX_FMT_Y32).grey_red, 1, 100000, 7, 6);
+    expectChannel("F32 constant", histogram(std::vector<float>(6, 2.5f), PIX_FMT_F32).grey_red, 2.5, 2.5, 2.5, 0);
+    expectChannel("F32 negative", histogram(std::vector<float>{ -3.5f, -1, -2, -0.5f, -4 }, PIX_FMT_F32).grey_red, -4, -0.5, -2, 1.5);
+
+    // NaN samples are left out, the rest is ranked as if they were not there
+    std::vector<float> with_nan = { 1, NAN, 4, 2, -NAN, 8 };
+    expectChannel("F32 NaN", histogram(with_nan, PIX_FMT_F32).grey_red, 1, 8, 4, 3);
+    ImageStats stats = imageStats(reinterpret_cast<const uint8_t*>(with_nan.data()), (int)with_nan.size(), 1, PIX_FMT_F32);
+    uint32_t binned = 0;
+    for (int i = 0; i < hist_width; i++) binned += stats.grey_red.histogram[i];
+    expect("F32 NaN", "histogram count", binned, 4);
+    expect("F32 NaN", "mean", stats.grey_red.mean, 3.75);
+    expectChannel("F32 all NaN", histogram(std::vector<float>(3, NAN), PIX_FMT_F32).grey_red, 0, 0, 0, 0);
+
+    if (failures) {
+        qCritical() << failures << "image statistics checks failed";
+        return 1;
+    }
+    qInfo() << "Image statistics checks passed";
+    return 0;
+}
@@ -0,0 +1,21 @@
+QT += core gui  # QImage for makeHistogram()
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+TARGET = test_image_stats
+TEMPLATE = app
+
+SOURCES += \
+    test_image_stats.cpp \
+    ../common_src/image_stats.cpp \
+    ../common_src/utils.cpp
+
+HEADERS += \
+    ../common_src/image_stats.h \
+    ../common_src/pixel_layout.h \
+    ../common_src/utils.h
+
+INCLUDEPATH += \
+    ../indigo/indigo_libs \
+    ../common_src